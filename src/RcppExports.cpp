@@ -10,6 +10,18 @@ Rcpp::Rostream<true>&  Rcpp::Rcout = Rcpp::Rcpp_cout_get();
 Rcpp::Rostream<false>& Rcpp::Rcerr = Rcpp::Rcpp_cerr_get();
 #endif
 
+// convert_mesh_rcpp
+void convert_mesh_rcpp(std::string inputfile, std::string basedir, std::string outputfile);
+RcppExport SEXP _rayrender_convert_mesh_rcpp(SEXP inputfileSEXP, SEXP basedirSEXP, SEXP outputfileSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type inputfile(inputfileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type basedir(basedirSEXP);
+    Rcpp::traits::input_parameter< std::string >::type outputfile(outputfileSEXP);
+    convert_mesh_rcpp(inputfile, basedir, outputfile);
+    return R_NilValue;
+END_RCPP
+}
 // render_animation_rcpp
 void render_animation_rcpp(List camera_info, List scene_info, List camera_movement, int start_frame, CharacterVector filenames, Function post_process_frame, int toneval, bool bloom);
 RcppExport SEXP _rayrender_render_animation_rcpp(SEXP camera_infoSEXP, SEXP scene_infoSEXP, SEXP camera_movementSEXP, SEXP start_frameSEXP, SEXP filenamesSEXP, SEXP post_process_frameSEXP, SEXP tonevalSEXP, SEXP bloomSEXP) {
@@ -39,6 +51,16 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// clear_texture_cache_rcpp
+int clear_texture_cache_rcpp();
+RcppExport SEXP _rayrender_clear_texture_cache_rcpp() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    rcpp_result_gen = Rcpp::wrap(clear_texture_cache_rcpp());
+    return rcpp_result_gen;
+END_RCPP
+}
 // tonemap_image
 Rcpp::List tonemap_image(Rcpp::NumericMatrix routput, Rcpp::NumericMatrix goutput, Rcpp::NumericMatrix boutput, int toneval);
 RcppExport SEXP _rayrender_tonemap_image(SEXP routputSEXP, SEXP goutputSEXP, SEXP boutputSEXP, SEXP tonevalSEXP) {
@@ -55,8 +77,10 @@ END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
+    {"_rayrender_convert_mesh_rcpp", (DL_FUNC) &_rayrender_convert_mesh_rcpp, 3},
     {"_rayrender_render_animation_rcpp", (DL_FUNC) &_rayrender_render_animation_rcpp, 8},
     {"_rayrender_render_scene_rcpp", (DL_FUNC) &_rayrender_render_scene_rcpp, 2},
+    {"_rayrender_clear_texture_cache_rcpp", (DL_FUNC) &_rayrender_clear_texture_cache_rcpp, 0},
     {"_rayrender_tonemap_image", (DL_FUNC) &_rayrender_tonemap_image, 4},
     {NULL, NULL, 0}
 };
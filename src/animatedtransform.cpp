@@ -899,3 +899,41 @@ aabb AnimatedTransform::BoundPointMotion(const point3f &p) const {
   }
   return bounds;
 }
+
+aabb AnimatedTransform::MotionBounds(const aabb &b, Float time0, Float time1) const {
+  if (!actuallyAnimated) return (*startTransform)(b);
+  if (hasRotation == false) {
+    Transform t0, t1;
+    Interpolate(time0, &t0);
+    Interpolate(time1, &t1);
+    return surrounding_box(t0(b), t1(b));
+  }
+  aabb bounds;
+  for (int corner = 0; corner < 8; ++corner) {
+    bounds = surrounding_box(bounds, BoundPointMotion(b.Corner(corner), time0, time1));
+  }
+  return bounds;
+}
+
+aabb AnimatedTransform::BoundPointMotion(const point3f &p, Float time0, Float time1) const {
+  if (!actuallyAnimated) return aabb((*startTransform)(p));
+  aabb bounds((*this)(time0, p), (*this)(time1, p));
+  if (endTime <= startTime) return bounds;
+  // Only search for motion derivative zeros in the part of the animation that's covered
+  Float u0 = clamp((time0 - startTime) / (endTime - startTime), 0, 1);
+  Float u1 = clamp((time1 - startTime) / (endTime - startTime), 0, 1);
+  Float cosTheta = dot(R[0], R[1]);
+  Float theta = std::acos(clamp(cosTheta, -1, 1));
+  for (int c = 0; c < 3; ++c) {
+    Float zeros[8];
+    int nZeros = 0;
+    IntervalFindZeros(c1[c].Eval(p), c2[c].Eval(p), c3[c].Eval(p),
+                      c4[c].Eval(p), c5[c].Eval(p), theta, Interval(u0, u1),
+                      zeros, &nZeros);
+    for (int i = 0; i < nZeros; ++i) {
+      point3f pz = (*this)(lerp(zeros[i], startTime, endTime), p);
+      bounds = surrounding_box(bounds, pz);
+    }
+  }
+  return bounds;
+}
@@ -24,6 +24,9 @@ public:
   }
   aabb MotionBounds(const aabb &b) const;
   aabb BoundPointMotion(const point3f &p) const;
+  //Bounds of the motion between time0 and time1 only (clamped to the animation's times)
+  aabb MotionBounds(const aabb &b, Float time0, Float time1) const;
+  aabb BoundPointMotion(const point3f &p, Float time0, Float time1) const;
   
 private:
   // AnimatedTransform Private Data
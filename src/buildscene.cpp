@@ -51,7 +51,8 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
                      List& scale_list, NumericVector& sigma,  List &glossyinfo,
                      IntegerVector& shared_id_mat, LogicalVector& is_shared_mat,
                      std::vector<std::shared_ptr<material> >* shared_materials, List& image_repeat_list,
-                     List& csg_info, List& mesh_list, int bvh_type,
+                     List& csg_info, List& mesh_list, int bvh_type, int max_leaf_size, size_t numbercores,
+                     const std::string& bvh_cache, const MeshLOD& mesh_lod,
                      TransformCache& transformCache, List& animation_info, 
                      random_gen& rng) {
   hitable_list list;
@@ -102,6 +103,55 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
   std::vector<std::shared_ptr<bump_texture> > bump(n);
   std::vector<std::shared_ptr<roughness_texture> > roughness(n);
   
+  //Meshes loaded from the same file with the same scale and material are built once (with an
+  //identity transform) and shared between rows as instances, each with its own transform
+  std::vector<std::string> mesh_keys(n);
+  std::map<std::string, int> mesh_key_count;
+  for(int i = 0; i < n; i++) {
+    if(shape(i) != 7 && shape(i) != 8 && shape(i) != 12 && shape(i) != 16 && shape(i) != 18 && shape(i) != 19) {
+      continue;
+    }
+    bool uses_tex = shape(i) == 7 || shape(i) == 16 || shape(i) == 18;
+    if(uses_tex && !is_shared_mat(i) &&
+       (isimage(i) || isnoise(i) || ischeckered(i) || isgradient(i) || is_world_gradient(i) ||
+        is_tri_color(i) || has_alpha(i) || has_bump(i) || has_roughness(i))) {
+      continue;
+    }
+    tempvector = as<NumericVector>(properties(i));
+    std::ostringstream key;
+    key.precision(17);
+    key << shape(i) << '|' << Rcpp::as<std::string>(fileinfo(i)) << '|' << 
+      Rcpp::as<std::string>(filebasedir(i)) << '|' << isflipped(i) << '|' << sigma(i);
+    if(uses_tex) {
+      if(is_shared_mat(i)) {
+        key << "|shared" << shared_id_mat(i);
+      } else {
+        temp_glossy = as<NumericVector>(glossyinfo(i));
+        key << '|' << type(i) << '|' << lightintensity(i);
+        for(int j = 0; j < temp_glossy.size(); j++) {
+          key << ',' << temp_glossy(j);
+        }
+      }
+    }
+    for(int j = 0; j < tempvector.size(); j++) {
+      key << ',' << tempvector(j);
+    }
+    mesh_keys[i] = key.str();
+    mesh_key_count[mesh_keys[i]]++;
+  }
+  std::map<std::string, std::shared_ptr<hitable> > shared_meshes;
+  std::shared_ptr<Transform> IdentityTransform = transformCache.Lookup(Transform());
+  //With level of detail on, instances only share a mesh if they use the same level of it, which is
+  //picked from the full mesh's size once the first instance has been loaded
+  std::map<std::string, LodSource> lod_sources;
+  auto shared_mesh_key = [&](int i, const MeshLOD& lod) {
+    std::map<std::string, LodSource>::const_iterator source = lod_sources.find(mesh_keys[i]);
+    if(!lod.enabled() || source == lod_sources.end() || source->second.faces == 0) {
+      return(mesh_keys[i]);
+    }
+    return(mesh_keys[i] + "|lod" + std::to_string(lod.level(source->second.bounds, source->second.faces)));
+  };
+  
   for(int i = 0; i < n; i++) {
     tempvector = as<NumericVector>(properties(i));
     tempgradient = as<NumericVector>(gradient_colors(i));
@@ -492,6 +542,10 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       center = vec3f(x(i), y(i), z(i));
     } else if(shape(i) == 17) {
       center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 18) {
+      center = vec3f(x(i), y(i), z(i));
+    } else if(shape(i) == 19) {
+      center = vec3f(x(i), y(i), z(i));
     }
     
     Transform GroupTransform(temp_group_transform);
@@ -510,6 +564,14 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
     AnimatedTransform Animate(StartAnim, animation_start_time(i), 
                               EndAnim, animation_end_time(i));
     
+    //Mirroring transforms flip the winding of baked-in triangles, so those are never instanced
+    bool instanced = !mesh_keys[i].empty() && mesh_key_count[mesh_keys[i]] > 1 &&
+      !ObjToWorld->SwapsHandedness();
+    std::shared_ptr<Transform> MeshToWorld = instanced ? IdentityTransform : ObjToWorld;
+    std::shared_ptr<Transform> WorldToMesh = instanced ? IdentityTransform : WorldToObj;
+    //Lights keep their full mesh, as do the light sampling meshes built by build_imp_sample()
+    MeshLOD row_lod = type(i) == 5 ? MeshLOD() : instanced ? mesh_lod.for_instance(*ObjToWorld) : mesh_lod;
+    
     //Generate objects
     if (shape(i) == 1) {
       std::shared_ptr<hitable> entry;
@@ -600,11 +662,21 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
-                         tex,
-                         tempvector(prop_len+1),
-                         shutteropen, shutterclose, bvh_type, rng,
-                         ObjToWorld,WorldToObj, isflipped(i));
+      if(instanced && shared_meshes.count(shared_mesh_key(i, row_lod))) {
+        entry = shared_meshes[shared_mesh_key(i, row_lod)];
+      } else {
+        std::shared_ptr<trimesh> mesh_entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
+                           tex,
+                           tempvector(prop_len+1),
+                           shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, bvh_cache, rng,
+                           MeshToWorld,WorldToMesh, isflipped(i), row_lod);
+        lod_sources[mesh_keys[i]] = mesh_entry->lod_source;
+        entry = mesh_entry;
+      }
+      if(instanced) {
+        shared_meshes[shared_mesh_key(i, row_lod)] = entry;
+        entry = std::make_shared<instance>(entry, ObjToWorld, WorldToObj);
+      }
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
                                                   std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
@@ -617,16 +689,27 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      if(sigma(i) == 0) {
-        entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
-                            tempvector(prop_len+1), 
-                            shutteropen, shutterclose, bvh_type, rng,
-                            ObjToWorld,WorldToObj, isflipped(i));
+      if(instanced && shared_meshes.count(shared_mesh_key(i, row_lod))) {
+        entry = shared_meshes[shared_mesh_key(i, row_lod)];
       } else {
-        entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
-                            tempvector(prop_len+1), sigma(i),
-                            shutteropen, shutterclose, bvh_type, rng,
-                            ObjToWorld,WorldToObj, isflipped(i));
+        std::shared_ptr<trimesh> mesh_entry;
+        if(sigma(i) == 0) {
+          mesh_entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
+                              tempvector(prop_len+1), 
+                              shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng,
+                              MeshToWorld,WorldToMesh, isflipped(i), row_lod);
+        } else {
+          mesh_entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
+                              tempvector(prop_len+1), sigma(i),
+                              shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng,
+                              MeshToWorld,WorldToMesh, isflipped(i), row_lod);
+        }
+        lod_sources[mesh_keys[i]] = mesh_entry->lod_source;
+        entry = mesh_entry;
+      }
+      if(instanced) {
+        shared_meshes[shared_mesh_key(i, row_lod)] = entry;
+        entry = std::make_shared<instance>(entry, ObjToWorld, WorldToObj);
       }
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
@@ -672,11 +755,19 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
-                          sigma(i),
-                          tempvector(prop_len+1), true,
-                          shutteropen, shutterclose, bvh_type, rng,
-                          ObjToWorld,WorldToObj, isflipped(i));
+      if(instanced && shared_meshes.count(mesh_keys[i])) {
+        entry = shared_meshes[mesh_keys[i]];
+      } else {
+        entry = std::make_shared<trimesh>(objfilename, objbasedirname, 
+                            sigma(i),
+                            tempvector(prop_len+1), true,
+                            shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng,
+                            MeshToWorld,WorldToMesh, isflipped(i));
+      }
+      if(instanced) {
+        shared_meshes[mesh_keys[i]] = entry;
+        entry = std::make_shared<instance>(entry, ObjToWorld, WorldToObj);
+      }
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
                                                   std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
@@ -732,14 +823,71 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       std::shared_ptr<hitable> entry;
       std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
       std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
-      entry = std::make_shared<plymesh>(objfilename, objbasedirname, 
-                          tex,
-                          tempvector(prop_len+1),
-                          shutteropen, shutterclose, bvh_type, rng,
-                          ObjToWorld,WorldToObj, isflipped(i));
+      if(instanced && shared_meshes.count(shared_mesh_key(i, row_lod))) {
+        entry = shared_meshes[shared_mesh_key(i, row_lod)];
+      } else {
+        std::shared_ptr<plymesh> mesh_entry = std::make_shared<plymesh>(objfilename, objbasedirname, 
+                            tex,
+                            tempvector(prop_len+1),
+                            shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, bvh_cache, rng,
+                            MeshToWorld,WorldToMesh, isflipped(i), row_lod);
+        lod_sources[mesh_keys[i]] = mesh_entry->lod_source;
+        entry = mesh_entry;
+      }
       if(entry == nullptr) {
         continue;
       }
+      if(instanced) {
+        shared_meshes[shared_mesh_key(i, row_lod)] = entry;
+        entry = std::make_shared<instance>(entry, ObjToWorld, WorldToObj);
+      }
+      if(isvolume(i)) {
+        entry = std::make_shared<constant_medium>(entry, voldensity(i), 
+                                                  std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
+      }
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 18) {
+      std::shared_ptr<hitable> entry;
+      std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
+      if(instanced && shared_meshes.count(mesh_keys[i])) {
+        entry = shared_meshes[mesh_keys[i]];
+      } else {
+        entry = std::make_shared<raymesh>(objfilename, 
+                            tex,
+                            tempvector(prop_len+1),
+                            shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, bvh_cache, rng,
+                            MeshToWorld,WorldToMesh, isflipped(i));
+      }
+      if(instanced) {
+        shared_meshes[mesh_keys[i]] = entry;
+        entry = std::make_shared<instance>(entry, ObjToWorld, WorldToObj);
+      }
+      if(isvolume(i)) {
+        entry = std::make_shared<constant_medium>(entry, voldensity(i), 
+                                                  std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
+      }
+      if(has_animation(i)) {
+        entry = std::make_shared<AnimatedHitable>(entry, Animate);
+      }
+      list.add(entry);
+    } else if (shape(i) == 19) {
+      std::shared_ptr<hitable> entry;
+      std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
+      if(instanced && shared_meshes.count(mesh_keys[i])) {
+        entry = shared_meshes[mesh_keys[i]];
+      } else {
+        entry = std::make_shared<raymesh>(objfilename, 
+                            tempvector(prop_len+1), sigma(i),
+                            shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng,
+                            MeshToWorld,WorldToMesh, isflipped(i));
+      }
+      if(instanced) {
+        shared_meshes[mesh_keys[i]] = entry;
+        entry = std::make_shared<instance>(entry, ObjToWorld, WorldToObj);
+      }
       if(isvolume(i)) {
         entry = std::make_shared<constant_medium>(entry, voldensity(i), 
                                                   std::make_shared<constant_texture>(point3f(tempvector(0),tempvector(1),tempvector(2))));
@@ -751,7 +899,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
     } else if (shape(i) == 17) {
       List mesh_entry = mesh_list(i);
       std::shared_ptr<hitable> entry = std::make_shared<mesh3d>(mesh_entry, tex,
-                                  shutteropen, shutterclose, bvh_type, rng,
+                                  shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng,
                                   ObjToWorld,WorldToObj, isflipped(i));
       if(has_animation(i)) {
         entry = std::make_shared<AnimatedHitable>(entry, Animate);
@@ -759,7 +907,7 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
       list.add(entry);
     }
   }
-  std::shared_ptr<hitable> full_scene = std::make_shared<bvh_node>(list, shutteropen, shutterclose, bvh_type, rng);
+  std::shared_ptr<hitable> full_scene = std::make_shared<bvh_node>(list, shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng);
   return(full_scene);
 }
 
@@ -773,7 +921,8 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
                           List& group_transform,
                           CharacterVector& fileinfo, CharacterVector& filebasedir,
                           TransformCache& transformCache,
-                          List& scale_list, List& mesh_list, int bvh_type, 
+                          List& scale_list, List& mesh_list, int bvh_type, int max_leaf_size, size_t numbercores,
+                          const std::string& bvh_cache,
                           List& animation_info, random_gen& rng) {
   NumericVector x = position_list["xvec"];
   NumericVector y = position_list["yvec"];
@@ -868,6 +1017,10 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
     center = vec3f(x(i), y(i), z(i));
   } else if(shape(i) == 17) {
     center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 18) {
+    center = vec3f(x(i), y(i), z(i));
+  } else if(shape(i) == 19) {
+    center = vec3f(x(i), y(i), z(i));
   }
   
   
@@ -950,7 +1103,7 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
     std::string objbasedirname = Rcpp::as<std::string>(filebasedir(i));
     entry = std::make_shared<trimesh>(objfilename, objbasedirname,
                         tempvector(prop_len+1),
-                        shutteropen, shutterclose, bvh_type, rng, ObjToWorld,WorldToObj, false);
+                        shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng, ObjToWorld,WorldToObj, false);
     if(has_animation(i)) {
       entry = std::make_shared<AnimatedHitable>(entry, Animate);
     }
@@ -1020,7 +1173,30 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
     entry = std::make_shared<plymesh>(objfilename, objbasedirname, 
                         tex,
                         tempvector(prop_len+1),
-                        shutteropen, shutterclose, bvh_type, rng, 
+                        shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, bvh_cache, rng, 
+                        ObjToWorld,WorldToObj, false);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
+  } else if (shape(i) == 18) {
+    std::shared_ptr<hitable> entry;
+    std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
+    entry = std::make_shared<raymesh>(objfilename, 
+                        tex,
+                        tempvector(prop_len+1),
+                        shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, bvh_cache, rng, 
+                        ObjToWorld,WorldToObj, false);
+    if(has_animation(i)) {
+      entry = std::make_shared<AnimatedHitable>(entry, Animate);
+    }
+    return(entry);
+  } else if (shape(i) == 19) {
+    std::shared_ptr<hitable> entry;
+    std::string objfilename = Rcpp::as<std::string>(fileinfo(i));
+    entry = std::make_shared<raymesh>(objfilename, 
+                        tempvector(prop_len+1), 0,
+                        shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng, 
                         ObjToWorld,WorldToObj, false);
     if(has_animation(i)) {
       entry = std::make_shared<AnimatedHitable>(entry, Animate);
@@ -1029,7 +1205,7 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
   } else {
     List mesh_entry = mesh_list(i);
     std::shared_ptr<hitable> entry = std::make_shared<mesh3d>(mesh_entry, tex,
-                                shutteropen, shutterclose, bvh_type, rng, 
+                                shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng, 
                                 ObjToWorld,WorldToObj, false);
     if(has_animation(i)) {
       entry = std::make_shared<AnimatedHitable>(entry, Animate);
@@ -1037,3 +1213,134 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
     return(entry);
   }
 }
+
+//Walks the scene BVH and the BVHs of the meshes inside it. Meshes shared between instances
+//are only counted once.
+struct BVHStatistics {
+  BVHStatistics() : trees(0), nodes(0), references(0), primitives(0),
+                    node_bytes(0), uncompressed_node_bytes(0), reference_bytes(0), mesh_bytes(0) {}
+  size_t trees, nodes, references, primitives;
+  size_t node_bytes, uncompressed_node_bytes, reference_bytes, mesh_bytes;
+};
+
+//Calls f on every BVH reachable from entry, visiting shared (instanced) ones once
+template<typename F>
+static void visit_bvhs(hitable* entry, std::unordered_set<const hitable*>& visited, F& f) {
+  if(!entry || !visited.insert(entry).second) {
+    return;
+  }
+  if(bvh_node* bvh = dynamic_cast<bvh_node*>(entry)) {
+    f(bvh);
+    for(size_t i = 0; i < bvh->primitives.size(); i++) {
+      visit_bvhs(bvh->primitives[i].get(), visited, f);
+    }
+  } else if (hitable_list* list = dynamic_cast<hitable_list*>(entry)) {
+    for(size_t i = 0; i < list->objects.size(); i++) {
+      visit_bvhs(list->objects[i].get(), visited, f);
+    }
+  } else if (trimesh* mesh = dynamic_cast<trimesh*>(entry)) {
+    visit_bvhs(mesh->tri_mesh_bvh.get(), visited, f);
+  } else if (plymesh* mesh = dynamic_cast<plymesh*>(entry)) {
+    visit_bvhs(mesh->ply_mesh_bvh.get(), visited, f);
+  } else if (mesh3d* mesh = dynamic_cast<mesh3d*>(entry)) {
+    visit_bvhs(mesh->mesh_bvh.get(), visited, f);
+  } else if (raymesh* mesh = dynamic_cast<raymesh*>(entry)) {
+    visit_bvhs(mesh->mesh_bvh.get(), visited, f);
+  } else if (instance* inst = dynamic_cast<instance*>(entry)) {
+    visit_bvhs(inst->primitive.get(), visited, f);
+  } else if (AnimatedHitable* anim = dynamic_cast<AnimatedHitable*>(entry)) {
+    visit_bvhs(anim->primitive.get(), visited, f);
+  } else if (constant_medium* medium = dynamic_cast<constant_medium*>(entry)) {
+    visit_bvhs(medium->boundary.get(), visited, f);
+  }
+}
+
+void print_bvh_statistics(std::shared_ptr<hitable> worldbvh) {
+  std::unordered_set<const hitable*> visited;
+  std::unordered_set<const TriangleMesh*> meshes;
+  BVHStatistics stats;
+  auto add_statistics = [&stats, &meshes] (const bvh_node* bvh) {
+    stats.trees++;
+    stats.nodes += bvh->node_count();
+    stats.references += bvh->reference_count();
+    stats.primitives += bvh->unique_primitives;
+    stats.node_bytes += bvh->node_bytes();
+    stats.uncompressed_node_bytes += bvh->uncompressed_node_bytes();
+    stats.reference_bytes += bvh->reference_bytes();
+    if(bvh->mesh && meshes.insert(bvh->mesh.get()).second) {
+      stats.mesh_bytes += bvh->mesh->memory_size();
+    }
+  };
+  visit_bvhs(worldbvh.get(), visited, add_statistics);
+  Rcpp::Rcout << "BVH: " << stats.trees << " trees, " << stats.nodes << " nodes, " << stats.references << 
+    " primitive references (" << stats.primitives << " unique)" << "\n";
+  Rcpp::Rcout << "BVH memory: " << stats.node_bytes / 1024 << " KB of nodes";
+  if(stats.uncompressed_node_bytes != stats.node_bytes) {
+    Rcpp::Rcout << " (" << stats.uncompressed_node_bytes / 1024 << " KB uncompressed)";
+  }
+  Rcpp::Rcout << ", " << stats.reference_bytes / 1024 << " KB of primitive references";
+  if(stats.mesh_bytes > 0) {
+    Rcpp::Rcout << ", " << stats.mesh_bytes / 1024 << " KB of indexed meshes";
+  }
+  Rcpp::Rcout << "\n";
+}
+
+List bvh_statistics(std::shared_ptr<hitable> worldbvh, const BVHTraversalCounters* traversal_counters) {
+  std::unordered_set<const hitable*> visited;
+  std::vector<double> primitives, references, nodes, sah_cost, max_depth, mean_depth;
+  std::vector<size_t> leaf_sizes;
+  auto add_tree = [&] (const bvh_node* bvh) {
+    BVHTreeStatistics tree = bvh->tree_statistics();
+    primitives.push_back(bvh->unique_primitives);
+    references.push_back(bvh->reference_count());
+    nodes.push_back(bvh->node_count());
+    sah_cost.push_back(bvh->sah_cost());
+    max_depth.push_back(tree.max_depth);
+    mean_depth.push_back(tree.leaves > 0 ? tree.leaf_depth_sum / tree.leaves : 0);
+    if(leaf_sizes.size() < tree.leaf_sizes.size()) {
+      leaf_sizes.resize(tree.leaf_sizes.size(), 0);
+    }
+    for(size_t i = 0; i < tree.leaf_sizes.size(); i++) {
+      leaf_sizes[i] += tree.leaf_sizes[i];
+    }
+  };
+  visit_bvhs(worldbvh.get(), visited, add_tree);
+  //Leaves are never empty, so the histogram starts at one primitive
+  NumericVector leaf_histogram(leaf_sizes.size() > 1 ? leaf_sizes.size() - 1 : 0);
+  CharacterVector leaf_names(leaf_histogram.size());
+  for(int i = 0; i < leaf_histogram.size(); i++) {
+    leaf_histogram(i) = leaf_sizes[i+1];
+    leaf_names(i) = std::to_string(i+1);
+  }
+  leaf_histogram.names() = leaf_names;
+  List stats = List::create(_["trees"] = DataFrame::create(_["primitives"] = primitives,
+                                                           _["references"] = references,
+                                                           _["nodes"] = nodes,
+                                                           _["sah_cost"] = sah_cost,
+                                                           _["max_depth"] = max_depth,
+                                                           _["mean_depth"] = mean_depth),
+                            _["leaf_sizes"] = leaf_histogram);
+  if(traversal_counters) {
+    std::vector<double> rays(traversal_counters->rays.begin(), traversal_counters->rays.end());
+    std::vector<double> visited_nodes(traversal_counters->nodes.begin(), traversal_counters->nodes.end());
+    std::vector<double> tests(traversal_counters->primitives.begin(), traversal_counters->primitives.end());
+    double total_rays = std::accumulate(rays.begin(), rays.end(), 0.0);
+    double total_nodes = std::accumulate(visited_nodes.begin(), visited_nodes.end(), 0.0);
+    double total_tests = std::accumulate(tests.begin(), tests.end(), 0.0);
+    stats["traversal"] = List::create(_["rays"] = total_rays,
+                                      _["nodes_per_ray"] = total_rays > 0 ? total_nodes / total_rays : 0,
+                                      _["primitives_per_ray"] = total_rays > 0 ? total_tests / total_rays : 0,
+                                      _["threads"] = DataFrame::create(_["rays"] = rays,
+                                                                       _["nodes"] = visited_nodes,
+                                                                       _["primitives"] = tests));
+  }
+  return(stats);
+}
+
+void reorder_bvh_nodes(hitable* world) {
+  std::unordered_set<const hitable*> visited;
+  auto reorder = [] (bvh_node* bvh) {
+    bvh->reorder();
+  };
+  visit_bvhs(world, visited, reorder);
+}
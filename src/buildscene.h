@@ -21,10 +21,16 @@
 #include "csg.h"
 #include "plymesh.h"
 #include "mesh3d.h"
+#include "raymesh.h"
+#include "instance.h"
 #include "transform.h"
 #include "transformcache.h"
 #include <Rcpp.h>
 #include <memory>
+#include <map>
+#include <unordered_set>
+#include <numeric>
+#include <sstream>
 using namespace Rcpp;
 
 
@@ -59,7 +65,8 @@ std::shared_ptr<hitable> build_scene(IntegerVector& type,
                                      List& scale_list, NumericVector& sigma,  List &glossyinfo,
                                      IntegerVector& shared_id_mat, LogicalVector& is_shared_mat,
                                      std::vector<std::shared_ptr<material> >* shared_materials, List& image_repeat_list,
-                                     List& csg_info, List& mesh_list, int bvh_type,
+                                     List& csg_info, List& mesh_list, int bvh_type, int max_leaf_size, size_t numbercores,
+                                     const std::string& bvh_cache, const MeshLOD& mesh_lod,
                                      TransformCache &transformCache, List& animation_info,
                                      random_gen& rng);
 
@@ -73,7 +80,17 @@ std::shared_ptr<hitable> build_imp_sample(IntegerVector& type,
                                           List& group_transform,
                                           CharacterVector& fileinfo, CharacterVector& filebasedir,
                                           TransformCache& transformCache,
-                                          List& scale_list, List& mesh_list, int bvh_type, 
+                                          List& scale_list, List& mesh_list, int bvh_type, int max_leaf_size, size_t numbercores,
+                                          const std::string& bvh_cache,
                                           List& animation_info, random_gen& rng);
 
+void print_bvh_statistics(std::shared_ptr<hitable> worldbvh);
+
+//Per-tree quality statistics of every BVH in the scene and, if traversal_counters isn't null,
+//the traversal counters of the render (bvh_stats = TRUE)
+List bvh_statistics(std::shared_ptr<hitable> worldbvh, const BVHTraversalCounters* traversal_counters);
+
+//Moves the nodes of every BVH in the scene into the clustered layout (bvh_layout = "clustered")
+void reorder_bvh_nodes(hitable* world);
+
 #endif
@@ -1,4 +1,10 @@
 #include "bvh_node.h"
+#include "triangle.h"
+#include <unordered_set>
+
+#if defined(__SSE2__) && !defined(RAY_FLOAT_AS_DOUBLE)
+#include <immintrin.h>
+#endif
 
 
 #ifdef DEBUGBBOX
@@ -13,94 +19,1360 @@ bool bvh_node::bounding_box(Float t0, Float t1, aabb& b) const {
   return(true);
 }
 
-bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
-#ifndef DEBUGBVH
-  if(box.hit(r, t_min, t_max, rng)) {
-    if(left->hit(r,t_min,t_max,rec, rng)) {
-      right->hit(r,t_min,rec.t,rec, rng);
-      return(true);
-    } else {
-      return(right->hit(r,t_min,t_max,rec, rng));
+//Uniform draw from either sampler type, so traversal and sampling code only needs to be written once
+static inline Float bvh_rand(random_gen& rng) {
+  return(rng.unif_rand());
+}
+
+static inline Float bvh_rand(Sampler* sampler) {
+  return(sampler->Get1D());
+}
+
+//Slab test against all W children of a wide node at once: writes the entry distance of
+//each child to tnear and returns a bitmask of the children hit. Operations are ordered
+//the same as LinearBVHNode::hit(), so all widths return the same intersections.
+template<int W>
+static inline int intersect_wide(const WideBVHNode<W>& node, const ray& r,
+                                 Float tmin, Float tmax, Float* tnear) {
+  int mask = 0;
+  for(int i = 0; i < W; i++) {
+    Float t0 = tmin, t1 = tmax;
+    for(int a = 0; a < 3; a++) {
+      Float ta = (node.bounds[  r.sign[a]][a][i] - r.A.e[a]) * r.inv_dir.e[a];
+      Float tb = (node.bounds[1-r.sign[a]][a][i] - r.A.e[a]) * r.inv_dir_pad.e[a];
+      t0 = ffmax(ta, t0);
+      t1 = ffmin(tb, t1);
+    }
+    tnear[i] = t0;
+    mask |= (t0 <= t1) << i;
+  }
+  return(mask);
+}
+
+#if defined(__SSE2__) && !defined(RAY_FLOAT_AS_DOUBLE)
+//_mm_max_ps(a,b)/_mm_min_ps(a,b) return b when either argument is NaN, matching ffmax()/ffmin()
+template<int W>
+static inline int intersect4_sse(const WideBVHNode<W>& node, int first, const ray& r,
+                                 Float tmin, Float tmax, Float* tnear) {
+  __m128 t0 = _mm_set1_ps(tmin);
+  __m128 t1 = _mm_set1_ps(tmax);
+  for(int a = 0; a < 3; a++) {
+    __m128 o = _mm_set1_ps(r.A.e[a]);
+    __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[  r.sign[a]][a][first]), o),
+                           _mm_set1_ps(r.inv_dir.e[a]));
+    __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&node.bounds[1-r.sign[a]][a][first]), o),
+                           _mm_set1_ps(r.inv_dir_pad.e[a]));
+    t0 = _mm_max_ps(ta, t0);
+    t1 = _mm_min_ps(tb, t1);
+  }
+  _mm_storeu_ps(tnear + first, t0);
+  return(_mm_movemask_ps(_mm_cmple_ps(t0, t1)));
+}
+
+template<>
+inline int intersect_wide<4>(const WideBVHNode<4>& node, const ray& r,
+                             Float tmin, Float tmax, Float* tnear) {
+  return(intersect4_sse(node, 0, r, tmin, tmax, tnear));
+}
+
+template<>
+inline int intersect_wide<8>(const WideBVHNode<8>& node, const ray& r,
+                             Float tmin, Float tmax, Float* tnear) {
+#ifdef __AVX__
+  __m256 t0 = _mm256_set1_ps(tmin);
+  __m256 t1 = _mm256_set1_ps(tmax);
+  for(int a = 0; a < 3; a++) {
+    __m256 o = _mm256_set1_ps(r.A.e[a]);
+    __m256 ta = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[  r.sign[a]][a]), o),
+                              _mm256_set1_ps(r.inv_dir.e[a]));
+    __m256 tb = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[1-r.sign[a]][a]), o),
+                              _mm256_set1_ps(r.inv_dir_pad.e[a]));
+    t0 = _mm256_max_ps(ta, t0);
+    t1 = _mm256_min_ps(tb, t1);
+  }
+  _mm256_storeu_ps(tnear, t0);
+  return(_mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)));
+#else
+  return(intersect4_sse(node, 0, r, tmin, tmax, tnear) |
+         (intersect4_sse(node, 4, r, tmin, tmax, tnear) << 4));
+#endif
+}
+#endif
+
+//Shared by the build, refit and traversal, so the rounding checks made when quantizing hold
+//for the boxes that are actually tested. scale * q is exact, so only the add rounds.
+static inline Float dequantize(Float origin, Float scale, uint8_t q) {
+  return(origin + scale * q);
+}
+
+//Compressed nodes are decoded to full precision bounds and tested with the same kernel
+template<int W>
+static inline int intersect_wide(const QuantizedBVHNode<W>& node, const ray& r,
+                                 Float tmin, Float tmax, Float* tnear) {
+  WideBVHNode<W> decoded;
+  for(int m = 0; m < 2; m++) {
+    for(int a = 0; a < 3; a++) {
+      for(int i = 0; i < W; i++) {
+        decoded.bounds[m][a][i] = dequantize(node.origin[a], node.scale[a], node.qbounds[m][a][i]);
+      }
+    }
+  }
+  return(intersect_wide<W>(decoded, r, tmin, tmax, tnear));
+}
+
+thread_local BVHTraceRecorder* bvh_trace_recorder = nullptr;
+
+void BVHTraversalCounters::add(const BVHTraceRecorder& recorder) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto index = thread_index.insert(std::make_pair(std::this_thread::get_id(), rays.size()));
+  if(index.second) {
+    rays.push_back(0);
+    nodes.push_back(0);
+    primitives.push_back(0);
+  }
+  size_t i = index.first->second;
+  rays[i] += recorder.rays;
+  nodes[i] += recorder.nodes;
+  primitives[i] += recorder.primitives;
+}
+
+//Leaves reference either faces of the mesh or hitables
+template<typename S>
+inline bool bvh_node::occluded_reference(int i, const ray& r, Float t_min, Float t_max, S& sampler) {
+  return(mesh ? mesh->intersect_p(faces[i], r, t_min, t_max) :
+                primitives[i]->occluded(r, t_min, t_max, sampler));
+}
+
+template<typename S>
+inline Float bvh_node::pdf_value_reference(int i, const point3f& o, const vec3f& v, S& sampler, Float time) {
+  return(mesh ? mesh->pdf_value(faces[i], o, v, sampler) :
+                primitives[i]->pdf_value(o, v, sampler, time));
+}
+
+template<typename S>
+inline vec3f bvh_node::random_reference(int i, const point3f& o, S& sampler, Float time) {
+  return(mesh ? mesh->random(faces[i], o, sampler) : primitives[i]->random(o, sampler, time));
+}
+
+template<bool Record, typename S>
+bool bvh_node::hit_binary(const LinearBVHNode* tree,
+                          const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler,
+                          const WatertightRay* wray) {
+  bool hit_anything = false;
+  int toVisitOffset = 0, currentNodeIndex = 0;
+  int nodesToVisit[2*kMaxBVHDepth];
+  while(true) {
+    const LinearBVHNode* node = &tree[currentNodeIndex];
+    if(Record) {
+      bvh_trace_recorder->visit(node, sizeof(LinearBVHNode));
+    }
+    if(node->hit(r, t_min, t_max)) {
+#ifdef DEBUGBVH
+      hit.rec->bvh_nodes += 1.0;
+#endif
+      if(node->nPrimitives > 0) {
+        if(Record) {
+          bvh_trace_recorder->primitives += node->nPrimitives;
+        }
+        if(wray) {
+          if(hit_mesh_leaf(node->primitivesOffset, node->nPrimitives, *wray, hit, t_min, t_max)) {
+            hit_anything = true;
+            t_max = hit.t;
+          }
+        } else {
+          for(int i = 0; i < node->nPrimitives; ++i) {
+            if(primitives[node->primitivesOffset + i]->intersect(r, t_min, t_max, hit, sampler)) {
+              hit_anything = true;
+              t_max = hit.t;
+            }
+          }
+        }
+        if(toVisitOffset == 0) break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+      } else {
+        //Visit the child closest to the ray origin first
+        if(r.sign[node->axis]) {
+          nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+          currentNodeIndex = node->secondChildOffset;
+        } else {
+          nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+          currentNodeIndex = currentNodeIndex + 1;
+        }
+      }
+    } else {
+      if(toVisitOffset == 0) break;
+      currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+  }
+  return(hit_anything);
+}
+
+template<bool Record, typename Node, typename S>
+bool bvh_node::hit_wide(const Node* wide_nodes,
+                        const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler,
+                        const WatertightRay* wray) {
+  const int W = Node::width;
+  //Stack entries are either wide nodes (nPrimitives == 0) or leaves, along with the
+  //distance at which the ray enters them so entries beyond the closest hit can be culled
+  struct StackEntry {
+    int offset;
+    int nPrimitives;
+    Float tnear;
+  };
+  StackEntry toVisit[2*kMaxBVHDepth*(W-1)+1];
+  int toVisitOffset = 0;
+  bool hit_anything = false;
+  toVisit[toVisitOffset++] = {0, 0, t_min};
+  while(toVisitOffset > 0) {
+    const StackEntry current = toVisit[--toVisitOffset];
+    if(current.tnear > t_max) {
+      continue;
+    }
+    if(current.nPrimitives > 0) {
+      if(Record) {
+        bvh_trace_recorder->primitives += current.nPrimitives;
+      }
+      if(wray) {
+        if(hit_mesh_leaf(current.offset, current.nPrimitives, *wray, hit, t_min, t_max)) {
+          hit_anything = true;
+          t_max = hit.t;
+        }
+      } else {
+        for(int i = 0; i < current.nPrimitives; ++i) {
+          if(primitives[current.offset + i]->intersect(r, t_min, t_max, hit, sampler)) {
+            hit_anything = true;
+            t_max = hit.t;
+          }
+        }
+      }
+      continue;
+    }
+    const Node& node = wide_nodes[current.offset];
+    if(Record) {
+      bvh_trace_recorder->visit(&node, sizeof(Node));
+    }
+    Float tnear[W];
+    int mask = intersect_wide<W>(node, r, t_min, t_max, tnear) & ((1 << node.nChildren) - 1);
+
+    //Sort the children hit by entry distance (farthest first), so the nearest is popped next
+    int order[W];
+    int nHit = 0;
+    for(int i = 0; i < node.nChildren; i++) {
+      if(mask & (1 << i)) {
+        int j = nHit++;
+        while(j > 0 && tnear[order[j-1]] < tnear[i]) {
+          order[j] = order[j-1];
+          j--;
+        }
+        order[j] = i;
+      }
+    }
+#ifdef DEBUGBVH
+    hit.rec->bvh_nodes += nHit;
+#endif
+    for(int i = 0; i < nHit; i++) {
+      int child = order[i];
+      toVisit[toVisitOffset++] = {node.offset[child], node.nPrimitives[child], tnear[child]};
+    }
+  }
+  return(hit_anything);
+}
+
+template<bool Record, typename S>
+bool bvh_node::hit_nodes(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler,
+                         const WatertightRay* wray) {
+  switch(width) {
+    case 4:  return(hit_wide<Record>(nodes4.data() + motion_tree(r.time(), nodes4.size()), r, t_min, t_max, hit, sampler, wray));
+    case 8:  return(compressed ?
+                    hit_wide<Record>(nodes8q.data() + motion_tree(r.time(), nodes8q.size()), r, t_min, t_max, hit, sampler, wray) :
+                    hit_wide<Record>(nodes8.data() + motion_tree(r.time(), nodes8.size()), r, t_min, t_max, hit, sampler, wray));
+    default: return(hit_binary<Record>(nodes.data() + motion_tree(r.time(), nodes.size()), r, t_min, t_max, hit, sampler, wray));
+  }
+}
+
+//Traversals only keep the closest hit: primitives leave their interaction to the caller, and
+//mesh leaves record the face, t and barycentrics for interaction()
+template<bool Record, typename S>
+bool bvh_node::hit_tree(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler) {
+  if(!mesh) {
+    return(hit_nodes<Record>(r, t_min, t_max, hit, sampler, nullptr));
+  }
+  WatertightRay wray(r);
+  return(hit_nodes<Record>(r, t_min, t_max, hit, sampler, &wray));
+}
+
+bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  return(deferred_hit(this, r, t_min, t_max, rec, rng));
+}
+
+bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  return(deferred_hit(this, r, t_min, t_max, rec, sampler));
+}
+
+//Recording is a template parameter, so normal traversals don't check for it at every node
+bool bvh_node::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  if(bvh_trace_recorder) {
+    bvh_trace_recorder->enter();
+    bool hit_anything = hit_tree<true>(r, t_min, t_max, hit, rng);
+    bvh_trace_recorder->leave();
+    return(hit_anything);
+  }
+  return(hit_tree<false>(r, t_min, t_max, hit, rng));
+}
+
+bool bvh_node::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  if(bvh_trace_recorder) {
+    bvh_trace_recorder->enter();
+    bool hit_anything = hit_tree<true>(r, t_min, t_max, hit, sampler);
+    bvh_trace_recorder->leave();
+    return(hit_anything);
+  }
+  return(hit_tree<false>(r, t_min, t_max, hit, sampler));
+}
+
+void bvh_node::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng) {
+  mesh->interaction(hit.index, r, hit.t, hit.u, hit.v, rec, rng);
+}
+
+void bvh_node::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler) {
+  mesh->interaction(hit.index, r, hit.t, hit.u, hit.v, rec, sampler);
+}
+
+//Any-hit traversal: stops at the first primitive that occludes the ray, so the children don't
+//need to be visited in order
+template<bool Record, typename S>
+bool bvh_node::occluded_binary(const LinearBVHNode* tree,
+                               const ray& r, Float t_min, Float t_max, S& sampler,
+                               const WatertightRay* wray) {
+  int toVisitOffset = 0, currentNodeIndex = 0;
+  int nodesToVisit[2*kMaxBVHDepth];
+  while(true) {
+    const LinearBVHNode* node = &tree[currentNodeIndex];
+    if(Record) {
+      bvh_trace_recorder->visit(node, sizeof(LinearBVHNode));
+    }
+    if(node->hit(r, t_min, t_max)) {
+      if(node->nPrimitives > 0) {
+        if(Record) {
+          bvh_trace_recorder->primitives += node->nPrimitives;
+        }
+        if(wray) {
+          if(occluded_triangle_blocks(&blocks[node->primitivesOffset / kTriangleBlockWidth],
+                                      node->nPrimitives, *wray, t_min, t_max)) {
+            return(true);
+          }
+        } else {
+          for(int i = 0; i < node->nPrimitives; ++i) {
+            if(occluded_reference(node->primitivesOffset + i, r, t_min, t_max, sampler)) {
+              return(true);
+            }
+          }
+        }
+        if(toVisitOffset == 0) break;
+        currentNodeIndex = nodesToVisit[--toVisitOffset];
+      } else {
+        nodesToVisit[toVisitOffset++] = node->secondChildOffset;
+        currentNodeIndex = currentNodeIndex + 1;
+      }
+    } else {
+      if(toVisitOffset == 0) break;
+      currentNodeIndex = nodesToVisit[--toVisitOffset];
+    }
+  }
+  return(false);
+}
+
+template<bool Record, typename Node, typename S>
+bool bvh_node::occluded_wide(const Node* wide_nodes,
+                             const ray& r, Float t_min, Float t_max, S& sampler,
+                             const WatertightRay* wray) {
+  const int W = Node::width;
+  struct StackEntry {
+    int offset;
+    int nPrimitives;
+  };
+  StackEntry toVisit[2*kMaxBVHDepth*(W-1)+1];
+  int toVisitOffset = 0;
+  toVisit[toVisitOffset++] = {0, 0};
+  while(toVisitOffset > 0) {
+    const StackEntry current = toVisit[--toVisitOffset];
+    if(current.nPrimitives > 0) {
+      if(Record) {
+        bvh_trace_recorder->primitives += current.nPrimitives;
+      }
+      if(wray) {
+        if(occluded_triangle_blocks(&blocks[current.offset / kTriangleBlockWidth],
+                                    current.nPrimitives, *wray, t_min, t_max)) {
+          return(true);
+        }
+      } else {
+        for(int i = 0; i < current.nPrimitives; ++i) {
+          if(occluded_reference(current.offset + i, r, t_min, t_max, sampler)) {
+            return(true);
+          }
+        }
+      }
+      continue;
+    }
+    const Node& node = wide_nodes[current.offset];
+    if(Record) {
+      bvh_trace_recorder->visit(&node, sizeof(Node));
+    }
+    Float tnear[W];
+    int mask = intersect_wide<W>(node, r, t_min, t_max, tnear) & ((1 << node.nChildren) - 1);
+    for(int i = 0; i < node.nChildren; i++) {
+      if(mask & (1 << i)) {
+        toVisit[toVisitOffset++] = {node.offset[i], node.nPrimitives[i]};
+      }
+    }
+  }
+  return(false);
+}
+
+template<bool Record, typename S>
+bool bvh_node::occluded_nodes(const ray& r, Float t_min, Float t_max, S& sampler,
+                              const WatertightRay* wray) {
+  switch(width) {
+    case 4:  return(occluded_wide<Record>(nodes4.data() + motion_tree(r.time(), nodes4.size()), r, t_min, t_max, sampler, wray));
+    case 8:  return(compressed ?
+                    occluded_wide<Record>(nodes8q.data() + motion_tree(r.time(), nodes8q.size()), r, t_min, t_max, sampler, wray) :
+                    occluded_wide<Record>(nodes8.data() + motion_tree(r.time(), nodes8.size()), r, t_min, t_max, sampler, wray));
+    default: return(occluded_binary<Record>(nodes.data() + motion_tree(r.time(), nodes.size()), r, t_min, t_max, sampler, wray));
+  }
+}
+
+template<bool Record, typename S>
+bool bvh_node::occluded_tree(const ray& r, Float t_min, Float t_max, S& sampler) {
+  if(!mesh) {
+    return(occluded_nodes<Record>(r, t_min, t_max, sampler, nullptr));
+  }
+  WatertightRay wray(r);
+  return(occluded_nodes<Record>(r, t_min, t_max, sampler, &wray));
+}
+
+bool bvh_node::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  if(bvh_trace_recorder) {
+    bvh_trace_recorder->enter();
+    bool hit_anything = occluded_tree<true>(r, t_min, t_max, rng);
+    bvh_trace_recorder->leave();
+    return(hit_anything);
+  }
+  return(occluded_tree<false>(r, t_min, t_max, rng));
+}
+
+bool bvh_node::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  if(bvh_trace_recorder) {
+    bvh_trace_recorder->enter();
+    bool hit_anything = occluded_tree<true>(r, t_min, t_max, sampler);
+    bvh_trace_recorder->leave();
+    return(hit_anything);
+  }
+  return(occluded_tree<false>(r, t_min, t_max, sampler));
+}
+
+//Bits per axis of the Morton codes used by the LBVH builder
+static constexpr int kMortonBits = 10;
+
+static int treeDepth(const BVHBuildNode* node) {
+  if (node->nPrimitives > 0) {
+    return(1);
+  }
+  return(1 + std::max(treeDepth(node->children[0].get()), treeDepth(node->children[1].get())));
+}
+
+//Children of the wide node collapsed from `node`: the interior child with the largest surface
+//area is opened until there are W children, or only leaves are left
+template<int W>
+static int wide_node_children(BVHBuildNode *node, BVHBuildNode** children) {
+  int nChildren = 0;
+  if(node->nPrimitives > 0) {
+    children[nChildren++] = node;
+    return(nChildren);
+  }
+  children[nChildren++] = node->children[0].get();
+  children[nChildren++] = node->children[1].get();
+  while(nChildren < W) {
+    int best = -1;
+    Float best_area = -1;
+    for(int i = 0; i < nChildren; i++) {
+      if(children[i]->nPrimitives == 0 && children[i]->bounds.surface_area() > best_area) {
+        best_area = children[i]->bounds.surface_area();
+        best = i;
+      }
+    }
+    if(best == -1) {
+      break;
+    }
+    BVHBuildNode* open = children[best];
+    children[best] = open->children[0].get();
+    children[nChildren++] = open->children[1].get();
+  }
+  return(nChildren);
+}
+
+template<int W>
+static size_t count_wide_nodes(BVHBuildNode *node) {
+  BVHBuildNode* children[W];
+  int nChildren = wide_node_children<W>(node, children);
+  size_t count = 1;
+  for(int i = 0; i < nChildren; i++) {
+    if(children[i]->nPrimitives == 0) {
+      count += count_wide_nodes<W>(children[i]);
+    }
+  }
+  return(count);
+}
+
+//Pool for the passes over n primitives, or none if there are too few to be worth splitting. Each
+//build or refit creates one and shares it between all of its parallel passes.
+static std::unique_ptr<RcppThread::ThreadPool> make_pool(size_t n, size_t numbercores) {
+  std::unique_ptr<RcppThread::ThreadPool> pool;
+#ifndef DEBUGBBOX
+  if(numbercores > 1 && n >= kMinParallelBuildSize) {
+    pool.reset(new RcppThread::ThreadPool(numbercores));
+  }
+#endif
+  return(pool);
+}
+
+bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l,
+                   size_t start, size_t end,
+                   Float time0, Float time1, int bvh_type, int max_leaf_size, size_t numbercores, random_gen &rng) {
+  if(start == end) {
+    throw std::runtime_error("start node must not equal end node");
+  }
+  size_t n = end - start;
+  std::unique_ptr<RcppThread::ThreadPool> pool = make_pool(n, numbercores);
+  SBVHState state;
+  if(bvh_type == 7) {
+    state.triangles.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      state.triangles[i] = dynamic_cast<const triangle*>(l[start + i].get());
+    }
+  }
+  std::vector<BVHPrimitiveInfo> primitiveInfo = build(n, [&] (size_t i, aabb& b) {
+    l[start + i]->bounding_box(time0, time1, b);
+  }, state, bvh_type, max_leaf_size, numbercores, pool.get());
+
+  //Leaves are contiguous in primitiveInfo, so primitives can be gathered in one pass. The input
+  //list is left in the same order, which keeps neighbouring primitives close in memory.
+  primitives.resize(primitiveInfo.size());
+  for (size_t i = 0; i < primitiveInfo.size(); ++i) {
+    primitives[i] = l[start + primitiveInfo[i].primitiveNumber];
+  }
+  if(bvh_type != 7) {
+    std::copy(primitives.begin(), primitives.end(), l.begin() + start);
+  }
+  build_motion_trees(time0, time1, pool.get());
+}
+
+//Meshes don't move, so there are no motion trees
+bvh_node::bvh_node(std::shared_ptr<TriangleMesh> mesh,
+                   int bvh_type, int max_leaf_size, size_t numbercores, random_gen &rng) : mesh(mesh) {
+  if(mesh->size() == 0) {
+    throw std::runtime_error("Can't build a BVH over a mesh without faces");
+  }
+  SBVHState state;
+  state.mesh = mesh.get();
+  const TriangleMesh& tris = *mesh;
+  std::unique_ptr<RcppThread::ThreadPool> pool = make_pool(tris.size(), numbercores);
+  std::vector<BVHPrimitiveInfo> primitiveInfo = build(tris.size(), [&tris] (size_t i, aabb& b) {
+    tris.bounds(i, b);
+  }, state, bvh_type, max_leaf_size, numbercores, pool.get());
+  faces.resize(primitiveInfo.size());
+  for (size_t i = 0; i < primitiveInfo.size(); ++i) {
+    faces[i] = primitiveInfo[i].primitiveNumber;
+  }
+  motion_segments = 0;
+  motion_time0 = motion_time1 = 0;
+  pad_leaves();
+  build_triangle_blocks();
+}
+
+//Moves each leaf to the next multiple of kTriangleBlockWidth, so its faces map to whole
+//triangle blocks. Mesh BVHs have a single tree (no motion segments).
+void bvh_node::pad_leaves() {
+  std::vector<std::pair<int*, int> > leaves;
+  for(LinearBVHNode& node : nodes) {
+    if(node.nPrimitives > 0) {
+      leaves.push_back(std::make_pair(&node.primitivesOffset, static_cast<int>(node.nPrimitives)));
+    }
+  }
+  auto add_wide = [&leaves] (int* offset, uint16_t* nPrimitives, uint8_t nChildren) {
+    for(int c = 0; c < nChildren; c++) {
+      if(nPrimitives[c] > 0) {
+        leaves.push_back(std::make_pair(&offset[c], static_cast<int>(nPrimitives[c])));
+      }
+    }
+  };
+  for(WideBVHNode<4>& node : nodes4) {
+    add_wide(node.offset, node.nPrimitives, node.nChildren);
+  }
+  for(WideBVHNode<8>& node : nodes8) {
+    add_wide(node.offset, node.nPrimitives, node.nChildren);
+  }
+  for(QuantizedBVHNode<8>& node : nodes8q) {
+    add_wide(node.offset, node.nPrimitives, node.nChildren);
+  }
+  std::sort(leaves.begin(), leaves.end(), [] (const std::pair<int*, int>& a, const std::pair<int*, int>& b) {
+    return(*a.first < *b.first);
+  });
+  std::vector<uint32_t> padded;
+  padded.reserve(faces.size() + leaves.size() * (kTriangleBlockWidth - 1));
+  for(auto& leaf : leaves) {
+    int offset = *leaf.first;
+    *leaf.first = static_cast<int>(padded.size());
+    padded.insert(padded.end(), faces.begin() + offset, faces.begin() + offset + leaf.second);
+    while(padded.size() % kTriangleBlockWidth != 0) {
+      padded.push_back(kNoMeshIndex);
+    }
+  }
+  faces.swap(padded);
+}
+
+void bvh_node::build_triangle_blocks() {
+  blocks.assign(faces.size() / kTriangleBlockWidth, TriangleBlock());
+  for(size_t i = 0; i < faces.size(); i++) {
+    if(faces[i] != kNoMeshIndex) {
+      mesh->set_block_lane(blocks[i / kTriangleBlockWidth], i % kTriangleBlockWidth, faces[i]);
+    }
+  }
+}
+
+bool bvh_node::hit_mesh_leaf(int offset, int n, const WatertightRay& wray, SurfaceHit& hit,
+                             Float t_min, Float t_max) {
+  Float t, u, v;
+  int lane = intersect_triangle_blocks(&blocks[offset / kTriangleBlockWidth], n, wray,
+                                       t_min, t_max, t, u, v);
+  if(lane < 0) {
+    return(false);
+  }
+  hit.t = t;
+  hit.u = u;
+  hit.v = v;
+  hit.index = faces[offset + lane];
+  hit.shape = this;
+  return(true);
+}
+
+std::vector<BVHPrimitiveInfo> bvh_node::build(size_t n, const std::function<void(size_t, aabb&)>& bounds,
+                                              SBVHState& state, int bvh_type, int max_leaf_size,
+                                              size_t numbercores, RcppThread::ThreadPool* pool) {
+  build_type = bvh_type;
+  max_prims_in_leaf = std::max(max_leaf_size, 1);
+  motion_segments = 0;
+  reordered = false;
+  //bvh_type 3, 4 and 8 build the same SAH tree and then collapse it to 4/8-wide nodes, which
+  //bvh_type 8 stores compressed
+  width = bvh_type == 3 ? 4 : bvh_type == 4 || bvh_type == 8 ? 8 : 2;
+  compressed = bvh_type == 8;
+  if(width != 2) {
+    bvh_type = 1;
+  }
+
+  //Bounds and centroids are only computed once: the build partitions this array, and
+  //leaves reference contiguous ranges of it
+  std::vector<BVHPrimitiveInfo> primitiveInfo(n);
+  auto fill_info = [&] (size_t first, size_t last) {
+    for (size_t i = first; i < last; ++i) {
+      primitiveInfo[i].primitiveNumber = i;
+      bounds(i, primitiveInfo[i].bounds);
+    }
+  };
+  if(pool) {
+    size_t nChunks = (n + kParallelChunkSize - 1) / kParallelChunkSize;
+    pool->parallelFor(0, nChunks, [&] (size_t chunk) {
+      fill_info(chunk * kParallelChunkSize, std::min((chunk + 1) * kParallelChunkSize, n));
+    });
+    pool->wait();
+  } else {
+    fill_info(0, n);
+  }
+
+  std::atomic<int> totalNodes(0);
+  std::unique_ptr<BVHBuildNode> root;
+  //With a pool, the top of the tree is split serially (with parallel bounds/bucket passes) and
+  //the subtrees below task_size primitives are built on the pool. Subtrees only touch their own
+  //range of primitiveInfo, so the result is identical to the single-threaded build.
+  task_size = pool ? std::max(n / (4 * numbercores), kMinParallelBuildSize / 4) : 0;
+  std::vector<BuildTask> tasks;
+  bool lbvh = bvh_type == 5 || bvh_type == 6;
+  bool sbvh = bvh_type == 7;
+  if(lbvh) {
+    root.reset(buildLBVH(primitiveInfo, totalNodes, pool, pool ? &tasks : nullptr));
+  } else if(sbvh) {
+    //Spatial splits change the number of references, so the SBVH is built serially into
+    //a new reference array
+    state.budget = static_cast<size_t>(n * (kSBVHMemoryBudget - 1));
+    aabb root_box;
+    for (size_t i = 0; i < n; ++i) {
+      root_box = surrounding_box(root_box, primitiveInfo[i].bounds);
+    }
+    state.root_area = root_box.surface_area();
+    root.reset(buildSBVH(primitiveInfo, 0, totalNodes, state));
+    primitiveInfo.swap(state.ordered);
+  } else {
+    root.reset(recursiveBuild(primitiveInfo, 0, n, bvh_type, 0, totalNodes,
+                              pool, pool ? &tasks : nullptr));
+  }
+  if(pool) {
+    pool->parallelFor(0, tasks.size(), [&] (size_t i) {
+      const BuildTask& task = tasks[i];
+      std::unique_ptr<BVHBuildNode> subtree(lbvh ?
+        emitLBVH(primitiveInfo, task.start, task.end, task.bitIndex, task.depth, totalNodes, nullptr) :
+        recursiveBuild(primitiveInfo, task.start, task.end, task.bvh_type, task.depth, totalNodes,
+                       nullptr, nullptr));
+      *task.node = std::move(*subtree);
+    });
+    pool->wait();
+  }
+  if(bvh_type == 6) {
+    restructureBVH(root.get(), pool, numbercores);
+    //Restructuring can deepen the tree: fall back to the plain LBVH if it no longer fits
+    //in the traversal stack
+    if(treeDepth(root.get()) >= 2*kMaxBVHDepth) {
+      totalNodes = 0;
+      root.reset(emitLBVH(primitiveInfo, 0, n, 3 * kMortonBits - 1, 0, totalNodes, nullptr));
+    }
+  }
+  morton_codes.clear();
+  morton_codes.shrink_to_fit();
+
+  unique_primitives = n;
+
+  //Infinite bounds can't be quantized, so those trees are stored uncompressed
+  for(int a = 0; a < 3; a++) {
+    if(!std::isfinite(root->bounds.min().e[a]) || !std::isfinite(root->bounds.max().e[a])) {
+      compressed = false;
+    }
+  }
+  //The wide node arrays are sized up front, so they're allocated exactly once
+  if(width == 4) {
+    nodes4.reserve(count_wide_nodes<4>(root.get()));
+    collapseBVHTree(root.get(), nodes4);
+  } else if (width == 8 && compressed) {
+    nodes8q.reserve(count_wide_nodes<8>(root.get()));
+    collapseBVHTree(root.get(), nodes8q);
+  } else if (width == 8) {
+    nodes8.reserve(count_wide_nodes<8>(root.get()));
+    collapseBVHTree(root.get(), nodes8);
+  } else {
+    nodes.resize(totalNodes);
+    int offset = 0;
+    flattenBVHTree(root.get(), &offset);
+  }
+  box = root->bounds;
+  build_cost = sah_cost();
+  return(primitiveInfo);
+}
+
+template<int W>
+static inline aabb wide_child_bounds(const WideBVHNode<W>& node, int child) {
+  return(aabb(point3f(node.bounds[0][0][child], node.bounds[0][1][child], node.bounds[0][2][child]),
+              point3f(node.bounds[1][0][child], node.bounds[1][1][child], node.bounds[1][2][child])));
+}
+
+template<int W>
+static inline aabb wide_child_bounds(const QuantizedBVHNode<W>& node, int child) {
+  point3f b[2];
+  for(int m = 0; m < 2; m++) {
+    for(int a = 0; a < 3; a++) {
+      b[m].e[a] = dequantize(node.origin[a], node.scale[a], node.qbounds[m][a][child]);
+    }
+  }
+  return(aabb(b[0], b[1]));
+}
+
+//Sets the bounds the children of a wide node are stored relative to: a no-op for
+//uncompressed nodes
+template<int W>
+static inline void init_wide_node(WideBVHNode<W>& node, const aabb& b) {}
+
+//The step is the smallest power of two that covers the node's extent in 255 steps
+template<int W>
+static inline void init_wide_node(QuantizedBVHNode<W>& node, const aabb& b) {
+  for(int a = 0; a < 3; a++) {
+    Float lo = b.bounds[0].e[a], hi = b.bounds[1].e[a];
+    Float step = (hi - lo) / 255;
+    node.origin[a] = lo;
+    node.scale[a] = 0;
+    if(step > 0) {
+      int exponent;
+      Float mantissa = std::frexp(step, &exponent);
+      node.scale[a] = std::ldexp(mantissa == 0.5 ? static_cast<Float>(0.5) : static_cast<Float>(1), exponent);
+      while(dequantize(lo, node.scale[a], 255) < hi) {
+        node.scale[a] *= 2;
+      }
+    }
+  }
+}
+
+template<int W>
+static inline void set_wide_child_bounds(WideBVHNode<W>& node, int child, const aabb& b) {
+  for(int a = 0; a < 3; a++) {
+    node.bounds[0][a][child] = b.bounds[0].e[a];
+    node.bounds[1][a][child] = b.bounds[1].e[a];
+  }
+}
+
+//Mins are rounded down and maxes up, and then checked against the decoded value, so the
+//decoded box always contains b
+template<int W>
+static inline void set_wide_child_bounds(QuantizedBVHNode<W>& node, int child, const aabb& b) {
+  for(int a = 0; a < 3; a++) {
+    Float lo = b.bounds[0].e[a], hi = b.bounds[1].e[a];
+    Float origin = node.origin[a], scale = node.scale[a];
+    Float qlo = 0, qhi = 255;
+    if(scale > 0) {
+      qlo = std::min(std::max(std::floor((lo - origin) / scale), static_cast<Float>(0)), static_cast<Float>(255));
+      qhi = std::min(std::max(std::ceil((hi - origin) / scale), static_cast<Float>(0)), static_cast<Float>(255));
+    }
+    uint8_t ql = static_cast<uint8_t>(qlo), qh = static_cast<uint8_t>(qhi);
+    while(ql > 0 && dequantize(origin, scale, ql) > lo) {
+      ql--;
+    }
+    while(qh < 255 && dequantize(origin, scale, qh) < hi) {
+      qh++;
+    }
+    node.qbounds[0][a][child] = ql;
+    node.qbounds[1][a][child] = qh;
+  }
+}
+
+//Empty slots get inverted bounds so they never pass the slab test
+template<int W>
+static inline void clear_wide_child(WideBVHNode<W>& node, int child) {
+  for(int a = 0; a < 3; a++) {
+    node.bounds[0][a][child] =  INFINITY;
+    node.bounds[1][a][child] = -INFINITY;
+  }
+}
+
+template<int W>
+static inline void clear_wide_child(QuantizedBVHNode<W>& node, int child) {
+  for(int a = 0; a < 3; a++) {
+    node.qbounds[0][a][child] = 255;
+    node.qbounds[1][a][child] = 0;
+  }
+}
+
+template<typename Node>
+static double wide_sah_cost(const Node* wide_nodes, size_t count) {
+  double cost = 0;
+  for(size_t i = 0; i < count; i++) {
+    cost += 1;
+    for(int c = 0; c < wide_nodes[i].nChildren; c++) {
+      aabb child_box = wide_child_bounds(wide_nodes[i], c);
+      cost += child_box.surface_area() * std::max<int>(wide_nodes[i].nPrimitives[c], 1);
+    }
+  }
+  return(cost);
+}
+
+//Traversal and intersection both have unit cost, and areas are relative to the root, so the
+//cost stays comparable when the whole scene moves. Only the whole-interval tree is counted.
+Float bvh_node::sah_cost() const {
+  double cost = 0;
+  if(width == 4) {
+    cost = wide_sah_cost(nodes4.data(), tree_size(nodes4.size()));
+  } else if (width == 8) {
+    cost = compressed ? wide_sah_cost(nodes8q.data(), tree_size(nodes8q.size())) :
+                        wide_sah_cost(nodes8.data(), tree_size(nodes8.size()));
+  } else {
+    for(size_t i = 0; i < tree_size(nodes.size()); i++) {
+      aabb node_box(nodes[i].bounds[0], nodes[i].bounds[1]);
+      cost += node_box.surface_area() * std::max<int>(nodes[i].nPrimitives, 1);
+    }
+  }
+  aabb root_box(box);
+  return(cost / root_box.surface_area());
+}
+
+template<typename Node>
+static void wide_tree_statistics(const std::vector<Node>& wide_nodes, BVHTreeStatistics& stats) {
+  if(wide_nodes.empty()) {
+    return;
+  }
+  std::vector<std::pair<int, int> > toVisit(1, std::make_pair(0, 0));
+  while(!toVisit.empty()) {
+    std::pair<int, int> current = toVisit.back();
+    toVisit.pop_back();
+    const Node& node = wide_nodes[current.first];
+    for(int c = 0; c < node.nChildren; c++) {
+      if(node.nPrimitives[c] > 0) {
+        stats.add_leaf(current.second + 1, node.nPrimitives[c]);
+      } else {
+        toVisit.push_back(std::make_pair(node.offset[c], current.second + 1));
+      }
+    }
+  }
+}
+
+BVHTreeStatistics bvh_node::tree_statistics() const {
+  BVHTreeStatistics stats;
+  if(width == 4) {
+    wide_tree_statistics(nodes4, stats);
+  } else if (width == 8) {
+    if(compressed) {
+      wide_tree_statistics(nodes8q, stats);
+    } else {
+      wide_tree_statistics(nodes8, stats);
+    }
+  } else if (!nodes.empty()) {
+    std::vector<std::pair<int, int> > toVisit(1, std::make_pair(0, 0));
+    while(!toVisit.empty()) {
+      std::pair<int, int> current = toVisit.back();
+      toVisit.pop_back();
+      const LinearBVHNode& node = nodes[current.first];
+      if(node.nPrimitives > 0) {
+        stats.add_leaf(current.second, node.nPrimitives);
+      } else {
+        toVisit.push_back(std::make_pair(current.first + 1, current.second + 1));
+        toVisit.push_back(std::make_pair(node.secondChildOffset, current.second + 1));
+      }
+    }
+  }
+  return(stats);
+}
+
+size_t bvh_node::node_count() const {
+  return(tree_size(width == 4 ? nodes4.size() : width == 8 ? nodes8.size() + nodes8q.size() : nodes.size()));
+}
+
+//Includes the motion trees
+size_t bvh_node::node_bytes() const {
+  return(nodes.size() * sizeof(LinearBVHNode) + nodes4.size() * sizeof(WideBVHNode<4>) +
+         nodes8.size() * sizeof(WideBVHNode<8>) + nodes8q.size() * sizeof(QuantizedBVHNode<8>));
+}
+
+size_t bvh_node::uncompressed_node_bytes() const {
+  return(nodes.size() * sizeof(LinearBVHNode) + nodes4.size() * sizeof(WideBVHNode<4>) +
+         (nodes8.size() + nodes8q.size()) * sizeof(WideBVHNode<8>));
+}
+
+size_t bvh_node::reference_count() const {
+  if(!mesh) {
+    return(primitives.size());
+  }
+  return(faces.size() - std::count(faces.begin(), faces.end(), kNoMeshIndex));
+}
+
+size_t bvh_node::reference_bytes() const {
+  return(mesh ? faces.size() * sizeof(uint32_t) + blocks.size() * sizeof(TriangleBlock) :
+                primitives.size() * sizeof(std::shared_ptr<hitable>));
+}
+
+//Padding between mesh leaves gets an empty box, which no leaf range includes
+void bvh_node::reference_bounds(Float time0, Float time1, RcppThread::ThreadPool* pool, aabb* refBounds) const {
+  size_t n = mesh ? faces.size() : primitives.size();
+  auto fill_bounds = [&] (size_t first, size_t last) {
+    for(size_t i = first; i < last; i++) {
+      if(mesh) {
+        if(faces[i] == kNoMeshIndex) {
+          refBounds[i] = aabb();
+        } else {
+          mesh->bounds(faces[i], refBounds[i]);
+        }
+      } else {
+        primitives[i]->bounding_box(time0, time1, refBounds[i]);
+      }
+    }
+  };
+  if(pool) {
+    size_t nChunks = (n + kParallelChunkSize - 1) / kParallelChunkSize;
+    pool->parallelFor(0, nChunks, [&] (size_t chunk) {
+      fill_bounds(chunk * kParallelChunkSize, std::min((chunk + 1) * kParallelChunkSize, n));
+    });
+    pool->wait();
+  } else {
+    fill_bounds(0, n);
+  }
+}
+
+//Motion tree boxes never need to be larger than the same box in the whole-interval tree, which
+//keeps the clipped leaves of the SBVH tight. Boxes that don't overlap it (the primitives only
+//reach that part of the tree in other segments) fall back to the whole-interval box.
+static aabb clip_box(const aabb& box, const aabb& clip) {
+  point3f lo, hi;
+  for(int a = 0; a < 3; a++) {
+    lo.e[a] = std::max(box.min().e[a], clip.min().e[a]);
+    hi.e[a] = std::min(box.max().e[a], clip.max().e[a]);
+    if(lo.e[a] > hi.e[a]) {
+      return(clip);
+    }
+  }
+  return(aabb(lo, hi));
+}
+
+//Sets the box of node i from its children's boxes, which must be up to date. If `clip` is given,
+//the box is clipped to the box of the same node there.
+static void refit_node(LinearBVHNode* tree, int i, const aabb* primBounds, const LinearBVHNode* clip) {
+  LinearBVHNode& node = tree[i];
+  aabb node_box;
+  if(node.nPrimitives > 0) {
+    for(int j = 0; j < node.nPrimitives; j++) {
+      node_box = surrounding_box(node_box, primBounds[node.primitivesOffset + j]);
+    }
+  } else {
+    node_box = surrounding_box(aabb(tree[i+1].bounds[0], tree[i+1].bounds[1]),
+                               aabb(tree[node.secondChildOffset].bounds[0],
+                                    tree[node.secondChildOffset].bounds[1]));
+  }
+  if(clip) {
+    node_box = clip_box(node_box, aabb(clip[i].bounds[0], clip[i].bounds[1]));
+  }
+  node.bounds[0] = node_box.min();
+  node.bounds[1] = node_box.max();
+}
+
+template<typename Node>
+static void refit_node(Node* wide_nodes, int i, const aabb* primBounds, const Node* clip) {
+  Node& node = wide_nodes[i];
+  aabb child_box[Node::width];
+  aabb node_box;
+  for(int c = 0; c < node.nChildren; c++) {
+    if(node.nPrimitives[c] > 0) {
+      for(int j = 0; j < node.nPrimitives[c]; j++) {
+        child_box[c] = surrounding_box(child_box[c], primBounds[node.offset[c] + j]);
+      }
+    } else {
+      const Node& child = wide_nodes[node.offset[c]];
+      for(int k = 0; k < child.nChildren; k++) {
+        child_box[c] = surrounding_box(child_box[c], wide_child_bounds(child, k));
+      }
+    }
+    if(clip) {
+      child_box[c] = clip_box(child_box[c], wide_child_bounds(clip[i], c));
+    }
+    node_box = surrounding_box(node_box, child_box[c]);
+  }
+  init_wide_node(node, node_box);
+  for(int c = 0; c < node.nChildren; c++) {
+    set_wide_child_bounds(node, c, child_box[c]);
+  }
+}
+
+static aabb root_bounds(const LinearBVHNode* tree) {
+  return(aabb(tree[0].bounds[0], tree[0].bounds[1]));
+}
+
+template<typename Node>
+static aabb root_bounds(const Node* wide_nodes) {
+  aabb root_box;
+  for(int c = 0; c < wide_nodes[0].nChildren; c++) {
+    root_box = surrounding_box(root_box, wide_child_bounds(wide_nodes[0], c));
+  }
+  return(root_box);
+}
+
+//Writes the interior children of node i to `children` and returns how many there are
+static int interior_children(const LinearBVHNode* tree, int i, int* children) {
+  if(tree[i].nPrimitives > 0) {
+    return(0);
+  }
+  children[0] = i + 1;
+  children[1] = tree[i].secondChildOffset;
+  return(2);
+}
+
+template<typename Node>
+static int interior_children(const Node* wide_nodes, int i, int* children) {
+  int count = 0;
+  for(int c = 0; c < wide_nodes[i].nChildren; c++) {
+    if(wide_nodes[i].nPrimitives[c] == 0) {
+      children[count++] = wide_nodes[i].offset[c];
+    }
+  }
+  return(count);
+}
+
+//Nodes are stored parent-first, so walking them backwards visits children before parents.
+//Returns the new root bounds.
+template<typename Node>
+static aabb refit_tree(Node* tree, size_t count, const aabb* primBounds, const Node* clip = nullptr) {
+  for(int i = count - 1; i >= 0; i--) {
+    refit_node(tree, i, primBounds, clip);
+  }
+  return(root_bounds(tree));
+}
+
+//With a pool, the top levels are split until there are enough subtrees to keep every thread
+//busy. Each subtree is refit on the pool (in reverse breadth-first order, so children still
+//come first in the clustered layout), and then the top levels are refit serially.
+template<typename Node>
+static aabb refit_tree(Node* tree, size_t count, const aabb* primBounds,
+                       RcppThread::ThreadPool* pool, size_t numbercores) {
+  if(!pool) {
+    return(refit_tree(tree, count, primBounds));
+  }
+  std::vector<int> top;
+  std::vector<int> subtrees(1, 0);
+  int children[8];
+  while(!subtrees.empty() && subtrees.size() < 4 * numbercores) {
+    std::vector<int> next;
+    for(size_t i = 0; i < subtrees.size(); i++) {
+      top.push_back(subtrees[i]);
+      int nChildren = interior_children(tree, subtrees[i], children);
+      next.insert(next.end(), children, children + nChildren);
+    }
+    subtrees.swap(next);
+  }
+  pool->parallelFor(0, subtrees.size(), [&] (size_t s) {
+    std::vector<int> order(1, subtrees[s]);
+    int subtree_children[8];
+    for(size_t i = 0; i < order.size(); i++) {
+      int nChildren = interior_children(tree, order[i], subtree_children);
+      order.insert(order.end(), subtree_children, subtree_children + nChildren);
+    }
+    for(int i = order.size() - 1; i >= 0; i--) {
+      refit_node(tree, order[i], primBounds, static_cast<const Node*>(nullptr));
+    }
+  });
+  pool->wait();
+  for(int i = top.size() - 1; i >= 0; i--) {
+    refit_node(tree, top[i], primBounds, static_cast<const Node*>(nullptr));
+  }
+  return(root_bounds(tree));
+}
+
+//Appends a copy of the tree for each segment, refit to that segment's primitive bounds. Child
+//offsets are relative to the start of a tree, so the copies can be traversed unchanged.
+template<typename Node>
+static void add_motion_trees(std::vector<Node>& tree_nodes, const std::vector<aabb>& segmentBounds,
+                             size_t n, int segments) {
+  size_t count = tree_nodes.size();
+  tree_nodes.resize(count * (segments + 1));
+  for(int s = 0; s < segments; s++) {
+    Node* tree = tree_nodes.data() + count * (s + 1);
+    std::copy(tree_nodes.begin(), tree_nodes.begin() + count, tree);
+    refit_tree(tree, count, segmentBounds.data() + n * s, tree_nodes.data());
+  }
+}
+
+static bool same_box(const aabb& a, const aabb& b) {
+  for(int i = 0; i < 3; i++) {
+    if(a.min().e[i] != b.min().e[i] || a.max().e[i] != b.max().e[i]) {
+      return(false);
+    }
+  }
+  return(true);
+}
+
+//The topology is built from the whole-interval bounds, so a primitive that moves only widens
+//the boxes of the segments it moves in
+void bvh_node::build_motion_trees(Float time0, Float time1, RcppThread::ThreadPool* pool) {
+  motion_segments = 0;
+  motion_time0 = time0;
+  motion_time1 = time1;
+  if(!(time1 > time0) || mesh) {
+    return;
+  }
+  size_t n = primitives.size();
+  std::vector<aabb> wholeBounds(n);
+  std::vector<aabb> segmentBounds(n * kMotionBVHSegments);
+  reference_bounds(time0, time1, pool, wholeBounds.data());
+  for(int s = 0; s < kMotionBVHSegments; s++) {
+    Float t0 = time0 + (time1 - time0) * s / kMotionBVHSegments;
+    Float t1 = s == kMotionBVHSegments - 1 ? time1 : time0 + (time1 - time0) * (s + 1) / kMotionBVHSegments;
+    reference_bounds(t0, t1, pool, segmentBounds.data() + n * s);
+  }
+  bool moving = false;
+  for(size_t i = 0; i < n && !moving; i++) {
+    for(int s = 0; s < kMotionBVHSegments; s++) {
+      if(!same_box(wholeBounds[i], segmentBounds[n * s + i])) {
+        moving = true;
+        break;
+      }
+    }
+  }
+  if(!moving) {
+    return;
+  }
+  if(width == 4) {
+    add_motion_trees(nodes4, segmentBounds, n, kMotionBVHSegments);
+  } else if (width == 8) {
+    if(compressed) {
+      add_motion_trees(nodes8q, segmentBounds, n, kMotionBVHSegments);
+    } else {
+      add_motion_trees(nodes8, segmentBounds, n, kMotionBVHSegments);
+    }
+  } else {
+    add_motion_trees(nodes, segmentBounds, n, kMotionBVHSegments);
+  }
+  motion_segments = kMotionBVHSegments;
+}
+
+void bvh_node::drop_motion_trees() {
+  nodes.resize(tree_size(nodes.size()));
+  nodes4.resize(tree_size(nodes4.size()));
+  nodes8.resize(tree_size(nodes8.size()));
+  nodes8q.resize(tree_size(nodes8q.size()));
+  motion_segments = 0;
+}
+
+//Lays out the subtree below `root`, `levels` levels deep, in van Emde Boas order: the top half of
+//its levels first, then each subtree hanging off them. A root-to-leaf path then touches
+//O(log_B N) blocks of B nodes for every block size. The interior nodes just below the laid out
+//levels are appended to `frontier`.
+template<typename Node>
+static void veb_layout(const std::vector<Node>& wide_nodes, int root, int levels,
+                       std::vector<int>& order, std::vector<int>* frontier) {
+  if(levels == 1) {
+    order.push_back(root);
+    if(frontier) {
+      const Node& node = wide_nodes[root];
+      for(int c = 0; c < node.nChildren; c++) {
+        if(node.nPrimitives[c] == 0) {
+          frontier->push_back(node.offset[c]);
+        }
+      }
+    }
+    return;
+  }
+  int top = levels / 2;
+  std::vector<int> middle;
+  veb_layout(wide_nodes, root, top, order, &middle);
+  for(size_t i = 0; i < middle.size(); i++) {
+    veb_layout(wide_nodes, middle[i], levels - top, order, frontier);
+  }
+}
+
+//Parents still come before their children afterwards, so refitting works unchanged. Motion trees
+//share the topology of the whole-interval tree and are permuted the same way.
+template<typename Node>
+static void reorder_wide(std::vector<Node>& wide_nodes, int motion_segments) {
+  size_t count = wide_nodes.size() / (motion_segments + 1);
+  if(count == 0) {
+    return;
+  }
+  std::vector<int> height(count, 1);
+  for(int i = count - 1; i >= 0; i--) {
+    for(int c = 0; c < wide_nodes[i].nChildren; c++) {
+      if(wide_nodes[i].nPrimitives[c] == 0) {
+        height[i] = std::max(height[i], height[wide_nodes[i].offset[c]] + 1);
+      }
     }
   }
-  return(false);
-#endif
-#ifdef DEBUGBVH
-  if(box.hit(r, t_min, t_max, rng)) {
-    rec.bvh_nodes += 1.0;
-    if(left->hit(r,t_min,t_max,rec, rng)) {
-      right->hit(r,t_min,rec.t,rec, rng);
-      return(true);
-    } else {
-      return(right->hit(r,t_min,t_max,rec, rng));
+  std::vector<int> order;
+  order.reserve(count);
+  std::vector<int> level(1, 0);
+  while(!level.empty() && (order.size() + level.size()) * sizeof(Node) <= kBVHHotBlockBytes) {
+    std::vector<int> next;
+    for(size_t i = 0; i < level.size(); i++) {
+      const Node& node = wide_nodes[level[i]];
+      order.push_back(level[i]);
+      for(int c = 0; c < node.nChildren; c++) {
+        if(node.nPrimitives[c] == 0) {
+          next.push_back(node.offset[c]);
+        }
+      }
     }
+    level.swap(next);
+  }
+  for(size_t i = 0; i < level.size(); i++) {
+    veb_layout(wide_nodes, level[i], height[level[i]], order, nullptr);
   }
-  return(false);
-#endif
-}
 
-bool bvh_node::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-#ifndef DEBUGBVH
-  if(box.hit(r, t_min, t_max, sampler)) {
-    if(left->hit(r,t_min,t_max,rec, sampler)) {
-      right->hit(r,t_min,rec.t,rec, sampler);
-      return(true);
-    } else {
-      return(right->hit(r,t_min,t_max,rec, sampler));
-    }
+  std::vector<int> new_index(count);
+  for(size_t i = 0; i < count; i++) {
+    new_index[order[i]] = i;
   }
-  return(false);
-#endif
-#ifdef DEBUGBVH
-  if(box.hit(r, t_min, t_max, sampler)) {
-    rec.bvh_nodes += 1.0;
-    if(left->hit(r,t_min,t_max,rec, sampler)) {
-      right->hit(r,t_min,rec.t,rec, sampler);
-      return(true);
-    } else {
-      return(right->hit(r,t_min,t_max,rec, sampler));
+  std::vector<Node> reordered(wide_nodes.size());
+  for(int t = 0; t <= motion_segments; t++) {
+    for(size_t i = 0; i < count; i++) {
+      Node node = wide_nodes[t * count + order[i]];
+      for(int c = 0; c < node.nChildren; c++) {
+        if(node.nPrimitives[c] == 0) {
+          node.offset[c] = new_index[node.offset[c]];
+        }
+      }
+      reordered[t * count + i] = node;
     }
   }
-  return(false);
-#endif
+  wide_nodes.swap(reordered);
 }
 
-inline bool box_compare(const std::shared_ptr<hitable> a, const std::shared_ptr<hitable> b, int axis) {
-  aabb box_a;
-  aabb box_b;
-  
-  if (!a->bounding_box(0,0, box_a) || !b->bounding_box(0,0, box_b)){}
-
-  return(box_a.centroid.e[axis] < box_b.centroid.e[axis]);
+void bvh_node::reorder() {
+  reordered = true;
+  if(width == 4) {
+    reorder_wide(nodes4, motion_segments);
+  } else if (width == 8) {
+    if(compressed) {
+      reorder_wide(nodes8q, motion_segments);
+    } else {
+      reorder_wide(nodes8, motion_segments);
+    }
+  }
 }
 
+bool bvh_node::refit(Float time0, Float time1, size_t numbercores) {
+  drop_motion_trees();
+  size_t n = mesh ? faces.size() : primitives.size();
+  std::unique_ptr<RcppThread::ThreadPool> pool = make_pool(n, numbercores);
+  std::vector<aabb> primBounds(n);
+  reference_bounds(time0, time1, pool.get(), primBounds.data());
 
-bool box_x_compare (const std::shared_ptr<hitable> a, const std::shared_ptr<hitable> b) {
-  return box_compare(a, b, 0);
-}
-
-bool box_y_compare (const std::shared_ptr<hitable> a, const std::shared_ptr<hitable> b) {
-  return box_compare(a, b, 1);
-}
+  if(width == 4) {
+    box = refit_tree(nodes4.data(), nodes4.size(), primBounds.data(), pool.get(), numbercores);
+  } else if (width == 8) {
+    box = compressed ? refit_tree(nodes8q.data(), nodes8q.size(), primBounds.data(), pool.get(), numbercores) :
+                       refit_tree(nodes8.data(), nodes8.size(), primBounds.data(), pool.get(), numbercores);
+  } else {
+    box = refit_tree(nodes.data(), nodes.size(), primBounds.data(), pool.get(), numbercores);
+  }
 
-bool box_z_compare (const std::shared_ptr<hitable> a, const std::shared_ptr<hitable> b) {
-  return box_compare(a, b, 2);
+  //Primitives that moved apart leave large, overlapping nodes behind: rebuild once the tree
+  //has degraded too far from the one the builder would produce
+  if(sah_cost() > kRefitRebuildRatio * build_cost) {
+    random_gen rng(0);
+    std::unique_ptr<bvh_node> rebuilt;
+    if(mesh) {
+      rebuilt.reset(new bvh_node(mesh, build_type, max_prims_in_leaf, numbercores, rng));
+    } else {
+      std::vector<std::shared_ptr<hitable> > prims;
+      if(build_type == 7) {
+        //Rebuild from the unique primitives, not the duplicated references
+        std::unordered_set<const hitable*> seen;
+        for(size_t i = 0; i < n; i++) {
+          if(seen.insert(primitives[i].get()).second) {
+            prims.push_back(primitives[i]);
+          }
+        }
+      } else {
+        prims = primitives;
+      }
+      rebuilt.reset(new bvh_node(prims, 0, prims.size(), time0, time1, build_type, max_prims_in_leaf, numbercores, rng));
+    }
+    nodes.swap(rebuilt->nodes);
+    nodes4.swap(rebuilt->nodes4);
+    nodes8.swap(rebuilt->nodes8);
+    nodes8q.swap(rebuilt->nodes8q);
+    compressed = rebuilt->compressed;
+    motion_segments = rebuilt->motion_segments;
+    motion_time0 = rebuilt->motion_time0;
+    motion_time1 = rebuilt->motion_time1;
+    primitives.swap(rebuilt->primitives);
+    faces.swap(rebuilt->faces);
+    blocks.swap(rebuilt->blocks);
+    box = rebuilt->box;
+    build_cost = rebuilt->build_cost;
+    if(reordered) {
+      reorder();
+    }
+    return(true);
+  }
+  build_motion_trees(time0, time1, pool.get());
+  return(false);
 }
 
-#ifdef DEBUGBBOX
-bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l, 
-                   size_t start, size_t end,
-                   Float time0, Float time1, int bvh_type, int depth, random_gen &rng) {
-  if(start == end) {
-    throw std::runtime_error("start node must not equal end node");
-  }
-#endif
-#ifndef DEBUGBBOX
-  bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l, 
-                     size_t start, size_t end,
-                     Float time0, Float time1, int bvh_type, random_gen &rng) {
-#endif
+BVHBuildNode* bvh_node::recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                       size_t start, size_t end, int bvh_type,
+                                       int depth, std::atomic<int>& totalNodes,
+                                       RcppThread::ThreadPool* pool, std::vector<BuildTask>* tasks) {
+  BVHBuildNode* node = new BVHBuildNode;
+  totalNodes++;
   aabb centroid_bounds;
+  bool sah;
   if(bvh_type == 1) {
     sah = true;
   } else {
@@ -108,24 +1380,32 @@ bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l,
   }
   constexpr int nBuckets = 12;
   size_t n = end - start;
-  
-  //Don't need sorted, just used to count bins and generate bin bounds
-  //Contains AABB of each primitve
-  std::vector<aabb> primitiveBounds(n); 
 
-  l[start]->bounding_box(time0, time1, centroid_bounds);
   aabb central_bounds;
 
-
-  for (int i = start; i < end; ++i) {
-    aabb tempbox;
-    if(l[i]->bounding_box(time0,time1,tempbox)) {
-      centroid_bounds = surrounding_box(centroid_bounds, tempbox);
-      central_bounds = surrounding_box(central_bounds, tempbox.centroid);
-      primitiveBounds[i-start] = tempbox;
+  if(pool) {
+    //Unions of boxes are exact, so merging the per-chunk bounds gives the serial result
+    size_t nChunks = (n + kParallelChunkSize - 1) / kParallelChunkSize;
+    std::vector<aabb> chunk_bounds(nChunks), chunk_central(nChunks);
+    pool->parallelFor(0, nChunks, [&] (size_t chunk) {
+      size_t chunk_end = std::min(start + (chunk + 1) * kParallelChunkSize, end);
+      for (size_t i = start + chunk * kParallelChunkSize; i < chunk_end; ++i) {
+        chunk_bounds[chunk] = surrounding_box(chunk_bounds[chunk], primitiveInfo[i].bounds);
+        chunk_central[chunk] = surrounding_box(chunk_central[chunk], primitiveInfo[i].bounds.centroid);
+      }
+    });
+    pool->wait();
+    for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+      centroid_bounds = surrounding_box(centroid_bounds, chunk_bounds[chunk]);
+      central_bounds = surrounding_box(central_bounds, chunk_central[chunk]);
+    }
+  } else {
+    for (size_t i = start; i < end; ++i) {
+      centroid_bounds = surrounding_box(centroid_bounds, primitiveInfo[i].bounds);
+      central_bounds = surrounding_box(central_bounds, primitiveInfo[i].bounds.centroid);
     }
   }
-  
+
   vec3f centroid_bounds_values = central_bounds.max() - central_bounds.min();
 
 #ifdef DEBUGBBOX
@@ -134,60 +1414,45 @@ bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l,
   }
       ofstream myfile;
       myfile.open("bbox.txt", ios::app | ios::out);
-      myfile << "Min: " << central_bounds.min() << ", Max: " << central_bounds.max() << 
+      myfile << "Min: " << central_bounds.min() << ", Max: " << central_bounds.max() <<
         ", Diag: " << central_bounds.diag << ", Vol: " << central_bounds.Volume() << ", N: " << n << ", Depth:" << depth << "\n";
       myfile.close();
   #endif
-  
+
   int axis = centroid_bounds_values.x() > centroid_bounds_values.y() ? 0 : 1;
   if(axis == 0) {
     axis = centroid_bounds_values.x() > centroid_bounds_values.z() ? 0 : 2;
   } else {
     axis = centroid_bounds_values.y() > centroid_bounds_values.z() ? 1 : 2;
   }
-  // int axis = 0;
-  auto comparator = (axis == 0) ? box_x_compare
-    : (axis == 1) ? box_y_compare
-    : box_z_compare;
+  auto comparator = [axis] (const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+    return(a.bounds.centroid.e[axis] < b.bounds.centroid.e[axis]);
+  };
 
-  if(central_bounds.Volume() < 1e-6) {
+  if(central_bounds.Volume() < 1e-6 || depth >= kMaxBVHDepth) {
     sah = false;
     bvh_type = 2;
   }
   if (n == 1) {
-    left = right = l[start];
-  } else if (n == 2) {
-    if (comparator(l[start], l[start+1])) {
-      left = l[start];
-      right = l[start+1];
-    } else {
-      left = l[start+1];
-      right = l[start];
-    }
+    node->InitLeaf(start, 1, centroid_bounds);
   } else {
-    std::sort(l.begin() + start, l.begin() + end, comparator);
     //Handle case where all shapes share the same centroid
     if(central_bounds.diag.e[axis] == 0 ) {
       sah = false;
       bvh_type = 2;
-    }      
-    
-    if(n <= 4) {
-      sah = false;
-      bvh_type = 2;
     }
-    //SAH 
+    size_t mid = start + n/2;
+    bool make_leaf = !sah && n <= static_cast<size_t>(max_prims_in_leaf);
+    //SAH
     if(sah) {
       struct BucketInfo {
         int count = 0;
         aabb bounds;
       };
-      
+
       BucketInfo buckets[nBuckets];
-      
-      //Count number of objects in each bin and calculate bounding box for each bin.
-      for (int i = 0; i < n; ++i) {
-        int b = nBuckets * central_bounds.offset(primitiveBounds[i].centroid)[axis];
+      auto bucket_index = [&] (const BVHPrimitiveInfo& info) {
+        int b = nBuckets * central_bounds.offset(info.bounds.centroid)[axis];
         if (b == nBuckets) {
           b = nBuckets - 1;
         }
@@ -196,8 +1461,34 @@ bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l,
           throw std::runtime_error("SAH bucket out of bounds");
         }
 #endif
-        buckets[b].count++;
-        buckets[b].bounds = surrounding_box(buckets[b].bounds, primitiveBounds[i]);
+        return(b);
+      };
+
+      //Count number of objects in each bin and calculate bounding box for each bin.
+      auto fill_buckets = [&] (size_t first, size_t last, BucketInfo* bins) {
+        for (size_t i = first; i < last; ++i) {
+          int b = bucket_index(primitiveInfo[i]);
+          bins[b].count++;
+          bins[b].bounds = surrounding_box(bins[b].bounds, primitiveInfo[i].bounds);
+        }
+      };
+      if(pool) {
+        size_t nChunks = (n + kParallelChunkSize - 1) / kParallelChunkSize;
+        std::vector<BucketInfo> chunk_buckets(nChunks * nBuckets);
+        pool->parallelFor(0, nChunks, [&] (size_t chunk) {
+          fill_buckets(start + chunk * kParallelChunkSize,
+                       std::min(start + (chunk + 1) * kParallelChunkSize, end),
+                       &chunk_buckets[chunk * nBuckets]);
+        });
+        pool->wait();
+        for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+          for (int b = 0; b < nBuckets; ++b) {
+            buckets[b].count += chunk_buckets[chunk * nBuckets + b].count;
+            buckets[b].bounds = surrounding_box(buckets[b].bounds, chunk_buckets[chunk * nBuckets + b].bounds);
+          }
+        }
+      } else {
+        fill_buckets(start, end, buckets);
       }
       constexpr int nSplits = nBuckets - 1;
       int countBelow[nSplits], countAbove[nSplits];
@@ -208,7 +1499,7 @@ bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l,
         countBelow[i] = countBelow[i - 1] + buckets[i].count;
         boundsBelow[i] = surrounding_box(boundsBelow[i - 1], buckets[i].bounds);
       }
-      
+
       countAbove[nSplits - 1] = buckets[nBuckets - 1].count;
       boundsAbove[nSplits - 1] = buckets[nBuckets - 1].bounds;
       for (int i = nSplits - 2; i >= 0; --i) {
@@ -218,68 +1509,855 @@ bvh_node::bvh_node(std::vector<std::shared_ptr<hitable> >& l,
 
       int minCostSplitBucket = -1;
       Float minCost = INFINITY;
-      Float costs[nBuckets];
-      
+
       for (int i = 0; i < nSplits; ++i) {
         if (countBelow[i] == 0 || countAbove[i] == 0) {
           continue;
         }
         Float cost = (countBelow[i] * boundsBelow[i].surface_area() +
           countAbove[i] * boundsAbove[i].surface_area());
-        costs[i] = cost;
-        
+
         if (cost < minCost) {
           minCost = cost;
           minCostSplitBucket = i;
         }
       }
-      int halfCount = countBelow[minCostSplitBucket];
+      //A leaf costs one intersection per primitive, a split one traversal step plus the
+      //intersections expected in each child
+      Float leafCost = n;
+      minCost = kBVHTraversalCost + minCost / centroid_bounds.surface_area();
+      if(n <= static_cast<size_t>(max_prims_in_leaf) &&
+         (minCostSplitBucket == -1 || leafCost <= minCost)) {
+        make_leaf = true;
+      } else if(minCostSplitBucket != -1) {
+        //Buckets are ordered along the axis, so an O(n) partition on the split bucket
+        //gives the same two sets of primitives as sorting and splitting at countBelow
+        BVHPrimitiveInfo* pmid = std::partition(&primitiveInfo[start], &primitiveInfo[end-1] + 1,
+          [&] (const BVHPrimitiveInfo& info) {
+            return(bucket_index(info) <= minCostSplitBucket);
+          });
+        mid = pmid - &primitiveInfo[0];
+      } else {
+        sah = false;
+      }
       //End SAH
-#ifdef DEBUGBBOX
-      depth++;
-      left = std::make_shared<bvh_node>(l, start, start + halfCount, time0, time1, bvh_type, depth, rng);
-      right = std::make_shared<bvh_node>(l, start + halfCount, end, time0, time1, bvh_type, depth, rng);
-#endif
-#ifndef DEBUGBBOX
-      left = std::make_shared<bvh_node>(l, start, start + halfCount, time0, time1, bvh_type, rng);
-      right = std::make_shared<bvh_node>(l, start + halfCount, end, time0, time1, bvh_type, rng);
-#endif
+    }
+    if(make_leaf) {
+      node->InitLeaf(start, n, centroid_bounds);
+      return(node);
+    }
+    if(!sah) {
+      std::nth_element(&primitiveInfo[start], &primitiveInfo[mid], &primitiveInfo[end-1] + 1,
+                       comparator);
+    }
+    BVHBuildNode* left  = buildChild(primitiveInfo, start, mid, bvh_type, depth+1, totalNodes,
+                                     pool, tasks);
+    BVHBuildNode* right = buildChild(primitiveInfo, mid, end, bvh_type, depth+1, totalNodes,
+                                     pool, tasks);
+    node->InitInterior(axis, left, right);
+  }
+  return(node);
+}
+
+//Below task_size primitives, the child is returned as an empty placeholder and queued to be
+//built on the pool. Its bounds are filled in immediately, since InitInterior() needs them.
+BVHBuildNode* bvh_node::buildChild(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                   size_t start, size_t end, int bvh_type,
+                                   int depth, std::atomic<int>& totalNodes,
+                                   RcppThread::ThreadPool* pool, std::vector<BuildTask>* tasks) {
+  size_t n = end - start;
+  if(tasks && n < task_size) {
+    BVHBuildNode* placeholder = new BVHBuildNode;
+    for (size_t i = start; i < end; ++i) {
+      placeholder->bounds = surrounding_box(placeholder->bounds, primitiveInfo[i].bounds);
+    }
+    tasks->push_back({placeholder, start, end, bvh_type, depth, -1});
+    return(placeholder);
+  }
+  bool parallel = pool && n >= kMinParallelBuildSize;
+  return(recursiveBuild(primitiveInfo, start, end, bvh_type, depth, totalNodes,
+                        parallel ? pool : nullptr, tasks));
+}
+
+static inline bool box_is_empty(const aabb& b) {
+  return(b.min().x() > b.max().x() || b.min().y() > b.max().y() || b.min().z() > b.max().z());
+}
+
+static inline aabb box_intersection(const aabb& a, const aabb& b) {
+  point3f lo(ffmax(a.min().x(), b.min().x()), ffmax(a.min().y(), b.min().y()), ffmax(a.min().z(), b.min().z()));
+  point3f hi(ffmin(a.max().x(), b.max().x()), ffmin(a.max().y(), b.max().y()), ffmin(a.max().z(), b.max().z()));
+  if(lo.x() > hi.x() || lo.y() > hi.y() || lo.z() > hi.z()) {
+    return(aabb());
+  }
+  return(aabb(lo, hi));
+}
+
+//Bounds of the parts of a reference on either side of the plane at `pos`. Triangles (given by
+//their three vertices) are clipped against the plane exactly, everything else (tri == nullptr) by
+//its bounding box.
+static void split_reference(const vec3f* tri, const aabb& bounds, int axis, Float pos,
+                            aabb& left, aabb& right) {
+  //Accumulated as plain min/max corners, since this runs for every bin a reference overlaps
+  Float lmin[3], lmax[3], rmin[3], rmax[3];
+  for(int k = 0; k < 3; k++) {
+    lmin[k] = rmin[k] = bounds.bounds[0].e[k];
+    lmax[k] = rmax[k] = bounds.bounds[1].e[k];
+  }
+  if(tri) {
+    Float tlmin[3], tlmax[3], trmin[3], trmax[3];
+    for(int k = 0; k < 3; k++) {
+      tlmin[k] = trmin[k] = std::numeric_limits<Float>::max();
+      tlmax[k] = trmax[k] = std::numeric_limits<Float>::lowest();
+    }
+    auto add_point = [] (Float* lo, Float* hi, const vec3f& p) {
+      for(int k = 0; k < 3; k++) {
+        lo[k] = ffmin(lo[k], p.e[k]);
+        hi[k] = ffmax(hi[k], p.e[k]);
+      }
+    };
+    for(int i = 0; i < 3; i++) {
+      const vec3f& v0 = tri[i];
+      const vec3f& v1 = tri[(i + 1) % 3];
+      Float p0 = v0.e[axis];
+      Float p1 = v1.e[axis];
+      if(p0 <= pos) {
+        add_point(tlmin, tlmax, v0);
+      }
+      if(p0 >= pos) {
+        add_point(trmin, trmax, v0);
+      }
+      if((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+        vec3f x = v0 + (v1 - v0) * ((pos - p0) / (p1 - p0));
+        x.e[axis] = pos;
+        add_point(tlmin, tlmax, x);
+        add_point(trmin, trmax, x);
+      }
+    }
+    for(int k = 0; k < 3; k++) {
+      lmin[k] = ffmax(lmin[k], tlmin[k]);
+      lmax[k] = ffmin(lmax[k], tlmax[k]);
+      rmin[k] = ffmax(rmin[k], trmin[k]);
+      rmax[k] = ffmin(rmax[k], trmax[k]);
+    }
+  }
+  lmax[axis] = ffmin(lmax[axis], pos);
+  rmin[axis] = ffmax(rmin[axis], pos);
+  bool left_empty = false, right_empty = false;
+  for(int k = 0; k < 3; k++) {
+    left_empty  = left_empty  || lmin[k] > lmax[k];
+    right_empty = right_empty || rmin[k] > rmax[k];
+  }
+  left  = left_empty  ? aabb() : aabb(point3f(lmin[0], lmin[1], lmin[2]), point3f(lmax[0], lmax[1], lmax[2]));
+  right = right_empty ? aabb() : aabb(point3f(rmin[0], rmin[1], rmin[2]), point3f(rmax[0], rmax[1], rmax[2]));
+}
+
+const vec3f* bvh_node::SBVHState::vertices(size_t i, vec3f* v) const {
+  if(mesh) {
+    for(int k = 0; k < 3; k++) {
+      v[k] = vec3f(mesh->p[mesh->vertexIndices[3*i+k]]);
+    }
+    return(v);
+  }
+  const triangle* tri = triangles[i];
+  if(!tri) {
+    return(nullptr);
+  }
+  v[0] = tri->a;
+  v[1] = tri->b;
+  v[2] = tri->c;
+  return(v);
+}
+
+//Spatial split BVH (Stich et al. 2009): each node takes the cheaper of the best object split and
+//the best spatial split, where references straddling the plane are clipped into both children
+//unless the SAH prefers to leave them whole on one side
+BVHBuildNode* bvh_node::buildSBVH(std::vector<BVHPrimitiveInfo>& refs, int depth,
+                                  std::atomic<int>& totalNodes, SBVHState& state) {
+  BVHBuildNode* node = new BVHBuildNode;
+  totalNodes++;
+  size_t n = refs.size();
+  aabb bounds, central_bounds;
+  for (size_t i = 0; i < n; ++i) {
+    bounds = surrounding_box(bounds, refs[i].bounds);
+    central_bounds = surrounding_box(central_bounds, refs[i].bounds.centroid);
+  }
+  auto make_leaf = [&] () {
+    node->InitLeaf(state.ordered.size(), n, bounds);
+    state.ordered.insert(state.ordered.end(), refs.begin(), refs.end());
+    return(node);
+  };
+  if(n == 1) {
+    return(make_leaf());
+  }
+  vec3f tri[3]; //Vertices of the reference being split
+  vec3f centroid_extent = central_bounds.max() - central_bounds.min();
+  int axis = centroid_extent.x() > centroid_extent.y() ? 0 : 1;
+  axis = centroid_extent.e[axis] > centroid_extent.z() ? axis : 2;
+
+  //Object split, binned on the centroids as in recursiveBuild()
+  constexpr int nBuckets = 12;
+  int objectSplit = -1;
+  Float objectCost = INFINITY;
+  aabb objectOverlap;
+  auto bucket_index = [&] (const BVHPrimitiveInfo& info) {
+    int b = nBuckets * central_bounds.offset(info.bounds.centroid)[axis];
+    return(b >= nBuckets ? nBuckets - 1 : b);
+  };
+  if(centroid_extent.e[axis] > 0 && depth < kMaxBVHDepth) {
+    int counts[nBuckets] = {0};
+    aabb bucket_bounds[nBuckets];
+    for (size_t i = 0; i < n; ++i) {
+      int b = bucket_index(refs[i]);
+      counts[b]++;
+      bucket_bounds[b] = surrounding_box(bucket_bounds[b], refs[i].bounds);
+    }
+    aabb boundsAbove[nBuckets];
+    int countAbove[nBuckets];
+    boundsAbove[nBuckets - 1] = bucket_bounds[nBuckets - 1];
+    countAbove[nBuckets - 1] = counts[nBuckets - 1];
+    for (int b = nBuckets - 2; b >= 0; --b) {
+      boundsAbove[b] = surrounding_box(boundsAbove[b + 1], bucket_bounds[b]);
+      countAbove[b] = countAbove[b + 1] + counts[b];
+    }
+    aabb boundsBelow;
+    int countBelow = 0;
+    for (int b = 0; b < nBuckets - 1; ++b) {
+      boundsBelow = surrounding_box(boundsBelow, bucket_bounds[b]);
+      countBelow += counts[b];
+      if(countBelow == 0 || countAbove[b + 1] == 0) {
+        continue;
+      }
+      Float cost = countBelow * boundsBelow.surface_area() +
+        countAbove[b + 1] * boundsAbove[b + 1].surface_area();
+      if(cost < objectCost) {
+        objectCost = cost;
+        objectSplit = b;
+        objectOverlap = box_intersection(boundsBelow, boundsAbove[b + 1]);
+      }
+    }
+  }
+
+  //Spatial split, binned along each axis of the node bounds
+  constexpr int nSpatialBins = 32;
+  int spatialAxis = -1, spatialSplit = -1;
+  Float spatialCost = INFINITY;
+  aabb spatialLeft, spatialRight;
+  int spatialLeftCount = 0, spatialRightCount = 0;
+  bool try_spatial = state.budget > 0 && depth < kMaxBVHDepth &&
+    (objectSplit == -1 || (!box_is_empty(objectOverlap) &&
+                           objectOverlap.surface_area() > kSBVHOverlapThreshold * state.root_area));
+  auto spatial_bin = [&] (Float x, int a) {
+    int b = nSpatialBins * (x - bounds.min().e[a]) / (bounds.max().e[a] - bounds.min().e[a]);
+    return(std::min(std::max(b, 0), nSpatialBins - 1));
+  };
+  for(int a = 0; try_spatial && a < 3; a++) {
+    Float lo = bounds.min().e[a];
+    Float extent = bounds.max().e[a] - lo;
+    if(extent <= 0) {
+      continue;
+    }
+    aabb bin_bounds[nSpatialBins];
+    int enter[nSpatialBins] = {0}, exit[nSpatialBins] = {0};
+    for (size_t i = 0; i < n; ++i) {
+      int first = spatial_bin(refs[i].bounds.min().e[a], a);
+      int last  = spatial_bin(refs[i].bounds.max().e[a], a);
+      aabb rest = refs[i].bounds;
+      for(int b = first; b < last; b++) {
+        aabb piece;
+        split_reference(state.vertices(refs[i].primitiveNumber, tri), rest, a,
+                        lo + extent * (b + 1) / nSpatialBins, piece, rest);
+        bin_bounds[b] = surrounding_box(bin_bounds[b], piece);
+      }
+      bin_bounds[last] = surrounding_box(bin_bounds[last], rest);
+      enter[first]++;
+      exit[last]++;
+    }
+    aabb boundsAbove[nSpatialBins];
+    int countAbove[nSpatialBins];
+    boundsAbove[nSpatialBins - 1] = bin_bounds[nSpatialBins - 1];
+    countAbove[nSpatialBins - 1] = exit[nSpatialBins - 1];
+    for (int b = nSpatialBins - 2; b >= 0; --b) {
+      boundsAbove[b] = surrounding_box(boundsAbove[b + 1], bin_bounds[b]);
+      countAbove[b] = countAbove[b + 1] + exit[b];
+    }
+    aabb boundsBelow;
+    int countBelow = 0;
+    for (int b = 0; b < nSpatialBins - 1; ++b) {
+      boundsBelow = surrounding_box(boundsBelow, bin_bounds[b]);
+      countBelow += enter[b];
+      //Both children must shrink, otherwise duplication could recurse indefinitely
+      if(countBelow == 0 || countAbove[b + 1] == 0 ||
+         countBelow == static_cast<int>(n) || countAbove[b + 1] == static_cast<int>(n)) {
+        continue;
+      }
+      Float cost = countBelow * boundsBelow.surface_area() +
+        countAbove[b + 1] * boundsAbove[b + 1].surface_area();
+      if(cost < spatialCost) {
+        spatialCost = cost;
+        spatialAxis = a;
+        spatialSplit = b;
+        spatialLeft = boundsBelow;
+        spatialRight = boundsAbove[b + 1];
+        spatialLeftCount = countBelow;
+        spatialRightCount = countAbove[b + 1];
+      }
+    }
+  }
+
+  Float splitCost = kBVHTraversalCost + std::min(objectCost, spatialCost) / bounds.surface_area();
+  if(n <= static_cast<size_t>(max_prims_in_leaf) && n <= splitCost) {
+    return(make_leaf());
+  }
+  std::vector<BVHPrimitiveInfo> left, right;
+  if(spatialAxis != -1 && spatialCost < objectCost) {
+    int a = spatialAxis;
+    Float pos = bounds.min().e[a] + (bounds.max().e[a] - bounds.min().e[a]) * (spatialSplit + 1) / nSpatialBins;
+    Float leftArea = spatialLeft.surface_area();
+    Float rightArea = spatialRight.surface_area();
+    for (size_t i = 0; i < n; ++i) {
+      const BVHPrimitiveInfo& ref = refs[i];
+      int first = spatial_bin(ref.bounds.min().e[a], a);
+      int last  = spatial_bin(ref.bounds.max().e[a], a);
+      if(last <= spatialSplit) {
+        left.push_back(ref);
+        continue;
+      } else if (first > spatialSplit) {
+        right.push_back(ref);
+        continue;
+      }
+      //Reference unsplitting: keep the whole reference on one side if that is cheaper
+      Float splitCost = leftArea * spatialLeftCount + rightArea * spatialRightCount;
+      aabb leftWhole = surrounding_box(spatialLeft, ref.bounds);
+      aabb rightWhole = surrounding_box(spatialRight, ref.bounds);
+      Float leftCost = leftWhole.surface_area() * spatialLeftCount + rightArea * (spatialRightCount - 1);
+      Float rightCost = leftArea * (spatialLeftCount - 1) + rightWhole.surface_area() * spatialRightCount;
+      if(state.budget == 0) {
+        splitCost = INFINITY;
+      }
+      if(leftCost < splitCost && leftCost <= rightCost) {
+        left.push_back(ref);
+        spatialLeft = leftWhole;
+        leftArea = spatialLeft.surface_area();
+        spatialRightCount--;
+      } else if (rightCost < splitCost) {
+        right.push_back(ref);
+        spatialRight = rightWhole;
+        rightArea = spatialRight.surface_area();
+        spatialLeftCount--;
+      } else {
+        aabb leftPiece, rightPiece;
+        split_reference(state.vertices(ref.primitiveNumber, tri), ref.bounds, a, pos, leftPiece, rightPiece);
+        bool leftEmpty = box_is_empty(leftPiece);
+        bool rightEmpty = box_is_empty(rightPiece);
+        if(!leftEmpty) {
+          left.push_back({ref.primitiveNumber, leftPiece});
+        }
+        if(!rightEmpty) {
+          right.push_back({ref.primitiveNumber, rightPiece});
+        }
+        if(leftEmpty && rightEmpty) {
+          left.push_back(ref);
+        } else if(!leftEmpty && !rightEmpty) {
+          state.budget--;
+        }
+      }
+    }
+  }
+  if(left.empty() || right.empty()) {
+    left.clear();
+    right.clear();
+    BVHPrimitiveInfo* pmid;
+    if(objectSplit != -1) {
+      pmid = std::partition(&refs[0], &refs[0] + n, [&] (const BVHPrimitiveInfo& info) {
+        return(bucket_index(info) <= objectSplit);
+      });
     } else {
-#ifdef DEBUGBBOX
-      depth++;
-      auto mid = start + n/2;
-      left = std::make_shared<bvh_node>(l, start, mid, time0, time1, bvh_type, depth, rng);
-      right = std::make_shared<bvh_node>(l, mid, end, time0, time1, bvh_type,  depth, rng);
-#endif
-#ifndef DEBUGBBOX
-      auto mid = start + n/2;
-      left = std::make_shared<bvh_node>(l, start, mid, time0, time1, bvh_type, rng);
-      right = std::make_shared<bvh_node>(l, mid, end, time0, time1, bvh_type, rng);
-#endif
+      pmid = &refs[0] + n/2;
+      std::nth_element(&refs[0], pmid, &refs[0] + n,
+                       [axis] (const BVHPrimitiveInfo& a, const BVHPrimitiveInfo& b) {
+        return(a.bounds.centroid.e[axis] < b.bounds.centroid.e[axis]);
+      });
+    }
+    left.assign(&refs[0], pmid);
+    right.assign(pmid, &refs[0] + n);
+  } else {
+    axis = spatialAxis;
+  }
+  refs.clear();
+  refs.shrink_to_fit();
+  BVHBuildNode* c0 = buildSBVH(left, depth + 1, totalNodes, state);
+  BVHBuildNode* c1 = buildSBVH(right, depth + 1, totalNodes, state);
+  node->InitInterior(axis, c0, c1);
+  return(node);
+}
+
+//Spreads the lower 10 bits of x out to every third bit
+static inline uint32_t LeftShift3(uint32_t x) {
+  if (x == (1 << 10)) {
+    --x;
+  }
+  x = (x | (x << 16)) & 0x30000ff;
+  x = (x | (x <<  8)) & 0x300f00f;
+  x = (x | (x <<  4)) & 0x30c30c3;
+  x = (x | (x <<  2)) & 0x9249249;
+  return(x);
+}
+
+static inline uint32_t EncodeMorton3(const point3f &v) {
+  return((LeftShift3(v.z()) << 2) | (LeftShift3(v.y()) << 1) | LeftShift3(v.x()));
+}
+
+struct MortonPrimitive {
+  size_t primitiveIndex;
+  uint32_t mortonCode;
+};
+
+//Stable LSD radix sort on the 30 bit Morton codes. With a pool, each pass histograms and
+//scatters fixed chunks in parallel, which keeps the order identical to the serial sort.
+static void RadixSort(std::vector<MortonPrimitive> *v, RcppThread::ThreadPool* pool) {
+  std::vector<MortonPrimitive> tempVector(v->size());
+  constexpr int bitsPerPass = 6;
+  constexpr int nBits = 30;
+  constexpr int nPasses = nBits / bitsPerPass;
+  constexpr int nBuckets = 1 << bitsPerPass;
+  constexpr int bitMask = (1 << bitsPerPass) - 1;
+  size_t n = v->size();
+  size_t nChunks = pool ? (n + kParallelChunkSize - 1) / kParallelChunkSize : 1;
+  size_t chunkSize = pool ? kParallelChunkSize : n;
+  std::vector<size_t> bucketCount(nChunks * nBuckets);
+
+  for (int pass = 0; pass < nPasses; ++pass) {
+    int lowBit = pass * bitsPerPass;
+    std::vector<MortonPrimitive> &in  = (pass & 1) ? tempVector : *v;
+    std::vector<MortonPrimitive> &out = (pass & 1) ? *v : tempVector;
+
+    auto count_chunk = [&] (size_t chunk) {
+      size_t* count = &bucketCount[chunk * nBuckets];
+      std::fill(count, count + nBuckets, 0);
+      size_t chunk_end = std::min((chunk + 1) * chunkSize, n);
+      for (size_t i = chunk * chunkSize; i < chunk_end; ++i) {
+        count[(in[i].mortonCode >> lowBit) & bitMask]++;
+      }
+    };
+    //Convert counts to output offsets: bucket-major, then chunk order within each bucket
+    auto scatter_chunk = [&] (size_t chunk) {
+      size_t* offset = &bucketCount[chunk * nBuckets];
+      size_t chunk_end = std::min((chunk + 1) * chunkSize, n);
+      for (size_t i = chunk * chunkSize; i < chunk_end; ++i) {
+        out[offset[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+      }
+    };
+    if(pool) {
+      pool->parallelFor(0, nChunks, count_chunk);
+      pool->wait();
+    } else {
+      count_chunk(0);
+    }
+    size_t total = 0;
+    for (int b = 0; b < nBuckets; ++b) {
+      for (size_t chunk = 0; chunk < nChunks; ++chunk) {
+        size_t count = bucketCount[chunk * nBuckets + b];
+        bucketCount[chunk * nBuckets + b] = total;
+        total += count;
+      }
+    }
+    if(pool) {
+      pool->parallelFor(0, nChunks, scatter_chunk);
+      pool->wait();
+    } else {
+      scatter_chunk(0);
+    }
+  }
+  if (nPasses & 1) {
+    std::swap(*v, tempVector);
+  }
+}
+
+//Linear BVH: primitives are sorted along a Morton curve through their centroids, and the
+//hierarchy is emitted by splitting each range where its highest differing Morton bit changes
+BVHBuildNode* bvh_node::buildLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                  std::atomic<int>& totalNodes,
+                                  RcppThread::ThreadPool* pool, std::vector<BuildTask>* tasks) {
+  size_t n = primitiveInfo.size();
+  aabb central_bounds;
+  for (size_t i = 0; i < n; ++i) {
+    central_bounds = surrounding_box(central_bounds, primitiveInfo[i].bounds.centroid);
+  }
+
+  constexpr int mortonScale = 1 << kMortonBits;
+  std::vector<MortonPrimitive> mortonPrims(n);
+  auto fill_codes = [&] (size_t first, size_t last) {
+    for (size_t i = first; i < last; ++i) {
+      point3f centroidOffset = central_bounds.offset(primitiveInfo[i].bounds.centroid);
+      mortonPrims[i].primitiveIndex = i;
+      mortonPrims[i].mortonCode = EncodeMorton3(centroidOffset * mortonScale);
+    }
+  };
+  if(pool) {
+    size_t nChunks = (n + kParallelChunkSize - 1) / kParallelChunkSize;
+    pool->parallelFor(0, nChunks, [&] (size_t chunk) {
+      fill_codes(chunk * kParallelChunkSize, std::min((chunk + 1) * kParallelChunkSize, n));
+    });
+    pool->wait();
+  } else {
+    fill_codes(0, n);
+  }
+  RadixSort(&mortonPrims, pool);
+
+  std::vector<BVHPrimitiveInfo> sortedInfo(n);
+  morton_codes.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    sortedInfo[i] = primitiveInfo[mortonPrims[i].primitiveIndex];
+    morton_codes[i] = mortonPrims[i].mortonCode;
+  }
+  primitiveInfo.swap(sortedInfo);
+  return(emitLBVH(primitiveInfo, 0, n, 3 * kMortonBits - 1, 0, totalNodes, tasks));
+}
+
+BVHBuildNode* bvh_node::emitLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                 size_t start, size_t end, int bitIndex, int depth,
+                                 std::atomic<int>& totalNodes, std::vector<BuildTask>* tasks) {
+  size_t n = end - start;
+  BVHBuildNode* node = new BVHBuildNode;
+  totalNodes++;
+  if (n <= static_cast<size_t>(max_prims_in_leaf)) {
+    aabb bounds;
+    for (size_t i = start; i < end; ++i) {
+      bounds = surrounding_box(bounds, primitiveInfo[i].bounds);
+    }
+    node->InitLeaf(start, n, bounds);
+    return(node);
+  }
+  //Skip bit planes that every code in the (sorted) range shares
+  while (bitIndex >= 0 &&
+         (morton_codes[start] & (1 << bitIndex)) == (morton_codes[end - 1] & (1 << bitIndex))) {
+    bitIndex--;
+  }
+  size_t mid;
+  int axis;
+  if (bitIndex < 0) {
+    //Identical codes: split the range in half
+    mid = start + n/2;
+    axis = 0;
+  } else {
+    //Binary search for the first primitive with bitIndex set
+    uint32_t mask = 1 << bitIndex;
+    size_t lo = start, hi = end - 1;
+    while (lo + 1 != hi) {
+      size_t m = (lo + hi) / 2;
+      if ((morton_codes[lo] & mask) == (morton_codes[m] & mask)) {
+        lo = m;
+      } else {
+        hi = m;
+      }
+    }
+    mid = hi;
+    axis = bitIndex % 3;
+  }
+  BVHBuildNode* children[2];
+  size_t ranges[3] = {start, mid, end};
+  for (int c = 0; c < 2; ++c) {
+    if (tasks && ranges[c+1] - ranges[c] < task_size) {
+      BVHBuildNode* placeholder = new BVHBuildNode;
+      for (size_t i = ranges[c]; i < ranges[c+1]; ++i) {
+        placeholder->bounds = surrounding_box(placeholder->bounds, primitiveInfo[i].bounds);
+      }
+      tasks->push_back({placeholder, ranges[c], ranges[c+1], 5, depth+1, bitIndex-1});
+      children[c] = placeholder;
+    } else {
+      children[c] = emitLBVH(primitiveInfo, ranges[c], ranges[c+1], bitIndex-1, depth+1,
+                             totalNodes, tasks);
+    }
+  }
+  node->InitInterior(axis, children[0], children[1]);
+  return(node);
+}
+
+//Treelet restructuring (Karras & Aila 2013): the treelet under each interior node is grown to
+//kTreeletSize leaves by opening its largest children, then rebuilt with the topology that
+//minimizes the summed surface area of its interior nodes.
+static constexpr int kTreeletSize = 7;
+
+static void rebuildTreelet(BVHBuildNode* node, int subset, BVHBuildNode** leaves,
+                           const int* partition, BVHBuildNode** internals, int& nextInternal) {
+  int sides[2] = {partition[subset], subset ^ partition[subset]};
+  BVHBuildNode* children[2];
+  for (int c = 0; c < 2; ++c) {
+    if ((sides[c] & (sides[c] - 1)) == 0) {
+      int leaf = 0;
+      while (!(sides[c] & (1 << leaf))) {
+        leaf++;
+      }
+      children[c] = leaves[leaf];
+    } else {
+      children[c] = internals[nextInternal++];
+      rebuildTreelet(children[c], sides[c], leaves, partition, internals, nextInternal);
+    }
+  }
+  //Split along the axis that best separates the children, lower child first, so
+  //traversal can still pick the near child from the ray direction
+  vec3f d = children[1]->bounds.centroid - children[0]->bounds.centroid;
+  int axis = std::fabs(d.x()) > std::fabs(d.y()) ? 0 : 1;
+  axis = std::fabs(d.e[axis]) > std::fabs(d.z()) ? axis : 2;
+  if (d.e[axis] < 0) {
+    std::swap(children[0], children[1]);
+  }
+  node->InitInterior(axis, children[0], children[1]);
+}
+
+static void optimizeTreelet(BVHBuildNode* root) {
+  if (root->nPrimitives > 0) {
+    return;
+  }
+  BVHBuildNode* leaves[kTreeletSize];
+  BVHBuildNode* internals[kTreeletSize - 2];
+  int nLeaves = 0, nInternals = 0;
+  leaves[nLeaves++] = root->children[0].get();
+  leaves[nLeaves++] = root->children[1].get();
+  while (nLeaves < kTreeletSize) {
+    int best = -1;
+    Float best_area = -1;
+    for (int i = 0; i < nLeaves; ++i) {
+      if (leaves[i]->nPrimitives == 0 && leaves[i]->bounds.surface_area() > best_area) {
+        best_area = leaves[i]->bounds.surface_area();
+        best = i;
+      }
+    }
+    if (best == -1) {
+      break;
+    }
+    BVHBuildNode* open = leaves[best];
+    internals[nInternals++] = open;
+    leaves[best] = open->children[0].get();
+    leaves[nLeaves++] = open->children[1].get();
+  }
+  if (nLeaves < 3) {
+    return;
+  }
+  Float current_cost = root->bounds.surface_area();
+  for (int i = 0; i < nInternals; ++i) {
+    current_cost += internals[i]->bounds.surface_area();
+  }
+
+  //Optimal cost of every subset of the leaves, built up from smaller subsets
+  int nSubsets = 1 << nLeaves;
+  Float cost[1 << kTreeletSize];
+  int partition[1 << kTreeletSize];
+  for (int s = 1; s < nSubsets; ++s) {
+    if ((s & (s - 1)) == 0) {
+      cost[s] = 0;
+      continue;
+    }
+    aabb bounds;
+    for (int i = 0; i < nLeaves; ++i) {
+      if (s & (1 << i)) {
+        bounds = surrounding_box(bounds, leaves[i]->bounds);
+      }
+    }
+    int lowest = s & -s;
+    Float best = INFINITY;
+    for (int p = (s - 1) & s; p > 0; p = (p - 1) & s) {
+      if ((p & lowest) && cost[p] + cost[s ^ p] < best) {
+        best = cost[p] + cost[s ^ p];
+        partition[s] = p;
+      }
+    }
+    cost[s] = bounds.surface_area() + best;
+  }
+  if (cost[nSubsets - 1] >= current_cost * (1 - 1e-5)) {
+    return;
+  }
+  //Every node in the treelet is referenced from leaves/internals, so ownership can be
+  //released and then handed back out by InitInterior() in the new topology
+  root->children[0].release();
+  root->children[1].release();
+  for (int i = 0; i < nInternals; ++i) {
+    internals[i]->children[0].release();
+    internals[i]->children[1].release();
+  }
+  int nextInternal = 0;
+  rebuildTreelet(root, nSubsets - 1, leaves, partition, internals, nextInternal);
+}
+
+static void restructureSubtree(BVHBuildNode* node, int depth, int stopDepth) {
+  if (node->nPrimitives > 0 || depth == stopDepth) {
+    return;
+  }
+  restructureSubtree(node->children[0].get(), depth + 1, stopDepth);
+  restructureSubtree(node->children[1].get(), depth + 1, stopDepth);
+  optimizeTreelet(node);
+}
+
+static void collectSubtrees(BVHBuildNode* node, int depth, int stopDepth,
+                            std::vector<BVHBuildNode*>& subtrees) {
+  if (node->nPrimitives > 0) {
+    return;
+  }
+  if (depth == stopDepth) {
+    subtrees.push_back(node);
+    return;
+  }
+  collectSubtrees(node->children[0].get(), depth + 1, stopDepth, subtrees);
+  collectSubtrees(node->children[1].get(), depth + 1, stopDepth, subtrees);
+}
+
+//Bottom-up: subtrees below stopDepth are restructured in parallel, then the nodes above them
+void bvh_node::restructureBVH(BVHBuildNode* root, RcppThread::ThreadPool* pool, size_t numbercores) {
+  int stopDepth = -1;
+  if (pool) {
+    stopDepth = 0;
+    while ((size_t(1) << stopDepth) < 4 * numbercores) {
+      stopDepth++;
+    }
+    std::vector<BVHBuildNode*> subtrees;
+    collectSubtrees(root, 0, stopDepth, subtrees);
+    pool->parallelFor(0, subtrees.size(), [&] (size_t i) {
+      restructureSubtree(subtrees[i], 0, -1);
+    });
+    pool->wait();
+  }
+  restructureSubtree(root, 0, stopDepth);
+}
+
+int bvh_node::flattenBVHTree(BVHBuildNode *node, int *offset) {
+  LinearBVHNode *linearNode = &nodes[*offset];
+  linearNode->bounds[0] = node->bounds.min();
+  linearNode->bounds[1] = node->bounds.max();
+  int myOffset = (*offset)++;
+  if (node->nPrimitives > 0) {
+    linearNode->primitivesOffset = node->firstPrimOffset;
+    linearNode->nPrimitives = node->nPrimitives;
+  } else {
+    // Create interior flattened BVH node
+    linearNode->axis = node->splitAxis;
+    linearNode->nPrimitives = 0;
+    flattenBVHTree(node->children[0].get(), offset);
+    linearNode->secondChildOffset = flattenBVHTree(node->children[1].get(), offset);
+  }
+  return(myOffset);
+}
+
+//Pulls grandchildren up into a node until it has W children, always opening the interior child
+//with the largest surface area (the one most likely to be hit). Returns the index of the new node.
+template<typename Node>
+int bvh_node::collapseBVHTree(BVHBuildNode *node, std::vector<Node>& wide_nodes) {
+  const int W = Node::width;
+  BVHBuildNode* children[W];
+  int nChildren = wide_node_children<W>(node, children);
+  int myIndex = wide_nodes.size();
+  wide_nodes.push_back(Node());
+  Node& wide = wide_nodes[myIndex];
+  wide.nChildren = nChildren;
+  init_wide_node(wide, node->bounds);
+  for(int i = 0; i < W; i++) {
+    if(i < nChildren) {
+      set_wide_child_bounds(wide, i, children[i]->bounds);
+    } else {
+      clear_wide_child(wide, i);
+    }
+    wide.offset[i] = 0;
+    wide.nPrimitives[i] = 0;
+  }
+  //Recursing may reallocate wide_nodes, so the reference above can't be used past this point
+  for(int i = 0; i < nChildren; i++) {
+    if(children[i]->nPrimitives > 0) {
+      wide_nodes[myIndex].offset[i] = children[i]->firstPrimOffset;
+      wide_nodes[myIndex].nPrimitives[i] = children[i]->nPrimitives;
+    } else {
+      int childIndex = collapseBVHTree(children[i], wide_nodes);
+      wide_nodes[myIndex].offset[i] = childIndex;
+    }
+  }
+  return(myIndex);
+}
+
+//Each child of an interior node gets half the weight, and the primitives in a leaf share it equally
+template<typename S>
+Float bvh_node::pdf_value_node(int index, const point3f& o, const vec3f& v, S& sampler, Float time) {
+  const LinearBVHNode& node = nodes[index];
+  if(node.nPrimitives > 0) {
+    Float pdf = 0;
+    for(int i = 0; i < node.nPrimitives; i++) {
+      pdf += pdf_value_reference(node.primitivesOffset + i, o, v, sampler, time);
+    }
+    return(pdf / node.nPrimitives);
+  }
+  return(0.5*pdf_value_node(index + 1, o, v, sampler, time) +
+         0.5*pdf_value_node(node.secondChildOffset, o, v, sampler, time));
+}
+
+template<typename S>
+vec3f bvh_node::random_node(int index, const point3f& o, S& sampler, Float time) {
+  const LinearBVHNode& node = nodes[index];
+  if(node.nPrimitives > 0) {
+    int i = std::min(static_cast<int>(bvh_rand(sampler) * node.nPrimitives), node.nPrimitives - 1);
+    return(random_reference(node.primitivesOffset + i, o, sampler, time));
+  }
+  return(bvh_rand(sampler) > 0.5 ? random_node(index + 1, o, sampler, time) :
+                                   random_node(node.secondChildOffset, o, sampler, time));
+}
+
+//Wide nodes weight each child equally, and leaves weight each of their primitives equally
+template<typename Node, typename S>
+Float bvh_node::pdf_value_wide(const std::vector<Node>& wide_nodes, int index,
+                               const point3f& o, const vec3f& v, S& sampler, Float time) {
+  const Node& node = wide_nodes[index];
+  Float pdf = 0;
+  for(int i = 0; i < node.nChildren; i++) {
+    if(node.nPrimitives[i] > 0) {
+      Float leaf_pdf = 0;
+      for(int j = 0; j < node.nPrimitives[i]; j++) {
+        leaf_pdf += pdf_value_reference(node.offset[i] + j, o, v, sampler, time);
+      }
+      pdf += leaf_pdf / node.nPrimitives[i];
+    } else {
+      pdf += pdf_value_wide(wide_nodes, node.offset[i], o, v, sampler, time);
     }
   }
+  return(pdf / node.nChildren);
+}
 
-  aabb box_left, box_right;
-  if(!left->bounding_box(time0,time1,box_left) || !right->bounding_box(time0,time1,box_right)) {
+template<typename Node, typename S>
+vec3f bvh_node::random_wide(const std::vector<Node>& wide_nodes, int index,
+                            const point3f& o, S& sampler, Float time) {
+  const Node& node = wide_nodes[index];
+  int i = std::min(static_cast<int>(bvh_rand(sampler) * node.nChildren), node.nChildren - 1);
+  if(node.nPrimitives[i] > 0) {
+    int j = std::min(static_cast<int>(bvh_rand(sampler) * node.nPrimitives[i]),
+                     node.nPrimitives[i] - 1);
+    return(random_reference(node.offset[i] + j, o, sampler, time));
   }
-  box = surrounding_box(box_left,box_right);
+  return(random_wide(wide_nodes, node.offset[i], o, sampler, time));
 }
-  
-  
+
 Float bvh_node::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
-  return(0.5*left->pdf_value(o,v, rng, time) + 0.5*right->pdf_value(o,v, rng, time));
+  switch(width) {
+    case 4:  return(pdf_value_wide(nodes4, 0, o, v, rng, time));
+    case 8:  return(compressed ? pdf_value_wide(nodes8q, 0, o, v, rng, time) : pdf_value_wide(nodes8, 0, o, v, rng, time));
+    default: return(pdf_value_node(0, o, v, rng, time));
+  }
 }
 
 Float bvh_node::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
-  return(0.5*left->pdf_value(o,v, sampler, time) + 0.5*right->pdf_value(o,v, sampler, time));
-  
+  switch(width) {
+    case 4:  return(pdf_value_wide(nodes4, 0, o, v, sampler, time));
+    case 8:  return(compressed ? pdf_value_wide(nodes8q, 0, o, v, sampler, time) : pdf_value_wide(nodes8, 0, o, v, sampler, time));
+    default: return(pdf_value_node(0, o, v, sampler, time));
+  }
 }
 
 vec3f bvh_node::random(const point3f& o, random_gen& rng, Float time) {
-  return(rng.unif_rand() > 0.5 ? left->random(o, rng, time) : right->random(o, rng, time));
+  switch(width) {
+    case 4:  return(random_wide(nodes4, 0, o, rng, time));
+    case 8:  return(compressed ? random_wide(nodes8q, 0, o, rng, time) : random_wide(nodes8, 0, o, rng, time));
+    default: return(random_node(0, o, rng, time));
+  }
 }
 
 vec3f bvh_node::random(const point3f& o, Sampler* sampler, Float time) {
-  return(sampler->Get1D() > 0.5 ? left->random(o, sampler, time) : right->random(o, sampler, time));
-  
+  switch(width) {
+    case 4:  return(random_wide(nodes4, 0, o, sampler, time));
+    case 8:  return(compressed ? random_wide(nodes8q, 0, o, sampler, time) : random_wide(nodes8, 0, o, sampler, time));
+    default: return(random_node(0, o, sampler, time));
+  }
 }
@@ -2,56 +2,367 @@
 #define BVHNODEH
 
 #include "hitable.h"
+#include "hitablelist.h"
 #include "aabb.h"
 #include <Rcpp.h>
+#include "RcppThread.h"
 #include "material.h"
+#include "triangle.h"
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+//Interior nodes deeper than this are split at the midpoint, which keeps the total depth
+//(and therefore the traversal stack) bounded by kMaxBVHDepth * 2
+static const int kMaxBVHDepth = 32;
+
+//Meshes with fewer primitives than this are always built on a single thread, and ranges are
+//split into chunks of kParallelChunkSize primitives for the parallel bounds and SAH passes
+static const size_t kMinParallelBuildSize = 1 << 16;
+static const size_t kParallelChunkSize = 1 << 14;
+
+//refit() rebuilds the tree instead when its SAH cost grows past this multiple of the cost
+//right after the last build
+static const Float kRefitRebuildRatio = 1.5;
+
+//Cost of one traversal step relative to one primitive intersection, used by the SAH to decide
+//between a leaf and a split. Primitive tests are virtual calls, so they cost about as much as
+//visiting a node.
+static const Float kBVHTraversalCost = 1;
+
+//SBVH (bvh_type 7): spatial splits are only tried where the children of the best object split
+//overlap by more than this fraction of the root surface area, and may add at most
+//(kSBVHMemoryBudget - 1) * N duplicate references in total
+static const Float kSBVHOverlapThreshold = 1e-5;
+static const Float kSBVHMemoryBudget = 1.3;
+
+//Motion BVH: when primitives move during the shutter interval, the tree is stored once more for
+//each of this many equal parts of the interval, with bounds refit to that part only
+static const int kMotionBVHSegments = 4;
+
+//Clustered node layout (bvh_layout = "clustered"): the top levels of a wide tree are stored first,
+//in breadth-first order, in a block of at most this many bytes that stays in cache
+static const size_t kBVHHotBlockBytes = 16 * 1024;
+static const size_t kCacheLineSize = 64;
+
+//While bvh_trace_recorder is set, BVH traversals on that thread count the rays, nodes and
+//primitive tests they make (bvh_stats = TRUE). In the benchmark mode (debug_channel = "cachelines")
+//they also record the cache lines each node spans.
+struct BVHTraceRecorder {
+  BVHTraceRecorder(bool record_lines = true) : rays(0), nodes(0), primitives(0), depth(0),
+    record_lines(record_lines) {}
+  void visit(const void* node, size_t size) {
+    if(record_lines) {
+      uintptr_t address = reinterpret_cast<uintptr_t>(node);
+      for(uintptr_t line = address / kCacheLineSize; line <= (address + size - 1) / kCacheLineSize; line++) {
+        lines.push_back(line);
+      }
+    }
+    nodes++;
+  }
+  //Rays are counted by the outermost BVH only. A nested BVH (e.g. a mesh) was counted as a
+  //primitive test by the leaf of the enclosing tree that reached it, so that test is removed.
+  void enter() {
+    if(depth++ == 0) {
+      rays++;
+    } else {
+      primitives--;
+    }
+  }
+  void leave() {
+    depth--;
+  }
+  size_t rays, nodes, primitives;
+  int depth;
+  bool record_lines;
+  std::vector<uintptr_t> lines;
+};
+extern thread_local BVHTraceRecorder* bvh_trace_recorder;
+
+//Traversal counters of a render, summed over the tasks each render thread ran
+class BVHTraversalCounters {
+  public:
+    void add(const BVHTraceRecorder& recorder);
+    std::vector<size_t> rays, nodes, primitives; //One entry per thread
+  private:
+    std::mutex lock;
+    std::map<std::thread::id, size_t> thread_index;
+};
+
+//Shape of the whole-interval tree of a BVH. Depths count the interior nodes above each leaf, so
+//wide trees are shallower than binary ones over the same primitives.
+struct BVHTreeStatistics {
+  BVHTreeStatistics() : leaves(0), max_depth(0), leaf_depth_sum(0) {}
+  size_t leaves;
+  int max_depth;
+  double leaf_depth_sum;
+  std::vector<size_t> leaf_sizes; //Number of leaves with each primitive count
+  void add_leaf(int depth, int size) {
+    leaves++;
+    max_depth = std::max(max_depth, depth);
+    leaf_depth_sum += depth;
+    if(leaf_sizes.size() <= static_cast<size_t>(size)) {
+      leaf_sizes.resize(size + 1, 0);
+    }
+    leaf_sizes[size]++;
+  }
+};
+
+//Bounds (and centroid) of each primitive, computed once before the build. primitiveNumber is the
+//position of the primitive in the range of the input list the BVH is built over.
+struct BVHPrimitiveInfo {
+  size_t primitiveNumber;
+  aabb bounds;
+};
+
+//Intermediate node used only during construction, before the tree is flattened
+struct BVHBuildNode {
+  BVHBuildNode() : splitAxis(0), firstPrimOffset(0), nPrimitives(0) {}
+  void InitLeaf(int first, int n, const aabb &b) {
+    firstPrimOffset = first;
+    nPrimitives = n;
+    bounds = b;
+  }
+  void InitInterior(int axis, BVHBuildNode *c0, BVHBuildNode *c1) {
+    children[0].reset(c0);
+    children[1].reset(c1);
+    bounds = surrounding_box(c0->bounds, c1->bounds);
+    splitAxis = axis;
+    nPrimitives = 0;
+  }
+  aabb bounds;
+  std::unique_ptr<BVHBuildNode> children[2];
+  int splitAxis, firstPrimOffset, nPrimitives;
+};
+
+//32 bytes (with single precision floats): the first child of an interior node directly
+//follows it in memory, so only the offset to the second child needs to be stored.
+struct LinearBVHNode {
+  inline bool hit(const ray& r, Float tmin, Float tmax) const {
+    Float txmin, txmax, tymin, tymax, tzmin, tzmax;
+    txmin = (bounds[  r.sign[0]].x()-r.A.x()) * r.inv_dir.x();
+    txmax = (bounds[1-r.sign[0]].x()-r.A.x()) * r.inv_dir_pad.x();
+    tymin = (bounds[  r.sign[1]].y()-r.A.y()) * r.inv_dir.y();
+    tymax = (bounds[1-r.sign[1]].y()-r.A.y()) * r.inv_dir_pad.y();
+    tzmin = (bounds[  r.sign[2]].z()-r.A.z()) * r.inv_dir.z();
+    tzmax = (bounds[1-r.sign[2]].z()-r.A.z()) * r.inv_dir_pad.z();
+    tmin = ffmax(tzmin, ffmax(tymin, ffmax(txmin, tmin)));
+    tmax = ffmin(tzmax, ffmin(tymax, ffmin(txmax, tmax)));
+    return(tmin <= tmax);
+  }
+  point3f bounds[2];
+  union {
+    int primitivesOffset;   // leaf
+    int secondChildOffset;  // interior
+  };
+  uint16_t nPrimitives;  // 0 -> interior node
+  uint8_t axis;          // interior node: xyz
+  uint8_t pad[1];        // ensure 32 byte total size
+};
+
+//Collapsed node with up to W children. Child bounds are stored as bounds[min/max][axis][child]
+//so the slab test for all children can be done at once with SIMD instructions.
+template<int W>
+struct WideBVHNode {
+  static const int width = W;
+  Float bounds[2][3][W];
+  int offset[W];            // interior child: node index, leaf child: first primitive
+  uint16_t nPrimitives[W];  // 0 -> interior child
+  uint8_t nChildren;
+};
+
+//Compressed wide node (bvh_type 8): child bounds are stored as 8-bit offsets from the node's
+//own bounds, in steps of scale[axis] from origin[axis]. Mins are rounded down and maxes up, so
+//the decoded boxes always contain the exact ones. 124 bytes for W = 8, vs 244 for WideBVHNode<8>.
+template<int W>
+struct QuantizedBVHNode {
+  static const int width = W;
+  Float origin[3];
+  Float scale[3];           // power of two, so decoding a bound is exact up to the final add
+  int offset[W];
+  uint16_t nPrimitives[W];
+  uint8_t qbounds[2][3][W];
+  uint8_t nChildren;
+};
 
 class bvh_node : public hitable {
   public:
-    bvh_node() {}
-#ifndef DEBUGBBOX 
-    bvh_node(hitable_list& l,  
-             Float time0, Float time1, int bvh_type, random_gen &rng) :
-      bvh_node(l.objects, 0 ,l.objects.size(), time0, time1, bvh_type, rng) {};
-    bvh_node(std::vector<std::shared_ptr<hitable> >& l, 
-             size_t start, size_t end, 
-             Float time0, Float time1, int bvh_type, random_gen &rng);
-#endif
-#ifdef DEBUGBBOX
-    bvh_node(hitable_list& l,  
-             Float time0, Float time1, int bvh_type, random_gen &rng) :
-      bvh_node(l.objects, 0 ,l.objects.size(), time0, time1, bvh_type, 0, rng) {};
-    bvh_node(std::vector<std::shared_ptr<hitable> >& l, 
-             size_t start, size_t end, 
-             Float time0, Float time1, int bvh_type, random_gen &rng);
+    bvh_node() : unique_primitives(0), width(2), compressed(false), max_prims_in_leaf(1),
+                 motion_segments(0), motion_time0(0), motion_time1(0), reordered(false) {}
     bvh_node(hitable_list& l,
-             Float time0, Float time1, int bvh_type, int depth, random_gen &rng) :
-      bvh_node(l.objects, 0 ,l.objects.size(), time0, time1, bvh_type, depth, rng) {};
+             Float time0, Float time1, int bvh_type, int max_leaf_size, size_t numbercores, random_gen &rng) :
+      bvh_node(l.objects, 0 ,l.objects.size(), time0, time1, bvh_type, max_leaf_size, numbercores, rng) {};
     bvh_node(std::vector<std::shared_ptr<hitable> >& l,
              size_t start, size_t end,
-             Float time0, Float time1, int bvh_type, int depth, random_gen &rng);
-#endif
+             Float time0, Float time1, int bvh_type, int max_leaf_size, size_t numbercores, random_gen &rng);
+    //BVH over the faces of an indexed mesh: leaves store face numbers instead of primitives
+    bvh_node(std::shared_ptr<TriangleMesh> mesh,
+             int bvh_type, int max_leaf_size, size_t numbercores, random_gen &rng);
 
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+    virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+    virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+    virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng);
+    virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler);
+    //Only called for mesh faces: other hits are finished by the primitive that found them
+    virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng);
+    virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler);
 
     virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
-    
+
+    //Updates the node bounds bottom-up for primitives that have moved (e.g. animated transforms
+    //over a new shutter interval), keeping the topology. Returns true if the tree was rebuilt.
+    bool refit(Float time0, Float time1, size_t numbercores);
+    //Post-build pass that moves wide nodes into the clustered layout. Binary trees are left
+    //as they are, since their first child is always the next node.
+    void reorder();
+    Float sah_cost() const;
+    BVHTreeStatistics tree_statistics() const;
+    size_t node_count() const;
+    size_t reference_count() const;
+    size_t reference_bytes() const;
+    //Memory used by the nodes, and what the same tree would use with uncompressed nodes
+    size_t node_bytes() const;
+    size_t uncompressed_node_bytes() const;
+
     Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
     Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
     vec3f random(const point3f& o, random_gen& rng, Float time = 0);
     vec3f random(const point3f& o, Sampler* sampler, Float time = 0);
-    
+
     std::string GetName() const {
       return(std::string("BVH Node"));
     }
-    std::shared_ptr<hitable> left;
-    std::shared_ptr<hitable> right;
+    std::vector<LinearBVHNode> nodes;
+    std::vector<WideBVHNode<4> > nodes4;
+    std::vector<WideBVHNode<8> > nodes8;
+    std::vector<QuantizedBVHNode<8> > nodes8q;
+    std::vector<std::shared_ptr<hitable> > primitives; //Spatial splits can reference a primitive twice
+    //Mesh BVHs reference faces of `mesh` instead, and leave `primitives` empty. Their leaves start
+    //on a multiple of kTriangleBlockWidth (padded with kNoMeshIndex), so the faces of the leaf at
+    //offset i are also stored in blocks[i / kTriangleBlockWidth] onwards.
+    std::shared_ptr<TriangleMesh> mesh;
+    std::vector<uint32_t> faces;
+    std::vector<TriangleBlock> blocks;
+    //Fills `blocks` from `faces` (also used when the BVH is loaded from the cache)
+    void build_triangle_blocks();
+    size_t unique_primitives;
     aabb box;
-    bool sah;
-#ifdef DEBUGBBOX
-    int depth;
-#endif
+    int width;
+    bool compressed;
+    int build_type;
+    int max_prims_in_leaf;
+    Float build_cost;
+    //Number of per-segment copies of the tree that follow the whole-interval one in the node
+    //array (0 if nothing moves), and the interval they split
+    int motion_segments;
+    Float motion_time0, motion_time1;
+    bool reordered;
+
+  private:
+    //Subtree deferred to the thread pool: built into the placeholder node `node`
+    struct BuildTask {
+      BVHBuildNode* node;
+      size_t start, end;
+      int bvh_type, depth;
+      int bitIndex; //LBVH only: next Morton bit to split on
+    };
+    //SBVH only: references are appended to `ordered` as leaves are created
+    struct SBVHState {
+      SBVHState() : mesh(nullptr) {}
+      std::vector<const triangle*> triangles; //nullptr for primitives clipped by their bounds
+      const TriangleMesh* mesh;               //Set instead of `triangles` for mesh BVHs
+      std::vector<BVHPrimitiveInfo> ordered;
+      size_t budget;  //Duplicate references that can still be created
+      Float root_area;
+      //Vertices of primitive i (stored in v), or nullptr if it's clipped by its bounds
+      const vec3f* vertices(size_t i, vec3f* v) const;
+    };
+    //Index of the first node of the tree to traverse for a ray at `time`
+    size_t motion_tree(Float time, size_t size) const {
+      if(motion_segments == 0) {
+        return(0);
+      }
+      int segment = static_cast<int>((time - motion_time0) / (motion_time1 - motion_time0) * motion_segments);
+      segment = std::min(std::max(segment, 0), motion_segments - 1);
+      return(size / (motion_segments + 1) * (segment + 1));
+    }
+    size_t tree_size(size_t size) const {
+      return(size / (motion_segments + 1));
+    }
+    //Builds the tree over n primitives, where bounds(i, box) sets the bounds of primitive i, and
+    //returns the primitive number of each reference in leaf order
+    std::vector<BVHPrimitiveInfo> build(size_t n, const std::function<void(size_t, aabb&)>& bounds,
+                                        SBVHState& state, int bvh_type, int max_leaf_size, size_t numbercores,
+                                        RcppThread::ThreadPool* pool);
+    //Passes over the primitives run on `pool` if it isn't nullptr
+    void reference_bounds(Float time0, Float time1, RcppThread::ThreadPool* pool, aabb* refBounds) const;
+    void pad_leaves();
+    void build_motion_trees(Float time0, Float time1, RcppThread::ThreadPool* pool);
+    void drop_motion_trees();
+    size_t task_size;      //Subtrees with fewer primitives than this are built as pool tasks
+    std::vector<uint32_t> morton_codes; //LBVH only: sorted codes, freed after the build
+    BVHBuildNode* recursiveBuild(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                                 size_t start, size_t end, int bvh_type,
+                                 int depth, std::atomic<int>& totalNodes,
+                                 RcppThread::ThreadPool* pool, std::vector<BuildTask>* tasks);
+    BVHBuildNode* buildChild(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                             size_t start, size_t end, int bvh_type,
+                             int depth, std::atomic<int>& totalNodes,
+                             RcppThread::ThreadPool* pool, std::vector<BuildTask>* tasks);
+    BVHBuildNode* buildLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                            std::atomic<int>& totalNodes,
+                            RcppThread::ThreadPool* pool, std::vector<BuildTask>* tasks);
+    BVHBuildNode* emitLBVH(std::vector<BVHPrimitiveInfo>& primitiveInfo,
+                           size_t start, size_t end, int bitIndex, int depth,
+                           std::atomic<int>& totalNodes, std::vector<BuildTask>* tasks);
+    BVHBuildNode* buildSBVH(std::vector<BVHPrimitiveInfo>& refs, int depth,
+                            std::atomic<int>& totalNodes, SBVHState& state);
+    void restructureBVH(BVHBuildNode* root, RcppThread::ThreadPool* pool, size_t numbercores);
+    int flattenBVHTree(BVHBuildNode *node, int *offset);
+    template<typename Node>
+    int collapseBVHTree(BVHBuildNode *node, std::vector<Node>& wide_nodes);
+    template<typename S>
+    bool occluded_reference(int i, const ray& r, Float t_min, Float t_max, S& sampler);
+    template<typename S>
+    Float pdf_value_reference(int i, const point3f& o, const vec3f& v, S& sampler, Float time);
+    template<typename S>
+    vec3f random_reference(int i, const point3f& o, S& sampler, Float time);
+    bool hit_mesh_leaf(int offset, int n, const WatertightRay& wray, SurfaceHit& hit,
+                       Float t_min, Float t_max);
+    template<bool Record, typename S>
+    bool hit_tree(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler);
+    template<bool Record, typename S>
+    bool hit_nodes(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler, const WatertightRay* wray);
+    template<bool Record, typename S>
+    bool hit_binary(const LinearBVHNode* tree,
+                    const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler, const WatertightRay* wray);
+    template<bool Record, typename Node, typename S>
+    bool hit_wide(const Node* wide_nodes,
+                  const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler, const WatertightRay* wray);
+    template<bool Record, typename S>
+    bool occluded_tree(const ray& r, Float t_min, Float t_max, S& sampler);
+    template<bool Record, typename S>
+    bool occluded_nodes(const ray& r, Float t_min, Float t_max, S& sampler, const WatertightRay* wray);
+    template<bool Record, typename S>
+    bool occluded_binary(const LinearBVHNode* tree, const ray& r, Float t_min, Float t_max, S& sampler,
+                         const WatertightRay* wray);
+    template<bool Record, typename Node, typename S>
+    bool occluded_wide(const Node* wide_nodes,
+                       const ray& r, Float t_min, Float t_max, S& sampler, const WatertightRay* wray);
+    template<typename S>
+    Float pdf_value_node(int index, const point3f& o, const vec3f& v, S& sampler, Float time);
+    template<typename S>
+    vec3f random_node(int index, const point3f& o, S& sampler, Float time);
+    template<typename Node, typename S>
+    Float pdf_value_wide(const std::vector<Node>& wide_nodes, int index,
+                         const point3f& o, const vec3f& v, S& sampler, Float time);
+    template<typename Node, typename S>
+    vec3f random_wide(const std::vector<Node>& wide_nodes, int index,
+                      const point3f& o, S& sampler, Float time);
 };
 
 #endif
@@ -0,0 +1,333 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "bvhcache.h"
+#include "mappedfile.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+//Fixed size header at the start of each cache file. The node sizes are stored so files written
+//by a build with a different node layout (or Float type) are rejected.
+struct BVHCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t float_size;
+  uint32_t node_sizes[4];   // LinearBVHNode, WideBVHNode<4>, WideBVHNode<8>, QuantizedBVHNode<8>
+  uint64_t key;
+  uint64_t vertex_count, normal_count, face_count;
+  uint64_t normal_index_count;  //0 or 3 per face
+  uint64_t reference_count;
+  uint64_t unique_primitives;
+  uint64_t node_counts[4];
+  int32_t width, compressed, build_type, max_prims_in_leaf;
+  Float box[6];
+  Float build_cost;
+};
+
+static const char kBVHCacheMagic[8] = {'R','A','Y','B','V','H','\0','\0'};
+
+//The header is followed by these sections, each starting on a 16 byte boundary so they can be
+//read in place from the mapped file
+enum BVHCacheSection {
+  kVertices, kNormals, kVertexIndices, kNormalIndices, kReferences,
+  kNodes, kNodes4, kNodes8, kNodes8q, kSectionCount
+};
+
+static void section_offsets(const BVHCacheHeader& header, size_t* offsets) {
+  size_t sizes[kSectionCount] = {
+    header.vertex_count * sizeof(point3f),
+    header.normal_count * sizeof(normal3f),
+    header.face_count * 3 * sizeof(uint32_t),
+    header.normal_index_count * sizeof(uint32_t),
+    header.reference_count * sizeof(uint32_t),
+    header.node_counts[0] * sizeof(LinearBVHNode),
+    header.node_counts[1] * sizeof(WideBVHNode<4>),
+    header.node_counts[2] * sizeof(WideBVHNode<8>),
+    header.node_counts[3] * sizeof(QuantizedBVHNode<8>)
+  };
+  size_t offset = sizeof(BVHCacheHeader);
+  for(int i = 0; i < kSectionCount; i++) {
+    offset = (offset + 15) & ~static_cast<size_t>(15);
+    offsets[i] = offset;
+    offset += sizes[i];
+  }
+  offsets[kSectionCount] = offset;
+}
+
+static const uint64_t kFNVOffset = 14695981039346656037ull;
+static const uint64_t kFNVPrime = 1099511628211ull;
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+  const unsigned char* ptr = static_cast<const unsigned char*>(data);
+  for(size_t i = 0; i < size; i++) {
+    hash ^= ptr[i];
+    hash *= kFNVPrime;
+  }
+  return(hash);
+}
+
+uint64_t bvh_cache_key(const std::string& inputfile, const std::string& format,
+                       const Transform& ObjectToWorld, Float scale,
+                       int bvh_type, int max_leaf_size, uint64_t variant) {
+  MappedFile file(inputfile);
+  if(!file.data()) {
+    return(0);
+  }
+  uint64_t contents = file.hash();
+  uint64_t file_size = file.size();
+  uint64_t hash = kFNVOffset;
+  hash = hash_bytes(hash, &kBVHCacheVersion, sizeof(kBVHCacheVersion));
+  hash = hash_bytes(hash, format.c_str(), format.size());
+  hash = hash_bytes(hash, &contents, sizeof(contents));
+  hash = hash_bytes(hash, &file_size, sizeof(file_size));
+  hash = hash_bytes(hash, &ObjectToWorld.GetMatrix().m, sizeof(ObjectToWorld.GetMatrix().m));
+  hash = hash_bytes(hash, &scale, sizeof(scale));
+  hash = hash_bytes(hash, &bvh_type, sizeof(bvh_type));
+  hash = hash_bytes(hash, &max_leaf_size, sizeof(max_leaf_size));
+  hash = hash_bytes(hash, &variant, sizeof(variant));
+  return(hash == 0 ? 1 : hash);
+}
+
+std::string bvh_cache_path(const std::string& cache_dir, uint64_t key) {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(key));
+  return(cache_dir + "/" + name);
+}
+
+static bool valid_leaf(int offset, int count, uint64_t references) {
+  return(offset >= 0 && offset % kTriangleBlockWidth == 0 && static_cast<uint64_t>(offset) + count <= references);
+}
+
+//Children are always stored after their parent, which also rules out cycles
+static bool valid_child(int child, size_t parent, size_t count, std::vector<int>& depth) {
+  if(child < 0 || static_cast<size_t>(child) <= parent || static_cast<size_t>(child) >= count) {
+    return(false);
+  }
+  depth[child] = std::max(depth[child], depth[parent] + 1);
+  return(depth[child] < 2 * kMaxBVHDepth);
+}
+
+//Checks every child offset and leaf range against the array sizes, and that the tree fits in
+//the traversal stack, so a corrupted file is rebuilt instead of being traversed
+static bool valid_nodes(const LinearBVHNode* nodes, size_t count, uint64_t references) {
+  std::vector<int> depth(count, 0);
+  for(size_t i = 0; i < count; i++) {
+    const LinearBVHNode& node = nodes[i];
+    if(node.nPrimitives > 0) {
+      if(!valid_leaf(node.primitivesOffset, node.nPrimitives, references)) {
+        return(false);
+      }
+    } else if(!valid_child(i + 1, i, count, depth) ||
+              !valid_child(node.secondChildOffset, i, count, depth)) {
+      return(false);
+    }
+  }
+  return(count > 0);
+}
+
+template<typename Node>
+static bool valid_nodes(const Node* nodes, size_t count, uint64_t references) {
+  std::vector<int> depth(count, 0);
+  for(size_t i = 0; i < count; i++) {
+    const Node& node = nodes[i];
+    if(node.nChildren == 0 || node.nChildren > Node::width) {
+      return(false);
+    }
+    for(int c = 0; c < node.nChildren; c++) {
+      bool valid = node.nPrimitives[c] > 0 ? valid_leaf(node.offset[c], node.nPrimitives[c], references) :
+                                             valid_child(node.offset[c], i, count, depth);
+      if(!valid) {
+        return(false);
+      }
+    }
+  }
+  return(count > 0);
+}
+
+bool load_bvh_cache(const std::string& path, uint64_t key, std::shared_ptr<material> mat,
+                    std::shared_ptr<TriangleMesh>& mesh, std::shared_ptr<bvh_node>& bvh) {
+  std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>(path);
+  const MappedFile& file = *mapped;
+  if(!file.data() || file.size() < sizeof(BVHCacheHeader)) {
+    return(false);
+  }
+  BVHCacheHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  uint32_t node_sizes[4] = {sizeof(LinearBVHNode), sizeof(WideBVHNode<4>),
+                            sizeof(WideBVHNode<8>), sizeof(QuantizedBVHNode<8>)};
+  if(std::memcmp(header.magic, kBVHCacheMagic, sizeof(kBVHCacheMagic)) != 0 ||
+     header.version != kBVHCacheVersion || header.float_size != sizeof(Float) ||
+     std::memcmp(header.node_sizes, node_sizes, sizeof(node_sizes)) != 0 ||
+     header.key != key || header.face_count == 0 ||
+     (header.normal_index_count != 0 && header.normal_index_count != 3 * header.face_count)) {
+    return(false);
+  }
+  //Every element takes at least a byte, so larger counts can't fit (and would overflow the offsets)
+  uint64_t counts[8] = {header.vertex_count, header.normal_count, header.face_count, header.reference_count,
+                        header.node_counts[0], header.node_counts[1], header.node_counts[2], header.node_counts[3]};
+  for(int i = 0; i < 8; i++) {
+    if(counts[i] > file.size()) {
+      return(false);
+    }
+  }
+  size_t offsets[kSectionCount + 1];
+  section_offsets(header, offsets);
+  if(file.size() < offsets[kSectionCount]) {
+    return(false);
+  }
+  const point3f* vertices = reinterpret_cast<const point3f*>(file.data() + offsets[kVertices]);
+  const normal3f* normals = reinterpret_cast<const normal3f*>(file.data() + offsets[kNormals]);
+  const uint32_t* vertex_indices = reinterpret_cast<const uint32_t*>(file.data() + offsets[kVertexIndices]);
+  const uint32_t* normal_indices = reinterpret_cast<const uint32_t*>(file.data() + offsets[kNormalIndices]);
+  const uint32_t* references = reinterpret_cast<const uint32_t*>(file.data() + offsets[kReferences]);
+  for(size_t i = 0; i < 3 * header.face_count; i++) {
+    if(vertex_indices[i] >= header.vertex_count ||
+       (header.normal_index_count == 0 && header.normal_count != 0 && vertex_indices[i] >= header.normal_count)) {
+      return(false);
+    }
+  }
+  for(size_t i = 0; i < header.normal_index_count; i++) {
+    if(normal_indices[i] != kNoMeshIndex && normal_indices[i] >= header.normal_count) {
+      return(false);
+    }
+  }
+  if(header.reference_count % kTriangleBlockWidth != 0) {
+    return(false);
+  }
+  for(size_t i = 0; i < header.reference_count; i++) {
+    if(references[i] != kNoMeshIndex && references[i] >= header.face_count) {
+      return(false);
+    }
+  }
+  const LinearBVHNode* nodes = reinterpret_cast<const LinearBVHNode*>(file.data() + offsets[kNodes]);
+  const WideBVHNode<4>* nodes4 = reinterpret_cast<const WideBVHNode<4>*>(file.data() + offsets[kNodes4]);
+  const WideBVHNode<8>* nodes8 = reinterpret_cast<const WideBVHNode<8>*>(file.data() + offsets[kNodes8]);
+  const QuantizedBVHNode<8>* nodes8q = reinterpret_cast<const QuantizedBVHNode<8>*>(file.data() + offsets[kNodes8q]);
+  bool valid_tree;
+  if(header.width == 2) {
+    valid_tree = valid_nodes(nodes, header.node_counts[0], header.reference_count);
+  } else if (header.width == 4) {
+    valid_tree = valid_nodes(nodes4, header.node_counts[1], header.reference_count);
+  } else if (header.width == 8) {
+    valid_tree = header.compressed ? valid_nodes(nodes8q, header.node_counts[3], header.reference_count) :
+                                     valid_nodes(nodes8, header.node_counts[2], header.reference_count);
+  } else {
+    valid_tree = false;
+  }
+  if(!valid_tree) {
+    return(false);
+  }
+
+  //The mesh buffers are used in place, keeping the file mapped for as long as the mesh exists
+  std::shared_ptr<TriangleMesh> cached_mesh = std::make_shared<TriangleMesh>();
+  cached_mesh->p.set_view(vertices, header.vertex_count, mapped);
+  cached_mesh->n.set_view(normals, header.normal_count, mapped);
+  cached_mesh->vertexIndices.set_view(vertex_indices, 3 * header.face_count, mapped);
+  cached_mesh->normalIndices.set_view(normal_indices, header.normal_index_count, mapped);
+  cached_mesh->add_material(mat, nullptr, nullptr);
+
+  std::shared_ptr<bvh_node> cached = std::make_shared<bvh_node>();
+  cached->mesh = cached_mesh;
+  cached->faces.assign(references, references + header.reference_count);
+  cached->nodes.assign(nodes, nodes + header.node_counts[0]);
+  cached->nodes4.assign(nodes4, nodes4 + header.node_counts[1]);
+  cached->nodes8.assign(nodes8, nodes8 + header.node_counts[2]);
+  cached->nodes8q.assign(nodes8q, nodes8q + header.node_counts[3]);
+  cached->unique_primitives = header.unique_primitives;
+  cached->box = aabb(point3f(header.box[0], header.box[1], header.box[2]),
+                     point3f(header.box[3], header.box[4], header.box[5]));
+  cached->width = header.width;
+  cached->compressed = header.compressed != 0;
+  cached->build_type = header.build_type;
+  cached->max_prims_in_leaf = header.max_prims_in_leaf;
+  cached->build_cost = header.build_cost;
+  cached->build_triangle_blocks();
+
+  mesh = cached_mesh;
+  bvh = cached;
+  return(true);
+}
+
+static unsigned long process_id() {
+#ifdef _WIN32
+  return(GetCurrentProcessId());
+#else
+  return(getpid());
+#endif
+}
+
+static void write_section(std::ofstream& out, const void* data, size_t size) {
+  while(out.tellp() % 16 != 0) {
+    out.put(0);
+  }
+  if(size > 0) {
+    out.write(static_cast<const char*>(data), size);
+  }
+}
+
+void save_bvh_cache(const std::string& path, uint64_t key, const TriangleMesh& mesh, const bvh_node& bvh) {
+  BVHCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kBVHCacheMagic, sizeof(kBVHCacheMagic));
+  header.version = kBVHCacheVersion;
+  header.float_size = sizeof(Float);
+  header.node_sizes[0] = sizeof(LinearBVHNode);
+  header.node_sizes[1] = sizeof(WideBVHNode<4>);
+  header.node_sizes[2] = sizeof(WideBVHNode<8>);
+  header.node_sizes[3] = sizeof(QuantizedBVHNode<8>);
+  header.key = key;
+  header.vertex_count = mesh.p.size();
+  header.normal_count = mesh.n.size();
+  header.face_count = mesh.size();
+  header.normal_index_count = mesh.normalIndices.size();
+  header.reference_count = bvh.faces.size();
+  header.unique_primitives = bvh.unique_primitives;
+  header.node_counts[0] = bvh.nodes.size();
+  header.node_counts[1] = bvh.nodes4.size();
+  header.node_counts[2] = bvh.nodes8.size();
+  header.node_counts[3] = bvh.nodes8q.size();
+  header.width = bvh.width;
+  header.compressed = bvh.compressed;
+  header.build_type = bvh.build_type;
+  header.max_prims_in_leaf = bvh.max_prims_in_leaf;
+  for(int a = 0; a < 3; a++) {
+    header.box[a] = bvh.box.min().e[a];
+    header.box[a+3] = bvh.box.max().e[a];
+  }
+  header.build_cost = bvh.build_cost;
+
+  //Written under a temporary name and then renamed, so a concurrent render never maps a
+  //partially written file
+  std::string temp_path = path + "." + std::to_string(process_id()) + ".tmp";
+  std::ofstream out(temp_path.c_str(), std::ios::binary | std::ios::trunc);
+  if(!out) {
+    throw std::runtime_error("Could not write BVH cache file " + temp_path);
+  }
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  write_section(out, mesh.p.data(), mesh.p.size() * sizeof(point3f));
+  write_section(out, mesh.n.data(), mesh.n.size() * sizeof(normal3f));
+  write_section(out, mesh.vertexIndices.data(), mesh.vertexIndices.size() * sizeof(uint32_t));
+  write_section(out, mesh.normalIndices.data(), mesh.normalIndices.size() * sizeof(uint32_t));
+  write_section(out, bvh.faces.data(), bvh.faces.size() * sizeof(uint32_t));
+  write_section(out, bvh.nodes.data(), bvh.nodes.size() * sizeof(LinearBVHNode));
+  write_section(out, bvh.nodes4.data(), bvh.nodes4.size() * sizeof(WideBVHNode<4>));
+  write_section(out, bvh.nodes8.data(), bvh.nodes8.size() * sizeof(WideBVHNode<8>));
+  write_section(out, bvh.nodes8q.data(), bvh.nodes8q.size() * sizeof(QuantizedBVHNode<8>));
+  out.close();
+  if(!out) {
+    std::remove(temp_path.c_str());
+    throw std::runtime_error("Could not write BVH cache file " + temp_path);
+  }
+#ifdef _WIN32
+  std::remove(path.c_str());
+#endif
+  if(std::rename(temp_path.c_str(), path.c_str()) != 0) {
+    std::remove(temp_path.c_str());
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef BVHCACHEH
+#define BVHCACHEH
+
+#include "bvh_node.h"
+#include "triangle.h"
+#include "transform.h"
+#include <string>
+
+//Bump whenever the cache layout, the mesh loaders or the BVH builders change, so stale cache
+//files are rebuilt instead of loaded
+static const uint32_t kBVHCacheVersion = 3;
+
+//Key of the cache file for a mesh: a hash of the file contents, the loader (`format`), the
+//transform and every setting the BVH build depends on, plus `variant` for anything else that
+//changes the mesh (e.g. the level of detail picked for it). Returns 0 if the file can't be read.
+uint64_t bvh_cache_key(const std::string& inputfile, const std::string& format,
+                       const Transform& ObjectToWorld, Float scale,
+                       int bvh_type, int max_leaf_size, uint64_t variant = 0);
+
+std::string bvh_cache_path(const std::string& cache_dir, uint64_t key);
+
+//Recreates a single-material mesh (with material `mat`) and its BVH from a cache file. Returns
+//false, leaving both untouched, if there's no valid cache file for this key.
+bool load_bvh_cache(const std::string& path, uint64_t key, std::shared_ptr<material> mat,
+                    std::shared_ptr<TriangleMesh>& mesh, std::shared_ptr<bvh_node>& bvh);
+
+//Stores the world space mesh buffers (the key includes the transform) and the BVH over them
+void save_bvh_cache(const std::string& path, uint64_t key, const TriangleMesh& mesh, const bvh_node& bvh);
+
+#endif
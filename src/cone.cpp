@@ -411,8 +411,7 @@ bool cone::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler*
 }
 
 Float cone::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
-  hit_record rec;
-  if(this->hit(ray(o,v), 0.001, FLT_MAX, rec, rng)) {
+  if(this->occluded(ray(o,v), 0.001, FLT_MAX, rng)) {
     point3f o2 = (*WorldToObject)(o);
     
     Float maxval = ffmax(radius, 0.5f*height);
@@ -426,8 +425,7 @@ Float cone::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float t
 
 
 Float cone::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
-  hit_record rec;
-  if(this->hit(ray(o,v), 0.001, FLT_MAX, rec, sampler)) {
+  if(this->occluded(ray(o,v), 0.001, FLT_MAX, sampler)) {
     point3f o2 = (*WorldToObject)(o);
     Float maxval = ffmax(radius, 0.5f*height);
     Float cos_theta_max = sqrt(1 - maxval * maxval/o2.squared_length());
@@ -8,7 +8,26 @@ void cylinder::get_cylinder_uv(const point3f& p, Float& u, Float& v) {
 };
 
 bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
-  ray r2 = (*WorldToObject)(r);
+  return(deferred_hit(this, r, t_min, t_max, rec, rng));
+}
+
+bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  return(deferred_hit(this, r, t_min, t_max, rec, sampler));
+}
+
+//Surfaces of the cylinder, in the order they're tested
+enum CylinderPart {
+  kCylinderNearSide = 0,
+  kCylinderTopCap = 1,
+  kCylinderBottomCap = 2,
+  kCylinderFarSide = 3
+};
+
+template<typename S>
+static bool cylinder_intersect(cylinder& cyl, const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler) {
+  ray r2 = (*cyl.WorldToObject)(r);
+  Float radius = cyl.radius;
+  Float length = cyl.length;
   
   vec3f oc = r2.origin() - point3f(0.0);
   vec3f dir = r2.direction();
@@ -24,19 +43,19 @@ bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, rand
   bool is_hit = true;
   bool second_is_hit = true;
   bool alpha_miss = false;
-  if(alpha_mask) {
+  if(cyl.alpha_mask) {
     point3f temppoint = r2.point_at_parameter(temp1);
     Float phi = atan2(temppoint.z(),temppoint.x());
     phi = phi < 0 ? phi + 2 * M_PI : phi;
     Float u;
     Float v;
     if(temp1 < t_max && temp1 > t_min && 
-       temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
+       temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= cyl.phi_max && phi >= cyl.phi_min) {
       Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
       temppoint.e[0] *= radius / hitRad;
       temppoint.e[2] *= radius / hitRad;
-      get_cylinder_uv(temppoint, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < rng.unif_rand()) {
+      cyl.get_cylinder_uv(temppoint, u, v);
+      if(cyl.alpha_mask->value(u, v, temppoint).x() < sample_1d(sampler)) {
         is_hit = false;
       }
     }
@@ -44,12 +63,12 @@ bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, rand
     phi = atan2(temppoint.z(),temppoint.x());
     phi = phi < 0 ? phi + 2 * M_PI : phi;
     if(temp2 < t_max && temp2 > t_min && 
-       temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
+       temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= cyl.phi_max && phi >= cyl.phi_min) {
       Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
       temppoint.e[0] *= radius / hitRad;
       temppoint.e[2] *= radius / hitRad;
-      get_cylinder_uv(temppoint, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < rng.unif_rand()) {
+      cyl.get_cylinder_uv(temppoint, u, v);
+      if(cyl.alpha_mask->value(u, v, temppoint).x() < sample_1d(sampler)) {
         if(!is_hit) {
           alpha_miss = true;
         }
@@ -61,41 +80,11 @@ bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, rand
   Float phi = atan2(temppoint.z(),temppoint.x());
   phi = phi < 0 ? phi + 2 * M_PI : phi;
   if(is_hit && temp1 < t_max && temp1 > t_min && 
-     temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
-    Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
-    temppoint.e[0] *= radius / hitRad;
-    temppoint.e[2] *= radius / hitRad;
-    rec.t = temp1;
-    rec.p = temppoint;
-    
-    temppoint.e[1] = 0;
-    rec.normal = dot(temppoint, dir) > 0 ? vec3f(-temppoint) / radius : vec3f(temppoint) / radius;
-    
-    get_cylinder_uv(rec.p, rec.u, rec.v);
-    
-    //Interaction information
-    rec.dpdu = vec3f(-temppoint.z(),0,  temppoint.x());
-    rec.dpdv = vec3f(0, length, 0);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u, rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-      rec.bump_normal *= dot(temppoint, dir) > 0 ? -1 : 1;
-
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    
-    rec.shape = this;
-    rec.alpha_miss = alpha_miss;
-      
-    rec.mat_ptr = mat_ptr.get();
+     temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= cyl.phi_max && phi >= cyl.phi_min) {
+    hit.t = temp1;
+    hit.index = kCylinderNearSide;
+    hit.alpha_miss = alpha_miss;
+    hit.shape = &cyl;
     return(true);
   }
   Float t_cyl = -(r2.origin().y()-length/2) / r2.direction().y();
@@ -106,43 +95,12 @@ bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, rand
   Float phi2 = atan2(z,x);
   phi2 = phi2 < 0 ? phi2 + 2 * M_PI : phi2;
   Float radHit2 = x*x + z*z;
-  if(has_caps && t_cyl < temp2 && t_cyl > t_min && t_cyl < t_max && t_cyl < t_cyl2 && 
-     radHit2 <= radius * radius && phi2 <= phi_max && phi2 >= phi_min) {
-    point3f p = r2.point_at_parameter(t_cyl);
-    p.e[1] = length/2;
-    
-    Float u = p.x() / (2.0 * radius) + 0.5;
-    Float v = p.z() / (2.0 * radius) + 0.5;
-    u = 1 - u;
-    if(alpha_mask) {
-      if(alpha_mask->value(u, v, rec.p).x() < 1) {
-        alpha_miss = true;
-      }
-    }
-    rec.p = p;
-    rec.normal = vec3f(0,1,0);
-    rec.t = t_cyl;
-    rec.mat_ptr = mat_ptr.get();
-    rec.u = u;
-    rec.v = v;
-    rec.dpdu = vec3f(1, 0, 0);
-    rec.dpdv = vec3f(0, 0, 1);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv);
-      rec.bump_normal.make_unit_vector(); 
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    rec.alpha_miss = alpha_miss;
-    
-    rec.shape = this;
+  if(cyl.has_caps && t_cyl < temp2 && t_cyl > t_min && t_cyl < t_max && t_cyl < t_cyl2 && 
+     radHit2 <= radius * radius && phi2 <= cyl.phi_max && phi2 >= cyl.phi_min) {
+    hit.t = t_cyl;
+    hit.index = kCylinderTopCap;
+    hit.alpha_miss = alpha_miss;
+    hit.shape = &cyl;
     return(true);
   }
   Float x2 = r2.origin().x() + t_cyl2*r2.direction().x();
@@ -151,298 +109,106 @@ bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, rand
   Float phi3 = atan2(z2,x2);
   phi3 = phi3 < 0 ? phi3 + 2 * M_PI : phi3;
   Float radHit3 = x2*x2 + z2*z2;
-  if(has_caps && t_cyl2 < temp2 && t_cyl2 > t_min && t_cyl2 < t_max && radHit3 <= radius * radius && phi3 <= phi_max && phi3 >= phi_min) {
-    point3f p = r2.point_at_parameter(t_cyl2);
-    p.e[1] = -length/2;
-    
-    Float u = p.x() / (2.0 * radius) + 0.5;
-    Float v = p.z() / (2.0 * radius) + 0.5;
-    u = 1 - u;
-    if(alpha_mask) {
-      if(alpha_mask->value(u, v, rec.p).x() < 1) {
-        alpha_miss = true;
-      }
-    }
-    rec.p = p;
-    rec.normal = vec3f(0,-1,0);
-    rec.t = t_cyl2;
-    rec.mat_ptr = mat_ptr.get();
-    rec.u = u;
-    rec.v = v;
-    rec.dpdu = vec3f(1, 0, 0);
-    rec.dpdv = vec3f(0, 0, 1);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv);
-      rec.bump_normal.make_unit_vector();
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    rec.alpha_miss = alpha_miss;
-    
-    rec.shape = this;
-
+  if(cyl.has_caps && t_cyl2 < temp2 && t_cyl2 > t_min && t_cyl2 < t_max && radHit3 <= radius * radius && 
+     phi3 <= cyl.phi_max && phi3 >= cyl.phi_min) {
+    hit.t = t_cyl2;
+    hit.index = kCylinderBottomCap;
+    hit.alpha_miss = alpha_miss;
+    hit.shape = &cyl;
     return(true);
   }
   temppoint = r2.point_at_parameter(temp2);
   phi = atan2(temppoint.z(),temppoint.x());
   phi = phi < 0 ? phi + 2 * M_PI : phi;
   if(second_is_hit && temp2 < t_max && temp2 > t_min && 
-     temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
-    Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
-    temppoint.e[0] *= radius / hitRad;
-    temppoint.e[2] *= radius / hitRad;
-    rec.t = temp2;
-    rec.p = temppoint;
-    
-    temppoint.e[1] = 0;
-    rec.normal = dot(temppoint,dir) > 0 ? vec3f(-temppoint) / radius : vec3f(temppoint) / radius;
-    get_cylinder_uv(rec.p, rec.u, rec.v);
-    
-    //Interaction information
-    rec.dpdu = vec3f(-phi_max * temppoint.z(), 0,  phi_max * temppoint.x());
-    rec.dpdv = vec3f(0, length, 0);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    rec.alpha_miss = alpha_miss;
-    
-    rec.shape = this;
-    rec.mat_ptr = mat_ptr.get();
+     temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= cyl.phi_max && phi >= cyl.phi_min) {
+    hit.t = temp2;
+    hit.index = kCylinderFarSide;
+    hit.alpha_miss = alpha_miss;
+    hit.shape = &cyl;
     return(true);
   }
   return(false);
 }
 
+bool cylinder::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  return(cylinder_intersect(*this, r, t_min, t_max, hit, rng));
+}
 
-bool cylinder::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+bool cylinder::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  return(cylinder_intersect(*this, r, t_min, t_max, hit, sampler));
+}
+
+void cylinder::fill_interaction(const ray& r, const SurfaceHit& hit, hit_record& rec) {
   ray r2 = (*WorldToObject)(r);
-  
-  vec3f oc = r2.origin()-point3f(0.);
-  vec3f dir = r2.direction();
-  dir.e[1] = 0;
-  oc.e[1] = 0;
-  Float a = dot(dir, dir);
-  Float b = 2 * dot(oc, dir); 
-  Float c = dot(oc, oc) - radius * radius;
-  Float temp1, temp2;
-  if (!quadratic(a, b, c, &temp1, &temp2)) {
-    return(false);
-  }
-  bool is_hit = true;
-  bool second_is_hit = true;
-  if(alpha_mask) {
-    point3f temppoint = r2.point_at_parameter(temp1);
-    Float phi = atan2(temppoint.z(),temppoint.x());
-    phi = phi < 0 ? phi + 2 * M_PI : phi;
-    Float u;
-    Float v;
-    if(temp1 < t_max && temp1 > t_min && 
-       temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
-      Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
-      temppoint.e[0] *= radius / hitRad;
-      temppoint.e[2] *= radius / hitRad;
-      get_cylinder_uv(temppoint, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < sampler->Get1D()) {
-        is_hit = false;
-      }
-    }
-    temppoint = r2.point_at_parameter(temp2);
-    phi = atan2(temppoint.z(),temppoint.x());
-    phi = phi < 0 ? phi + 2 * M_PI : phi;
-    if(temp2 < t_max && temp2 > t_min && 
-       temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
-      Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
-      temppoint.e[0] *= radius / hitRad;
-      temppoint.e[2] *= radius / hitRad;
-      get_cylinder_uv(temppoint, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < sampler->Get1D()) {
-        if(!is_hit) {
-          return(false);
-        }
-        second_is_hit = false;
-      } 
-    }
-  }
-  point3f temppoint = r2.point_at_parameter(temp1);
-  Float phi = atan2(temppoint.z(),temppoint.x());
-  phi = phi < 0 ? phi + 2 * M_PI : phi;
-  if(is_hit && temp1 < t_max && temp1 > t_min && 
-     temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
-    Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
-    temppoint.e[0] *= radius / hitRad;
-    temppoint.e[2] *= radius / hitRad;
-    rec.t = temp1;
-    rec.p = temppoint;
-    
-    temppoint.e[1] = 0;
-    rec.normal = dot(temppoint, dir) > 0 ? vec3f(-temppoint) / radius : vec3f(temppoint) / radius;
-    get_cylinder_uv(rec.p, rec.u, rec.v);
-    
-    //Interaction information
-    rec.dpdu = vec3f(-temppoint.z(),0,  temppoint.x());
-    rec.dpdv = vec3f(0, length, 0);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u, rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-      rec.bump_normal *= dot(temppoint, dir) > 0 ? -1 : 1;
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    
-    rec.shape = this;
-    rec.mat_ptr = mat_ptr.get();
-    return(true);
-  }
-  Float t_cyl = -(r2.origin().y()-length/2) / r2.direction().y();
-  Float t_cyl2 = -(r2.origin().y()+length/2) / r2.direction().y();
-  Float x = r2.origin().x() + t_cyl*r2.direction().x();
-  Float z = r2.origin().z() + t_cyl*r2.direction().z();
-  
-  Float phi2 = atan2(z,x);
-  phi2 = phi2 < 0 ? phi2 + 2 * M_PI : phi2;
-  Float radHit2 = x*x + z*z;
-  if(has_caps && t_cyl < temp2 && t_cyl > t_min && t_cyl < t_max && t_cyl < t_cyl2 && 
-     radHit2 <= radius * radius && phi2 <= phi_max && phi2 >= phi_min) {
-    point3f p = r2.point_at_parameter(t_cyl);
-    p.e[1] = length/2;
-    
-    Float u = p.x() / (2.0 * radius) + 0.5;
-    Float v = p.z() / (2.0 * radius) + 0.5;
-    u = 1 - u;
-    if(alpha_mask) {
-      if(alpha_mask->value(u, v, rec.p).x() < 1) {
-        return(false);
-      }
-    }
-    rec.p = p;
-    rec.normal = vec3f(0,1,0);
-    rec.t = t_cyl;
-    rec.mat_ptr = mat_ptr.get();
-    rec.u = u;
-    rec.v = v;
-    rec.dpdu = vec3f(1, 0, 0);
-    rec.dpdv = vec3f(0, 0, 1);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv);
-      rec.bump_normal.make_unit_vector();
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    
-    rec.shape = this;
-    
-    return(true);
-  }
-  Float x2 = r2.origin().x() + t_cyl2*r2.direction().x();
-  Float z2 = r2.origin().z() + t_cyl2*r2.direction().z();
-  
-  Float phi3 = atan2(z2,x2);
-  phi3 = phi3 < 0 ? phi3 + 2 * M_PI : phi3;
-  Float radHit3 = x2*x2 + z2*z2;
-  if(has_caps && t_cyl2 < temp2 && t_cyl2 > t_min && t_cyl2 < t_max && radHit3 <= radius * radius && phi3 <= phi_max && phi3 >= phi_min) {
-    point3f p = r2.point_at_parameter(t_cyl2);
-    p.e[1] = -length/2;
+  rec.t = hit.t;
+  rec.alpha_miss = hit.alpha_miss;
+  Float bump_sign = 1;
+  if(hit.index == kCylinderTopCap || hit.index == kCylinderBottomCap) {
+    bool top = hit.index == kCylinderTopCap;
+    point3f p = r2.point_at_parameter(hit.t);
+    p.e[1] = top ? length/2 : -length/2;
     
     Float u = p.x() / (2.0 * radius) + 0.5;
     Float v = p.z() / (2.0 * radius) + 0.5;
     u = 1 - u;
     if(alpha_mask) {
-      if(alpha_mask->value(u, v, rec.p).x() < 1) {
-        return(false);
+      if(alpha_mask->value(u, v, p).x() < 1) {
+        rec.alpha_miss = true;
       }
     }
     rec.p = p;
-    rec.normal = vec3f(0,-1,0);
-    rec.t = t_cyl2;
-    rec.mat_ptr = mat_ptr.get();
+    rec.normal = vec3f(0, top ? 1 : -1, 0);
     rec.u = u;
     rec.v = v;
     rec.dpdu = vec3f(1, 0, 0);
     rec.dpdv = vec3f(0, 0, 1);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv);
-      rec.bump_normal.make_unit_vector();
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    rec.shape = this;
-    
-    rec.normal = !reverseOrientation ? (*ObjectToWorld)(rec.normal) : -(*ObjectToWorld)(rec.normal);
-    return(true);
-  }
-  temppoint = r2.point_at_parameter(temp2);
-  phi = atan2(temppoint.z(),temppoint.x());
-  phi = phi < 0 ? phi + 2 * M_PI : phi;
-  if(second_is_hit && temp2 < t_max && temp2 > t_min && 
-     temppoint.y() > -length/2 && temppoint.y() < length/2 && phi <= phi_max && phi >= phi_min) {
+  } else {
+    vec3f dir = r2.direction();
+    dir.e[1] = 0;
+    point3f temppoint = r2.point_at_parameter(hit.t);
     Float hitRad = std::sqrt(temppoint.x() * temppoint.x() + temppoint.z() * temppoint.z());
     temppoint.e[0] *= radius / hitRad;
     temppoint.e[2] *= radius / hitRad;
-    rec.t = temp2;
     rec.p = temppoint;
     
     temppoint.e[1] = 0;
-    rec.normal = dot(temppoint,dir) > 0 ? vec3f(-temppoint) / radius : vec3f(temppoint) / radius;
+    rec.normal = dot(temppoint, dir) > 0 ? vec3f(-temppoint) / radius : vec3f(temppoint) / radius;
     get_cylinder_uv(rec.p, rec.u, rec.v);
+    if(hit.index == kCylinderNearSide && dot(temppoint, dir) > 0) {
+      bump_sign = -1;
+    }
     
     //Interaction information
-    rec.dpdu = vec3f(-phi_max * temppoint.z(), 0,  phi_max * temppoint.x());
+    Float dphi = hit.index == kCylinderFarSide ? phi_max : 1;
+    rec.dpdu = vec3f(-dphi * temppoint.z(), 0, dphi * temppoint.x());
     rec.dpdv = vec3f(0, length, 0);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-      rec.bump_normal = (*ObjectToWorld)(rec.bump_normal);
-    }
-    rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
-    
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.shape = this;
-    rec.mat_ptr = mat_ptr.get();
-    return(true);
   }
-  return(false);
+  rec.has_bump = bump_tex ? true : false;
+  
+  if(bump_tex) {
+    point3f bvbu = bump_tex->value(rec.u, rec.v, rec.p);
+    rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
+    rec.bump_normal.make_unit_vector();
+    rec.bump_normal *= bump_sign;
+  }
+  rec.pError = gamma(3) * Abs(vec3f(rec.p.x(), 0, rec.p.z()));
+  
+  rec = (*ObjectToWorld)(rec);
+  rec.normal *= reverseOrientation  ? -1 : 1;
+  rec.bump_normal *= reverseOrientation  ? -1 : 1;
+  rec.normal.make_unit_vector();
+  
+  rec.shape = this;
+  rec.mat_ptr = mat_ptr.get();
+}
+
+void cylinder::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng) {
+  fill_interaction(r, hit, rec);
+}
+
+void cylinder::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler) {
+  fill_interaction(r, hit, rec);
 }
 
 Float cylinder::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
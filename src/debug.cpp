@@ -1,4 +1,81 @@
 #include "debug.h"
+#include "bvh_node.h"
+#include "buildscene.h"
+#include <algorithm>
+
+//Side of the pixel tiles whose rays share a cache in the L2 proxy
+static const unsigned int kBenchmarkTileSize = 16;
+//Granularity of the TLB proxy
+static const size_t kBenchmarkPageSize = 4096;
+
+struct BVHLayoutStats {
+  BVHLayoutStats() : rays(0), nodes(0), lines(0), tile_lines(0), tile_pages(0) {}
+  size_t rays, nodes, lines, tile_lines, tile_pages;
+};
+
+//One primary ray through each pixel center, recording every BVH node the traversal visits. Lines
+//touched per ray approximate L1 misses, and distinct lines touched by all the rays of a tile
+//approximate L2 misses, since neighbouring rays mostly share the upper levels of the trees. Wide
+//nodes span whole cache lines in either layout, so the gain from reordering them mostly shows up
+//in the distinct pages touched per tile.
+static BVHLayoutStats measure_bvh_layout(size_t nx, size_t ny, Float fov,
+                                         ortho_camera& ocam, camera &cam, environment_camera &ecam,
+                                         hitable_list& world, Rcpp::NumericMatrix& lines_per_ray) {
+  BVHLayoutStats stats;
+  BVHTraceRecorder recorder;
+  std::vector<uintptr_t> tile;
+  random_gen rng(0);
+  bvh_trace_recorder = &recorder;
+  for(unsigned int tj = 0; tj < ny; tj += kBenchmarkTileSize) {
+    for(unsigned int ti = 0; ti < nx; ti += kBenchmarkTileSize) {
+      tile.clear();
+      for(unsigned int j = tj; j < std::min<size_t>(tj + kBenchmarkTileSize, ny); j++) {
+        for(unsigned int i = ti; i < std::min<size_t>(ti + kBenchmarkTileSize, nx); i++) {
+          Float u = (Float(i) + 0.5) / Float(nx);
+          Float v = (Float(j) + 0.5) / Float(ny);
+          ray r;
+          if(fov != 0 && fov != 360) {
+            r = cam.get_ray(u,v, vec3f(0,0,0), 0);
+          } else if (fov == 0){
+            r = ocam.get_ray(u,v, 0);
+          } else {
+            r = ecam.get_ray(u,v, 0);
+          }
+          recorder.lines.clear();
+          hit_record hrec;
+          world.hit(r, 0.001, FLT_MAX, hrec, rng);
+          std::sort(recorder.lines.begin(), recorder.lines.end());
+          recorder.lines.erase(std::unique(recorder.lines.begin(), recorder.lines.end()), recorder.lines.end());
+          lines_per_ray(i,j) = recorder.lines.size();
+          stats.lines += recorder.lines.size();
+          tile.insert(tile.end(), recorder.lines.begin(), recorder.lines.end());
+          stats.rays++;
+        }
+      }
+      std::sort(tile.begin(), tile.end());
+      tile.erase(std::unique(tile.begin(), tile.end()), tile.end());
+      stats.tile_lines += tile.size();
+      for(size_t k = 0; k < tile.size(); k++) {
+        tile[k] = tile[k] * kCacheLineSize / kBenchmarkPageSize;
+      }
+      stats.tile_pages += std::unique(tile.begin(), tile.end()) - tile.begin();
+    }
+  }
+  bvh_trace_recorder = nullptr;
+  stats.nodes = recorder.nodes;
+  return(stats);
+}
+
+static void print_bvh_layout_stats(const char* layout, const BVHLayoutStats& stats, size_t tiles) {
+  Float rays = std::max<size_t>(stats.rays, 1);
+  Rcpp::Rcout << layout << ": " << stats.nodes / rays << " nodes/ray, " <<
+    stats.lines / rays << " cache lines/ray (L1 proxy: " <<
+    (Float)stats.nodes / std::max<size_t>(stats.lines, 1) << " nodes per line), " <<
+    (Float)stats.tile_lines / std::max<size_t>(tiles, 1) << " lines per " << kBenchmarkTileSize << "x" <<
+    kBenchmarkTileSize << " tile (L2 proxy: " <<
+    (Float)stats.nodes / std::max<size_t>(stats.tile_lines, 1) << " nodes per line), " <<
+    (Float)stats.tile_pages / std::max<size_t>(tiles, 1) << " pages per tile" << "\n";
+}
 
 void debug_scene(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_channel,
                 Float min_variance, size_t min_adaptive_size, 
@@ -417,5 +494,21 @@ void debug_scene(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_
       pool.push(worker,j);
     }
     pool.join();
+  } else if (debug_channel == 17) {
+    //Benchmark mode: the same rays are traced with the depth-first node layout and again after
+    //reordering. Returns the cache lines touched per ray before (green) and after (red and blue).
+    size_t tiles = ((nx + kBenchmarkTileSize - 1) / kBenchmarkTileSize) *
+      ((ny + kBenchmarkTileSize - 1) / kBenchmarkTileSize);
+    BVHLayoutStats before = measure_bvh_layout(nx, ny, fov, ocam, cam, ecam, world, goutput);
+    reorder_bvh_nodes(&world);
+    BVHLayoutStats after = measure_bvh_layout(nx, ny, fov, ocam, cam, ecam, world, routput);
+    for(unsigned int j = 0; j < ny; j++) {
+      for(unsigned int i = 0; i < nx; i++) {
+        boutput(i,j) = routput(i,j);
+      }
+    }
+    Rcpp::Rcout << "BVH layout benchmark (" << before.rays << " primary rays):" << "\n";
+    print_bvh_layout_stats("  depth-first", before, tiles);
+    print_bvh_layout_stats("  clustered  ", after, tiles);
   }
 }
@@ -167,6 +167,26 @@ vec3f disk::random(const point3f& o, Sampler* sampler, Float time) {
   return((*ObjectToWorld)(point3f(x,0,z))+center-o);
 }
 
+bool disk::intersect_p(const ray& r, Float t_min, Float t_max) const {
+  ray r2 = (*WorldToObject)(r);
+  Float t = -r2.origin().y() / r2.direction().y();
+  if(t < t_min || t > t_max) {
+    return(false);
+  }
+  Float x = r2.origin().x() + t*r2.direction().x();
+  Float z = r2.origin().z() + t*r2.direction().z();
+  Float radHit2 = x*x + z*z;
+  return(radHit2 < radius * radius && radHit2 > inner_radius * inner_radius);
+}
+
+bool disk::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(intersect_p(r, t_min, t_max));
+}
+
+bool disk::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(intersect_p(r, t_min, t_max));
+}
+
 bool disk::bounding_box(Float t0, Float t1, aabb& box) const {
   box = (*ObjectToWorld)(aabb(-point3f(radius,0.001,radius), point3f(radius,0.001,radius)));
   return(true);
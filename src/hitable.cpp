@@ -16,6 +16,42 @@ void get_sphere_uv(const normal3f& p, Float& u, Float& v) {
   v = (theta + M_PI/2) / M_PI;
 }
 
+bool hitable::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  hit_record rec;
+  SurfaceHit closest(rec);
+  return(intersect(r, t_min, t_max, closest, rng));
+}
+
+bool hitable::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  hit_record rec;
+  SurfaceHit closest(rec);
+  return(intersect(r, t_min, t_max, closest, sampler));
+}
+
+//hit() can write to the record before rejecting a hit (e.g. on an alpha miss), so the closest
+//hit so far is only replaced once a nearer one is found
+bool hitable::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& closest, random_gen& rng) {
+  hit_record rec;
+  if(!hit(r, t_min, t_max, rec, rng)) {
+    return(false);
+  }
+  *closest.rec = rec;
+  closest.t = rec.t;
+  closest.shape = nullptr;
+  return(true);
+}
+
+bool hitable::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& closest, Sampler* sampler) {
+  hit_record rec;
+  if(!hit(r, t_min, t_max, rec, sampler)) {
+    return(false);
+  }
+  *closest.rec = rec;
+  closest.t = rec.t;
+  closest.shape = nullptr;
+  return(true);
+}
+
 Float AnimatedHitable::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
   Transform InterpolatedPrimToWorld;
   PrimitiveToWorld.Interpolate(time, &InterpolatedPrimToWorld);
@@ -49,7 +85,9 @@ std::string AnimatedHitable::GetName() const {
 
 bool AnimatedHitable::bounding_box(Float t0, Float t1, aabb& box) const {
   primitive->bounding_box(t0, t1, box);
-  box = PrimitiveToWorld.MotionBounds(box);
+  //Only the part of the motion inside [t0, t1] is covered, so the motion BVH can bound each
+  //time segment separately
+  box = PrimitiveToWorld.MotionBounds(box, t0, t1);
   return(true);
 }
 
@@ -81,4 +119,16 @@ bool AnimatedHitable::hit(const ray& r, Float t_min, Float t_max, hit_record& re
     rec = InterpolatedPrimToWorld(rec);
   }
   return true;
-}
\ No newline at end of file
+}
+
+bool AnimatedHitable::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  Transform InterpolatedPrimToWorld;
+  PrimitiveToWorld.Interpolate(r.time(), &InterpolatedPrimToWorld);
+  return(primitive->occluded(Inverse(InterpolatedPrimToWorld)(r), t_min, t_max, rng));
+}
+
+bool AnimatedHitable::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  Transform InterpolatedPrimToWorld;
+  PrimitiveToWorld.Interpolate(r.time(), &InterpolatedPrimToWorld);
+  return(primitive->occluded(Inverse(InterpolatedPrimToWorld)(r), t_min, t_max, sampler));
+}
@@ -11,13 +11,36 @@
 #include "animatedtransform.h"
 #include <memory>
 #include <cfloat>
+#include <cstdint>
 
 class material;
 
 void get_sphere_uv(const vec3f& p, Float& u, Float& v);
 void get_sphere_uv(const normal3f& p, Float& u, Float& v);
 
+//One uniform sample from either source of randomness, for code templated on the sampler type
+inline Float sample_1d(random_gen& rng) {
+  return(rng.unif_rand());
+}
+
+inline Float sample_1d(Sampler* sampler) {
+  return(sampler->Get1D());
+}
+
 struct hit_record;
+class hitable;
+
+//Closest hit found so far by hitable::intersect(). Shapes that defer their interaction set
+//`shape` to themselves and keep what they need to finish it in t, u, v, index and alpha_miss.
+//Other shapes write the full interaction to `rec` right away and leave `shape` unset.
+struct SurfaceHit {
+  SurfaceHit(hit_record& rec) : index(0), alpha_miss(false), shape(nullptr), rec(&rec) {}
+  Float t, u, v;
+  uint32_t index;
+  bool alpha_miss;
+  hitable* shape;
+  hit_record* rec;
+};
 
 class hitable {
   public:
@@ -27,6 +50,17 @@ class hitable {
       transformSwapsHandedness(ObjectToWorld->SwapsHandedness()) {}
     virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) = 0;
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler) = 0;
+    //Visibility only: true if hit() would find an intersection between t_min and t_max. Shapes
+    //override this to skip filling in the hit_record, and aggregates to stop at the first hit.
+    virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+    virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+    //Two-phase hit: intersect() finds the same closest hit as hit(), but may leave the surface
+    //interaction to interaction(), which aggregates only call once for the final hit. By default
+    //the whole interaction is computed right away.
+    virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng);
+    virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler);
+    virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng) {}
+    virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler) {}
     virtual bool bounding_box(Float t0, Float t1, aabb& box) const = 0;
     virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0) {
       return(0.0);
@@ -77,6 +111,18 @@ struct hit_record {
   //int faceIndex (for ptex lookups)
 };
 
+//hit() in terms of intersect(), for hitables that implement the two-phase protocol
+template<typename S>
+inline bool deferred_hit(hitable* h, const ray& r, Float t_min, Float t_max, hit_record& rec, S& sampler) {
+  SurfaceHit closest(rec);
+  if(!h->intersect(r, t_min, t_max, closest, sampler)) {
+    return(false);
+  }
+  if(closest.shape) {
+    closest.shape->interaction(r, closest, rec, sampler);
+  }
+  return(true);
+}
 
 class AnimatedHitable: public hitable {
 public:
@@ -86,6 +132,8 @@ public:
   ~AnimatedHitable() {}
   bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler);
+  bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
   Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
   Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
   vec3f random(const point3f& o, random_gen& rng, Float time = 0);
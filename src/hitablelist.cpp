@@ -2,39 +2,54 @@
 
 
 bool hitable_list::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
-  hit_record temp_rec;
-#ifdef DEBUGBVH
-  temp_rec.bvh_nodes = rec.bvh_nodes;
-#endif
+  return(deferred_hit(this, r, t_min, t_max, rec, rng));
+}
+
+bool hitable_list::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  return(deferred_hit(this, r, t_min, t_max, rec, sampler));
+}
+
+//Only the closest object's interaction is computed, once the whole list has been tested
+bool hitable_list::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
   bool hit_anything = false;
-  double closest_so_far = t_max;
   for (const auto& object : objects) {
-    if (object->hit(r, t_min, closest_so_far, temp_rec, rng)) {
+    if (object->intersect(r, t_min, t_max, hit, rng)) {
       hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
+      t_max = hit.t;
     }
   }
   return(hit_anything);
 }
 
-bool hitable_list::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-  hit_record temp_rec;
-#ifdef DEBUGBVH
-  temp_rec.bvh_nodes = rec.bvh_nodes;
-#endif
+bool hitable_list::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
   bool hit_anything = false;
-  double closest_so_far = t_max;
   for (const auto& object : objects) {
-    if (object->hit(r, t_min, closest_so_far, temp_rec, sampler)) {
+    if (object->intersect(r, t_min, t_max, hit, sampler)) {
       hit_anything = true;
-      closest_so_far = temp_rec.t;
-      rec = temp_rec;
+      t_max = hit.t;
     }
   }
   return(hit_anything);
 }
 
+bool hitable_list::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  for (const auto& object : objects) {
+    if (object->occluded(r, t_min, t_max, rng)) {
+      return(true);
+    }
+  }
+  return(false);
+}
+
+bool hitable_list::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  for (const auto& object : objects) {
+    if (object->occluded(r, t_min, t_max, sampler)) {
+      return(true);
+    }
+  }
+  return(false);
+}
+
 bool hitable_list::bounding_box(Float t0, Float t1, aabb& box) const {
   if(objects.empty()) {
     return(false);
@@ -0,0 +1,66 @@
+#include "instance.h"
+
+bool instance::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  //Rays are moved into the primitive's space on entry, and the hit back into world space
+  ray r_obj = (*WorldToObject)(r);
+  if (!primitive->hit(r_obj, t_min, t_max, rec, rng)) {
+    return false;
+  }
+  r.tMax = r_obj.tMax;
+  rec = (*ObjectToWorld)(rec);
+  rec.normal.make_unit_vector();
+  if(rec.has_bump) {
+    rec.bump_normal.make_unit_vector();
+  }
+  return true;
+}
+
+bool instance::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  ray r_obj = (*WorldToObject)(r);
+  if (!primitive->hit(r_obj, t_min, t_max, rec, sampler)) {
+    return false;
+  }
+  r.tMax = r_obj.tMax;
+  rec = (*ObjectToWorld)(rec);
+  rec.normal.make_unit_vector();
+  if(rec.has_bump) {
+    rec.bump_normal.make_unit_vector();
+  }
+  return true;
+}
+
+bool instance::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(primitive->occluded((*WorldToObject)(r), t_min, t_max, rng));
+}
+
+bool instance::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(primitive->occluded((*WorldToObject)(r), t_min, t_max, sampler));
+}
+
+Float instance::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  return(primitive->pdf_value((*WorldToObject)(o), (*WorldToObject)(v), rng, time));
+}
+
+Float instance::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  return(primitive->pdf_value((*WorldToObject)(o), (*WorldToObject)(v), sampler, time));
+}
+
+vec3f instance::random(const point3f& o, random_gen& rng, Float time) {
+  return((*ObjectToWorld)(primitive->random((*WorldToObject)(o), rng, time)));
+}
+
+vec3f instance::random(const point3f& o, Sampler* sampler, Float time) {
+  return((*ObjectToWorld)(primitive->random((*WorldToObject)(o), sampler, time)));
+}
+
+std::string instance::GetName() const {
+  return(std::string("Instance"));
+}
+
+bool instance::bounding_box(Float t0, Float t1, aabb& box) const {
+  if(!primitive->bounding_box(t0, t1, box)) {
+    return(false);
+  }
+  box = (*ObjectToWorld)(box);
+  return(true);
+}
@@ -0,0 +1,28 @@
+#ifndef INSTANCEH
+#define INSTANCEH
+
+#include "hitable.h"
+
+//Bottom-level geometry (usually a mesh with its own BVH) placed in the scene with its own
+//ObjectToWorld/WorldToObject pair. Several instances can share the same primitive, so repeated
+//copies of a mesh only store its triangles and BVH once.
+class instance: public hitable {
+public:
+  instance(std::shared_ptr<hitable> primitive,
+           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject) :
+    hitable(ObjectToWorld, WorldToObject, false), primitive(primitive) {}
+  ~instance() {}
+  bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler);
+  bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+  Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
+  Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
+  vec3f random(const point3f& o, random_gen& rng, Float time = 0);
+  vec3f random(const point3f& o, Sampler* sampler, Float time = 0);
+  std::string GetName() const;
+  bool bounding_box(Float t0, Float t1, aabb& box) const;
+  std::shared_ptr<hitable> primitive;
+};
+
+#endif
@@ -8,7 +8,8 @@ void pathtracer(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_c
                 bool progress_bar, int sample_method, Rcpp::NumericVector& stratified_dim,
                 bool verbose, ortho_camera& ocam, camera &cam, environment_camera &ecam, Float fov,
                 hitable_list& world, hitable_list& hlist,
-                Float clampval, size_t max_depth, size_t roulette_active) {
+                Float clampval, size_t max_depth, size_t roulette_active,
+                BVHTraversalCounters* traversal_counters) {
   RProgress::RProgress pb_sampler("Generating Samples [:bar] :percent%");
   pb_sampler.set_width(70);
   RProgress::RProgress pb("Adaptive Raytracing [:bar] :percent%");
@@ -78,13 +79,17 @@ void pathtracer(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_c
                    nx, ny, s, sample_method,
                    &rngs, fov, &samplers,
                    &cam, &ocam, &ecam, &world, &hlist,
-                   clampval, max_depth, roulette_active] (int k) {
+                   clampval, max_depth, roulette_active, traversal_counters] (int k) {
                      // MitchellFilter fil(vec2f(1.0),1./3.,1./3.);
                      int nx_begin = adaptive_pixel_sampler.pixel_chunks[k].startx;
                      int ny_begin = adaptive_pixel_sampler.pixel_chunks[k].starty;
                      int nx_end = adaptive_pixel_sampler.pixel_chunks[k].endx;
                      int ny_end = adaptive_pixel_sampler.pixel_chunks[k].endy;
                      
+                     BVHTraceRecorder recorder(false);
+                     if(traversal_counters) {
+                       bvh_trace_recorder = &recorder;
+                     }
                      std::vector<dielectric*> *mat_stack = new std::vector<dielectric*>;
                      for(int i = nx_begin; i < nx_end; i++) {
                        for(int j = ny_begin; j < ny_end; j++) {
@@ -120,6 +125,10 @@ void pathtracer(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_c
                        adaptive_pixel_sampler.test_for_convergence(k, s, nx_end, nx_begin, ny_end, ny_begin);
                      }
                      delete mat_stack;
+                     if(traversal_counters) {
+                       bvh_trace_recorder = nullptr;
+                       traversal_counters->add(recorder);
+                     }
                    };
     for(size_t j = 0; j < adaptive_pixel_sampler.size(); j++) {
       pool.push(worker, j);
@@ -12,13 +12,16 @@
 #include "color.h"
 #include "mathinline.h"
 #include "filter.h"
+#include "bvh_node.h"
 
+//traversal_counters: if not null, BVH traversal counts of every thread are added to it
 void pathtracer(size_t numbercores, size_t nx, size_t ny, size_t ns, int debug_channel,
                 Float min_variance, size_t min_adaptive_size, 
                 Rcpp::NumericMatrix& routput, Rcpp::NumericMatrix& goutput, Rcpp::NumericMatrix& boutput,
                 bool progress_bar, int sample_method, Rcpp::NumericVector& stratified_dim,
                 bool verbose, ortho_camera& ocam, camera &cam, environment_camera &ecam, Float fov,
                 hitable_list& world, hitable_list& hlist,
-                Float clampval, size_t max_depth, size_t roulette_active);
+                Float clampval, size_t max_depth, size_t roulette_active,
+                BVHTraversalCounters* traversal_counters);
 
 #endif
\ No newline at end of file
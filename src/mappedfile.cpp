@@ -0,0 +1,75 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mappedfile.h"
+#include <cstring>
+
+MappedFile::MappedFile(const std::string& path) : ptr(nullptr), length(0) {
+#ifdef _WIN32
+  file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                     FILE_ATTRIBUTE_NORMAL, nullptr);
+  mapping = nullptr;
+  LARGE_INTEGER file_size;
+  if(file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+    return;
+  }
+  mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if(mapping) {
+    ptr = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    length = ptr ? static_cast<size_t>(file_size.QuadPart) : 0;
+  }
+#else
+  fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+    return;
+  }
+  void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(mapped != MAP_FAILED) {
+    ptr = static_cast<const unsigned char*>(mapped);
+    length = st.st_size;
+  }
+#endif
+}
+
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+  if(ptr) UnmapViewOfFile(ptr);
+  if(mapping) CloseHandle(mapping);
+  if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+  if(ptr) munmap(const_cast<unsigned char*>(ptr), length);
+  if(fd >= 0) close(fd);
+#endif
+}
+
+//Hashes 8 bytes per step (mesh and image files can be large), with a shift to mix the high bits down
+uint64_t MappedFile::hash() const {
+  const uint64_t kFNVOffset = 14695981039346656037ull;
+  const uint64_t kFNVPrime = 1099511628211ull;
+  if(!ptr) {
+    return(0);
+  }
+  uint64_t hash = kFNVOffset;
+  size_t words = length / 8;
+  for(size_t i = 0; i < words; i++) {
+    uint64_t word;
+    std::memcpy(&word, ptr + 8 * i, 8);
+    hash = (hash ^ word) * kFNVPrime;
+    hash ^= hash >> 29;
+  }
+  for(size_t i = 8 * words; i < length; i++) {
+    hash ^= ptr[i];
+    hash *= kFNVPrime;
+  }
+  return(hash);
+}
@@ -0,0 +1,30 @@
+#ifndef MAPPEDFILEH
+#define MAPPEDFILEH
+
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+//Read-only memory map of a whole file. data() is nullptr if the file couldn't be mapped.
+class MappedFile {
+public:
+  MappedFile(const std::string& path);
+  ~MappedFile();
+  const unsigned char* data() const {return(ptr);}
+  size_t size() const {return(length);}
+  //64-bit FNV-1a style hash of the contents (0 if the file isn't mapped), for content-addressed caches
+  uint64_t hash() const;
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+  const unsigned char* ptr;
+  size_t length;
+#ifdef _WIN32
+  void* file;
+  void* mapping;
+#else
+  int fd;
+#endif
+};
+
+#endif
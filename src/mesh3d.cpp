@@ -1,11 +1,34 @@
 #include "mesh3d.h"
+#include "RcppThread.h"
+#include <array>
+#include <map>
 
+//Runs f(first, last) over [0, n), split into chunks on numbercores threads for large meshes
+template<typename F>
+static void for_each_mesh_chunk(size_t n, size_t numbercores, F f) {
+  if(numbercores > 1 && n >= kMinParallelBuildSize) {
+    RcppThread::ThreadPool pool(numbercores);
+    size_t nChunks = (n + kParallelChunkSize - 1) / kParallelChunkSize;
+    pool.parallelFor(0, nChunks, [&] (size_t chunk) {
+      f(chunk * kParallelChunkSize, std::min((chunk + 1) * kParallelChunkSize, n));
+    });
+    pool.wait();
+  } else {
+    f(0, n);
+  }
+}
+
+//The R matrices keep one vertex, normal, texture coordinate or face per column (as in rgl), and
+//are converted to the mesh's buffers in bulk without copying them in R first: the 1-based
+//triangle and quad indices are rebased (and the quads split) straight into the index buffer.
 mesh3d::mesh3d(Rcpp::List mesh_info, std::shared_ptr<material> mat, 
-       Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
+       Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, random_gen rng,
        std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
   hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
   Rcpp::NumericMatrix vertices = Rcpp::as<Rcpp::NumericMatrix>(mesh_info["vertices"]);
   Rcpp::IntegerMatrix indices = Rcpp::as<Rcpp::IntegerMatrix>(mesh_info["indices"]);
+  Rcpp::IntegerMatrix quads = Rcpp::as<Rcpp::IntegerMatrix>(mesh_info["quads"]);
+  bool reverse = Rcpp::as<bool>(mesh_info["reverse"]);
   Rcpp::NumericMatrix norms = Rcpp::as<Rcpp::NumericMatrix>(mesh_info["normals"]);
   Rcpp::NumericMatrix txcoord = Rcpp::as<Rcpp::NumericMatrix>(mesh_info["texcoords"]);
   float scale_mesh = Rcpp::as<float>(mesh_info["scale_mesh"]);
@@ -15,77 +38,123 @@ mesh3d::mesh3d(Rcpp::List mesh_info, std::shared_ptr<material> mat,
   Rcpp::NumericMatrix colors = Rcpp::as<Rcpp::NumericMatrix>(mesh_info["color_vals"]);
   int colortype = Rcpp::as<int>(mesh_info["color_type"]);
   
-  int nx,ny,nn;
   bool has_texture = false;
   if(strlen(texture.c_str()) > 0) {
-    mesh_materials = stbi_loadf(texture.c_str(), &nx, &ny, &nn, 0);
+    mesh_texture = load_texture(texture);
     has_texture = true;
-  } else {
-    mesh_materials = nullptr;
   }
   mat_ptr = mat;
-  int number_faces = indices.nrow();
-  bool has_normals = norms.nrow() > 1;
-  bool has_texcoords = txcoord.nrow() > 1;
-  std::shared_ptr<material> tex = nullptr;
-  bool single_tex = colortype != 3;
+  size_t number_tris = indices.ncol();
+  size_t number_quads = quads.ncol();
+  size_t number_faces = number_tris + 2 * number_quads;
+  size_t number_verts = vertices.ncol();
+  size_t number_norms = norms.ncol() > 1 ? norms.ncol() : 0;
+  bool has_texcoords = txcoord.ncol() > 1;
+  //A texture image is shared by all faces through the mesh's texture coordinates
+  bool image_texture = colortype == 1 && has_texcoords && has_texture;
+  size_t number_uv = image_texture ? txcoord.ncol() : 0;
+  if(indices.nrow() != 3 || quads.nrow() != 4) {
+    throw std::runtime_error("mesh3d triangle indices must have three rows and quad indices four");
+  }
+  if(number_norms > 0 && number_norms < number_verts) {
+    throw std::runtime_error("mesh3d normals must have a column for each vertex");
+  }
   
-  for (int i = 0; i < number_faces; i++) {
-    bool tempnormal = false;
-    vec3f tris[3];
-    vec3f normals[3];
-
-    vec2f tx[3];
-    
-    int idx[3] = {indices(i,0),indices(i,1),indices(i,2)};
-    tris[0] = vec3f(vertices(idx[0],0),vertices(idx[0],1),vertices(idx[0],2))*scale_mesh;
-    tris[1] = vec3f(vertices(idx[1],0),vertices(idx[1],1),vertices(idx[1],2))*scale_mesh;
-    tris[2] = vec3f(vertices(idx[2],0),vertices(idx[2],1),vertices(idx[2],2))*scale_mesh;
-    
-    if(has_normals) {
-      normals[0] = vec3f(norms(idx[0],0),norms(idx[0],1),norms(idx[0],2));
-      normals[1] = vec3f(norms(idx[1],0),norms(idx[1],1),norms(idx[1],2));
-      normals[2] = vec3f(norms(idx[2],0),norms(idx[2],1),norms(idx[2],2));
+  mesh = std::make_shared<TriangleMesh>();
+  mesh->vertexIndices.resize(3 * number_faces);
+  mesh->p.resize(number_verts);
+  mesh->n.resize(number_norms);
+  mesh->uv.resize(number_uv);
+  
+  const double* vb = vertices.begin();
+  const double* nb = norms.begin();
+  const double* tb = txcoord.begin();
+  size_t vstride = vertices.nrow(), nstride = norms.nrow(), tstride = txcoord.nrow();
+  point3f* p = mesh->p.mutable_data();
+  normal3f* n = mesh->n.mutable_data();
+  point2f* uv = mesh->uv.mutable_data();
+  //Quads are split along their 2-4 diagonal, after the triangles. Indices of 0 or NA wrap
+  //around to values past the last vertex, which are rejected below.
+  const int* ib = indices.begin();
+  const int* qb = quads.begin();
+  uint32_t* vi = mesh->vertexIndices.mutable_data();
+  int first_corner = reverse ? 2 : 0;
+  int corner_step = reverse ? -1 : 1;
+  for_each_mesh_chunk(number_tris + number_quads, numbercores, [&] (size_t first, size_t last) {
+    for(size_t i = first; i < last; i++) {
+      if(i < number_tris) {
+        for(int k = 0; k < 3; k++) {
+          vi[3*i + k] = static_cast<uint32_t>(ib[3*i + first_corner + corner_step * k]) - 1;
+        }
+      } else {
+        const int* q = qb + 4 * (i - number_tris);
+        uint32_t* face = vi + 3 * number_tris + 6 * (i - number_tris);
+        const int split[6] = {q[0], q[1], q[3], q[1], q[2], q[3]};
+        for(int k = 0; k < 3; k++) {
+          face[k] = static_cast<uint32_t>(split[first_corner + corner_step * k]) - 1;
+          face[3 + k] = static_cast<uint32_t>(split[3 + first_corner + corner_step * k]) - 1;
+        }
+      }
     }
-    
-    if(has_texcoords) {
-      tx[0] = vec2f(txcoord(idx[0],0),txcoord(idx[0],1));
-      tx[1] = vec2f(txcoord(idx[1],0),txcoord(idx[1],1));
-      tx[2] = vec2f(txcoord(idx[2],0),txcoord(idx[2],1));
+  });
+  const Transform& ToWorld = *ObjectToWorld;
+  for_each_mesh_chunk(std::max(number_verts, std::max(number_norms, number_uv)), numbercores, 
+                      [&] (size_t first, size_t last) {
+    for(size_t i = first; i < std::min(last, number_verts); i++) {
+      const double* v = vb + vstride * i;
+      p[i] = ToWorld(point3f(vec3f(v[0],v[1],v[2])*scale_mesh));
     }
-    if(colortype == 1 && has_texcoords && has_texture) {
-      tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(mesh_materials,
-                                                      nx,ny,nn,
-                                                      tx[0].x(),tx[0].y(),
-                                                      tx[1].x(),tx[1].y(),
-                                                      tx[2].x(),tx[2].y()));
-    } else if(colortype == 2) {
-      tex = std::make_shared<lambertian>(std::make_shared<triangle_texture>(
-        vec3f(colors(i,0),colors(i,1),colors(i,2)),
-        vec3f(colors(i,0),colors(i,1),colors(i,2)),
-        vec3f(colors(i,0),colors(i,1),colors(i,2))));
-    } else if(colortype == 4) {
-      tex = std::make_shared<lambertian>(std::make_shared<triangle_texture>(
-        vec3f(colors(idx[0],0),colors(idx[0],1),colors(idx[0],2)),
-        vec3f(colors(idx[1],0),colors(idx[1],1),colors(idx[1],2)),
-        vec3f(colors(idx[2],0),colors(idx[2],1),colors(idx[2],2))));
-    } else {
-      tex = mat_ptr;
+    for(size_t i = first; i < std::min(last, number_norms); i++) {
+      const double* v = nb + nstride * i;
+      n[i] = ToWorld(normal3f(v[0],v[1],v[2]));
     }
-    
-    if(has_normals) {
-      triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2],
-                                       normals[0],normals[1],normals[2],
-                                       single_tex,
-                                       tex, nullptr,  nullptr, 
-                                       ObjectToWorld, WorldToObject, reverseOrientation));
-    } else {
-      triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], 
-                                       single_tex, tex, nullptr, nullptr, 
-                                       ObjectToWorld, WorldToObject, reverseOrientation));
+    for(size_t i = first; i < std::min(last, number_uv); i++) {
+      const double* v = tb + tstride * i;
+      uv[i] = point2f(v[0],v[1]);
     }
+  });
+  bool valid = true;
+  for(uint32_t idx : mesh->vertexIndices) {
+    valid = valid && idx < number_verts;
   }
-  mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
+  if(!valid) {
+    throw std::runtime_error("mesh3d indices must refer to existing vertices");
+  }
+  
+  //Vertex colors are baked into a material for each face, and face colors into one material per
+  //distinct color
+  if(image_texture) {
+    mesh->add_material(std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(
+      mesh_texture->data, mesh_texture->nx, mesh_texture->ny, mesh_texture->nn, 0, 0, 1, 0, 0, 1)),
+      nullptr, nullptr, true);
+  } else if(colortype == 2 || colortype == 4) {
+    std::vector<uint32_t> face_materials(number_faces);
+    std::map<std::array<double, 3>, uint32_t> color_materials;
+    for(size_t i = 0; i < number_faces; i++) {
+      if(colortype == 2) {
+        std::array<double, 3> color = {{colors(i,0),colors(i,1),colors(i,2)}};
+        auto entry = color_materials.find(color);
+        if(entry == color_materials.end()) {
+          vec3f c(color[0],color[1],color[2]);
+          entry = color_materials.insert(std::make_pair(color, mesh->add_material(std::make_shared<lambertian>(
+            std::make_shared<triangle_texture>(c, c, c)), nullptr, nullptr))).first;
+        }
+        face_materials[i] = entry->second;
+      } else {
+        const uint32_t* idx = vi + 3*i;
+        face_materials[i] = mesh->add_material(std::make_shared<lambertian>(std::make_shared<triangle_texture>(
+          vec3f(colors(idx[0],0),colors(idx[0],1),colors(idx[0],2)),
+          vec3f(colors(idx[1],0),colors(idx[1],1),colors(idx[1],2)),
+          vec3f(colors(idx[2],0),colors(idx[2],1),colors(idx[2],2)))), nullptr, nullptr);
+      }
+    }
+    if(mesh->materials.size() > 1) {
+      mesh->faceMaterials.assign(face_materials.begin(), face_materials.end());
+    }
+  } else {
+    mesh->add_material(mat_ptr, nullptr, nullptr);
+  }
+  mesh_bvh = std::make_shared<bvh_node>(mesh, bvh_type, max_leaf_size, numbercores, rng);
 }
 
 bool mesh3d::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
@@ -97,6 +166,22 @@ bool mesh3d::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sample
   return(mesh_bvh->hit(r, t_min, t_max, rec, sampler));
 };
 
+bool mesh3d::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  return(mesh_bvh->intersect(r, t_min, t_max, hit, rng));
+};
+
+bool mesh3d::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  return(mesh_bvh->intersect(r, t_min, t_max, hit, sampler));
+};
+
+bool mesh3d::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(mesh_bvh->occluded(r, t_min, t_max, rng));
+};
+
+bool mesh3d::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(mesh_bvh->occluded(r, t_min, t_max, sampler));
+};
+
 bool mesh3d::bounding_box(Float t0, Float t1, aabb& box) const {
   return(mesh_bvh->bounding_box(t0,t1,box));
 };
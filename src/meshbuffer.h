@@ -0,0 +1,105 @@
+#ifndef MESHBUFFERH
+#define MESHBUFFERH
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+//Contiguous buffer of TriangleMesh data. It either owns its elements (in a std::vector) or is a
+//read-only view of elements kept alive by `owner`, e.g. a memory mapped mesh file, so those can be
+//used in place without copying them. Writing to a view first copies it into an owned buffer.
+template<typename T>
+class MeshBuffer {
+public:
+  MeshBuffer() : ptr(nullptr), count(0) {}
+  MeshBuffer(const MeshBuffer& other) : owned(other.owned), owner(other.owner), count(other.count) {
+    ptr = owner ? other.ptr : owned.data();
+  }
+  MeshBuffer& operator=(const MeshBuffer& other) {
+    if(this != &other) {
+      owned = other.owned;
+      owner = other.owner;
+      count = other.count;
+      ptr = owner ? other.ptr : owned.data();
+    }
+    return(*this);
+  }
+
+  void set_view(const T* data, size_t n, std::shared_ptr<const void> keep_alive) {
+    std::vector<T>().swap(owned);
+    owner = keep_alive;
+    ptr = data;
+    count = n;
+  }
+  bool is_view() const {return(owner != nullptr);}
+
+  size_t size() const {return(count);}
+  bool empty() const {return(count == 0);}
+  //Heap memory held by the buffer, which is none for views
+  size_t capacity() const {return(owned.capacity());}
+  const T* data() const {return(ptr);}
+  const T& operator[](size_t i) const {return(ptr[i]);}
+  const T* begin() const {return(ptr);}
+  const T* end() const {return(ptr + count);}
+  bool operator==(const MeshBuffer& other) const {
+    return(count == other.count && std::equal(begin(), end(), other.begin()));
+  }
+
+  void push_back(const T& value) {
+    own();
+    owned.push_back(value);
+    sync();
+  }
+  void reserve(size_t n) {
+    own();
+    owned.reserve(n);
+    sync();
+  }
+  void resize(size_t n) {
+    own();
+    owned.resize(n);
+    sync();
+  }
+  //Writable access to the elements, e.g. to fill a buffer sized with resize()
+  T* mutable_data() {
+    own();
+    return(owned.data());
+  }
+  template<typename It>
+  void assign(It first, It last) {
+    owner.reset();
+    owned.assign(first, last);
+    sync();
+  }
+  void clear() {
+    owner.reset();
+    owned.clear();
+    sync();
+  }
+  //Views hold no spare capacity, and copying them here would defeat the point of the view
+  void shrink_to_fit() {
+    if(owner) {
+      return;
+    }
+    owned.shrink_to_fit();
+    sync();
+  }
+
+private:
+  void own() {
+    if(owner) {
+      owned.assign(ptr, ptr + count);
+      owner.reset();
+    }
+  }
+  void sync() {
+    ptr = owned.data();
+    count = owned.size();
+  }
+  std::vector<T> owned;
+  std::shared_ptr<const void> owner;
+  const T* ptr;
+  size_t count;
+};
+
+#endif
@@ -0,0 +1,292 @@
+#include "meshfile.h"
+#include "mappedfile.h"
+#include "trimesh.h"
+#include "plymesh.h"
+#include <cstring>
+#include <fstream>
+#include <thread>
+
+//Fixed size header at the start of each mesh file. The vertex data is always stored in single
+//precision, whatever Float is.
+struct MeshFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;           //kMeshFileByteOrder as written by the converter
+  uint64_t vertex_count, normal_count, uv_count, face_count;
+  uint64_t normal_index_count;   //0 or 3 per face
+  uint64_t uv_index_count;       //0 or 3 per face
+  uint64_t face_material_count;  //0 or 1 per face
+  uint64_t material_count;
+  uint64_t string_bytes;
+};
+
+//Entry of the material table. The strings are offsets into the string section, which starts with
+//a NUL so offset 0 is the empty string.
+struct MeshFileMaterial {
+  float diffuse[3];
+  float specular[3];
+  float ior, dissolve, bump_intensity;
+  uint32_t name, diffuse_texture, bump_texture, alpha_texture;
+};
+
+static const char kMeshFileMagic[8] = {'R','A','Y','M','E','S','H','\0'};
+static const uint32_t kMeshFileByteOrder = 0x01020304;
+
+//The header is followed by these sections, each starting on a cache line so the buffers can be
+//used in place from the mapped file
+static const size_t kMeshFileAlignment = 64;
+enum MeshFileSection {
+  kMeshVertices, kMeshNormals, kMeshUVs, kMeshVertexIndices, kMeshNormalIndices, kMeshUVIndices,
+  kMeshFaceMaterials, kMeshMaterials, kMeshStrings, kMeshSectionCount
+};
+
+static void mesh_section_offsets(const MeshFileHeader& header, size_t* offsets) {
+  size_t sizes[kMeshSectionCount] = {
+    header.vertex_count * 3 * sizeof(float),
+    header.normal_count * 3 * sizeof(float),
+    header.uv_count * 2 * sizeof(float),
+    header.face_count * 3 * sizeof(uint32_t),
+    header.normal_index_count * sizeof(uint32_t),
+    header.uv_index_count * sizeof(uint32_t),
+    header.face_material_count * sizeof(uint32_t),
+    header.material_count * sizeof(MeshFileMaterial),
+    header.string_bytes
+  };
+  size_t offset = sizeof(MeshFileHeader);
+  for(int i = 0; i < kMeshSectionCount; i++) {
+    offset = (offset + kMeshFileAlignment - 1) & ~(kMeshFileAlignment - 1);
+    offsets[i] = offset;
+    offset += sizes[i];
+  }
+  offsets[kMeshSectionCount] = offset;
+}
+
+static void write_mesh_section(std::ofstream& out, const void* data, size_t size) {
+  while(out.tellp() % kMeshFileAlignment != 0) {
+    out.put(0);
+  }
+  if(size > 0) {
+    out.write(static_cast<const char*>(data), size);
+  }
+}
+
+//Vertex data in the file layout, converted from Float if needed
+template<typename T, int N>
+static std::vector<float> float_buffer(const MeshBuffer<T>& buffer) {
+  std::vector<float> values(N * buffer.size());
+  for(size_t i = 0; i < buffer.size(); i++) {
+    for(int k = 0; k < N; k++) {
+      values[N*i + k] = buffer[i].e[k];
+    }
+  }
+  return(values);
+}
+
+static uint32_t add_string(std::string& strings, const std::string& value) {
+  if(value.empty()) {
+    return(0);
+  }
+  uint32_t offset = strings.size();
+  strings += value;
+  strings.push_back('\0');
+  return(offset);
+}
+
+void save_mesh_file(const std::string& path, const TriangleMesh& mesh,
+                    const std::vector<MeshMaterialInfo>& materials) {
+  std::string strings(1, '\0');
+  std::vector<MeshFileMaterial> table(materials.size());
+  for(size_t i = 0; i < materials.size(); i++) {
+    const MeshMaterialInfo& info = materials[i];
+    for(int k = 0; k < 3; k++) {
+      table[i].diffuse[k] = info.diffuse.e[k];
+      table[i].specular[k] = info.specular.e[k];
+    }
+    table[i].ior = info.ior;
+    table[i].dissolve = info.dissolve;
+    table[i].bump_intensity = info.bump_intensity;
+    table[i].name = add_string(strings, info.name);
+    table[i].diffuse_texture = add_string(strings, info.diffuse_texture);
+    table[i].bump_texture = add_string(strings, info.bump_texture);
+    table[i].alpha_texture = add_string(strings, info.alpha_texture);
+  }
+  MeshFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kMeshFileMagic, sizeof(kMeshFileMagic));
+  header.version = kMeshFileVersion;
+  header.byte_order = kMeshFileByteOrder;
+  header.vertex_count = mesh.p.size();
+  header.normal_count = mesh.n.size();
+  header.uv_count = mesh.uv.size();
+  header.face_count = mesh.size();
+  header.normal_index_count = mesh.normalIndices.size();
+  header.uv_index_count = mesh.uvIndices.size();
+  header.face_material_count = mesh.faceMaterials.size();
+  header.material_count = table.size();
+  header.string_bytes = strings.size();
+
+  std::vector<float> vertices = float_buffer<point3f, 3>(mesh.p);
+  std::vector<float> normals = float_buffer<normal3f, 3>(mesh.n);
+  std::vector<float> uv = float_buffer<point2f, 2>(mesh.uv);
+  std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+  if(!out) {
+    throw std::runtime_error("Could not write mesh file " + path);
+  }
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  write_mesh_section(out, vertices.data(), vertices.size() * sizeof(float));
+  write_mesh_section(out, normals.data(), normals.size() * sizeof(float));
+  write_mesh_section(out, uv.data(), uv.size() * sizeof(float));
+  write_mesh_section(out, mesh.vertexIndices.data(), mesh.vertexIndices.size() * sizeof(uint32_t));
+  write_mesh_section(out, mesh.normalIndices.data(), mesh.normalIndices.size() * sizeof(uint32_t));
+  write_mesh_section(out, mesh.uvIndices.data(), mesh.uvIndices.size() * sizeof(uint32_t));
+  write_mesh_section(out, mesh.faceMaterials.data(), mesh.faceMaterials.size() * sizeof(uint32_t));
+  write_mesh_section(out, table.data(), table.size() * sizeof(MeshFileMaterial));
+  write_mesh_section(out, strings.data(), strings.size());
+  out.close();
+  if(!out) {
+    std::remove(path.c_str());
+    throw std::runtime_error("Could not write mesh file " + path);
+  }
+}
+
+void convert_mesh_file(const std::string& inputfile, const std::string& basedir,
+                       const std::string& outputfile) {
+  std::ifstream in(inputfile.c_str(), std::ios::binary);
+  if(!in) {
+    throw std::runtime_error("Could not open " + inputfile);
+  }
+  char start[3] = {0, 0, 0};
+  in.read(start, 3);
+  in.close();
+  Transform identity;
+  std::vector<MeshMaterialInfo> materials;
+  std::shared_ptr<TriangleMesh> mesh;
+  if(std::strncmp(start, "ply", 3) == 0) {
+    mesh = load_ply_mesh(inputfile, identity, 1, true);
+  } else {
+    mesh = load_obj_mesh(inputfile, basedir, identity, 1,
+                         std::max(std::thread::hardware_concurrency(), 1u), &materials);
+  }
+  save_mesh_file(outputfile, *mesh, materials);
+}
+
+//Checks that every entry of an index buffer is below `count` (or kNoMeshIndex, if allowed)
+static bool valid_indices(const uint32_t* indices, size_t n, uint64_t count, bool allow_missing) {
+  for(size_t i = 0; i < n; i++) {
+    if(indices[i] >= count && !(allow_missing && indices[i] == kNoMeshIndex)) {
+      return(false);
+    }
+  }
+  return(true);
+}
+
+std::shared_ptr<TriangleMesh> load_mesh_file(const std::string& path, const Transform& ObjectToWorld,
+                                             Float scale, std::vector<MeshMaterialInfo>* materials) {
+  std::shared_ptr<MappedFile> mapped = std::make_shared<MappedFile>(path);
+  const MappedFile& file = *mapped;
+  if(!file.data() || file.size() < sizeof(MeshFileHeader)) {
+    throw std::runtime_error("Could not read mesh file " + path);
+  }
+  MeshFileHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if(std::memcmp(header.magic, kMeshFileMagic, sizeof(kMeshFileMagic)) != 0 ||
+     header.byte_order != kMeshFileByteOrder) {
+    throw std::runtime_error(path + " is not a mesh file");
+  }
+  if(header.version != kMeshFileVersion) {
+    throw std::runtime_error(path + " was written by a different version of the mesh converter");
+  }
+  //Every count is bounded by the file size before the section offsets are computed from them
+  uint64_t counts[9] = {header.vertex_count, header.normal_count, header.uv_count, header.face_count,
+                        header.normal_index_count, header.uv_index_count, header.face_material_count,
+                        header.material_count, header.string_bytes};
+  for(int i = 0; i < 9; i++) {
+    if(counts[i] > file.size()) {
+      throw std::runtime_error("Mesh file " + path + " is truncated or corrupt");
+    }
+  }
+  size_t offsets[kMeshSectionCount + 1];
+  mesh_section_offsets(header, offsets);
+  const unsigned char* data = file.data();
+  const uint32_t* vertex_indices = reinterpret_cast<const uint32_t*>(data + offsets[kMeshVertexIndices]);
+  const uint32_t* normal_indices = reinterpret_cast<const uint32_t*>(data + offsets[kMeshNormalIndices]);
+  const uint32_t* uv_indices = reinterpret_cast<const uint32_t*>(data + offsets[kMeshUVIndices]);
+  const uint32_t* face_materials = reinterpret_cast<const uint32_t*>(data + offsets[kMeshFaceMaterials]);
+  const MeshFileMaterial* table = reinterpret_cast<const MeshFileMaterial*>(data + offsets[kMeshMaterials]);
+  const char* strings = reinterpret_cast<const char*>(data + offsets[kMeshStrings]);
+  bool valid = file.size() >= offsets[kMeshSectionCount] && header.face_count > 0 &&
+    header.vertex_count < kNoMeshIndex && header.normal_count < kNoMeshIndex && header.uv_count < kNoMeshIndex &&
+    (header.normal_index_count == 0 || header.normal_index_count == 3 * header.face_count) &&
+    (header.uv_index_count == 0 || header.uv_index_count == 3 * header.face_count) &&
+    (header.face_material_count == 0 || header.face_material_count == header.face_count) &&
+    header.string_bytes > 0;
+  valid = valid && valid_indices(vertex_indices, 3 * header.face_count, header.vertex_count, false) &&
+    valid_indices(normal_indices, header.normal_index_count, header.normal_count, true) &&
+    valid_indices(uv_indices, header.uv_index_count, header.uv_count, true) &&
+    valid_indices(face_materials, header.face_material_count, header.material_count, false);
+  //Normals and UVs indexed like the vertices need one per vertex
+  valid = valid && (header.normal_count == 0 || header.normal_index_count != 0 ||
+                    header.normal_count >= header.vertex_count);
+  valid = valid && (header.uv_count == 0 || header.uv_index_count != 0 ||
+                    header.uv_count >= header.vertex_count);
+  valid = valid && strings[0] == '\0' && strings[header.string_bytes - 1] == '\0';
+  for(size_t i = 0; valid && i < header.material_count; i++) {
+    valid = table[i].name < header.string_bytes && table[i].diffuse_texture < header.string_bytes &&
+      table[i].bump_texture < header.string_bytes && table[i].alpha_texture < header.string_bytes;
+  }
+  if(!valid) {
+    throw std::runtime_error("Mesh file " + path + " is truncated or corrupt");
+  }
+
+  const float* vertices = reinterpret_cast<const float*>(data + offsets[kMeshVertices]);
+  const float* normals = reinterpret_cast<const float*>(data + offsets[kMeshNormals]);
+  const float* uv = reinterpret_cast<const float*>(data + offsets[kMeshUVs]);
+  std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>();
+  bool single_precision = sizeof(point3f) == 3 * sizeof(float) && sizeof(normal3f) == 3 * sizeof(float) &&
+    sizeof(point2f) == 2 * sizeof(float);
+  if(single_precision && ObjectToWorld.IsIdentity() && scale == 1) {
+    mesh->p.set_view(reinterpret_cast<const point3f*>(vertices), header.vertex_count, mapped);
+    mesh->n.set_view(reinterpret_cast<const normal3f*>(normals), header.normal_count, mapped);
+  } else {
+    mesh->p.reserve(header.vertex_count);
+    for(size_t i = 0; i < header.vertex_count; i++) {
+      const float* v = &vertices[3*i];
+      mesh->p.push_back(ObjectToWorld(point3f(vec3f(v[0], v[1], v[2])*scale)));
+    }
+    mesh->n.reserve(header.normal_count);
+    for(size_t i = 0; i < header.normal_count; i++) {
+      const float* v = &normals[3*i];
+      mesh->n.push_back(ObjectToWorld(normal3f(v[0], v[1], v[2])));
+    }
+  }
+  if(single_precision) {
+    mesh->uv.set_view(reinterpret_cast<const point2f*>(uv), header.uv_count, mapped);
+  } else {
+    mesh->uv.reserve(header.uv_count);
+    for(size_t i = 0; i < header.uv_count; i++) {
+      mesh->uv.push_back(point2f(uv[2*i], uv[2*i+1]));
+    }
+  }
+  mesh->vertexIndices.set_view(vertex_indices, 3 * header.face_count, mapped);
+  mesh->normalIndices.set_view(normal_indices, header.normal_index_count, mapped);
+  mesh->uvIndices.set_view(uv_indices, header.uv_index_count, mapped);
+  mesh->faceMaterials.set_view(face_materials, header.face_material_count, mapped);
+
+  if(materials) {
+    materials->clear();
+    for(size_t i = 0; i < header.material_count; i++) {
+      MeshMaterialInfo info;
+      info.name = strings + table[i].name;
+      info.diffuse = vec3f(table[i].diffuse[0], table[i].diffuse[1], table[i].diffuse[2]);
+      info.specular = vec3f(table[i].specular[0], table[i].specular[1], table[i].specular[2]);
+      info.ior = table[i].ior;
+      info.dissolve = table[i].dissolve;
+      info.bump_intensity = table[i].bump_intensity;
+      info.diffuse_texture = strings + table[i].diffuse_texture;
+      info.bump_texture = strings + table[i].bump_texture;
+      info.alpha_texture = strings + table[i].alpha_texture;
+      materials->push_back(info);
+    }
+  }
+  return(mesh);
+}
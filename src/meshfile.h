@@ -0,0 +1,38 @@
+#ifndef MESHFILEH
+#define MESHFILEH
+
+#include "triangle.h"
+#include "transform.h"
+#include <string>
+
+//Native binary mesh file (.raymesh): the object space buffers of an indexed triangle mesh and
+//its material table, each in its own section so a memory mapped file can be used in place
+static const uint32_t kMeshFileVersion = 1;
+
+//Material of an OBJ file, as stored in the material table of a mesh file. The texture paths are
+//the ones the OBJ loader opens (joined with the OBJ's directory), empty if there's no texture.
+struct MeshMaterialInfo {
+  MeshMaterialInfo() : diffuse(1,1,1), specular(0,0,0), ior(1), dissolve(1), bump_intensity(1) {}
+  std::string name;
+  vec3f diffuse, specular;
+  Float ior, dissolve, bump_intensity;
+  std::string diffuse_texture, bump_texture, alpha_texture;
+};
+
+//Writes an object space mesh (one loaded with an identity transform and unit scale) and its
+//material table, which faceMaterials indexes into
+void save_mesh_file(const std::string& path, const TriangleMesh& mesh,
+                    const std::vector<MeshMaterialInfo>& materials);
+
+//Converts an OBJ or PLY file (PLY if the file starts with "ply") to a mesh file
+void convert_mesh_file(const std::string& inputfile, const std::string& basedir,
+                       const std::string& outputfile);
+
+//Maps a mesh file and returns its buffers, with the vertices and normals transformed as in the
+//OBJ and PLY loaders. With an identity transform and unit scale (and a single precision build)
+//every buffer is a view of the mapped file; otherwise only the vertices and normals are copied.
+//The mesh's own material table is left empty. Throws if the file isn't a valid mesh file.
+std::shared_ptr<TriangleMesh> load_mesh_file(const std::string& path, const Transform& ObjectToWorld,
+                                             Float scale, std::vector<MeshMaterialInfo>* materials);
+
+#endif
@@ -0,0 +1,414 @@
+#include "meshlod.h"
+#include <queue>
+#include <algorithm>
+
+MeshLOD MeshLOD::for_instance(const Transform& ToWorld) const {
+  MeshLOD lod = *this;
+  lod.InstanceToWorld = ToWorld;
+  return(lod);
+}
+
+//Pixels covered by a sphere, estimated by the area of its projected disk. Negative if the camera is
+//inside the sphere, where the mesh can fill the view at any size.
+static Float projected_pixels(const LodView& view, const vec3f& center, Float radius, int ny) {
+  Float radius_px;
+  if(view.fov == 0) {
+    radius_px = radius / view.ortho_height * ny;
+  } else {
+    Float dist = (center - view.lookfrom).length();
+    if(dist <= radius) {
+      return(-1);
+    }
+    Float angle = std::asin(radius / dist);
+    if(view.fov == 360) {
+      radius_px = angle / static_cast<Float>(M_PI) * ny;
+    } else {
+      radius_px = std::tan(angle) / std::tan(view.fov * static_cast<Float>(M_PI) / 360) * ny / 2;
+    }
+  }
+  return(static_cast<Float>(M_PI) * radius_px * radius_px);
+}
+
+int MeshLOD::level(const aabb& bounds, size_t faces) const {
+  if(!enabled() || faces < kMinLodFaces) {
+    return(0);
+  }
+  aabb box = InstanceToWorld(bounds);
+  vec3f low(box.min().x(), box.min().y(), box.min().z());
+  vec3f high(box.max().x(), box.max().y(), box.max().z());
+  vec3f center = (low + high) / 2;
+  Float radius = (high - low).length() / 2;
+  Float pixels = 0;
+  for(const LodView& view : views) {
+    Float view_pixels = projected_pixels(view, center, radius, ny);
+    if(view_pixels < 0) {
+      return(0);
+    }
+    pixels = std::max(pixels, view_pixels);
+  }
+  pixels = std::min(pixels, static_cast<Float>(nx) * static_cast<Float>(ny));
+  double budget = std::max(static_cast<double>(triangles_per_pixel) * pixels, static_cast<double>(kMinLodFaces));
+  int lod_level = 0;
+  double level_faces = static_cast<double>(faces) / 4;
+  while(level_faces >= budget) {
+    lod_level++;
+    level_faces /= 4;
+  }
+  return(lod_level);
+}
+
+//Symmetric 4x4 error quadric, stored as its upper triangle
+struct Quadric {
+  Quadric() {
+    std::fill(q, q + 10, 0.0);
+  }
+  //Squared distance to the plane ax + by + cz + d = 0 (with a unit normal), times `weight`
+  Quadric(double a, double b, double c, double d, double weight) {
+    q[0] = weight*a*a; q[1] = weight*a*b; q[2] = weight*a*c; q[3] = weight*a*d;
+    q[4] = weight*b*b; q[5] = weight*b*c; q[6] = weight*b*d;
+    q[7] = weight*c*c; q[8] = weight*c*d;
+    q[9] = weight*d*d;
+  }
+  Quadric& operator+=(const Quadric& other) {
+    for(int i = 0; i < 10; i++) {
+      q[i] += other.q[i];
+    }
+    return(*this);
+  }
+  double error(const point3f& p) const {
+    double x = p.x(), y = p.y(), z = p.z();
+    return(q[0]*x*x + 2*q[1]*x*y + 2*q[2]*x*z + 2*q[3]*x +
+           q[4]*y*y + 2*q[5]*y*z + 2*q[6]*y +
+           q[7]*z*z + 2*q[8]*z + q[9]);
+  }
+  double q[10];
+};
+
+//Moving vertex `from` onto vertex `to`. The stamps are the vertices' versions when the cost was
+//computed, so entries left in the queue after either vertex changes are skipped.
+struct EdgeCollapse {
+  double cost;
+  uint32_t from, to;
+  uint32_t from_stamp, to_stamp;
+  bool reversed;  //Already the other direction of a rejected collapse
+  bool operator<(const EdgeCollapse& other) const {
+    return(cost > other.cost);
+  }
+};
+
+//Weight of the planes that hold the mesh boundaries and seams in place, relative to the faces'
+static const double kBorderWeight = 1000;
+//Collapses that turn a face by more than this (the cosine of the angle) are rejected
+static const double kMinFaceCosine = 0.2;
+
+std::shared_ptr<TriangleMesh> simplify_mesh(const TriangleMesh& mesh, size_t target_faces) {
+  size_t num_faces = mesh.size();
+  size_t num_verts = mesh.p.size();
+  std::vector<uint32_t> tri(mesh.vertexIndices.begin(), mesh.vertexIndices.end());
+  const point3f* p = mesh.p.data();
+
+  auto corner_of = [&](uint32_t face, uint32_t vertex) {
+    return(tri[3*face] == vertex ? 0 : tri[3*face+1] == vertex ? 1 : tri[3*face+2] == vertex ? 2 : -1);
+  };
+  //Whether faces f0 and f1 can be merged across their shared edge (a, b): same material, and the
+  //same normals and texture coordinates on both sides if those are indexed separately
+  auto faces_match = [&](uint32_t f0, uint32_t f1, uint32_t a, uint32_t b) {
+    if(!mesh.faceMaterials.empty() && mesh.faceMaterials[f0] != mesh.faceMaterials[f1]) {
+      return(false);
+    }
+    uint32_t ends[2] = {a, b};
+    for(uint32_t v : ends) {
+      size_t c0 = 3 * f0 + corner_of(f0, v);
+      size_t c1 = 3 * f1 + corner_of(f1, v);
+      if(!mesh.normalIndices.empty() && mesh.normalIndices[c0] != mesh.normalIndices[c1]) {
+        return(false);
+      }
+      if(!mesh.uvIndices.empty() && mesh.uvIndices[c0] != mesh.uvIndices[c1]) {
+        return(false);
+      }
+    }
+    return(true);
+  };
+  auto face_normal = [&](uint32_t face, uint32_t moved, const point3f& moved_to) {
+    point3f v[3];
+    for(int i = 0; i < 3; i++) {
+      v[i] = tri[3*face+i] == moved ? moved_to : p[tri[3*face+i]];
+    }
+    return(cross(v[1] - v[0], v[2] - v[0]));
+  };
+
+  std::vector<std::vector<uint32_t> > vertex_faces(num_verts);
+  std::vector<Quadric> quadrics(num_verts);
+  for(uint32_t f = 0; f < num_faces; f++) {
+    vec3f normal = face_normal(f, kNoMeshIndex, point3f(0,0,0));
+    Float area2 = normal.length();
+    for(int i = 0; i < 3; i++) {
+      vertex_faces[tri[3*f+i]].push_back(f);
+    }
+    if(area2 == 0) {
+      continue;
+    }
+    normal /= area2;
+    const point3f& a = p[tri[3*f]];
+    Quadric plane(normal.x(), normal.y(), normal.z(),
+                  -(normal.x()*a.x() + normal.y()*a.y() + normal.z()*a.z()), area2 / 2);
+    for(int i = 0; i < 3; i++) {
+      quadrics[tri[3*f+i]] += plane;
+    }
+  }
+
+  //Edges sorted by their (lower, higher) vertex pair, so the faces sharing each are adjacent
+  std::vector<std::pair<uint64_t, uint32_t> > edges(3 * num_faces);
+  for(uint32_t f = 0; f < num_faces; f++) {
+    for(int i = 0; i < 3; i++) {
+      uint64_t a = tri[3*f+i], b = tri[3*f+(i+1)%3];
+      edges[3*f+i] = std::make_pair(std::min(a, b) << 32 | std::max(a, b), 3*f+i);
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+  std::vector<char> border(num_verts, 0);
+  std::vector<std::pair<uint32_t, uint32_t> > unique_edges;
+  for(size_t start = 0, end; start < edges.size(); start = end) {
+    for(end = start + 1; end < edges.size() && edges[end].first == edges[start].first; end++) {}
+    uint32_t a = static_cast<uint32_t>(edges[start].first >> 32);
+    uint32_t b = static_cast<uint32_t>(edges[start].first & 0xFFFFFFFF);
+    if(a == b) {
+      continue;
+    }
+    unique_edges.push_back(std::make_pair(a, b));
+    if(end - start == 2 && faces_match(edges[start].second / 3, edges[start+1].second / 3, a, b)) {
+      continue;
+    }
+    //Boundary, seam or non-manifold edge: add planes through it, perpendicular to its faces
+    border[a] = border[b] = 1;
+    for(size_t e = start; e < end; e++) {
+      uint32_t f = edges[e].second / 3;
+      vec3f normal = face_normal(f, kNoMeshIndex, point3f(0,0,0));
+      vec3f edge = p[b] - p[a];
+      vec3f side = cross(edge, normal);
+      Float length = side.length();
+      if(length == 0) {
+        continue;
+      }
+      side /= length;
+      Quadric plane(side.x(), side.y(), side.z(),
+                    -(side.x()*p[a].x() + side.y()*p[a].y() + side.z()*p[a].z()),
+                    kBorderWeight * edge.squared_length());
+      quadrics[a] += plane;
+      quadrics[b] += plane;
+    }
+  }
+  std::vector<std::pair<uint64_t, uint32_t> >().swap(edges);
+
+  std::vector<uint32_t> stamp(num_verts, 0);
+  std::vector<char> removed(num_verts, 0);
+  std::vector<char> face_alive(num_faces, 1);
+  std::priority_queue<EdgeCollapse> queue;
+  //Queues the cheaper direction of collapsing edge (a, b). A border vertex can only move onto
+  //another border vertex.
+  auto can_move = [&](uint32_t from, uint32_t to) {
+    return(!border[from] || border[to]);
+  };
+  auto collapse_cost = [&](uint32_t from, uint32_t to) {
+    Quadric q = quadrics[from];
+    q += quadrics[to];
+    return(q.error(p[to]));
+  };
+  auto push_edge = [&](uint32_t a, uint32_t b) {
+    bool a_to_b = can_move(a, b), b_to_a = can_move(b, a);
+    double cost_ab = a_to_b ? collapse_cost(a, b) : 0;
+    double cost_ba = b_to_a ? collapse_cost(b, a) : 0;
+    if(a_to_b && (!b_to_a || cost_ab <= cost_ba)) {
+      queue.push({cost_ab, a, b, stamp[a], stamp[b], false});
+    } else if(b_to_a) {
+      queue.push({cost_ba, b, a, stamp[b], stamp[a], false});
+    }
+  };
+  for(const auto& edge : unique_edges) {
+    push_edge(edge.first, edge.second);
+  }
+  std::vector<std::pair<uint32_t, uint32_t> >().swap(unique_edges);
+
+  std::vector<uint32_t> from_neighbors, to_neighbors, shared_faces;
+  auto gather_neighbors = [&](uint32_t v, std::vector<uint32_t>& neighbors) {
+    neighbors.clear();
+    for(uint32_t f : vertex_faces[v]) {
+      for(int i = 0; i < 3; i++) {
+        if(tri[3*f+i] != v) {
+          neighbors.push_back(tri[3*f+i]);
+        }
+      }
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+  };
+  auto can_collapse = [&](uint32_t from, uint32_t to) {
+    shared_faces.clear();
+    for(uint32_t f : vertex_faces[from]) {
+      if(corner_of(f, to) >= 0) {
+        shared_faces.push_back(f);
+      }
+    }
+    if(shared_faces.empty() || shared_faces.size() > 2) {
+      return(false);
+    }
+    //A border vertex has to slide along the border
+    if(border[from] && shared_faces.size() == 2 && faces_match(shared_faces[0], shared_faces[1], from, to)) {
+      return(false);
+    }
+    //Link condition: the edge's ends may only share the neighbors opposite it, or the collapse
+    //pinches the surface
+    gather_neighbors(from, from_neighbors);
+    gather_neighbors(to, to_neighbors);
+    size_t common = 0;
+    for(size_t i = 0, j = 0; i < from_neighbors.size() && j < to_neighbors.size();) {
+      if(from_neighbors[i] < to_neighbors[j]) {
+        i++;
+      } else if(from_neighbors[i] > to_neighbors[j]) {
+        j++;
+      } else {
+        common++;
+        i++;
+        j++;
+      }
+    }
+    if(common != shared_faces.size()) {
+      return(false);
+    }
+    for(uint32_t f : vertex_faces[from]) {
+      if(corner_of(f, to) >= 0) {
+        continue;
+      }
+      //Faces that are already degenerate (e.g. at the poles of a UV sphere) can't flip
+      vec3f before = face_normal(f, kNoMeshIndex, point3f(0,0,0));
+      if(before.squared_length() == 0) {
+        continue;
+      }
+      vec3f after = face_normal(f, from, p[to]);
+      double length = static_cast<double>(before.length()) * after.length();
+      if(length == 0 || dot(before, after) < kMinFaceCosine * length) {
+        return(false);
+      }
+    }
+    return(true);
+  };
+
+  size_t live_faces = num_faces;
+  while(live_faces > target_faces && !queue.empty()) {
+    EdgeCollapse collapse = queue.top();
+    queue.pop();
+    uint32_t from = collapse.from, to = collapse.to;
+    if(removed[from] || removed[to] || stamp[from] != collapse.from_stamp || stamp[to] != collapse.to_stamp) {
+      continue;
+    }
+    if(!can_collapse(from, to)) {
+      //Moving the other vertex instead may not flip any faces
+      if(!collapse.reversed && !shared_faces.empty() && can_move(to, from)) {
+        queue.push({collapse_cost(to, from), to, from, stamp[to], stamp[from], true});
+      }
+      continue;
+    }
+    for(uint32_t f : vertex_faces[from]) {
+      int corner = corner_of(f, to);
+      if(corner >= 0) {
+        face_alive[f] = 0;
+        live_faces--;
+        //The face's third vertex drops it too, so no vertex keeps a list entry for a dead face
+        for(int i = 0; i < 3; i++) {
+          uint32_t v = tri[3*f+i];
+          if(v != from && v != to) {
+            std::vector<uint32_t>& faces = vertex_faces[v];
+            faces.erase(std::remove(faces.begin(), faces.end(), f), faces.end());
+          }
+        }
+      } else {
+        tri[3*f+corner_of(f, from)] = to;
+        vertex_faces[to].push_back(f);
+      }
+    }
+    std::vector<uint32_t>& to_faces = vertex_faces[to];
+    to_faces.erase(std::remove_if(to_faces.begin(), to_faces.end(),
+                                  [&](uint32_t f) {return(!face_alive[f]);}), to_faces.end());
+    std::vector<uint32_t>().swap(vertex_faces[from]);
+    quadrics[to] += quadrics[from];
+    removed[from] = 1;
+    stamp[to]++;
+    gather_neighbors(to, to_neighbors);
+    for(uint32_t neighbor : to_neighbors) {
+      push_edge(to, neighbor);
+    }
+  }
+
+  //Copy the remaining faces, keeping only the vertices, normals and texture coordinates they use
+  std::shared_ptr<TriangleMesh> simplified = std::make_shared<TriangleMesh>();
+  std::vector<uint32_t> vertex_map(num_verts, kNoMeshIndex);
+  std::vector<uint32_t> normal_map(mesh.normalIndices.empty() ? 0 : mesh.n.size(), kNoMeshIndex);
+  std::vector<uint32_t> uv_map(mesh.uvIndices.empty() ? 0 : mesh.uv.size(), kNoMeshIndex);
+  bool vertex_normals = !mesh.n.empty() && mesh.normalIndices.empty();
+  bool vertex_uv = !mesh.uv.empty() && mesh.uvIndices.empty();
+  simplified->vertexIndices.reserve(3 * live_faces);
+  for(uint32_t f = 0; f < num_faces; f++) {
+    if(!face_alive[f]) {
+      continue;
+    }
+    for(int i = 0; i < 3; i++) {
+      uint32_t v = tri[3*f+i];
+      if(vertex_map[v] == kNoMeshIndex) {
+        vertex_map[v] = static_cast<uint32_t>(simplified->p.size());
+        simplified->p.push_back(p[v]);
+        if(vertex_normals) {
+          simplified->n.push_back(mesh.n[v]);
+        }
+        if(vertex_uv) {
+          simplified->uv.push_back(mesh.uv[v]);
+        }
+      }
+      simplified->vertexIndices.push_back(vertex_map[v]);
+      if(!mesh.normalIndices.empty()) {
+        uint32_t normal = mesh.normalIndices[3*f+i];
+        if(normal != kNoMeshIndex && normal_map[normal] == kNoMeshIndex) {
+          normal_map[normal] = static_cast<uint32_t>(simplified->n.size());
+          simplified->n.push_back(mesh.n[normal]);
+        }
+        simplified->normalIndices.push_back(normal == kNoMeshIndex ? kNoMeshIndex : normal_map[normal]);
+      }
+      if(!mesh.uvIndices.empty()) {
+        uint32_t uv = mesh.uvIndices[3*f+i];
+        if(uv != kNoMeshIndex && uv_map[uv] == kNoMeshIndex) {
+          uv_map[uv] = static_cast<uint32_t>(simplified->uv.size());
+          simplified->uv.push_back(mesh.uv[uv]);
+        }
+        simplified->uvIndices.push_back(uv == kNoMeshIndex ? kNoMeshIndex : uv_map[uv]);
+      }
+    }
+    if(!mesh.faceMaterials.empty()) {
+      simplified->faceMaterials.push_back(mesh.faceMaterials[f]);
+    }
+  }
+  simplified->materials = mesh.materials;
+  simplified->alpha_masks = mesh.alpha_masks;
+  simplified->bump_textures = mesh.bump_textures;
+  simplified->material_uv = mesh.material_uv;
+  simplified->compact();
+  return(simplified);
+}
+
+int mesh_lod_level(const TriangleMesh& mesh, const MeshLOD& lod, LodSource& source) {
+  source.faces = mesh.size();
+  source.bounds = aabb();
+  for(const point3f& v : mesh.p) {
+    source.bounds = surrounding_box(source.bounds, v);
+  }
+  return(lod.level(source.bounds, source.faces));
+}
+
+void simplify_mesh_level(std::shared_ptr<TriangleMesh>& mesh, int level) {
+  if(level > 0) {
+    size_t target = std::max(kMinLodFaces, mesh->size() >> (2 * level));
+    mesh = simplify_mesh(*mesh, target);
+  }
+}
+
+void apply_mesh_lod(std::shared_ptr<TriangleMesh>& mesh, const MeshLOD& lod, LodSource& source) {
+  simplify_mesh_level(mesh, mesh_lod_level(*mesh, lod, source));
+}
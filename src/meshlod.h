@@ -0,0 +1,63 @@
+#ifndef MESHLODH
+#define MESHLODH
+
+#include "triangle.h"
+#include "transform.h"
+#include "aabb.h"
+#include <vector>
+
+//Meshes with fewer faces than this are never simplified
+static const size_t kMinLodFaces = 1024;
+
+//A camera the scene is rendered from
+struct LodView {
+  LodView(vec3f lookfrom, Float fov, Float ortho_height) :
+    lookfrom(lookfrom), fov(fov), ortho_height(ortho_height) {}
+  vec3f lookfrom;
+  Float fov;          //Vertical field of view in degrees: 0 is orthographic and 360 an environment camera
+  Float ortho_height; //Height of the orthographic view
+};
+
+//Level of detail settings for the mesh objects. Level 0 is the full mesh and each level after it
+//has a quarter of the faces of the one before. A mesh uses the coarsest level that still has
+//`triangles_per_pixel` triangles for each pixel it covers in the view where it looks the largest.
+struct MeshLOD {
+  MeshLOD() : triangles_per_pixel(0), nx(0), ny(0) {}
+  bool enabled() const {
+    return(triangles_per_pixel > 0 && !views.empty());
+  }
+  //Settings for a mesh that's drawn with the transform `ToWorld` (e.g. an instance of a shared mesh)
+  MeshLOD for_instance(const Transform& ToWorld) const;
+  //Level for a mesh with `faces` faces and bounds `bounds` (before InstanceToWorld is applied)
+  int level(const aabb& bounds, size_t faces) const;
+
+  Float triangles_per_pixel;
+  int nx, ny;
+  std::vector<LodView> views;
+  Transform InstanceToWorld;
+};
+
+//Full detail face count and bounds of a mesh, which the levels of its other instances are picked from
+struct LodSource {
+  LodSource() : faces(0) {}
+  aabb bounds;
+  size_t faces;
+};
+
+//Simplifies the mesh to about `target_faces` faces with quadric error metrics (Garland and Heckbert),
+//collapsing edges into one of their vertices so the vertex positions, normals and texture
+//coordinates kept are all original ones. Mesh boundaries and the edges between faces with
+//different materials or texture coordinates are kept in place.
+std::shared_ptr<TriangleMesh> simplify_mesh(const TriangleMesh& mesh, size_t target_faces);
+
+//Level `lod` picks for the full mesh `mesh`, filling in `source` with its face count and bounds
+int mesh_lod_level(const TriangleMesh& mesh, const MeshLOD& lod, LodSource& source);
+
+//Replaces the full mesh `mesh` with its simplified version for `level` (unchanged for level 0)
+void simplify_mesh_level(std::shared_ptr<TriangleMesh>& mesh, int level);
+
+//Replaces `mesh` with the level `lod` picks for it, and fills in `source` with the full mesh's
+//face count and bounds
+void apply_mesh_lod(std::shared_ptr<TriangleMesh>& mesh, const MeshLOD& lod, LodSource& source);
+
+#endif
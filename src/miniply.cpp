@@ -1881,6 +1881,7 @@ namespace miniply {
       }
     }
 
+    const uint32_t numTris = n - 2;
     const Vec3* vpos = reinterpret_cast<const Vec3*>(pos);
 
     // Calculate the geometric normal of the face
@@ -1940,7 +1941,7 @@ namespace miniply {
     dst[1] = indices[next[first]];
     dst[2] = indices[prev[first]];
 
-    return n - 2;
+    return numTris;
   }
 
 } // namespace miniply
@@ -0,0 +1,494 @@
+#include "objloader.h"
+#include "mappedfile.h"
+#include "RcppThread.h"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <memory>
+#include <functional>
+
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tinyobj/tiny_obj_loader.h"
+
+using namespace tinyobj;
+
+namespace {
+
+//usemtl and mtllib lines, which are resolved in file order once every chunk is parsed
+struct ObjStatement {
+  bool usemtl;
+  std::string arg;
+  size_t face;
+  size_t line;
+};
+
+struct ObjChunk {
+  ObjChunk() : begin(nullptr), end(nullptr), lines(0), error_line(0), inherited_faces(0),
+    has_smoothing(false), last_smoothing(0), first_smoothing(0), v_offset(0), vn_offset(0),
+    vt_offset(0), greatest_v(-1), greatest_vn(-1), greatest_vt(-1) {}
+  const char* begin;
+  const char* end;
+  std::vector<real_t> v, vn, vt, vc;
+  //Corners of every face, and the number of corners and smoothing group of each face
+  std::vector<vertex_index_t> corners;
+  std::vector<unsigned int> face_sizes;
+  std::vector<unsigned int> smoothing;
+  //Corners (3 * corner + 0/1/2 for v/vt/vn) holding a negative index, which is resolved
+  //against the chunk's own counts until the preceding chunks' counts are known
+  std::vector<size_t> relative;
+  std::vector<ObjStatement> statements;
+  //Material of the faces from each position on
+  std::vector<std::pair<size_t, int> > runs;
+  size_t lines, error_line;
+  //Faces before the chunk's first `s` line, which are in the previous chunk's smoothing group
+  size_t inherited_faces;
+  bool has_smoothing;
+  unsigned int last_smoothing, first_smoothing;
+  int v_offset, vn_offset, vt_offset;
+  int greatest_v, greatest_vn, greatest_vt;
+  shape_t shape;
+  std::string warn;
+};
+
+//fixIndex, except that relative indices are recorded so they can be offset later
+inline bool fix_chunk_index(int idx, size_t n, int* ret, ObjChunk& chunk, size_t slot) {
+  if(idx > 0) {
+    *ret = idx - 1;
+    return(true);
+  }
+  if(idx == 0) {
+    return(false);
+  }
+  *ret = static_cast<int>(n) + idx;
+  chunk.relative.push_back(slot);
+  return(true);
+}
+
+//tinyobj's parseTriple for a face corner of a chunk
+bool parse_chunk_triple(const char** token, ObjChunk& chunk, vertex_index_t* ret) {
+  vertex_index_t vi(-1);
+  size_t slot = 3 * chunk.corners.size();
+  if(!fix_chunk_index(atoi(*token), chunk.v.size() / 3, &vi.v_idx, chunk, slot)) {
+    return(false);
+  }
+  (*token) += strcspn(*token, "/ \t\r");
+  if((*token)[0] != '/') {
+    *ret = vi;
+    return(true);
+  }
+  (*token)++;
+
+  //i//k
+  if((*token)[0] == '/') {
+    (*token)++;
+    if(!fix_chunk_index(atoi(*token), chunk.vn.size() / 3, &vi.vn_idx, chunk, slot + 2)) {
+      return(false);
+    }
+    (*token) += strcspn(*token, "/ \t\r");
+    *ret = vi;
+    return(true);
+  }
+
+  //i/j/k or i/j
+  if(!fix_chunk_index(atoi(*token), chunk.vt.size() / 2, &vi.vt_idx, chunk, slot + 1)) {
+    return(false);
+  }
+  (*token) += strcspn(*token, "/ \t\r");
+  if((*token)[0] != '/') {
+    *ret = vi;
+    return(true);
+  }
+
+  //i/j/k
+  (*token)++;
+  if(!fix_chunk_index(atoi(*token), chunk.vn.size() / 3, &vi.vn_idx, chunk, slot + 2)) {
+    return(false);
+  }
+  (*token) += strcspn(*token, "/ \t\r");
+  *ret = vi;
+  return(true);
+}
+
+//Parses the statements of a chunk that the renderer uses (v, vn, vt, f, s, usemtl and mtllib),
+//stopping at the first bad face
+void parse_obj_chunk(ObjChunk& chunk, bool vertex_colors) {
+  std::string linebuf;
+  unsigned int current_smoothing_id = 0;
+  const char* p = chunk.begin;
+  while(p < chunk.end) {
+    //Lines end in "\n", "\r\n" or "\r", as in tinyobj's safeGetline()
+    const char* line_end = p;
+    while(line_end < chunk.end && *line_end != '\n' && *line_end != '\r') {
+      line_end++;
+    }
+    linebuf.assign(p, line_end);
+    p = line_end;
+    if(p < chunk.end) {
+      if(*p == '\r' && p + 1 < chunk.end && p[1] == '\n') {
+        p++;
+      }
+      p++;
+    }
+    chunk.lines++;
+
+    const char* token = linebuf.c_str();
+    token += strspn(token, " \t");
+    if(token[0] == '\0' || token[0] == '#') {
+      continue;
+    }
+
+    if(token[0] == 'v' && IS_SPACE(token[1])) {
+      token += 2;
+      real_t x, y, z, r, g, b;
+      parseVertexWithColor(&x, &y, &z, &r, &g, &b, &token);
+      chunk.v.push_back(x);
+      chunk.v.push_back(y);
+      chunk.v.push_back(z);
+      if(vertex_colors) {
+        chunk.vc.push_back(r);
+        chunk.vc.push_back(g);
+        chunk.vc.push_back(b);
+      }
+      continue;
+    }
+
+    if(token[0] == 'v' && token[1] == 'n' && IS_SPACE(token[2])) {
+      token += 3;
+      real_t x, y, z;
+      parseReal3(&x, &y, &z, &token);
+      chunk.vn.push_back(x);
+      chunk.vn.push_back(y);
+      chunk.vn.push_back(z);
+      continue;
+    }
+
+    if(token[0] == 'v' && token[1] == 't' && IS_SPACE(token[2])) {
+      token += 3;
+      real_t x, y;
+      parseReal2(&x, &y, &token);
+      chunk.vt.push_back(x);
+      chunk.vt.push_back(y);
+      continue;
+    }
+
+    if(token[0] == 'f' && IS_SPACE(token[1])) {
+      token += 2;
+      token += strspn(token, " \t");
+      size_t first_corner = chunk.corners.size();
+      while(!IS_NEW_LINE(token[0])) {
+        vertex_index_t vi;
+        if(!parse_chunk_triple(&token, chunk, &vi)) {
+          chunk.error_line = chunk.lines;
+          return;
+        }
+        chunk.corners.push_back(vi);
+        token += strspn(token, " \t\r");
+      }
+      chunk.face_sizes.push_back(chunk.corners.size() - first_corner);
+      chunk.smoothing.push_back(current_smoothing_id);
+      if(!chunk.has_smoothing) {
+        chunk.inherited_faces++;
+      }
+      continue;
+    }
+
+    if(0 == strncmp(token, "usemtl", 6)) {
+      token += 6;
+      ObjStatement statement = {true, parseString(&token), chunk.face_sizes.size(), chunk.lines};
+      chunk.statements.push_back(statement);
+      continue;
+    }
+
+    if(0 == strncmp(token, "mtllib", 6) && IS_SPACE(token[6])) {
+      token += 7;
+      ObjStatement statement = {false, std::string(token), chunk.face_sizes.size(), chunk.lines};
+      chunk.statements.push_back(statement);
+      continue;
+    }
+
+    if(token[0] == 's' && IS_SPACE(token[1])) {
+      token += 2;
+      token += strspn(token, " \t");
+      if(token[0] == '\0' || token[0] == '\r' || token[1] == '\n') {
+        continue;
+      }
+      if(strlen(token) >= 3 && token[0] == 'o' && token[1] == 'f' && token[2] == 'f') {
+        current_smoothing_id = 0;
+      } else {
+        int smGroupId = parseInt(&token);
+        current_smoothing_id = smGroupId < 0 ? 0 : static_cast<unsigned int>(smGroupId);
+      }
+      chunk.has_smoothing = true;
+      chunk.last_smoothing = current_smoothing_id;
+      continue;
+    }
+  }
+}
+
+//Triangulates a chunk's faces into its shape: triangles directly and everything else with
+//tinyobj's own quad split and ear clipping
+void triangulate_obj_chunk(ObjChunk& chunk, const std::vector<real_t>& vertices) {
+  size_t n = chunk.face_sizes.size();
+  mesh_t& mesh = chunk.shape.mesh;
+  mesh.indices.reserve(chunk.corners.size());
+  mesh.num_face_vertices.reserve(n);
+  mesh.material_ids.reserve(n);
+  mesh.smoothing_group_ids.reserve(n);
+  PrimGroup polygon;
+  polygon.faceGroup.resize(1);
+  std::vector<tag_t> tags;
+  size_t run = 0;
+  size_t corner = 0;
+  for(size_t f = 0; f < n; f++) {
+    while(run + 1 < chunk.runs.size() && chunk.runs[run + 1].first <= f) {
+      run++;
+    }
+    int material_id = chunk.runs[run].second;
+    unsigned int smoothing_id = f < chunk.inherited_faces ? chunk.first_smoothing : chunk.smoothing[f];
+    size_t npolys = chunk.face_sizes[f];
+    if(npolys == 3) {
+      for(size_t k = 0; k < 3; k++) {
+        const vertex_index_t& vi = chunk.corners[corner + k];
+        index_t idx;
+        idx.vertex_index = vi.v_idx;
+        idx.normal_index = vi.vn_idx;
+        idx.texcoord_index = vi.vt_idx;
+        mesh.indices.push_back(idx);
+      }
+      mesh.num_face_vertices.push_back(3);
+      mesh.material_ids.push_back(material_id);
+      mesh.smoothing_group_ids.push_back(smoothing_id);
+    } else {
+      face_t& face = polygon.faceGroup[0];
+      face.smoothing_group_id = smoothing_id;
+      face.vertex_indices.assign(chunk.corners.begin() + corner, chunk.corners.begin() + corner + npolys);
+      exportGroupsToShape(&chunk.shape, polygon, tags, material_id, std::string(), true,
+                          vertices, &chunk.warn);
+    }
+    corner += npolys;
+  }
+}
+
+}
+
+bool load_obj_parallel(attrib_t* attrib, std::vector<shape_t>* shapes,
+                       std::vector<material_t>* materials, std::string* warn,
+                       std::string* err, const std::string& filename, const std::string& basedir,
+                       size_t numbercores, bool vertex_colors) {
+  attrib->vertices.clear();
+  attrib->normals.clear();
+  attrib->texcoords.clear();
+  attrib->colors.clear();
+  shapes->clear();
+
+  MappedFile file(filename);
+  if(!file.data()) {
+    std::ifstream ifs(filename.c_str());
+    if(!ifs) {
+      std::stringstream errss;
+      errss << "Cannot open file [" << filename << "]" << std::endl;
+      if(err) {
+        (*err) = errss.str();
+      }
+      return(false);
+    }
+    //Empty file
+    return(true);
+  }
+  const char* data = reinterpret_cast<const char*>(file.data());
+  size_t size = file.size();
+
+  //Split the file into line-aligned chunks, a few per thread so uneven chunks even out
+  numbercores = std::max(numbercores, static_cast<size_t>(1));
+  size_t nChunks = std::max(std::min(4 * numbercores, size / kMinObjChunkBytes), static_cast<size_t>(1));
+  if(numbercores == 1) {
+    nChunks = 1;
+  }
+  std::vector<ObjChunk> chunks;
+  const char* chunk_begin = data;
+  for(size_t i = 1; i <= nChunks && chunk_begin < data + size; i++) {
+    const char* chunk_end = data + size;
+    if(i < nChunks) {
+      chunk_end = std::max(data + size * i / nChunks, chunk_begin);
+      chunk_end = static_cast<const char*>(memchr(chunk_end, '\n', data + size - chunk_end));
+      chunk_end = chunk_end ? chunk_end + 1 : data + size;
+    }
+    chunks.push_back(ObjChunk());
+    chunks.back().begin = chunk_begin;
+    chunks.back().end = chunk_end;
+    chunk_begin = chunk_end;
+  }
+
+  std::unique_ptr<RcppThread::ThreadPool> pool;
+  if(chunks.size() > 1) {
+    pool.reset(new RcppThread::ThreadPool(numbercores));
+  }
+  auto for_each_chunk = [&] (std::function<void(ObjChunk&)> f) {
+    if(pool) {
+      pool->parallelFor(0, chunks.size(), [&] (size_t i) {
+        f(chunks[i]);
+      });
+      pool->wait();
+    } else {
+      f(chunks[0]);
+    }
+  };
+
+  for_each_chunk([&] (ObjChunk& chunk) {
+    parse_obj_chunk(chunk, vertex_colors);
+  });
+
+  //Resolve materials, smoothing groups and attribute offsets in file order
+  std::string baseDir = basedir;
+  if(!baseDir.empty()) {
+#ifndef _WIN32
+    const char dirsep = '/';
+#else
+    const char dirsep = '\\';
+#endif
+    if(baseDir[baseDir.length() - 1] != dirsep) baseDir += dirsep;
+  }
+  MaterialFileReader matFileReader(baseDir);
+  std::map<std::string, int> material_map;
+  int material = -1;
+  unsigned int current_smoothing_id = 0;
+  size_t line_offset = 0;
+  size_t nv = 0, nvn = 0, nvt = 0;
+  for(size_t c = 0; c < chunks.size(); c++) {
+    ObjChunk& chunk = chunks[c];
+    chunk.runs.push_back(std::make_pair(static_cast<size_t>(0), material));
+    for(size_t s = 0; s < chunk.statements.size(); s++) {
+      const ObjStatement& statement = chunk.statements[s];
+      if(statement.usemtl) {
+        int newMaterialId = -1;
+        std::map<std::string, int>::const_iterator it = material_map.find(statement.arg);
+        if(it != material_map.end()) {
+          newMaterialId = it->second;
+        } else if(warn) {
+          (*warn) += "material [ '" + statement.arg + "' ] not found in .mtl\n";
+        }
+        if(newMaterialId != material) {
+          chunk.runs.push_back(std::make_pair(statement.face, newMaterialId));
+          material = newMaterialId;
+        }
+        continue;
+      }
+      std::vector<std::string> filenames;
+      SplitString(statement.arg, ' ', '\\', filenames);
+      if(filenames.empty()) {
+        if(warn) {
+          std::stringstream ss;
+          ss << "Looks like empty filename for mtllib. Use default "
+                "material (line "
+             << line_offset + statement.line << ".)\n";
+          (*warn) += ss.str();
+        }
+        continue;
+      }
+      bool found = false;
+      for(size_t i = 0; i < filenames.size(); i++) {
+        std::string warn_mtl;
+        std::string err_mtl;
+        bool ok = matFileReader(filenames[i].c_str(), materials, &material_map, &warn_mtl, &err_mtl);
+        if(warn && !warn_mtl.empty()) {
+          (*warn) += warn_mtl;
+        }
+        if(err && !err_mtl.empty()) {
+          (*err) += err_mtl;
+        }
+        if(ok) {
+          found = true;
+          break;
+        }
+      }
+      if(!found && warn) {
+        (*warn) += "Failed to load material file(s). Use default material.\n";
+      }
+    }
+    if(chunk.error_line) {
+      if(err) {
+        std::stringstream ss;
+        ss << "Failed parse `f' line(e.g. zero value for face index. line "
+           << line_offset + chunk.error_line << ".)\n";
+        (*err) += ss.str();
+      }
+      return(false);
+    }
+    chunk.first_smoothing = current_smoothing_id;
+    if(chunk.has_smoothing) {
+      current_smoothing_id = chunk.last_smoothing;
+    }
+    chunk.v_offset = static_cast<int>(nv);
+    chunk.vn_offset = static_cast<int>(nvn);
+    chunk.vt_offset = static_cast<int>(nvt);
+    nv += chunk.v.size() / 3;
+    nvn += chunk.vn.size() / 3;
+    nvt += chunk.vt.size() / 2;
+    line_offset += chunk.lines;
+  }
+
+  //Gather the attributes and offset the relative indices
+  attrib->vertices.resize(3 * nv);
+  attrib->normals.resize(3 * nvn);
+  attrib->texcoords.resize(2 * nvt);
+  if(vertex_colors) {
+    attrib->colors.resize(3 * nv);
+  }
+  for_each_chunk([&] (ObjChunk& chunk) {
+    std::copy(chunk.v.begin(), chunk.v.end(), attrib->vertices.begin() + 3 * chunk.v_offset);
+    std::copy(chunk.vn.begin(), chunk.vn.end(), attrib->normals.begin() + 3 * chunk.vn_offset);
+    std::copy(chunk.vt.begin(), chunk.vt.end(), attrib->texcoords.begin() + 2 * chunk.vt_offset);
+    std::copy(chunk.vc.begin(), chunk.vc.end(), attrib->colors.begin() + 3 * chunk.v_offset);
+    std::vector<real_t>().swap(chunk.v);
+    std::vector<real_t>().swap(chunk.vn);
+    std::vector<real_t>().swap(chunk.vt);
+    std::vector<real_t>().swap(chunk.vc);
+    for(size_t i = 0; i < chunk.relative.size(); i++) {
+      vertex_index_t& vi = chunk.corners[chunk.relative[i] / 3];
+      switch(chunk.relative[i] % 3) {
+        case 0: vi.v_idx += chunk.v_offset; break;
+        case 1: vi.vt_idx += chunk.vt_offset; break;
+        default: vi.vn_idx += chunk.vn_offset; break;
+      }
+    }
+    for(size_t i = 0; i < chunk.corners.size(); i++) {
+      chunk.greatest_v = std::max(chunk.greatest_v, chunk.corners[i].v_idx);
+      chunk.greatest_vn = std::max(chunk.greatest_vn, chunk.corners[i].vn_idx);
+      chunk.greatest_vt = std::max(chunk.greatest_vt, chunk.corners[i].vt_idx);
+    }
+  });
+
+  for_each_chunk([&] (ObjChunk& chunk) {
+    triangulate_obj_chunk(chunk, attrib->vertices);
+    std::vector<vertex_index_t>().swap(chunk.corners);
+  });
+
+  int greatest_v_idx = -1, greatest_vn_idx = -1, greatest_vt_idx = -1;
+  for(size_t c = 0; c < chunks.size(); c++) {
+    greatest_v_idx = std::max(greatest_v_idx, chunks[c].greatest_v);
+    greatest_vn_idx = std::max(greatest_vn_idx, chunks[c].greatest_vn);
+    greatest_vt_idx = std::max(greatest_vt_idx, chunks[c].greatest_vt);
+    if(warn) {
+      (*warn) += chunks[c].warn;
+    }
+    if(!chunks[c].shape.mesh.indices.empty()) {
+      shapes->push_back(shape_t());
+      std::swap(shapes->back(), chunks[c].shape);
+    }
+  }
+  if(warn) {
+    std::stringstream ss;
+    if(greatest_v_idx >= static_cast<int>(nv)) {
+      ss << "Vertex indices out of bounds (line " << line_offset << ".)\n" << std::endl;
+    }
+    if(greatest_vn_idx >= static_cast<int>(nvn)) {
+      ss << "Vertex normal indices out of bounds (line " << line_offset << ".)\n" << std::endl;
+    }
+    if(greatest_vt_idx >= static_cast<int>(nvt)) {
+      ss << "Vertex texcoord indices out of bounds (line " << line_offset << ".)\n" << std::endl;
+    }
+    (*warn) += ss.str();
+  }
+  return(true);
+}
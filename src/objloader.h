@@ -0,0 +1,21 @@
+#ifndef OBJLOADERH
+#define OBJLOADERH
+
+#include "tinyobj/tiny_obj_loader.h"
+#include <string>
+#include <vector>
+
+//Files below this size per thread are parsed as a single chunk
+static const size_t kMinObjChunkBytes = 1 << 20;
+
+//Multithreaded version of tinyobj::LoadObj (with triangulation, and tinyobj's material handling
+//and messages). The file is memory mapped and split into line-aligned chunks, which are parsed
+//and then triangulated concurrently on `numbercores` threads. Each chunk's faces are returned as
+//one shape, so the faces come back in file order but aren't split by `g` and `o` statements.
+//Vertex colors are only returned if `vertex_colors` is true.
+bool load_obj_parallel(tinyobj::attrib_t* attrib, std::vector<tinyobj::shape_t>* shapes,
+                       std::vector<tinyobj::material_t>* materials, std::string* warn,
+                       std::string* err, const std::string& filename, const std::string& basedir,
+                       size_t numbercores, bool vertex_colors = false);
+
+#endif
@@ -2,6 +2,8 @@
 
 #include "miniply.h"
 #include "plymesh.h"
+#include "mappedfile.h"
+#include <cstring>
 
 inline char separator_ply() {
 #if defined _WIN32 || defined __CYGWIN__
@@ -12,87 +14,251 @@ inline char separator_ply() {
 }
 
 
-enum class Topology {
-  Soup,   // Every 3 indices specify a triangle.
-  Strip,  // Triangle strip, triangle i uses indices i, i-1 and i-2
-  Fan,    // Triangle fan, triangle i uses indices, i, i-1 and 0.
-};
+static const uint32_t kPlyTypeSize[] = {1, 1, 2, 2, 4, 4, 4, 8};
 
+template<typename T>
+static inline double ply_value_as(const uint8_t* bytes) {
+  T value;
+  std::memcpy(&value, bytes, sizeof(T));
+  return(value);
+}
 
-struct TriMesh {
-  // Per-vertex data
-  float* pos          = nullptr; // has 3*numVerts elements.
-  float* normal       = nullptr; // if non-null, has 3 * numVerts elements.
-  float* uv           = nullptr; // if non-null, has 2 * numVerts elements.
-  uint32_t numVerts   = 0;
-  
-  // Per-index data
-  int* indices        = nullptr; // has numIndices elements.
-  uint32_t numIndices = 0; // number of indices = 3 times the number of faces.
-  
-  Topology topology  = Topology::Soup; // How to interpret the indices.
-  bool hasTerminator = false;          // Only applies when topology != Soup.
-  int terminator     = -1;             // Value indicating the end of a strip or fan. Only applies when topology != Soup.
-  
-  ~TriMesh() {
-    delete[] pos;
-    delete[] normal;
-    delete[] uv;
-    delete[] indices;
+//Reads one binary PLY value, byte swapping it if the file is big endian
+static inline double read_ply_value(const uint8_t* src, miniply::PLYPropertyType type, bool swap) {
+  uint8_t bytes[8] = {0};
+  uint32_t size = kPlyTypeSize[uint32_t(type)];
+  if(swap) {
+    for(uint32_t i = 0; i < size; i++) {
+      bytes[i] = src[size - 1 - i];
+    }
+    src = bytes;
   }
-  
-  bool all_indices_valid() const {
-    bool checkTerminator = topology != Topology::Soup && hasTerminator && (terminator < 0 || terminator >= int(numVerts));
-    for (uint32_t i = 0; i < numIndices; i++) {
-      if (checkTerminator && indices[i] == terminator) {
-        continue;
+  switch(type) {
+    case miniply::PLYPropertyType::Char:   return(ply_value_as<int8_t>(src));
+    case miniply::PLYPropertyType::UChar:  return(ply_value_as<uint8_t>(src));
+    case miniply::PLYPropertyType::Short:  return(ply_value_as<int16_t>(src));
+    case miniply::PLYPropertyType::UShort: return(ply_value_as<uint16_t>(src));
+    case miniply::PLYPropertyType::Int:    return(ply_value_as<int32_t>(src));
+    case miniply::PLYPropertyType::UInt:   return(ply_value_as<uint32_t>(src));
+    case miniply::PLYPropertyType::Float:  return(ply_value_as<float>(src));
+    case miniply::PLYPropertyType::Double: return(ply_value_as<double>(src));
+    default: return(0);
+  }
+}
+
+//Type of the mesh's vertex position and texture coordinate components, for miniply's extraction
+static const miniply::PLYPropertyType kPlyFloatType =
+  sizeof(Float) == sizeof(double) ? miniply::PLYPropertyType::Double : miniply::PLYPropertyType::Float;
+
+//miniply triangulates polygons from single precision positions: these are the mesh's own unless
+//Float is double, in which case they're converted into `staging`
+static const float* ply_float_positions(const TriangleMesh& mesh, std::vector<float>& staging) {
+  if(sizeof(point3f) == 3 * sizeof(float)) {
+    return(reinterpret_cast<const float*>(mesh.p.data()));
+  }
+  staging.resize(3 * mesh.p.size());
+  for(size_t i = 0; i < mesh.p.size(); i++) {
+    for(int a = 0; a < 3; a++) {
+      staging[3 * i + a] = static_cast<float>(mesh.p[i].e[a]);
+    }
+  }
+  return(staging.data());
+}
+
+//Calls row(values, counts) for each row of a binary element starting at `pos`, where values[i] points
+//at property i's data in the mapped file and counts[i] is its length if it's a list. Returns the end
+//of the element, or nullptr if the file is truncated.
+template<typename F>
+static const uint8_t* for_each_ply_row(const miniply::PLYElement& elem, const uint8_t* pos, const uint8_t* end,
+                                       bool swap, F row) {
+  size_t num_props = elem.properties.size();
+  std::vector<const uint8_t*> values(num_props, nullptr);
+  std::vector<uint32_t> counts(num_props, 0);
+  if(elem.fixedSize) {
+    if(size_t(end - pos) < size_t(elem.count) * elem.rowStride) {
+      return(nullptr);
+    }
+    for(uint32_t i = 0; i < elem.count; i++, pos += elem.rowStride) {
+      for(size_t j = 0; j < num_props; j++) {
+        values[j] = pos + elem.properties[j].offset;
       }
-      if (indices[i] < 0 || uint32_t(indices[i]) >= numVerts) {
-        return false;
+      row(values.data(), counts.data());
+    }
+    return(pos);
+  }
+  for(uint32_t i = 0; i < elem.count; i++) {
+    for(size_t j = 0; j < num_props; j++) {
+      const miniply::PLYProperty& prop = elem.properties[j];
+      size_t bytes = kPlyTypeSize[uint32_t(prop.type)];
+      if(prop.countType != miniply::PLYPropertyType::None) {
+        size_t count_bytes = kPlyTypeSize[uint32_t(prop.countType)];
+        if(size_t(end - pos) < count_bytes) {
+          return(nullptr);
+        }
+        double count = read_ply_value(pos, prop.countType, swap);
+        if(count < 0) {
+          return(nullptr);
+        }
+        pos += count_bytes;
+        counts[j] = uint32_t(count);
+        bytes *= counts[j];
       }
+      if(size_t(end - pos) < bytes) {
+        return(nullptr);
+      }
+      values[j] = pos;
+      pos += bytes;
     }
-    return true;
+    row(values.data(), counts.data());
   }
-};
+  return(pos);
+}
+
+static bool find_ply_texcoord(const miniply::PLYElement& elem, uint32_t idx[2]) {
+  return(elem.find_properties(idx, 2, "u", "v") ||
+         elem.find_properties(idx, 2, "s", "t") ||
+         elem.find_properties(idx, 2, "texture_u", "texture_v") ||
+         elem.find_properties(idx, 2, "texture_s", "texture_t"));
+}
 
+//Offset of the data section, just past the "end_header" line
+static size_t ply_data_offset(const MappedFile& file) {
+  const char* start = reinterpret_cast<const char*>(file.data());
+  size_t size = file.size();
+  size_t line = 0;
+  while(line < size) {
+    const char* newline = static_cast<const char*>(std::memchr(start + line, '\n', size - line));
+    if(newline == nullptr) {
+      break;
+    }
+    size_t next = newline - start + 1;
+    if(next - line > 10 && std::strncmp(start + line, "end_header", 10) == 0) {
+      return(next);
+    }
+    line = next;
+  }
+  return(0);
+}
 
-static TriMesh* parse_file_with_miniply(const char* filename, bool assumeTriangles) {
-  miniply::PLYReader reader(filename);
-  if (!reader.valid()) {
+//Streams a binary PLY's vertex positions, texture coordinates and (triangulated) faces from the
+//mapped file straight into the mesh buffers, which are reserved at their final size. The vertices
+//are left in object space, since polygons are triangulated in that space.
+static bool stream_ply_binary(const std::string& inputfile, miniply::PLYReader& reader,
+                              TriangleMesh& mesh, bool keep_uv) {
+  MappedFile file(inputfile);
+  size_t offset = file.data() ? ply_data_offset(file) : 0;
+  if(offset == 0) {
     Rcpp::Rcout << "Not valid reader \n";
-    return nullptr;
+    return(false);
   }
+  const uint8_t* pos = file.data() + offset;
+  const uint8_t* end = file.data() + file.size();
+  bool swap = reader.file_type() == miniply::PLYFileType::BinaryBigEndian;
+  bool gotVerts = false, gotFaces = false;
   
+  for(uint32_t e = 0; e < reader.num_elements() && (!gotVerts || !gotFaces); e++) {
+    const miniply::PLYElement& elem = *reader.get_element(e);
+    uint32_t pidx[3], uvidx[2], fidx[1];
+    if(!gotVerts && elem.name == miniply::kPLYVertexElement && elem.find_properties(pidx, 3, "x", "y", "z")) {
+      bool has_uv = keep_uv && find_ply_texcoord(elem, uvidx);
+      miniply::PLYPropertyType ptype[3], uvtype[2];
+      for(int i = 0; i < 3; i++) {
+        ptype[i] = elem.properties[pidx[i]].type;
+      }
+      mesh.p.reserve(elem.count);
+      if(has_uv) {
+        uvtype[0] = elem.properties[uvidx[0]].type;
+        uvtype[1] = elem.properties[uvidx[1]].type;
+        mesh.uv.reserve(elem.count);
+      }
+      pos = for_each_ply_row(elem, pos, end, swap, [&](const uint8_t* const* values, const uint32_t* counts) {
+        mesh.p.push_back(point3f(read_ply_value(values[pidx[0]], ptype[0], swap),
+                                 read_ply_value(values[pidx[1]], ptype[1], swap),
+                                 read_ply_value(values[pidx[2]], ptype[2], swap)));
+        if(has_uv) {
+          mesh.uv.push_back(point2f(read_ply_value(values[uvidx[0]], uvtype[0], swap),
+                                    read_ply_value(values[uvidx[1]], uvtype[1], swap)));
+        }
+      });
+      gotVerts = true;
+    } else if(!gotFaces && elem.name == miniply::kPLYFaceElement &&
+              (elem.find_properties(fidx, 1, "vertex_index") || elem.find_properties(fidx, 1, "vertex_indices")) &&
+              elem.properties[fidx[0]].countType != miniply::PLYPropertyType::None) {
+      miniply::PLYPropertyType itype = elem.properties[fidx[0]].type;
+      uint32_t isize = kPlyTypeSize[uint32_t(itype)];
+      //A first pass over the list lengths sizes the index buffer exactly
+      size_t num_tris = 0;
+      bool polys = false;
+      const uint8_t* counted = for_each_ply_row(elem, pos, end, swap, [&](const uint8_t* const* values, const uint32_t* counts) {
+        num_tris += counts[fidx[0]] >= 3 ? counts[fidx[0]] - 2 : 0;
+        polys = polys || counts[fidx[0]] > 4;
+      });
+      if(counted && polys && !gotVerts) {
+        Rcpp::Rcout << "Error: need vertex positions to triangulate faces.\n";
+        break;
+      }
+      mesh.vertexIndices.reserve(3 * num_tris);
+      std::vector<float> staging;
+      const float* positions = polys ? ply_float_positions(mesh, staging) : nullptr;
+      std::vector<int> face, tris;
+      pos = counted == nullptr ? nullptr : for_each_ply_row(elem, pos, end, swap, [&](const uint8_t* const* values, const uint32_t* counts) {
+        uint32_t n = counts[fidx[0]];
+        if(n < 3) {
+          return;
+        }
+        face.resize(n);
+        tris.resize(3 * (n - 2));
+        for(uint32_t i = 0; i < n; i++) {
+          face[i] = int(read_ply_value(values[fidx[0]] + i * isize, itype, swap));
+        }
+        uint32_t n_tris = miniply::triangulate_polygon(n, positions,
+                                                       mesh.p.size(), face.data(), tris.data());
+        for(uint32_t i = 0; i < 3 * n_tris; i++) {
+          mesh.vertexIndices.push_back(tris[i]);
+        }
+      });
+      gotFaces = true;
+    } else {
+      pos = for_each_ply_row(elem, pos, end, swap, [](const uint8_t* const* values, const uint32_t* counts) {});
+    }
+    if(pos == nullptr) {
+      Rcpp::Rcout << "Failed to load: file ends in the " << elem.name << " data\n";
+      return(false);
+    }
+  }
+  if(!gotVerts || !gotFaces) {
+    std::string vert1 = gotVerts ? "" : "vertices ";
+    std::string face1 = gotFaces ? "" : "faces";
+    Rcpp::Rcout << "Failed to load: " << vert1 << face1 << "\n";
+    return(false);
+  }
+  return(true);
+}
+
+//ASCII files are loaded an element at a time by miniply, and extracted straight into the mesh buffers
+static bool read_ply_ascii(miniply::PLYReader& reader, TriangleMesh& mesh, bool keep_uv) {
   uint32_t indexes[3];
   bool gotVerts = false, gotFaces = false;
   
-  TriMesh* trimesh = new TriMesh();
   while (reader.has_element() && (!gotVerts || !gotFaces)) {
     if (reader.element_is(miniply::kPLYVertexElement) && reader.load_element() && reader.find_pos(indexes)) {
-      trimesh->numVerts = reader.num_rows();
-      trimesh->pos = new float[trimesh->numVerts * 3];
-      reader.extract_properties(indexes, 3, miniply::PLYPropertyType::Float, trimesh->pos);
-      if (reader.find_texcoord(indexes)) {
-        trimesh->uv = new float[trimesh->numVerts * 2];
-        reader.extract_properties(indexes, 2, miniply::PLYPropertyType::Float, trimesh->uv);
+      mesh.p.resize(reader.num_rows());
+      reader.extract_properties(indexes, 3, kPlyFloatType, mesh.p.mutable_data());
+      if (keep_uv && reader.find_texcoord(indexes)) {
+        mesh.uv.resize(reader.num_rows());
+        reader.extract_properties(indexes, 2, kPlyFloatType, mesh.uv.mutable_data());
       }
       gotVerts = true;
     } else if (reader.element_is(miniply::kPLYFaceElement) && reader.load_element() && reader.find_indices(indexes)) {
-      uint32_t propIdx = 1; 
-      bool polys = reader.requires_triangulation(propIdx);
+      bool polys = reader.requires_triangulation(indexes[0]);
       if (polys && !gotVerts) {
         Rcpp::Rcout << "Error: need vertex positions to triangulate faces.\n";
         break;
       }
-      if (polys) {
-        trimesh->numIndices = reader.num_triangles(indexes[0]) * 3;
-        trimesh->indices = new int[trimesh->numIndices];
-        reader.extract_triangles(indexes[0], trimesh->pos, trimesh->numVerts, miniply::PLYPropertyType::Int, trimesh->indices);
-      } else {
-        trimesh->numIndices = reader.num_rows() * 3;
-        trimesh->indices = new int[trimesh->numIndices];
-        reader.extract_list_property(indexes[0], miniply::PLYPropertyType::Int, trimesh->indices);
-      }
+      mesh.vertexIndices.resize(reader.num_triangles(indexes[0]) * 3);
+      std::vector<float> staging;
+      reader.extract_triangles(indexes[0], polys ? ply_float_positions(mesh, staging) : nullptr, mesh.p.size(),
+                               miniply::PLYPropertyType::UInt, mesh.vertexIndices.mutable_data());
       gotFaces = true;
     }
     if (gotVerts && gotFaces) {
@@ -104,81 +270,73 @@ static TriMesh* parse_file_with_miniply(const char* filename, bool assumeTriangl
     std::string vert1 = gotVerts ? "" : "vertices ";
     std::string face1 = gotFaces ? "" : "faces";
     Rcpp::Rcout << "Failed to load: " << vert1 << face1 << "\n";
-    delete trimesh;
-    return nullptr;
+    return(false);
   }
-  
-  return trimesh;
+  return(true);
 }
 
 
+std::shared_ptr<TriangleMesh> load_ply_mesh(const std::string& inputfile, const Transform& ObjectToWorld,
+                                            Float scale, bool keep_uv) {
+  std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>();
+  miniply::PLYReader reader(inputfile.c_str());
+  bool loaded = false;
+  if(!reader.valid()) {
+    Rcpp::Rcout << "Not valid reader \n";
+  } else if(reader.file_type() == miniply::PLYFileType::ASCII) {
+    loaded = read_ply_ascii(reader, *mesh, keep_uv);
+  } else {
+    loaded = stream_ply_binary(inputfile, reader, *mesh, keep_uv);
+  }
+  if(!loaded) {
+    throw std::runtime_error("No mesh loaded: " + inputfile);
+  }
+  uint32_t num_verts = mesh->p.size();
+  for(uint32_t idx : mesh->vertexIndices) {
+    if(idx >= num_verts) {
+      throw std::runtime_error("Face refers to a missing vertex in " + inputfile);
+    }
+  }
+  
+  //Transformed in place once the faces are triangulated
+  point3f* p = mesh->p.mutable_data();
+  for(uint32_t i = 0; i < num_verts; i++) {
+    p[i] = ObjectToWorld(point3f(vec3f(p[i]) * scale));
+  }
+  mesh->compact();
+  return(mesh);
+}
+
 plymesh::plymesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-            Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-            std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
+            Float scale, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
+            std::string bvh_cache, random_gen rng,
+            std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+            const MeshLOD& lod) :
   hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
-  TriMesh* tri = parse_file_with_miniply(inputfile.c_str(), false);
   mat_ptr = mat;
-  
-  if(tri == nullptr) {
-    std::string err = inputfile;
-    throw std::runtime_error("No mesh loaded: " + err);
+  //A cache hit skips parsing the file, simplifying the mesh and building the BVH. With level of
+  //detail on, the file is parsed first to pick the level, which the cache is keyed by (so moving
+  //the camera only misses the cache when it changes the level).
+  int lod_level = 0;
+  if(lod.enabled()) {
+    mesh = load_ply_mesh(inputfile, *ObjectToWorld, scale, false);
+    lod_level = mesh_lod_level(*mesh, lod, lod_source);
   }
-  bool has_normals = false;
-  if(tri->normal != nullptr) {
-    has_normals = true;
+  uint64_t cache_key = bvh_cache.empty() ? 0 : 
+    bvh_cache_key(inputfile, "ply", *ObjectToWorld, scale, bvh_type, max_leaf_size, lod_level);
+  if(cache_key != 0 && load_bvh_cache(bvh_cache_path(bvh_cache, cache_key), cache_key, mat_ptr, 
+                                      mesh, ply_mesh_bvh)) {
+    return;
   }
-  
-  bool has_uv = false;
-  if(tri->uv != nullptr) {
-    has_uv = true;
+  if(!mesh) {
+    mesh = load_ply_mesh(inputfile, *ObjectToWorld, scale, false);
   }
-  int number_faces = tri->numIndices / 3;
-  
-  vec3f tris[3];
-  vec3f normals[3];
-  for (int i = 0; i < number_faces; i++) {
-    bool tempnormal = false;
-    int idx = 3*i;
-    tris[0] = vec3f(tri->pos[3*tri->indices[idx  ]+0],
-                   tri->pos[3*tri->indices[idx  ]+1],
-                           tri->pos[3*tri->indices[idx  ]+2])*scale;
-    tris[1] = vec3f(tri->pos[3*tri->indices[idx+1]+0],
-                   tri->pos[3*tri->indices[idx+1]+1],
-                           tri->pos[3*tri->indices[idx+1]+2])*scale;
-    tris[2] = vec3f(tri->pos[3*tri->indices[idx+2]+0],
-                   tri->pos[3*tri->indices[idx+2]+1],
-                           tri->pos[3*tri->indices[idx+2]+2])*scale;
-    if(has_normals) {
-      tempnormal = true;
-      normals[0] = vec3f(tri->normal[3*tri->indices[idx  ]+0],
-                        tri->normal[3*tri->indices[idx  ]+1],
-                                   tri->normal[3*tri->indices[idx  ]+2]);
-      normals[1] = vec3f(tri->normal[3*tri->indices[idx+1]+0],
-                        tri->normal[3*tri->indices[idx+1]+1],
-                                   tri->normal[3*tri->indices[idx+1]+2]);
-      normals[2] = vec3f(tri->normal[3*tri->indices[idx+2]+0],
-                        tri->normal[3*tri->indices[idx+2]+1],
-                                   tri->normal[3*tri->indices[idx+2]+2]);
-    }
-    if((normals[0].x() == 0 && normals[0].y() == 0 && normals[0].z() == 0) ||
-       (normals[1].x() == 0 && normals[1].y() == 0 && normals[1].z() == 0) ||
-       (normals[2].x() == 0 && normals[2].y() == 0 && normals[2].z() == 0)) {
-      tempnormal = false;
-    }
-    
-    if(has_normals && tempnormal) {
-      triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2],
-                                       normals[0],normals[1],normals[2],
-                                                                    false,
-                                                                    mat_ptr, nullptr,  nullptr, 
-                                                                    ObjectToWorld, WorldToObject, reverseOrientation));
-    } else {
-      triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], false, mat_ptr, nullptr, nullptr, 
-                                               ObjectToWorld, WorldToObject, reverseOrientation));
-    }
+  mesh->add_material(mat_ptr, nullptr, nullptr);
+  simplify_mesh_level(mesh, lod_level);
+  ply_mesh_bvh = std::make_shared<bvh_node>(mesh, bvh_type, max_leaf_size, numbercores, rng);
+  if(cache_key != 0) {
+    save_bvh_cache(bvh_cache_path(bvh_cache, cache_key), cache_key, *mesh, *ply_mesh_bvh);
   }
-  ply_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
-  delete tri;
 };
 
 
@@ -190,6 +348,22 @@ bool plymesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampl
   return(ply_mesh_bvh->hit(r, t_min, t_max, rec, sampler));
 };
 
+bool plymesh::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  return(ply_mesh_bvh->intersect(r, t_min, t_max, hit, rng));
+};
+
+bool plymesh::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  return(ply_mesh_bvh->intersect(r, t_min, t_max, hit, sampler));
+};
+
+bool plymesh::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(ply_mesh_bvh->occluded(r, t_min, t_max, rng));
+};
+
+bool plymesh::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(ply_mesh_bvh->occluded(r, t_min, t_max, sampler));
+};
+
 bool plymesh::bounding_box(Float t0, Float t1, aabb& box) const {
   return(ply_mesh_bvh->bounding_box(t0,t1,box));
 };
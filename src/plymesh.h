@@ -3,21 +3,33 @@
 
 #include "triangle.h"
 #include "bvh_node.h"
+#include "bvhcache.h"
+#include "meshlod.h"
 #include <Rcpp.h>
 
 
-enum class Topology;
-struct TriMesh;
+//Reads a PLY file into an indexed mesh, with the vertices scaled and then transformed by ObjectToWorld.
+//Binary files are streamed from a memory map straight into the mesh buffers, triangulating polygons
+//as they're read. The mesh's material table is left empty. The texture coordinates are only kept if
+//`keep_uv` is set.
+std::shared_ptr<TriangleMesh> load_ply_mesh(const std::string& inputfile, const Transform& ObjectToWorld,
+                                            Float scale, bool keep_uv);
 
 class plymesh : public hitable {
   public:
     plymesh() {}
    ~plymesh() {}
   plymesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-          Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
+          Float scale, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
+          std::string bvh_cache, random_gen rng,
+          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+          const MeshLOD& lod = MeshLOD());
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
   
   virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
   virtual std::string GetName() const {
@@ -25,7 +37,9 @@ class plymesh : public hitable {
   }
   std::shared_ptr<bvh_node> ply_mesh_bvh;
   std::shared_ptr<material> mat_ptr;
-  hitable_list triangles;
+  std::shared_ptr<TriangleMesh> mesh;
+  //Size of the mesh before `lod` simplified it (empty if level of detail is off)
+  LodSource lod_source;
 };
 
 
@@ -0,0 +1,85 @@
+#include "raymesh.h"
+
+raymesh::raymesh(std::string inputfile, std::shared_ptr<material> mat, 
+                 Float scale, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
+                 std::string bvh_cache, random_gen rng,
+                 std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
+  mat_ptr = mat;
+  //A cache hit skips building the BVH
+  uint64_t cache_key = bvh_cache.empty() ? 0 : 
+    bvh_cache_key(inputfile, "raymesh", *ObjectToWorld, scale, bvh_type, max_leaf_size);
+  if(cache_key != 0 && load_bvh_cache(bvh_cache_path(bvh_cache, cache_key), cache_key, mat_ptr, 
+                                      mesh, mesh_bvh)) {
+    return;
+  }
+  //The file's material table isn't used here: every face gets `mat`
+  mesh = load_mesh_file(inputfile, *ObjectToWorld, scale, nullptr);
+  mesh->faceMaterials.clear();
+  mesh->add_material(mat_ptr, nullptr, nullptr);
+  mesh_bvh = std::make_shared<bvh_node>(mesh, bvh_type, max_leaf_size, numbercores, rng);
+  if(cache_key != 0) {
+    save_bvh_cache(bvh_cache_path(bvh_cache, cache_key), cache_key, *mesh, *mesh_bvh);
+  }
+};
+
+//Uses the materials stored in the file, as trimesh does for the OBJ's own materials
+raymesh::raymesh(std::string inputfile, Float scale, Float sigma,
+                 Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, random_gen rng,
+                 std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
+  hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
+  mat_ptr = nullptr;
+  std::vector<MeshMaterialInfo> materials;
+  mesh = load_mesh_file(inputfile, *ObjectToWorld, scale, &materials);
+  add_mesh_materials(*mesh, materials, sigma, obj_materials, bump_materials);
+  mesh_bvh = std::make_shared<bvh_node>(mesh, bvh_type, max_leaf_size, numbercores, rng);
+};
+
+bool raymesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  return(mesh_bvh->hit(r, t_min, t_max, rec, rng));
+};
+
+bool raymesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  return(mesh_bvh->hit(r, t_min, t_max, rec, sampler));
+};
+
+bool raymesh::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  return(mesh_bvh->intersect(r, t_min, t_max, hit, rng));
+};
+
+bool raymesh::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  return(mesh_bvh->intersect(r, t_min, t_max, hit, sampler));
+};
+
+bool raymesh::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(mesh_bvh->occluded(r, t_min, t_max, rng));
+};
+
+bool raymesh::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(mesh_bvh->occluded(r, t_min, t_max, sampler));
+};
+
+Float raymesh::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  return(mesh->pdf_value(o, v, rng));
+}
+
+Float raymesh::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  return(mesh->pdf_value(o, v, sampler));
+}
+
+vec3f raymesh::random(const point3f& o, random_gen& rng, Float time) {
+  return(mesh->random(o, rng));
+}
+
+vec3f raymesh::random(const point3f& o, Sampler* sampler, Float time) {
+  return(mesh->random(o, sampler));
+}
+
+bool raymesh::bounding_box(Float t0, Float t1, aabb& box) const {
+  return(mesh_bvh->bounding_box(t0,t1,box));
+};
+
+// [[Rcpp::export]]
+void convert_mesh_rcpp(std::string inputfile, std::string basedir, std::string outputfile) {
+  convert_mesh_file(inputfile, basedir, outputfile);
+}
@@ -0,0 +1,49 @@
+#ifndef RAYMESHH
+#define RAYMESHH
+
+#include "triangle.h"
+#include "bvh_node.h"
+#include "bvhcache.h"
+#include "meshfile.h"
+#include "trimesh.h"
+#include <Rcpp.h>
+
+//Mesh loaded from a native binary mesh file (see meshfile.h), either with a single material or
+//with the materials stored in the file
+class raymesh : public hitable {
+  public:
+    raymesh() {}
+    ~raymesh() {}
+  raymesh(std::string inputfile, std::shared_ptr<material> mat, 
+          Float scale, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
+          std::string bvh_cache, random_gen rng,
+          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
+  raymesh(std::string inputfile, Float scale, Float sigma,
+          Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, random_gen rng,
+          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
+  virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+  
+  Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
+  Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
+  vec3f random(const point3f& o, random_gen& rng, Float time = 0);
+  vec3f random(const point3f& o, Sampler* sampler, Float time = 0);
+  
+  virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
+  virtual std::string GetName() const {
+    return(std::string("Raymesh"));
+  }
+  std::shared_ptr<bvh_node> mesh_bvh;
+  std::shared_ptr<material> mat_ptr;
+  //Images of the file's material textures, when those are used
+  std::vector<std::shared_ptr<TextureImage> > obj_materials;
+  std::vector<std::shared_ptr<TextureImage> > bump_materials;
+  std::shared_ptr<TriangleMesh> mesh;
+};
+
+
+#endif
@@ -117,6 +117,26 @@ bool xy_rect::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampl
   return(true);
 }
 
+//Alpha masked hits still count as hits in hit(), so only the geometry is tested
+bool xy_rect::intersect_p(const ray& r, Float t_min, Float t_max) const {
+  ray r2 = (*WorldToObject)(r);
+  Float t = (k-r2.origin().z()) / r2.direction().z();
+  if(t < t_min || t > t_max) {
+    return(false);
+  }
+  Float x = r2.origin().x() + t*r2.direction().x();
+  Float y = r2.origin().y() + t*r2.direction().y();
+  return(!(x < x0 || x > x1 || y < y0 || y > y1));
+}
+
+bool xy_rect::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(intersect_p(r, t_min, t_max));
+}
+
+bool xy_rect::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(intersect_p(r, t_min, t_max));
+}
+
 bool xy_rect::bounding_box(Float t0, Float t1, aabb& box) const {
   box = (*ObjectToWorld)(aabb(vec3f(x0,y0,k-0.001), vec3f(x1,y1,k+0.001)));
   return(true);
@@ -278,6 +298,25 @@ bool xz_rect::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampl
   return(true);
 }
 
+bool xz_rect::intersect_p(const ray& r, Float t_min, Float t_max) const {
+  ray r2 = (*WorldToObject)(r);
+  Float t = (k-r2.origin().y()) / r2.direction().y();
+  if(t < t_min || t > t_max) {
+    return(false);
+  }
+  Float x = r2.origin().x() + t*r2.direction().x();
+  Float z = r2.origin().z() + t*r2.direction().z();
+  return(!(x < x0 || x > x1 || z < z0 || z > z1));
+}
+
+bool xz_rect::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(intersect_p(r, t_min, t_max));
+}
+
+bool xz_rect::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(intersect_p(r, t_min, t_max));
+}
+
 bool xz_rect::bounding_box(Float t0, Float t1, aabb& box) const {
   box = (*ObjectToWorld)(aabb(vec3f(x0,k-0.001,z0), vec3f(x1,k+0.001,z1)));
   return(true);
@@ -434,6 +473,25 @@ bool yz_rect::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampl
   return(true);
 }
 
+bool yz_rect::intersect_p(const ray& r, Float t_min, Float t_max) const {
+  ray r2 = (*WorldToObject)(r);
+  Float t = (k-r2.origin().x()) / r2.direction().x();
+  if(t < t_min || t > t_max) {
+    return(false);
+  }
+  Float z = r2.origin().z() + t*r2.direction().z();
+  Float y = r2.origin().y() + t*r2.direction().y();
+  return(!(z < z0 || z > z1 || y < y0 || y > y1));
+}
+
+bool yz_rect::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(intersect_p(r, t_min, t_max));
+}
+
+bool yz_rect::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(intersect_p(r, t_min, t_max));
+}
+
 bool yz_rect::bounding_box(Float t0, Float t1, aabb& box) const {
   box = (*ObjectToWorld)(aabb(vec3f(k-0.001,y0,z0), vec3f(k+0.001,y1,z1)));
   return(true);
@@ -18,6 +18,9 @@ public:
   ~xy_rect() {}
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+  bool intersect_p(const ray& r, Float t_min, Float t_max) const;
   
   virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
   virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
@@ -49,6 +52,9 @@ public:
   ~xz_rect() {}
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+  bool intersect_p(const ray& r, Float t_min, Float t_max) const;
   
   virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
   virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
@@ -77,6 +83,9 @@ public:
   ~yz_rect() {}
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+  bool intersect_p(const ray& r, Float t_min, Float t_max) const;
   
   virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
   virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
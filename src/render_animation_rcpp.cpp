@@ -18,11 +18,34 @@
 #include "transform.h"
 #include "transformcache.h"
 #include "debug.h"
+#include "texturecache.h"
 using namespace Rcpp;
 #include "RcppThread.h"
 
 using namespace std;
 
+//Objects animated with animate_objects() move between frames when the shutter interval changes,
+//so the world BVH bounds are updated to the new interval before rendering the frame
+static void update_frame_shutter(std::shared_ptr<bvh_node> world_bvh_node,
+                                 Float frame_open, Float frame_close,
+                                 Float& shutteropen, Float& shutterclose,
+                                 size_t numbercores, bool verbose) {
+  if(frame_open == shutteropen && frame_close == shutterclose) {
+    return;
+  }
+  shutteropen = frame_open;
+  shutterclose = frame_close;
+  if(world_bvh_node) {
+    auto start = std::chrono::high_resolution_clock::now();
+    bool rebuilt = world_bvh_node->refit(shutteropen, shutterclose, numbercores);
+    auto finish = std::chrono::high_resolution_clock::now();
+    if(verbose) {
+      std::chrono::duration<double> elapsed = finish - start;
+      Rcpp::Rcout << (rebuilt ? "Rebuilding BVH: " : "Refitting BVH: ") << elapsed.count() << " seconds" << "\n";
+    }
+  }
+}
+
 // [[Rcpp::export]]
 void render_animation_rcpp(List camera_info, List scene_info, List camera_movement, int start_frame,
                            CharacterVector filenames, Function post_process_frame, int toneval,
@@ -91,14 +114,17 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   int nx = as<int>(camera_info["nx"]);
   int ny = as<int>(camera_info["ny"]);
   int ns = as<int>(camera_info["ns"]);
-  Float shutteropen = as<Float>(camera_info["shutteropen"]);
-  Float shutterclose = as<Float>(camera_info["shutterclose"]);
+  NumericVector shutteropen_frames = as<NumericVector>(camera_info["shutteropen"]);
+  NumericVector shutterclose_frames = as<NumericVector>(camera_info["shutterclose"]);
   size_t max_depth = as<size_t>(camera_info["max_depth"]);
   size_t roulette_active = as<size_t>(camera_info["roulette_active_depth"]);
   int sample_method = as<int>(camera_info["sample_method"]);
   NumericVector stratified_dim = as<NumericVector>(camera_info["stratified_dim"]);
   NumericVector light_direction = as<NumericVector>(camera_info["light_direction"]);
   int bvh_type = as<int>(camera_info["bvh"]);
+  int max_leaf_size = as<int>(camera_info["bvh_leaf_size"]);
+  std::string bvh_cache = as<std::string>(camera_info["bvh_cache"]);
+  int bvh_layout = as<int>(camera_info["bvh_layout"]);
   
   //unpack motion info
   NumericVector cam_x        = as<NumericVector>(camera_movement["x"]);
@@ -116,6 +142,21 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   NumericVector cam_orthox   = as<NumericVector>(camera_movement["orthox"]);
   NumericVector cam_orthoy   = as<NumericVector>(camera_movement["orthoy"]);
   int n_frames = cam_x.size();
+  if(start_frame < 0 || start_frame >= n_frames ||
+     start_frame >= shutteropen_frames.size() || start_frame >= shutterclose_frames.size()) {
+    throw std::runtime_error("start_frame " + std::to_string(start_frame + 1) + " is outside the " +
+                             std::to_string(n_frames) + " animation frames");
+  }
+  Float shutteropen = shutteropen_frames(start_frame);
+  Float shutterclose = shutterclose_frames(start_frame);
+  //The scene is built once for every frame, so the mesh levels are picked from all of the views
+  MeshLOD mesh_lod;
+  mesh_lod.triangles_per_pixel = as<Float>(camera_info["mesh_lod"]);
+  mesh_lod.nx = nx;
+  mesh_lod.ny = ny;
+  for(int i = start_frame; i < n_frames; i++) {
+    mesh_lod.views.push_back(LodView(vec3f(cam_x(i),cam_y(i),cam_z(i)), cam_fov(i), cam_orthoy(i)));
+  }
   
   vec3f backgroundhigh(bghigh[0],bghigh[1],bghigh[2]);
   vec3f backgroundlow(bglow[0],bglow[1],bglow[2]);
@@ -152,53 +193,55 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   //Shared material vector
   std::vector<std::shared_ptr<material> >* shared_materials = new std::vector<std::shared_ptr<material> >;
   
+  //Decoded images come from the texture cache, shared between objects using the same file and kept
+  //for later renders. This holds on to them until the animation is done.
+  std::vector<std::shared_ptr<TextureImage> > texture_images;
+  
   for(int i = 0; i < n; i++) {
     if(isimage(i)) {
-      int nx, ny, nn;
-      Float* tex_data = stbi_loadf(filelocation(i), &nx, &ny, &nn, 0);
-      textures.push_back(tex_data);
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(filelocation(i)));
+      texture_images.push_back(image);
+      textures.push_back(image->data);
       nx_ny_nn.push_back(new int[3]);
-      nx_ny_nn[i][0] = nx;
-      nx_ny_nn[i][1] = ny;
-      nx_ny_nn[i][2] = nn;
+      nx_ny_nn[i][0] = image->nx;
+      nx_ny_nn[i][1] = image->ny;
+      nx_ny_nn[i][2] = image->nn;
     } else {
       textures.push_back(nullptr);
       nx_ny_nn.push_back(nullptr);
     }
     if(has_alpha(i)) {
-      stbi_ldr_to_hdr_gamma(1.0f);
-      int nxa, nya, nna;
-      Float* tex_data_alpha = stbi_loadf(alpha_files(i), &nxa, &nya, &nna, 0);
-      alpha_textures.push_back(tex_data_alpha);
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(alpha_files(i)), 1.0f);
+      texture_images.push_back(image);
+      alpha_textures.push_back(image->data);
       nx_ny_nn_alpha.push_back(new int[3]);
-      nx_ny_nn_alpha[i][0] = nxa;
-      nx_ny_nn_alpha[i][1] = nya;
-      nx_ny_nn_alpha[i][2] = nna;
-      stbi_ldr_to_hdr_gamma(2.2f);
+      nx_ny_nn_alpha[i][0] = image->nx;
+      nx_ny_nn_alpha[i][1] = image->ny;
+      nx_ny_nn_alpha[i][2] = image->nn;
     } else {
       alpha_textures.push_back(nullptr);
       nx_ny_nn_alpha.push_back(nullptr);
     }
     if(has_bump(i)) {
-      int nxb, nyb, nnb;
-      Float* tex_data_bump = stbi_loadf(bump_files(i), &nxb, &nyb, &nnb, 0);
-      bump_textures.push_back(tex_data_bump);
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(bump_files(i)));
+      texture_images.push_back(image);
+      bump_textures.push_back(image->data);
       nx_ny_nn_bump.push_back(new int[3]);
-      nx_ny_nn_bump[i][0] = nxb;
-      nx_ny_nn_bump[i][1] = nyb;
-      nx_ny_nn_bump[i][2] = nnb;
+      nx_ny_nn_bump[i][0] = image->nx;
+      nx_ny_nn_bump[i][1] = image->ny;
+      nx_ny_nn_bump[i][2] = image->nn;
     } else {
       bump_textures.push_back(nullptr);
       nx_ny_nn_bump.push_back(nullptr);
     }
     if(has_roughness(i)) {
-      int nxr, nyr, nnr;
-      Float* tex_data_roughness = stbi_loadf(roughness_files(i), &nxr, &nyr, &nnr, 0);
-      roughness_textures.push_back(tex_data_roughness);
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(roughness_files(i)));
+      texture_images.push_back(image);
+      roughness_textures.push_back(image->data);
       nx_ny_nn_roughness.push_back(new int[3]);
-      nx_ny_nn_roughness[i][0] = nxr;
-      nx_ny_nn_roughness[i][1] = nyr;
-      nx_ny_nn_roughness[i][2] = nnr;
+      nx_ny_nn_roughness[i][0] = image->nx;
+      nx_ny_nn_roughness[i][1] = image->ny;
+      nx_ny_nn_roughness[i][2] = image->nn;
     } else {
       roughness_textures.push_back(nullptr);
       nx_ny_nn_roughness.push_back(nullptr);
@@ -226,13 +269,19 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
                                                   fileinfo, filebasedir, 
                                                   scale_list, sigmavec, glossyinfo,
                                                   shared_id_mat, is_shared_mat, shared_materials,
-                                                  image_repeat, csg_info, mesh_list, bvh_type, transformCache, 
+                                                  image_repeat, csg_info, mesh_list, bvh_type, max_leaf_size, numbercores, bvh_cache, mesh_lod, transformCache, 
                                                   animation_info, rng);
+  if(bvh_layout == 1) {
+    reorder_bvh_nodes(worldbvh.get());
+  }
   auto finish = std::chrono::high_resolution_clock::now();
   if(verbose) {
     std::chrono::duration<double> elapsed = finish - start;
     Rcpp::Rcout << elapsed.count() << " seconds" << "\n";
+    print_bvh_statistics(worldbvh);
   }
+  //Refit (rather than rebuild) the world BVH when the shutter interval changes between frames
+  std::shared_ptr<bvh_node> world_bvh_node = std::dynamic_pointer_cast<bvh_node>(worldbvh);
   
   //Calculate world bounds
   aabb bounding_box_world;
@@ -258,7 +307,12 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   std::shared_ptr<Transform> BackgroundTransformInv = transformCache.Lookup(BackgroundAngle.GetInverseMatrix());
   
   if(hasbackground) {
-    background_texture_data = stbi_loadf(background[0], &nx1, &ny1, &nn1, 0);
+    std::shared_ptr<TextureImage> image = load_texture(as<std::string>(background[0]));
+    texture_images.push_back(image);
+    background_texture_data = image->data;
+    nx1 = image->nx;
+    ny1 = image->ny;
+    nn1 = image->nn;
     background_texture = std::make_shared<image_texture>(background_texture_data, nx1, ny1, nn1, 1, 1, intensity_env);
     background_material = std::make_shared<diffuse_light>(background_texture, 1.0, false);
     background_sphere = std::make_shared<InfiniteAreaLight>(nx1, ny1, world_radius*2, world_center,
@@ -317,7 +371,7 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
                                  angle, i, order_rotation_list,
                                  isgrouped, group_transform,
                                  fileinfo, filebasedir,transformCache, scale_list, 
-                                 mesh_list,bvh_type,  animation_info,
+                                 mesh_list,bvh_type, max_leaf_size, numbercores, bvh_cache,  animation_info,
                                  rng));
     }
   }
@@ -356,6 +410,8 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
       if(progress_bar) {
         pb_frames.tick();
       }
+      update_frame_shutter(world_bvh_node, shutteropen_frames(i), shutterclose_frames(i),
+                           shutteropen, shutterclose, numbercores, verbose);
       vec3f lookfrom = vec3f(cam_x(i),cam_y(i),cam_z(i));
       vec3f lookat = vec3f(cam_dx(i),cam_dy(i),cam_dz(i));
       Float fov = cam_fov(i);
@@ -402,6 +458,8 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
       if(progress_bar) {
         pb_frames.tick();
       }
+      update_frame_shutter(world_bvh_node, shutteropen_frames(i), shutterclose_frames(i),
+                           shutteropen, shutterclose, numbercores, verbose);
       vec3f lookfrom = vec3f(cam_x(i),cam_y(i),cam_z(i));
       vec3f lookat = vec3f(cam_dx(i),cam_dy(i),cam_dz(i));
       vec3f camera_up = vec3f(cam_upx(i),cam_upy(i),cam_upz(i));
@@ -438,7 +496,7 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
                  progress_bar, sample_method, stratified_dim,
                  verbose, ocam, cam, ecam, fov,
                  world, hlist,
-                 clampval, max_depth, roulette_active);
+                 clampval, max_depth, roulette_active, nullptr);
       List temp = List::create(_["r"] = routput, _["g"] = goutput, _["b"] = boutput);
       post_process_frame(temp, debug_channel, as<std::string>(filenames(i)), toneval, bloom);
     }
@@ -447,22 +505,19 @@ void render_animation_rcpp(List camera_info, List scene_info, List camera_moveme
   if(verbose) {
     Rcpp::Rcout << "Cleaning up memory..." << "\n";
   }
-  if(hasbackground) {
-    stbi_image_free(background_texture_data);
-  }
   for(int i = 0; i < n; i++) {
     if(isimage(i)) {
-      stbi_image_free(textures[i]);
       delete nx_ny_nn[i];
     } 
     if(has_alpha(i)) {
-      stbi_image_free(alpha_textures[i]);
       delete nx_ny_nn_alpha[i];
     }
     if(has_bump(i)) {
-      stbi_image_free(bump_textures[i]);
       delete nx_ny_nn_bump[i];
     }
+    if(has_roughness(i)) {
+      delete nx_ny_nn_roughness[i];
+    }
   }
   delete shared_materials;
   PutRNGstate();
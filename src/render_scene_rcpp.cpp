@@ -31,6 +31,8 @@ typedef float Float;
 #include "color.h"
 #include "integrator.h"
 #include "debug.h"
+#include "texturecache.h"
+#include <sstream>
 using namespace Rcpp;
 // [[Rcpp::plugins(cpp11)]]
 // [[Rcpp::depends(RcppThread)]]
@@ -127,6 +129,15 @@ List render_scene_rcpp(List camera_info, List scene_info) {
   NumericVector stratified_dim = as<NumericVector>(camera_info["stratified_dim"]);
   NumericVector light_direction = as<NumericVector>(camera_info["light_direction"]);
   int bvh_type = as<int>(camera_info["bvh"]);
+  int max_leaf_size = as<int>(camera_info["bvh_leaf_size"]);
+  std::string bvh_cache = as<std::string>(camera_info["bvh_cache"]);
+  int bvh_layout = as<int>(camera_info["bvh_layout"]);
+  bool bvh_stats = as<bool>(camera_info["bvh_stats"]);
+  MeshLOD mesh_lod;
+  mesh_lod.triangles_per_pixel = as<Float>(camera_info["mesh_lod"]);
+  mesh_lod.nx = nx;
+  mesh_lod.ny = ny;
+  mesh_lod.views.push_back(LodView(vec3f(lookfromvec[0],lookfromvec[1],lookfromvec[2]), fov, ortho_dimensions(1)));
   
   //Initialize output matrices
   NumericMatrix routput(nx,ny);
@@ -181,89 +192,100 @@ List render_scene_rcpp(List camera_info, List scene_info) {
   //Shared material vector
   std::vector<std::shared_ptr<material> >* shared_materials = new std::vector<std::shared_ptr<material> >;
   
+  //Decoded images come from the texture cache, shared between objects using the same file and kept
+  //for later renders. This holds on to them until the render is done.
+  std::vector<std::shared_ptr<TextureImage> > texture_images;
+  
   for(int i = 0; i < n; i++) {
     if(isimage(i)) {
-      int nx, ny, nn;
-      Float* tex_data = stbi_loadf(filelocation(i), &nx, &ny, &nn, 0);
-      textures.push_back(tex_data);
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(filelocation(i)));
+      texture_images.push_back(image);
+      textures.push_back(image->data);
       nx_ny_nn.push_back(new int[3]);
-      nx_ny_nn[i][0] = nx;
-      nx_ny_nn[i][1] = ny;
-      nx_ny_nn[i][2] = nn;
+      nx_ny_nn[i][0] = image->nx;
+      nx_ny_nn[i][1] = image->ny;
+      nx_ny_nn[i][2] = image->nn;
     } else {
       textures.push_back(nullptr);
       nx_ny_nn.push_back(nullptr);
     }
     if(has_alpha(i)) {
-      stbi_ldr_to_hdr_gamma(1.0f);
-      int nxa, nya, nna;
-      Float* tex_data_alpha = stbi_loadf(alpha_files(i), &nxa, &nya, &nna, 0);
-      alpha_textures.push_back(tex_data_alpha);
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(alpha_files(i)), 1.0f);
+      texture_images.push_back(image);
+      alpha_textures.push_back(image->data);
       nx_ny_nn_alpha.push_back(new int[3]);
-      nx_ny_nn_alpha[i][0] = nxa;
-      nx_ny_nn_alpha[i][1] = nya;
-      nx_ny_nn_alpha[i][2] = nna;
-      stbi_ldr_to_hdr_gamma(2.2f);
+      nx_ny_nn_alpha[i][0] = image->nx;
+      nx_ny_nn_alpha[i][1] = image->ny;
+      nx_ny_nn_alpha[i][2] = image->nn;
     } else {
       alpha_textures.push_back(nullptr);
       nx_ny_nn_alpha.push_back(nullptr);
     }
     if(has_bump(i)) {
-      int nxb, nyb, nnb;
-      Float* tex_data_bump = stbi_loadf(bump_files(i), &nxb, &nyb, &nnb, 0);
-      bump_textures.push_back(tex_data_bump);
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(bump_files(i)));
+      texture_images.push_back(image);
+      bump_textures.push_back(image->data);
       nx_ny_nn_bump.push_back(new int[3]);
-      nx_ny_nn_bump[i][0] = nxb;
-      nx_ny_nn_bump[i][1] = nyb;
-      nx_ny_nn_bump[i][2] = nnb;
+      nx_ny_nn_bump[i][0] = image->nx;
+      nx_ny_nn_bump[i][1] = image->ny;
+      nx_ny_nn_bump[i][2] = image->nn;
     } else {
       bump_textures.push_back(nullptr);
       nx_ny_nn_bump.push_back(nullptr);
     }
     if(has_roughness(i)) {
       NumericVector temp_glossy = as<NumericVector>(glossyinfo(i));
-      int nxr, nyr, nnr;
-      Float* tex_data_roughness = stbi_loadf(roughness_files(i), &nxr, &nyr, &nnr, 0);
       Float min = temp_glossy(9), max = temp_glossy(10);
-      Float rough_range = max-min;
-      Float maxr = 0, minr = 1;
-      for(int ii = 0; ii < nxr; ii++) {
-        for(int jj = 0; jj < nyr; jj++) {
-          Float temp_rough = tex_data_roughness[nnr*ii + nnr*nxr*jj];
-          maxr = maxr < temp_rough ? temp_rough : maxr;
-          minr = minr > temp_rough ? temp_rough : minr;
-          if(nnr > 1) {
-            temp_rough = tex_data_roughness[nnr*ii + nnr*nxr*jj+1];
+      bool invert = temp_glossy(11);
+      //The roughness is rescaled to [min, max] once, when the image is decoded
+      std::ostringstream rescale;
+      rescale.precision(9);
+      rescale << "roughness|" << min << '|' << max << '|' << invert;
+      std::shared_ptr<TextureImage> image = load_texture(as<std::string>(roughness_files(i)), 2.2f, rescale.str(),
+                                                         [min, max, invert](TextureImage& rough) {
+        Float* tex_data_roughness = rough.data;
+        int nxr = rough.nx, nyr = rough.ny, nnr = rough.nn;
+        Float rough_range = max-min;
+        Float maxr = 0, minr = 1;
+        for(int ii = 0; ii < nxr; ii++) {
+          for(int jj = 0; jj < nyr; jj++) {
+            Float temp_rough = tex_data_roughness[nnr*ii + nnr*nxr*jj];
             maxr = maxr < temp_rough ? temp_rough : maxr;
             minr = minr > temp_rough ? temp_rough : minr;
-          }
-        }
-      }
-      Float data_range = maxr-minr;
-      for(int ii = 0; ii < nxr; ii++) {
-        for(int jj = 0; jj < nyr; jj++) {
-          if(!temp_glossy(11)) {
-            tex_data_roughness[nnr*ii + nnr*nxr*jj] = 
-              (tex_data_roughness[nnr*ii + nnr*nxr*jj]-minr)/data_range * rough_range + min;
             if(nnr > 1) {
-              tex_data_roughness[nnr*ii + nnr*nxr*jj+1] = 
-                (tex_data_roughness[nnr*ii + nnr*nxr*jj+1]-minr)/data_range * rough_range + min;
+              temp_rough = tex_data_roughness[nnr*ii + nnr*nxr*jj+1];
+              maxr = maxr < temp_rough ? temp_rough : maxr;
+              minr = minr > temp_rough ? temp_rough : minr;
             }
-          } else {
-            tex_data_roughness[nnr*ii + nnr*nxr*jj] = 
-              (1.0-(tex_data_roughness[nnr*ii + nnr*nxr*jj]-minr)/data_range) * rough_range + min;
-            if(nnr > 1) {
-              tex_data_roughness[nnr*ii + nnr*nxr*jj+1] = 
-                (1.0-(tex_data_roughness[nnr*ii + nnr*nxr*jj+1]-minr)/data_range) * rough_range + min;
+          }
+        }
+        Float data_range = maxr-minr;
+        for(int ii = 0; ii < nxr; ii++) {
+          for(int jj = 0; jj < nyr; jj++) {
+            if(!invert) {
+              tex_data_roughness[nnr*ii + nnr*nxr*jj] = 
+                (tex_data_roughness[nnr*ii + nnr*nxr*jj]-minr)/data_range * rough_range + min;
+              if(nnr > 1) {
+                tex_data_roughness[nnr*ii + nnr*nxr*jj+1] = 
+                  (tex_data_roughness[nnr*ii + nnr*nxr*jj+1]-minr)/data_range * rough_range + min;
+              }
+            } else {
+              tex_data_roughness[nnr*ii + nnr*nxr*jj] = 
+                (1.0-(tex_data_roughness[nnr*ii + nnr*nxr*jj]-minr)/data_range) * rough_range + min;
+              if(nnr > 1) {
+                tex_data_roughness[nnr*ii + nnr*nxr*jj+1] = 
+                  (1.0-(tex_data_roughness[nnr*ii + nnr*nxr*jj+1]-minr)/data_range) * rough_range + min;
+              }
             }
           }
         }
-      }
-      roughness_textures.push_back(tex_data_roughness);
+      });
+      texture_images.push_back(image);
+      roughness_textures.push_back(image->data);
       nx_ny_nn_roughness.push_back(new int[3]);
-      nx_ny_nn_roughness[i][0] = nxr;
-      nx_ny_nn_roughness[i][1] = nyr;
-      nx_ny_nn_roughness[i][2] = nnr;
+      nx_ny_nn_roughness[i][0] = image->nx;
+      nx_ny_nn_roughness[i][1] = image->ny;
+      nx_ny_nn_roughness[i][2] = image->nn;
     } else {
       roughness_textures.push_back(nullptr);
       nx_ny_nn_roughness.push_back(nullptr);
@@ -292,12 +314,17 @@ List render_scene_rcpp(List camera_info, List scene_info) {
                                 fileinfo, filebasedir, 
                                 scale_list, sigmavec, glossyinfo,
                                 shared_id_mat, is_shared_mat, shared_materials,
-                                image_repeat, csg_info, mesh_list, bvh_type, transformCache, 
+                                image_repeat, csg_info, mesh_list, bvh_type, max_leaf_size, numbercores, bvh_cache, mesh_lod, transformCache, 
                                 animation_info, rng);
+  //The layout benchmark reorders the nodes itself, after measuring the depth-first layout
+  if(bvh_layout == 1 && debug_channel != 17) {
+    reorder_bvh_nodes(worldbvh.get());
+  }
   auto finish = std::chrono::high_resolution_clock::now();
   if(verbose) {
     std::chrono::duration<double> elapsed = finish - start;
     Rcpp::Rcout << elapsed.count() << " seconds" << "\n";
+    print_bvh_statistics(worldbvh);
   }
   
   //Calculate world bounds and ensure camera is inside infinite area light
@@ -332,7 +359,12 @@ List render_scene_rcpp(List camera_info, List scene_info) {
   std::shared_ptr<Transform> BackgroundTransformInv = transformCache.Lookup(BackgroundAngle.GetInverseMatrix());
   
   if(hasbackground) {
-    background_texture_data = stbi_loadf(background[0], &nx1, &ny1, &nn1, 0);
+    std::shared_ptr<TextureImage> image = load_texture(as<std::string>(background[0]));
+    texture_images.push_back(image);
+    background_texture_data = image->data;
+    nx1 = image->nx;
+    ny1 = image->ny;
+    nn1 = image->nn;
     background_texture = std::make_shared<image_texture>(background_texture_data, nx1, ny1, nn1, 1, 1, intensity_env);
     background_material = std::make_shared<diffuse_light>(background_texture, 1.0, false);
     background_sphere = std::make_shared<InfiniteAreaLight>(nx1, ny1, world_radius*2, vec3f(0.f),
@@ -394,7 +426,7 @@ List render_scene_rcpp(List camera_info, List scene_info) {
                                isgrouped, group_transform,
                                fileinfo, filebasedir,
                                transformCache ,scale_list, 
-                               mesh_list,bvh_type, animation_info,  rng));
+                               mesh_list,bvh_type, max_leaf_size, numbercores, bvh_cache, animation_info,  rng));
     }
   }
   finish = std::chrono::high_resolution_clock::now();
@@ -422,6 +454,7 @@ List render_scene_rcpp(List camera_info, List scene_info) {
     min_adaptive_size = 1;
     min_variance = 10E-8;
   }
+  BVHTraversalCounters traversal_counters;
   if(debug_channel != 0) {
     debug_scene(numbercores, nx, ny, ns, debug_channel,
                 min_variance, min_adaptive_size, 
@@ -438,30 +471,24 @@ List render_scene_rcpp(List camera_info, List scene_info) {
                progress_bar, sample_method, stratified_dim,
                verbose, ocam, cam, ecam, fov,
                world, hlist,
-               clampval, max_depth, roulette_active);
+               clampval, max_depth, roulette_active,
+               bvh_stats ? &traversal_counters : nullptr);
   }
 
   if(verbose) {
     Rcpp::Rcout << "Cleaning up memory..." << "\n";
   }
-  if(hasbackground) {
-    stbi_image_free(background_texture_data);
-  }
   for(int i = 0; i < n; i++) {
     if(isimage(i)) {
-      stbi_image_free(textures[i]);
       delete nx_ny_nn[i];
     } 
     if(has_alpha(i)) {
-      stbi_image_free(alpha_textures[i]);
       delete nx_ny_nn_alpha[i];
     }
     if(has_bump(i)) {
-      stbi_image_free(bump_textures[i]);
       delete nx_ny_nn_bump[i];
     }
     if(has_roughness(i)) {
-      stbi_image_free(roughness_textures[i]);
       delete nx_ny_nn_roughness[i];
     }
   }
@@ -472,5 +499,9 @@ List render_scene_rcpp(List camera_info, List scene_info) {
     std::chrono::duration<double> elapsed = finish - startfirst;
     Rcpp::Rcout << "Total time elapsed: " << elapsed.count() << " seconds" << "\n";
   }
-  return(List::create(_["r"] = routput, _["g"] = goutput, _["b"] = boutput));
+  List output = List::create(_["r"] = routput, _["g"] = goutput, _["b"] = boutput);
+  if(bvh_stats) {
+    output["bvh_stats"] = bvh_statistics(worldbvh, debug_channel == 0 ? &traversal_counters : nullptr);
+  }
+  return(output);
 }
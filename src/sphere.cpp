@@ -3,8 +3,19 @@
 // #include "RcppThread.h"
 
 bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  return(deferred_hit(this, r, t_min, t_max, rec, rng));
+}
+
+bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  return(deferred_hit(this, r, t_min, t_max, rec, sampler));
+}
+
+//Picks the closest root that isn't cut out by the alpha mask. The interaction is only computed
+//in interaction(), from the root's t and whether it was the far one (hit.index == 1).
+template<typename S>
+static bool sphere_intersect(sphere& s, const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler) {
   vec3f oErr, dErr;
-  ray r2 = (*WorldToObject)(r, &oErr, &dErr);
+  ray r2 = (*s.WorldToObject)(r, &oErr, &dErr);
   // Compute quadratic sphere coefficients
   
   // Initialize _EFloat_ ray coordinate values
@@ -12,7 +23,7 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random
   EFloat dx(r2.direction().x(), dErr.x()), dy(r2.direction().y(), dErr.y()), dz(r2.direction().z(), dErr.z());
   EFloat a = dx * dx + dy * dy + dz * dz;
   EFloat b = 2 * (dx * ox + dy * oy + dz * oz);
-  EFloat c = ox * ox + oy * oy + oz * oz - EFloat(radius) * EFloat(radius);
+  EFloat c = ox * ox + oy * oy + oz * oz - EFloat(s.radius) * EFloat(s.radius);
   
   // Solve quadratic equation for _t_ values
   EFloat temp1, temp2;
@@ -21,234 +32,100 @@ bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random
   }
   bool is_hit = true;
   bool second_is_hit = true;
-  bool alpha_miss = false;
-
-  if(alpha_mask) {
+  if(s.alpha_mask) {
     Float u;
     Float v;
     if(temp1 < t_max && temp1 > t_min) {
       point3f p1 = r2.point_at_parameter((Float)temp1);
-      p1 *= radius / p1.length(); 
-      vec3f normal = (p1 - center) / radius;
+      p1 *= s.radius / p1.length(); 
+      vec3f normal = (p1 - s.center) / s.radius;
       get_sphere_uv(normal, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < rng.unif_rand()) {
+      if(s.alpha_mask->value(u, v, p1).x() < sample_1d(sampler)) {
         is_hit = false;
       }
     }
     if(temp2 < t_max && temp2 > t_min) {
       point3f p2 = r2.point_at_parameter((Float)temp2);
-      p2 *= radius / p2.length(); 
-      vec3f normal = (p2 - center) / radius;
+      p2 *= s.radius / p2.length(); 
+      vec3f normal = (p2 - s.center) / s.radius;
       get_sphere_uv(normal, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < rng.unif_rand()) {
-        if(!is_hit) {
-          return(false);
-        }
+      if(s.alpha_mask->value(u, v, p2).x() < sample_1d(sampler)) {
         second_is_hit = false;
       } 
     }
   }
   if(temp1 < t_max && temp1 > t_min && is_hit) {
-    rec.t = (Float)temp1;
-    rec.p = r2.point_at_parameter(rec.t);
-    rec.p *= radius / rec.p.length(); 
-    rec.normal = (rec.p - center) / radius;
-    
-    //Interaction information
-    Float zRadius = std::sqrt(rec.p.x() * rec.p.x()  + rec.p.z()  * rec.p.z() );
-    Float invZRadius = 1 / zRadius;
-    Float cosPhi = rec.p.x() * invZRadius;
-    Float sinPhi = rec.p.z() * invZRadius;
-    Float theta = std::acos(clamp(rec.p.z() / radius, -1, 1));
-    rec.dpdu = 2 * M_PI * vec3f(-rec.p.z(), 0, rec.p.x());
-    rec.dpdv = 2 * M_PI * vec3f(rec.p.z() * cosPhi, rec.p.z() * sinPhi, -radius * std::sin(theta));
-    get_sphere_uv(rec.normal, rec.u, rec.v);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-    }
-    rec.pError = gamma(5) * Abs(rec.p);
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    rec.shape = this;
-    rec.alpha_miss = alpha_miss;
-    
-    rec.mat_ptr = mat_ptr.get();
-    return(true);
-  }
-  if(temp2 < t_max && temp2 > t_min && second_is_hit) {
-    rec.t = (Float)temp2;
-    rec.p = r2.point_at_parameter(rec.t);
-    rec.p *= radius / rec.p.length();
-    rec.normal = (rec.p - center) / radius;
-    
-    //Interaction information
-    Float zRadius = std::sqrt(rec.p.x() * rec.p.x()  + rec.p.z()  * rec.p.z() );
-    Float invZRadius = 1 / zRadius;
-    Float cosPhi = rec.p.x() * invZRadius;
-    Float sinPhi = rec.p.z() * invZRadius;
-    Float theta = std::acos(clamp(rec.p.z() / radius, -1, 1));
-    rec.dpdu = 2 * M_PI * vec3f(-rec.p.z(), 0, rec.p.x());
-    rec.dpdv = 2 * M_PI * vec3f(rec.p.z() * cosPhi, rec.p.z() * sinPhi, -radius * std::sin(theta));
-    get_sphere_uv(rec.normal, rec.u, rec.v);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal +  normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-    }
-    
-    if(alpha_mask) {
-      rec.normal = -rec.normal;
-      rec.bump_normal = -rec.bump_normal;
-    }
-    rec.pError = gamma(5) * Abs(rec.p);
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    
-    rec.shape = this;
-    rec.alpha_miss = alpha_miss;
-    
-    rec.mat_ptr = mat_ptr.get();
-    return(true);
+    hit.t = (Float)temp1;
+    hit.index = 0;
+  } else if(temp2 < t_max && temp2 > t_min && second_is_hit) {
+    hit.t = (Float)temp2;
+    hit.index = 1;
+  } else {
+    return(false);
   }
-  return(false);
+  hit.alpha_miss = false;
+  hit.shape = &s;
+  return(true);
 }
 
+bool sphere::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  return(sphere_intersect(*this, r, t_min, t_max, hit, rng));
+}
 
-bool sphere::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+bool sphere::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  return(sphere_intersect(*this, r, t_min, t_max, hit, sampler));
+}
+
+void sphere::fill_interaction(const ray& r, const SurfaceHit& hit, hit_record& rec) const {
   vec3f oErr, dErr;
   ray r2 = (*WorldToObject)(r, &oErr, &dErr);
-  // Compute quadratic sphere coefficients
+  rec.t = hit.t;
+  rec.p = r2.point_at_parameter(rec.t);
+  rec.p *= radius / rec.p.length(); 
+  rec.normal = (rec.p - center) / radius;
   
-  // Initialize _EFloat_ ray coordinate values
-  EFloat ox(r2.origin().x(), oErr.x()), oy(r2.origin().y(), oErr.y()), oz(r2.origin().z(), oErr.z());
-  EFloat dx(r2.direction().x(), dErr.x()), dy(r2.direction().y(), dErr.y()), dz(r2.direction().z(), dErr.z());
-  EFloat a = dx * dx + dy * dy + dz * dz;
-  EFloat b = 2 * (dx * ox + dy * oy + dz * oz);
-  EFloat c = ox * ox + oy * oy + oz * oz - EFloat(radius) * EFloat(radius);
+  //Interaction information
+  Float zRadius = std::sqrt(rec.p.x() * rec.p.x()  + rec.p.z()  * rec.p.z() );
+  Float invZRadius = 1 / zRadius;
+  Float cosPhi = rec.p.x() * invZRadius;
+  Float sinPhi = rec.p.z() * invZRadius;
+  Float theta = std::acos(clamp(rec.p.z() / radius, -1, 1));
+  rec.dpdu = 2 * M_PI * vec3f(-rec.p.z(), 0, rec.p.x());
+  rec.dpdv = 2 * M_PI * vec3f(rec.p.z() * cosPhi, rec.p.z() * sinPhi, -radius * std::sin(theta));
+  get_sphere_uv(rec.normal, rec.u, rec.v);
+  rec.has_bump = bump_tex ? true : false;
   
-  // Solve quadratic equation for _t_ values
-  EFloat temp1, temp2;
-  if (!Quadratic(a, b, c, &temp1, &temp2)) {
-    return(false);
-  }
-  bool is_hit = true;
-  bool second_is_hit = true;
-  bool alpha_miss = false;
-  if(alpha_mask) {
-    Float u;
-    Float v;
-    if(temp1 < t_max && temp1 > t_min) {
-      point3f p1 = r2.point_at_parameter((Float)temp1);
-      p1 *= radius / p1.length(); 
-      vec3f normal = (p1 - center) / radius;
-      get_sphere_uv(normal, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < sampler->Get1D()) {
-        is_hit = false;
-      }
-    }
-    if(temp2 < t_max && temp2 > t_min) {
-      point3f p2 = r2.point_at_parameter((Float)temp2);
-      p2 *= radius / p2.length(); 
-      vec3f normal = (p2 - center) / radius;
-      get_sphere_uv(normal, u, v);
-      if(alpha_mask->value(u, v, rec.p).x() < sampler->Get1D()) {
-        if(!is_hit) {
-          alpha_miss = true;
-        }
-        second_is_hit = false;
-      } 
-    }
-  }
-  if(temp1 < t_max && temp1 > t_min && is_hit) {
-    rec.t = (Float)temp1;
-    rec.p = r2.point_at_parameter(rec.t);
-    rec.p *= radius / rec.p.length(); 
-    rec.normal = (rec.p - center) / radius;
-    
-    //Interaction information
-    Float zRadius = std::sqrt(rec.p.x() * rec.p.x()  + rec.p.z()  * rec.p.z() );
-    Float invZRadius = 1 / zRadius;
-    Float cosPhi = rec.p.x() * invZRadius;
-    Float sinPhi = rec.p.z() * invZRadius;
-    Float theta = std::acos(clamp(rec.p.z() / radius, -1, 1));
-    rec.dpdu = 2 * M_PI * vec3f(-rec.p.z(), 0, rec.p.x());
-    rec.dpdv = 2 * M_PI * vec3f(rec.p.z() * cosPhi, rec.p.z() * sinPhi, -radius * std::sin(theta));
-    get_sphere_uv(rec.normal, rec.u, rec.v);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-    }
-    rec.pError = gamma(5) * Abs(rec.p);
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    
-    rec.shape = this;
-    rec.alpha_miss = alpha_miss;
-    
-    rec.mat_ptr = mat_ptr.get();
-    return(true);
+  if(bump_tex) {
+    point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
+    rec.bump_normal = rec.normal + normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
+    rec.bump_normal.make_unit_vector();
   }
-  if(temp2 < t_max && temp2 > t_min && second_is_hit) {
-    rec.t = (Float)temp2;
-    rec.p = r2.point_at_parameter(rec.t);
-    rec.p *= radius / rec.p.length();
-    rec.normal = (rec.p - center) / radius;
-    
-    //Interaction information
-    Float zRadius = std::sqrt(rec.p.x() * rec.p.x()  + rec.p.z()  * rec.p.z() );
-    Float invZRadius = 1 / zRadius;
-    Float cosPhi = rec.p.x() * invZRadius;
-    Float sinPhi = rec.p.z() * invZRadius;
-    Float theta = std::acos(clamp(rec.p.z() / radius, -1, 1));
-    rec.dpdu = 2 * M_PI * vec3f(-rec.p.z(), 0, rec.p.x());
-    rec.dpdv = 2 * M_PI * vec3f(rec.p.z() * cosPhi, rec.p.z() * sinPhi, -radius * std::sin(theta));
-    get_sphere_uv(rec.normal, rec.u, rec.v);
-    rec.has_bump = bump_tex ? true : false;
-    
-    if(bump_tex) {
-      point3f bvbu = bump_tex->value(rec.u,rec.v, rec.p);
-      rec.bump_normal = rec.normal +  normal3f(bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv); 
-      rec.bump_normal.make_unit_vector();
-    }
-    
-    if(alpha_mask) {
-      rec.normal = -rec.normal;
-      rec.bump_normal = -rec.bump_normal;
-    }
-    rec.pError = gamma(5) * Abs(rec.p);
-    rec = (*ObjectToWorld)(rec);
-    rec.normal *= reverseOrientation  ? -1 : 1;
-    rec.bump_normal *= reverseOrientation  ? -1 : 1;
-    rec.normal.make_unit_vector();
-    
-    rec.shape = this;
-    rec.alpha_miss = alpha_miss;
-    
-    rec.mat_ptr = mat_ptr.get();
-    return(true);
+  //The inside of alpha masked spheres is visible through the near side
+  if(alpha_mask && hit.index == 1) {
+    rec.normal = -rec.normal;
+    rec.bump_normal = -rec.bump_normal;
   }
-  return(false);
+  rec.pError = gamma(5) * Abs(rec.p);
+  rec = (*ObjectToWorld)(rec);
+  rec.normal *= reverseOrientation  ? -1 : 1;
+  rec.bump_normal *= reverseOrientation  ? -1 : 1;
+  rec.normal.make_unit_vector();
+  rec.shape = this;
+  rec.alpha_miss = hit.alpha_miss;
+  
+  rec.mat_ptr = mat_ptr.get();
 }
 
+void sphere::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng) {
+  fill_interaction(r, hit, rec);
+}
+
+void sphere::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler) {
+  fill_interaction(r, hit, rec);
+}
 
 Float sphere::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
-  hit_record rec;
-  if(!this->hit(ray(o,v), 0.001, FLT_MAX, rec, rng)) {
+  if(!this->occluded(ray(o,v), 0.001, FLT_MAX, rng)) {
     return(0);
   }
   point3f pCenter = (*ObjectToWorld)(point3f(0.f, 0.f, 0.f));
@@ -266,8 +143,7 @@ Float sphere::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float
 
 
 Float sphere::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
-  hit_record rec;
-  if(!this->hit(ray(o,v), 0.001, FLT_MAX, rec, sampler)) {
+  if(!this->occluded(ray(o,v), 0.001, FLT_MAX, sampler)) {
     return(0);
   }
   point3f pCenter = (*ObjectToWorld)(point3f(0.f, 0.f, 0.f));
@@ -361,6 +237,36 @@ vec3f sphere::random(const point3f& o, Sampler* sampler, Float time) {
   return (pWorld-o);
 }
 
+//Alpha masked spheres can let the ray through, so they fall back to hit()
+bool sphere::intersect_p(const ray& r, Float t_min, Float t_max) const {
+  vec3f oErr, dErr;
+  ray r2 = (*WorldToObject)(r, &oErr, &dErr);
+  EFloat ox(r2.origin().x(), oErr.x()), oy(r2.origin().y(), oErr.y()), oz(r2.origin().z(), oErr.z());
+  EFloat dx(r2.direction().x(), dErr.x()), dy(r2.direction().y(), dErr.y()), dz(r2.direction().z(), dErr.z());
+  EFloat a = dx * dx + dy * dy + dz * dz;
+  EFloat b = 2 * (dx * ox + dy * oy + dz * oz);
+  EFloat c = ox * ox + oy * oy + oz * oz - EFloat(radius) * EFloat(radius);
+  EFloat temp1, temp2;
+  if (!Quadratic(a, b, c, &temp1, &temp2)) {
+    return(false);
+  }
+  return((temp1 < t_max && temp1 > t_min) || (temp2 < t_max && temp2 > t_min));
+}
+
+bool sphere::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  if(alpha_mask) {
+    return(hitable::occluded(r, t_min, t_max, rng));
+  }
+  return(intersect_p(r, t_min, t_max));
+}
+
+bool sphere::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  if(alpha_mask) {
+    return(hitable::occluded(r, t_min, t_max, sampler));
+  }
+  return(intersect_p(r, t_min, t_max));
+}
+
 bool sphere::bounding_box(Float t0, Float t1, aabb& box) const {
   box = (*ObjectToWorld)(aabb(center - vec3f(radius,radius,radius), center + vec3f(radius,radius,radius)));
   return(true);
@@ -20,6 +20,14 @@ class sphere: public hitable {
             mat_ptr(mat), alpha_mask(alpha_mask), bump_tex(bump_tex) {};
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, random_gen& rng);
     virtual bool hit(const ray& r, Float tmin, Float tmax, hit_record& rec, Sampler* sampler);
+    virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+    virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+    virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng);
+    virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler);
+    virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng);
+    virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler);
+    void fill_interaction(const ray& r, const SurfaceHit& hit, hit_record& rec) const;
+    bool intersect_p(const ray& r, Float t_min, Float t_max) const;
     
     virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
     virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
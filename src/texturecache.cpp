@@ -0,0 +1,98 @@
+#include "texturecache.h"
+#include "mappedfile.h"
+#ifndef STBIMAGEH
+#define STBIMAGEH
+#include "stb_image.h"
+#endif
+#include <Rcpp.h>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <climits>
+
+TextureImage::~TextureImage() {
+  if(data) {
+    stbi_image_free(data);
+  }
+}
+
+struct CachedTexture {
+  std::shared_ptr<TextureImage> image;
+  size_t bytes;
+  uint64_t last_used;
+};
+
+static std::mutex texture_cache_mutex;
+static std::map<std::string, CachedTexture> texture_cache;
+static uint64_t texture_cache_clock = 0;
+
+//Expects texture_cache_mutex to be held
+static size_t trim_texture_cache_locked(size_t budget) {
+  size_t unused_bytes = 0;
+  for(const auto& entry : texture_cache) {
+    if(entry.second.image.use_count() == 1) {
+      unused_bytes += entry.second.bytes;
+    }
+  }
+  size_t freed = 0;
+  while(unused_bytes > budget) {
+    std::map<std::string, CachedTexture>::iterator oldest = texture_cache.end();
+    for(auto entry = texture_cache.begin(); entry != texture_cache.end(); ++entry) {
+      if(entry->second.image.use_count() == 1 &&
+         (oldest == texture_cache.end() || entry->second.last_used < oldest->second.last_used)) {
+        oldest = entry;
+      }
+    }
+    unused_bytes -= oldest->second.bytes;
+    texture_cache.erase(oldest);
+    freed++;
+  }
+  return(freed);
+}
+
+std::shared_ptr<TextureImage> load_texture(const std::string& path, Float gamma, const std::string& options,
+                                           std::function<void(TextureImage&)> prepare) {
+  MappedFile file(path);
+  if(!file.data() || file.size() > INT_MAX) {
+    return(std::make_shared<TextureImage>());
+  }
+  std::ostringstream key;
+  key.precision(9);
+  key << std::hex << file.hash() << std::dec << '|' << file.size() << '|' << gamma << '|' << options;
+
+  std::lock_guard<std::mutex> lock(texture_cache_mutex);
+  std::map<std::string, CachedTexture>::iterator cached = texture_cache.find(key.str());
+  if(cached != texture_cache.end()) {
+    cached->second.last_used = ++texture_cache_clock;
+    return(cached->second.image);
+  }
+  std::shared_ptr<TextureImage> image = std::make_shared<TextureImage>();
+  stbi_ldr_to_hdr_gamma(gamma);
+  image->data = stbi_loadf_from_memory(file.data(), static_cast<int>(file.size()),
+                                       &image->nx, &image->ny, &image->nn, 0);
+  stbi_ldr_to_hdr_gamma(2.2f);
+  if(!image->data) {
+    image->nx = image->ny = image->nn = 0;
+    return(image);
+  }
+  if(prepare) {
+    prepare(*image);
+  }
+  CachedTexture entry;
+  entry.image = image;
+  entry.bytes = sizeof(Float) * size_t(image->nx) * size_t(image->ny) * size_t(image->nn);
+  entry.last_used = ++texture_cache_clock;
+  texture_cache[key.str()] = entry;
+  trim_texture_cache_locked(kTextureCacheBudget);
+  return(image);
+}
+
+size_t trim_texture_cache(size_t budget) {
+  std::lock_guard<std::mutex> lock(texture_cache_mutex);
+  return(trim_texture_cache_locked(budget));
+}
+
+// [[Rcpp::export]]
+int clear_texture_cache_rcpp() {
+  return(static_cast<int>(trim_texture_cache(0)));
+}
@@ -0,0 +1,42 @@
+#ifndef TEXTURECACHEH
+#define TEXTURECACHEH
+
+#include <string>
+#include <memory>
+#include <functional>
+
+#ifndef FLOATDEF
+#define FLOATDEF
+#ifdef RAY_FLOAT_AS_DOUBLE
+typedef double Float;
+#else
+typedef float Float;
+#endif 
+#endif
+
+//Decoded image, shared by every object that uses the same file with the same load options
+struct TextureImage {
+  TextureImage() : data(nullptr), nx(0), ny(0), nn(0) {}
+  ~TextureImage();
+  Float* data;
+  int nx, ny, nn;
+};
+
+//Images that no object uses any more are kept (for the next render) up to this many bytes
+static const size_t kTextureCacheBudget = size_t(1) << 30;
+
+//Loads the image at `path`, with 8-bit images converted to linear with `gamma` (HDR files are read as
+//they are). Images are cached for the whole R session, keyed by a hash of the file's contents, `gamma`
+//and `options`, so an image used by many objects, many frames or copied to several temporary files is
+//only decoded and stored once. `prepare` is run once on each newly decoded image (e.g. to rescale
+//it), so everything it depends on has to be in `options`. If the file can't be read, the image's
+//data is null and nothing is cached.
+std::shared_ptr<TextureImage> load_texture(const std::string& path, Float gamma = 2.2f,
+                                           const std::string& options = std::string(),
+                                           std::function<void(TextureImage&)> prepare = nullptr);
+
+//Frees the least recently used images no object holds until the rest total at most `budget` bytes.
+//Returns the number of images freed.
+size_t trim_texture_cache(size_t budget = kTextureCacheBudget);
+
+#endif
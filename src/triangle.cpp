@@ -1,40 +1,71 @@
 #include "triangle.h"
 
+#if defined(__SSE2__) && !defined(RAY_FLOAT_AS_DOUBLE)
+#include <immintrin.h>
+#endif
+
 
 bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) {
+  return(deferred_hit(this, r, t_min, t_max, rec, rng));
+}
+
+bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
+  return(deferred_hit(this, r, t_min, t_max, rec, sampler));
+}
+
+//Moller-Trumbore test, shared by intersect() and intersect_p()
+bool triangle::intersect_uv(const ray& r, Float t_min, Float t_max, Float& t, Float& u, Float& v) const {
   vec3f pvec = cross(r.direction(), edge2);
   Float det = dot(pvec, edge1);
-  
-  bool alpha_miss = false;
   // no culling
   if (std::fabs(det) < 1E-15) {
     return(false);
   }
   Float invdet = 1.0 / det;
   vec3f tvec = vec3f(r.origin()) - a;
-  Float u = dot(pvec, tvec) * invdet;
+  u = dot(pvec, tvec) * invdet;
   if (u < 0.0 || u > 1.0) {
     return(false);
   }
   
   vec3f qvec = cross(tvec, edge1);
-  Float v = dot(qvec, r.direction()) * invdet;
+  v = dot(qvec, r.direction()) * invdet;
   if (v < 0 || u + v > 1.0) {
     return(false);
   }
-  Float t = dot(qvec, edge2) * invdet; 
-  
-  if (t < t_min || t > t_max) {
+  t = dot(qvec, edge2) * invdet; 
+  return(t >= t_min && t <= t_max);
+}
+
+template<typename S>
+static bool triangle_intersect(triangle& tri, const ray& r, Float t_min, Float t_max, SurfaceHit& hit, S& sampler) {
+  Float t, u, v;
+  if(!tri.intersect_uv(r, t_min, t_max, t, u, v)) {
     return(false);
   }
-  if(alpha_mask) {
-    if(alpha_mask->channel_value(u, v, rec.p) < rng.unif_rand()) {
-      alpha_miss = true;
-    }
-  }
+  hit.t = t;
+  hit.u = u;
+  hit.v = v;
+  hit.alpha_miss = tri.alpha_mask &&
+    tri.alpha_mask->channel_value(u, v, r.point_at_parameter(t)) < sample_1d(sampler);
+  hit.shape = &tri;
+  return(true);
+}
+
+bool triangle::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  return(triangle_intersect(*this, r, t_min, t_max, hit, rng));
+}
+
+bool triangle::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  return(triangle_intersect(*this, r, t_min, t_max, hit, sampler));
+}
+
+void triangle::fill_interaction(const ray& r, const SurfaceHit& hit, hit_record& rec) const {
+  Float u = hit.u;
+  Float v = hit.v;
   Float w = 1 - u - v;
-  rec.t = t;
-  rec.p = r.point_at_parameter(t);
+  rec.t = hit.t;
+  rec.p = r.point_at_parameter(hit.t);
   rec.u = u;
   rec.v = v;
   
@@ -96,64 +127,172 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, rand
     rec.has_bump = true;
   }
   rec.mat_ptr = mp.get();
-  rec.alpha_miss = alpha_miss;
-  return(true);
+  rec.alpha_miss = hit.alpha_miss;
 }
 
+void triangle::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng) {
+  fill_interaction(r, hit, rec);
+}
 
-bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) {
-  vec3f pvec = cross(r.direction(), edge2);
-  Float det = dot(pvec, edge1);
-  bool alpha_miss = false;
+void triangle::interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler) {
+  fill_interaction(r, hit, rec);
+}
+
+//Same test as hit(), without computing the interaction. Alpha masked hits set alpha_miss but still
+//count as hits there, so the mask doesn't need to be evaluated.
+bool triangle::intersect_p(const ray& r, Float t_min, Float t_max) const {
+  Float t, u, v;
+  return(intersect_uv(r, t_min, t_max, t, u, v));
+}
+
+bool triangle::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(intersect_p(r, t_min, t_max));
+}
+
+bool triangle::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(intersect_p(r, t_min, t_max));
+}
+
+bool triangle::bounding_box(Float t0, Float t1, aabb& box) const {
+  point3f min_v(fmin(fmin(a.x(), b.x()), c.x()), 
+                fmin(fmin(a.y(), b.y()), c.y()), 
+                fmin(fmin(a.z(), b.z()), c.z()));
+  point3f max_v(fmax(fmax(a.x(), b.x()), c.x()), 
+                fmax(fmax(a.y(), b.y()), c.y()), 
+                fmax(fmax(a.z(), b.z()), c.z()));
   
-  // no culling
-  if (std::fabs(det) < 1E-15) {
-    return(false);
+  point3f difference = max_v + -min_v;
+  
+  if (difference.x() < 1E-5) max_v.e[0] += 1E-5;
+  if (difference.y() < 1E-5) max_v.e[1] += 1E-5;
+  if (difference.z() < 1E-5) max_v.e[2] += 1E-5;
+  
+  box = aabb(min_v, max_v);
+  return(true);
+}
+
+Float triangle::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) { 
+  hit_record rec;
+  if (this->hit(ray(o, v), 0.001, FLT_MAX, rec, rng)) {
+    Float distance = rec.t * rec.t * v.squared_length();
+    Float cosine = std::fabs(dot(v, rec.normal)) / (v.length() * rec.normal.length());
+    return(distance / (cosine * area));
   }
-  Float invdet = 1.0 / det;
-  vec3f tvec = vec3f(r.origin()) - a;
-  Float u = dot(pvec, tvec) * invdet;
-  if (u < 0.0 || u > 1.0) {
-    return(false);
+  return 0; 
+}
+
+Float triangle::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) { 
+  hit_record rec;
+  if (this->hit(ray(o, v), 0.001, FLT_MAX, rec, sampler)) {
+    Float distance = rec.t * rec.t * v.squared_length();
+    Float cosine = std::fabs(dot(v, rec.normal)) / (v.length() * rec.normal.length());
+    return(distance / (cosine * area));
   }
-  
-  vec3f qvec = cross(tvec, edge1);
-  Float v = dot(qvec, r.direction()) * invdet;
-  if (v < 0 || u + v > 1.0) {
-    return(false);
+  return 0; 
+}
+
+vec3f triangle::random(const point3f& origin, random_gen& rng, Float time) {
+  Float r1 = rng.unif_rand();
+  Float r2 = rng.unif_rand();
+  Float sr1 = sqrt(r1);
+  point3f random_point((1.0 - sr1) * a + sr1 * (1.0 - r2) * b + sr1 * r2 * c);
+  return(random_point - origin); 
+}
+vec3f triangle::random(const point3f& origin, Sampler* sampler, Float time) {
+  vec2f u = sampler->Get2D();
+  Float r1 = u.x();
+  Float r2 = u.y();
+  Float sr1 = sqrt(r1);
+  point3f random_point((1.0 - sr1) * a + sr1 * (1.0 - r2) * b + sr1 * r2 * c);
+  return(random_point - origin); 
+}
+
+
+uint32_t TriangleMesh::add_material(std::shared_ptr<material> mat, std::shared_ptr<alpha_texture> alpha_mask,
+                                    std::shared_ptr<bump_texture> bump_tex, bool use_uv) {
+  materials.push_back(mat);
+  alpha_masks.push_back(alpha_mask);
+  bump_textures.push_back(bump_tex);
+  material_uv.push_back(use_uv);
+  return(materials.size() - 1);
+}
+
+void TriangleMesh::compact() {
+  if(normalIndices == vertexIndices) {
+    normalIndices.clear();
   }
-  Float t = dot(qvec, edge2) * invdet; 
-  
-  if (t < t_min || t > t_max) {
-    return(false);
+  if(uvIndices == vertexIndices) {
+    uvIndices.clear();
   }
-  if(alpha_mask) {
-    if(alpha_mask->channel_value(u, v, rec.p) < sampler->Get1D()) {
-      alpha_miss = true;
+  p.shrink_to_fit();
+  n.shrink_to_fit();
+  uv.shrink_to_fit();
+  vertexIndices.shrink_to_fit();
+  normalIndices.shrink_to_fit();
+  uvIndices.shrink_to_fit();
+  faceMaterials.shrink_to_fit();
+}
+
+size_t TriangleMesh::memory_size() const {
+  return(sizeof(TriangleMesh) + p.capacity() * sizeof(point3f) + n.capacity() * sizeof(normal3f) +
+         uv.capacity() * sizeof(point2f) +
+         (vertexIndices.capacity() + normalIndices.capacity() + uvIndices.capacity() +
+          faceMaterials.capacity()) * sizeof(uint32_t) +
+         materials.capacity() * (sizeof(std::shared_ptr<material>) + sizeof(std::shared_ptr<alpha_texture>) +
+                                 sizeof(std::shared_ptr<bump_texture>)) + material_uv.capacity() / 8);
+}
+
+//Mirrors the second half of triangle::hit(), with the edges and the face normal computed from
+//the shared vertices
+template<typename S>
+static void mesh_face_interaction(const TriangleMesh& mesh, uint32_t face, const ray& r, Float t, Float u, Float v,
+                                  hit_record& rec, S& sampler) {
+  const uint32_t* vi = &mesh.vertexIndices[3*face];
+  vec3f a(mesh.p[vi[0]]);
+  vec3f edge1 = vec3f(mesh.p[vi[1]]) - a;
+  vec3f edge2 = vec3f(mesh.p[vi[2]]) - a;
+  bool alpha_miss = false;
+  uint32_t m = mesh.faceMaterials.empty() ? 0 : mesh.faceMaterials[face];
+  const alpha_texture* alpha_mask = mesh.alpha_masks[m].get();
+  const bump_texture* bump_tex = mesh.bump_textures[m].get();
+  //Texture coordinates of the corners: the mesh's own for entries that use them, otherwise the
+  //ones baked into the bump texture
+  vec2f uv[3];
+  bool face_uv = mesh.material_uv[m] && mesh.has_uv(face);
+  if(face_uv) {
+    const uint32_t* ti = mesh.uvIndices.empty() ? vi : &mesh.uvIndices[3*face];
+    for(int k = 0; k < 3; k++) {
+      uv[k] = vec2f(mesh.uv[ti[k]].x(), mesh.uv[ti[k]].y());
     }
+  } else if(bump_tex) {
+    uv[0] = vec2f(bump_tex->u_vec.x(), bump_tex->v_vec.x());
+    uv[1] = vec2f(bump_tex->u_vec.y(), bump_tex->v_vec.y());
+    uv[2] = vec2f(bump_tex->u_vec.z(), bump_tex->v_vec.z());
   }
   Float w = 1 - u - v;
+  Float tu = u;
+  Float tv = v;
+  if(face_uv) {
+    tu = w * uv[0].x() + u * uv[1].x() + v * uv[2].x();
+    tv = w * uv[0].y() + u * uv[1].y() + v * uv[2].y();
+  }
   rec.t = t;
   rec.p = r.point_at_parameter(t);
-  rec.u = u;
-  rec.v = v;
-  rec.has_bump = false;
+  if(alpha_mask) {
+    if(alpha_mask->channel_value(tu, tv, rec.p) < sample_1d(sampler)) {
+      alpha_miss = true;
+    }
+  }
+  rec.u = tu;
+  rec.v = tv;
   rec.pError = vec3f(0,0,0);
-  
+  rec.has_bump = false;
+
+  vec3f normal = cross(edge1, edge2);
   if(bump_tex) {
-    //Get UV values + calculate dpdu/dpdv
-    vec3f u_val, v_val;
-    vec2f uv[3];
-    u_val = bump_tex->u_vec;
-    v_val = bump_tex->v_vec;
-    uv[0] = vec2f(u_val.x(), v_val.x());
-    uv[1] = vec2f(u_val.y(), v_val.y());
-    uv[2] = vec2f(u_val.z(), v_val.z());
+    //Calculate dpdu/dpdv from the corners' texture coordinates
     vec2f duv02 = uv[0] - uv[2];
     vec2f duv12 = uv[1] - uv[2];
-    vec3f dp02 = edge1;
-    vec3f dp12 = edge2;
-    
     Float determinant = DifferenceOfProducts(duv02[0],duv12[1],duv02[1],duv12[0]);
     if (determinant == 0) {
       onb uvw;
@@ -162,22 +301,23 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Samp
       rec.dpdv = uvw.v();
     } else {
       Float invdet = 1 / determinant;
-      rec.dpdu = -( duv12[1] * dp02 - duv02[1] * dp12) * invdet;
-      rec.dpdv = -(-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
+      rec.dpdu = -( duv12[1] * edge1 - duv02[1] * edge2) * invdet;
+      rec.dpdv = -(-duv12[0] * edge1 + duv02[0] * edge2) * invdet;
     }
   } else {
     rec.dpdu = vec3f(0,0,0);
     rec.dpdv = vec3f(0,0,0);
   }
-  // Use that to calculate normals
-  if(normals_provided) {
-    normal3f normal_temp = w * na + u * nb + v * nc;
+  if(mesh.has_normals(face)) {
+    const uint32_t* ni = mesh.normalIndices.empty() ? vi : &mesh.normalIndices[3*face];
+    normal3f normal_temp = w * mesh.n[ni[0]] + u * mesh.n[ni[1]] + v * mesh.n[ni[2]];
     if(alpha_mask) {
       rec.normal = dot(r.direction(), normal_temp) < 0 ? normal_temp : -normal_temp;
     } else {
       rec.normal = normal_temp;
     }
   } else {
+    normal.make_unit_vector();
     if(alpha_mask) {
       rec.normal = dot(r.direction(), normal) < 0 ? normal : -normal;
     } else {
@@ -186,68 +326,376 @@ bool triangle::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Samp
   }
   if(bump_tex) {
     point3f bvbu = bump_tex->mesh_value(rec.u, rec.v, rec.p);
-    rec.bump_normal = dot(r.direction(), normal) < 0 ? 
-    rec.normal + normal3f( bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv) :
+    rec.bump_normal = dot(r.direction(), normal) < 0 ?
+      rec.normal + normal3f( bvbu.x() * rec.dpdu + bvbu.y() * rec.dpdv) :
       rec.normal -  normal3f(bvbu.x() * rec.dpdu - bvbu.y() * rec.dpdv);
     rec.bump_normal.make_unit_vector();
     rec.has_bump = true;
   }
-  rec.mat_ptr = mp.get();
+  rec.mat_ptr = mesh.materials[m].get();
   rec.alpha_miss = alpha_miss;
-  
+}
+
+void TriangleMesh::interaction(uint32_t face, const ray& r, Float t, Float u, Float v,
+                               hit_record& rec, random_gen& rng) const {
+  mesh_face_interaction(*this, face, r, t, u, v, rec, rng);
+}
+
+void TriangleMesh::interaction(uint32_t face, const ray& r, Float t, Float u, Float v,
+                               hit_record& rec, Sampler* sampler) const {
+  mesh_face_interaction(*this, face, r, t, u, v, rec, sampler);
+}
+
+WatertightRay::WatertightRay(const ray& r) {
+  vec3f d = r.direction();
+  vec3f abs_d(std::fabs(d.x()), std::fabs(d.y()), std::fabs(d.z()));
+  kz = abs_d.x() > abs_d.y() ? (abs_d.x() > abs_d.z() ? 0 : 2) : (abs_d.y() > abs_d.z() ? 1 : 2);
+  kx = (kz + 1) % 3;
+  ky = (kx + 1) % 3;
+  //Swapping x and y keeps the winding of the triangles when the ray points along -z
+  if(d.e[kz] < 0) {
+    std::swap(kx, ky);
+  }
+  Sx = -d.e[kx] / d.e[kz];
+  Sy = -d.e[ky] / d.e[kz];
+  Sz = 1 / d.e[kz];
+  o = vec3f(r.origin());
+}
+
+//Watertight test of the triangle with corners p[0], p[1] and p[2] (p[corner][axis]). Edge functions
+//that come out exactly zero are recomputed in double precision, which decides the rays through an
+//edge or vertex consistently.
+static bool watertight_triangle(const Float (&p)[3][3], const WatertightRay& wr,
+                                Float t_min, Float t_max, Float& t, Float& u, Float& v) {
+  Float px[3], py[3], pz[3];
+  for(int i = 0; i < 3; i++) {
+    Float x = p[i][wr.kx] - wr.o.e[wr.kx];
+    Float y = p[i][wr.ky] - wr.o.e[wr.ky];
+    Float z = p[i][wr.kz] - wr.o.e[wr.kz];
+    px[i] = x + wr.Sx * z;
+    py[i] = y + wr.Sy * z;
+    pz[i] = z * wr.Sz;
+  }
+  Float e0 = px[1] * py[2] - py[1] * px[2];
+  Float e1 = px[2] * py[0] - py[2] * px[0];
+  Float e2 = px[0] * py[1] - py[0] * px[1];
+  if(e0 == 0 || e1 == 0 || e2 == 0) {
+    e0 = static_cast<Float>(static_cast<double>(px[1]) * py[2] - static_cast<double>(py[1]) * px[2]);
+    e1 = static_cast<Float>(static_cast<double>(px[2]) * py[0] - static_cast<double>(py[2]) * px[0]);
+    e2 = static_cast<Float>(static_cast<double>(px[0]) * py[1] - static_cast<double>(py[0]) * px[1]);
+  }
+  if((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) {
+    return(false);
+  }
+  Float det = e0 + e1 + e2;
+  if(det == 0) {
+    return(false);
+  }
+  Float inv_det = 1 / det;
+  t = (e0 * pz[0] + e1 * pz[1] + e2 * pz[2]) * inv_det;
+  if(!(t >= t_min && t <= t_max)) {
+    return(false);
+  }
+  u = e1 * inv_det;
+  v = e2 * inv_det;
   return(true);
 }
 
-bool triangle::bounding_box(Float t0, Float t1, aabb& box) const {
-  point3f min_v(fmin(fmin(a.x(), b.x()), c.x()), 
-                fmin(fmin(a.y(), b.y()), c.y()), 
+//The same watertight test the BVH leaves use, so light sampling and occlusion queries agree
+//with traversal at shared edges
+static bool intersect_mesh_face(const TriangleMesh& mesh, uint32_t face, const ray& r, Float t_min, Float t_max,
+                                Float& t, Float& u, Float& v) {
+  const uint32_t* vi = &mesh.vertexIndices[3*face];
+  Float p[3][3];
+  for(int i = 0; i < 3; i++) {
+    for(int a = 0; a < 3; a++) {
+      p[i][a] = mesh.p[vi[i]].e[a];
+    }
+  }
+  return(watertight_triangle(p, WatertightRay(r), t_min, t_max, t, u, v));
+}
+
+bool TriangleMesh::hit(uint32_t face, const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) const {
+  Float t, u, v;
+  if(!intersect_mesh_face(*this, face, r, t_min, t_max, t, u, v)) {
+    return(false);
+  }
+  mesh_face_interaction(*this, face, r, t, u, v, rec, rng);
+  return(true);
+}
+
+bool TriangleMesh::hit(uint32_t face, const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) const {
+  Float t, u, v;
+  if(!intersect_mesh_face(*this, face, r, t_min, t_max, t, u, v)) {
+    return(false);
+  }
+  mesh_face_interaction(*this, face, r, t, u, v, rec, sampler);
+  return(true);
+}
+
+bool TriangleMesh::intersect_p(uint32_t face, const ray& r, Float t_min, Float t_max) const {
+  Float t, u, v;
+  return(intersect_mesh_face(*this, face, r, t_min, t_max, t, u, v));
+}
+
+void TriangleMesh::set_block_lane(TriangleBlock& block, int lane, uint32_t face) const {
+  for(int i = 0; i < 3; i++) {
+    const point3f& vertex = p[vertexIndices[3*face+i]];
+    for(int a = 0; a < 3; a++) {
+      block.v[i][a][lane] = vertex.e[a];
+    }
+  }
+}
+
+void TriangleMesh::bounds(uint32_t face, aabb& box) const {
+  const point3f& a = p[vertexIndices[3*face]];
+  const point3f& b = p[vertexIndices[3*face+1]];
+  const point3f& c = p[vertexIndices[3*face+2]];
+  point3f min_v(fmin(fmin(a.x(), b.x()), c.x()),
+                fmin(fmin(a.y(), b.y()), c.y()),
                 fmin(fmin(a.z(), b.z()), c.z()));
-  point3f max_v(fmax(fmax(a.x(), b.x()), c.x()), 
-                fmax(fmax(a.y(), b.y()), c.y()), 
+  point3f max_v(fmax(fmax(a.x(), b.x()), c.x()),
+                fmax(fmax(a.y(), b.y()), c.y()),
                 fmax(fmax(a.z(), b.z()), c.z()));
-  
   point3f difference = max_v + -min_v;
-  
   if (difference.x() < 1E-5) max_v.e[0] += 1E-5;
   if (difference.y() < 1E-5) max_v.e[1] += 1E-5;
   if (difference.z() < 1E-5) max_v.e[2] += 1E-5;
-  
   box = aabb(min_v, max_v);
-  return(true);
 }
 
-Float triangle::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) { 
-  hit_record rec;
-  if (this->hit(ray(o, v), 0.001, FLT_MAX, rec, rng)) {
-    Float distance = rec.t * rec.t * v.squared_length();;
-    Float cosine = dot(v, rec.normal);
-    return(distance / (cosine * area));
-  }
-  return 0; 
+Float TriangleMesh::area(uint32_t face) const {
+  vec3f a(p[vertexIndices[3*face]]);
+  return(cross(vec3f(p[vertexIndices[3*face+1]]) - a, vec3f(p[vertexIndices[3*face+2]]) - a).length()/2);
 }
 
-Float triangle::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) { 
+template<typename S>
+static Float mesh_face_pdf_value(const TriangleMesh& mesh, uint32_t face, const point3f& o, const vec3f& v,
+                                 S& sampler) {
   hit_record rec;
-  if (this->hit(ray(o, v), 0.001, FLT_MAX, rec, sampler)) {
-    Float distance = rec.t * rec.t * v.squared_length();;
-    Float cosine = dot(v, rec.normal);
-    return(distance / (cosine * area));
+  if (mesh.hit(face, ray(o, v), 0.001, FLT_MAX, rec, sampler)) {
+    Float distance = rec.t * rec.t * v.squared_length();
+    Float cosine = std::fabs(dot(v, rec.normal)) / (v.length() * rec.normal.length());
+    return(distance / (cosine * mesh.area(face)));
   }
-  return 0; 
+  return(0);
 }
 
-vec3f triangle::random(const point3f& origin, random_gen& rng, Float time) {
-  Float r1 = rng.unif_rand();
-  Float r2 = rng.unif_rand();
+Float TriangleMesh::pdf_value(uint32_t face, const point3f& o, const vec3f& v, random_gen& rng) const {
+  return(mesh_face_pdf_value(*this, face, o, v, rng));
+}
+
+Float TriangleMesh::pdf_value(uint32_t face, const point3f& o, const vec3f& v, Sampler* sampler) const {
+  return(mesh_face_pdf_value(*this, face, o, v, sampler));
+}
+
+static vec3f mesh_face_random(const TriangleMesh& mesh, uint32_t face, const point3f& origin, Float r1, Float r2) {
+  vec3f a(mesh.p[mesh.vertexIndices[3*face]]);
+  vec3f b(mesh.p[mesh.vertexIndices[3*face+1]]);
+  vec3f c(mesh.p[mesh.vertexIndices[3*face+2]]);
   Float sr1 = sqrt(r1);
   point3f random_point((1.0 - sr1) * a + sr1 * (1.0 - r2) * b + sr1 * r2 * c);
-  return(random_point - origin); 
+  return(random_point - origin);
 }
-vec3f triangle::random(const point3f& origin, Sampler* sampler, Float time) {
+
+vec3f TriangleMesh::random(uint32_t face, const point3f& o, random_gen& rng) const {
+  Float r1 = rng.unif_rand();
+  Float r2 = rng.unif_rand();
+  return(mesh_face_random(*this, face, o, r1, r2));
+}
+
+vec3f TriangleMesh::random(uint32_t face, const point3f& o, Sampler* sampler) const {
   vec2f u = sampler->Get2D();
-  Float r1 = u.x();
-  Float r2 = u.y();
-  Float sr1 = sqrt(r1);
-  point3f random_point((1.0 - sr1) * a + sr1 * (1.0 - r2) * b + sr1 * r2 * c);
-  return(random_point - origin); 
+  return(mesh_face_random(*this, face, o, u.x(), u.y()));
+}
+
+Float TriangleMesh::pdf_value(const point3f& o, const vec3f& v, random_gen& rng) const {
+  Float weight = 1.0 / size();
+  Float sum = 0;
+  for(uint32_t face = 0; face < size(); face++) {
+    sum += weight*pdf_value(face, o, v, rng);
+  }
+  return(sum);
+}
+
+Float TriangleMesh::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler) const {
+  Float weight = 1.0 / size();
+  Float sum = 0;
+  for(uint32_t face = 0; face < size(); face++) {
+    sum += weight*pdf_value(face, o, v, sampler);
+  }
+  return(sum);
+}
+
+vec3f TriangleMesh::random(const point3f& o, random_gen& rng) const {
+  uint32_t face = uint32_t(rng.unif_rand() * size() * 0.99999999);
+  return(random(face, o, rng));
+}
+
+vec3f TriangleMesh::random(const point3f& o, Sampler* sampler) const {
+  uint32_t face = uint32_t(sampler->Get1D() * size() * 0.99999999);
+  return(random(face, o, sampler));
+}
+
+//Test of a single lane
+static bool watertight_lane(const TriangleBlock& block, int lane, const WatertightRay& wr,
+                            Float t_min, Float t_max, Float& t, Float& u, Float& v) {
+  Float p[3][3];
+  for(int i = 0; i < 3; i++) {
+    for(int a = 0; a < 3; a++) {
+      p[i][a] = block.v[i][a][lane];
+    }
+  }
+  return(watertight_triangle(p, wr, t_min, t_max, t, u, v));
+}
+
+#if defined(__SSE2__) && !defined(RAY_FLOAT_AS_DOUBLE)
+//Four lanes of one block at once, returning a bitmask of the lanes in `valid` that are hit. Lanes
+//with a zero edge function fall back to watertight_lane().
+static inline int watertight4_sse(const TriangleBlock& block, int valid, const WatertightRay& wr,
+                                  Float t_min, Float t_max, Float* t, Float* u, Float* v) {
+  __m128 Sx = _mm_set1_ps(wr.Sx), Sy = _mm_set1_ps(wr.Sy), Sz = _mm_set1_ps(wr.Sz);
+  __m128 px[3], py[3], pz[3];
+  for(int i = 0; i < 3; i++) {
+    __m128 x = _mm_sub_ps(_mm_loadu_ps(block.v[i][wr.kx]), _mm_set1_ps(wr.o.e[wr.kx]));
+    __m128 y = _mm_sub_ps(_mm_loadu_ps(block.v[i][wr.ky]), _mm_set1_ps(wr.o.e[wr.ky]));
+    __m128 z = _mm_sub_ps(_mm_loadu_ps(block.v[i][wr.kz]), _mm_set1_ps(wr.o.e[wr.kz]));
+    px[i] = _mm_add_ps(x, _mm_mul_ps(Sx, z));
+    py[i] = _mm_add_ps(y, _mm_mul_ps(Sy, z));
+    pz[i] = _mm_mul_ps(z, Sz);
+  }
+  __m128 e0 = _mm_sub_ps(_mm_mul_ps(px[1], py[2]), _mm_mul_ps(py[1], px[2]));
+  __m128 e1 = _mm_sub_ps(_mm_mul_ps(px[2], py[0]), _mm_mul_ps(py[2], px[0]));
+  __m128 e2 = _mm_sub_ps(_mm_mul_ps(px[0], py[1]), _mm_mul_ps(py[0], px[1]));
+  __m128 zero = _mm_setzero_ps();
+  int degenerate = _mm_movemask_ps(_mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(e0, zero), _mm_cmpeq_ps(e1, zero)),
+                                             _mm_cmpeq_ps(e2, zero))) & valid;
+  __m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(e0, zero), _mm_cmplt_ps(e1, zero)), _mm_cmplt_ps(e2, zero));
+  __m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(e0, zero), _mm_cmpgt_ps(e1, zero)), _mm_cmpgt_ps(e2, zero));
+  __m128 det = _mm_add_ps(_mm_add_ps(e0, e1), e2);
+  __m128 inv_det = _mm_div_ps(_mm_set1_ps(1), det);
+  __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e0, pz[0]), _mm_mul_ps(e1, pz[1])),
+                                    _mm_mul_ps(e2, pz[2])), inv_det);
+  __m128 hit = _mm_andnot_ps(_mm_and_ps(negative, positive), _mm_cmpneq_ps(det, zero));
+  hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(tt, _mm_set1_ps(t_min)), _mm_cmple_ps(tt, _mm_set1_ps(t_max))));
+  _mm_storeu_ps(t, tt);
+  _mm_storeu_ps(u, _mm_mul_ps(e1, inv_det));
+  _mm_storeu_ps(v, _mm_mul_ps(e2, inv_det));
+  int mask = _mm_movemask_ps(hit) & valid & ~degenerate;
+  for(int i = 0; i < kTriangleBlockWidth; i++) {
+    if((degenerate & (1 << i)) && watertight_lane(block, i, wr, t_min, t_max, t[i], u[i], v[i])) {
+      mask |= 1 << i;
+    }
+  }
+  return(mask);
+}
+
+#ifdef __AVX__
+static inline __m256 load_block_pair(const Float* first, const Float* second) {
+  return(_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(first)), _mm_loadu_ps(second), 1));
+}
+
+//Same as watertight4_sse(), for two consecutive blocks
+static inline int watertight8_avx(const TriangleBlock* blocks, int valid, const WatertightRay& wr,
+                                  Float t_min, Float t_max, Float* t, Float* u, Float* v) {
+  __m256 Sx = _mm256_set1_ps(wr.Sx), Sy = _mm256_set1_ps(wr.Sy), Sz = _mm256_set1_ps(wr.Sz);
+  __m256 px[3], py[3], pz[3];
+  for(int i = 0; i < 3; i++) {
+    __m256 x = _mm256_sub_ps(load_block_pair(blocks[0].v[i][wr.kx], blocks[1].v[i][wr.kx]), _mm256_set1_ps(wr.o.e[wr.kx]));
+    __m256 y = _mm256_sub_ps(load_block_pair(blocks[0].v[i][wr.ky], blocks[1].v[i][wr.ky]), _mm256_set1_ps(wr.o.e[wr.ky]));
+    __m256 z = _mm256_sub_ps(load_block_pair(blocks[0].v[i][wr.kz], blocks[1].v[i][wr.kz]), _mm256_set1_ps(wr.o.e[wr.kz]));
+    px[i] = _mm256_add_ps(x, _mm256_mul_ps(Sx, z));
+    py[i] = _mm256_add_ps(y, _mm256_mul_ps(Sy, z));
+    pz[i] = _mm256_mul_ps(z, Sz);
+  }
+  __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(px[1], py[2]), _mm256_mul_ps(py[1], px[2]));
+  __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(px[2], py[0]), _mm256_mul_ps(py[2], px[0]));
+  __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(px[0], py[1]), _mm256_mul_ps(py[0], px[1]));
+  __m256 zero = _mm256_setzero_ps();
+  int degenerate = _mm256_movemask_ps(_mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_EQ_OQ),
+                                                                _mm256_cmp_ps(e1, zero, _CMP_EQ_OQ)),
+                                                   _mm256_cmp_ps(e2, zero, _CMP_EQ_OQ))) & valid;
+  __m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_LT_OQ), _mm256_cmp_ps(e1, zero, _CMP_LT_OQ)),
+                                 _mm256_cmp_ps(e2, zero, _CMP_LT_OQ));
+  __m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(e0, zero, _CMP_GT_OQ), _mm256_cmp_ps(e1, zero, _CMP_GT_OQ)),
+                                 _mm256_cmp_ps(e2, zero, _CMP_GT_OQ));
+  __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+  __m256 inv_det = _mm256_div_ps(_mm256_set1_ps(1), det);
+  __m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, pz[0]), _mm256_mul_ps(e1, pz[1])),
+                                          _mm256_mul_ps(e2, pz[2])), inv_det);
+  __m256 hit = _mm256_andnot_ps(_mm256_and_ps(negative, positive), _mm256_cmp_ps(det, zero, _CMP_NEQ_UQ));
+  hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(tt, _mm256_set1_ps(t_min), _CMP_GE_OQ),
+                                         _mm256_cmp_ps(tt, _mm256_set1_ps(t_max), _CMP_LE_OQ)));
+  _mm256_storeu_ps(t, tt);
+  _mm256_storeu_ps(u, _mm256_mul_ps(e1, inv_det));
+  _mm256_storeu_ps(v, _mm256_mul_ps(e2, inv_det));
+  int mask = _mm256_movemask_ps(hit) & valid & ~degenerate;
+  for(int i = 0; i < 2 * kTriangleBlockWidth; i++) {
+    if((degenerate & (1 << i)) &&
+       watertight_lane(blocks[i / kTriangleBlockWidth], i % kTriangleBlockWidth, wr, t_min, t_max, t[i], u[i], v[i])) {
+      mask |= 1 << i;
+    }
+  }
+  return(mask);
+}
+#endif
+#endif
+
+//Tests up to two blocks, starting at `blocks`: the first `lanes` lanes are valid
+static inline int watertight_blocks(const TriangleBlock* blocks, int lanes, const WatertightRay& wr,
+                                    Float t_min, Float t_max, Float* t, Float* u, Float* v) {
+  int valid = (1 << lanes) - 1;
+#if defined(__SSE2__) && !defined(RAY_FLOAT_AS_DOUBLE)
+#ifdef __AVX__
+  if(lanes > kTriangleBlockWidth) {
+    return(watertight8_avx(blocks, valid, wr, t_min, t_max, t, u, v));
+  }
+#endif
+  int mask = watertight4_sse(blocks[0], valid & 0xF, wr, t_min, t_max, t, u, v);
+  if(lanes > kTriangleBlockWidth) {
+    mask |= watertight4_sse(blocks[1], valid >> 4, wr, t_min, t_max, t + 4, u + 4, v + 4) << 4;
+  }
+  return(mask);
+#else
+  int mask = 0;
+  for(int i = 0; i < lanes; i++) {
+    if(watertight_lane(blocks[i / kTriangleBlockWidth], i % kTriangleBlockWidth, wr, t_min, t_max, t[i], u[i], v[i])) {
+      mask |= 1 << i;
+    }
+  }
+  return(mask);
+#endif
+}
+
+int intersect_triangle_blocks(const TriangleBlock* blocks, int n, const WatertightRay& wr,
+                              Float t_min, Float t_max, Float& t, Float& u, Float& v) {
+  const int step = 2 * kTriangleBlockWidth;
+  Float tt[step], uu[step], vv[step];
+  int closest = -1;
+  for(int first = 0; first < n; first += step) {
+    int lanes = std::min(n - first, step);
+    int mask = watertight_blocks(blocks + first / kTriangleBlockWidth, lanes, wr, t_min, t_max, tt, uu, vv);
+    for(int i = 0; mask != 0; i++, mask >>= 1) {
+      if((mask & 1) && tt[i] <= t_max) {
+        closest = first + i;
+        t_max = t = tt[i];
+        u = uu[i];
+        v = vv[i];
+      }
+    }
+  }
+  return(closest);
+}
+
+bool occluded_triangle_blocks(const TriangleBlock* blocks, int n, const WatertightRay& wr,
+                              Float t_min, Float t_max) {
+  const int step = 2 * kTriangleBlockWidth;
+  Float tt[step], uu[step], vv[step];
+  for(int first = 0; first < n; first += step) {
+    int lanes = std::min(n - first, step);
+    if(watertight_blocks(blocks + first / kTriangleBlockWidth, lanes, wr, t_min, t_max, tt, uu, vv) != 0) {
+      return(true);
+    }
+  }
+  return(false);
 }
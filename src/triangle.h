@@ -4,6 +4,8 @@
 #include "hitable.h"
 #include "material.h"
 #include "onbh.h"
+#include "point2.h"
+#include "meshbuffer.h"
 
 class triangle : public hitable {
 public:
@@ -36,6 +38,15 @@ public:
   };
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler);
+  virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, random_gen& rng);
+  virtual void interaction(const ray& r, const SurfaceHit& hit, hit_record& rec, Sampler* sampler);
+  void fill_interaction(const ray& r, const SurfaceHit& hit, hit_record& rec) const;
+  bool intersect_uv(const ray& r, Float t_min, Float t_max, Float& t, Float& u, Float& v) const;
+  bool intersect_p(const ray& r, Float t_min, Float t_max) const;
   
   virtual bool bounding_box(Float t0, Float t1, aabb& box) const;
   virtual Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
@@ -58,4 +69,91 @@ public:
   std::shared_ptr<bump_texture> bump_tex;
 };
 
+//Marks faces without vertex normals in TriangleMesh::normalIndices (and padding in mesh BVHs)
+static const uint32_t kNoMeshIndex = 0xFFFFFFFF;
+
+//Faces of a mesh BVH leaf in SoA form, stored as v[vertex][axis][lane] so one ray can be tested
+//against all of them at once. Leaves start on a block boundary.
+static const int kTriangleBlockWidth = 4;
+struct TriangleBlock {
+  Float v[3][3][kTriangleBlockWidth];
+};
+
+//Watertight ray/triangle test (Woop et al. 2013): the vertices are moved into a space where the
+//ray starts at the origin and points along +z, so the test is 2D there and an edge shared by two
+//triangles is evaluated the same way for both. Rays through an edge can't slip between them.
+struct WatertightRay {
+  WatertightRay(const ray& r);
+  int kx, ky, kz;
+  Float Sx, Sy, Sz;
+  vec3f o;
+};
+
+//Closest hit with the first n faces stored in `blocks` (n can span several blocks). Returns the
+//face's position in the leaf or -1, setting t and the barycentrics u, v of vertices 1 and 2.
+int intersect_triangle_blocks(const TriangleBlock* blocks, int n, const WatertightRay& wr,
+                              Float t_min, Float t_max, Float& t, Float& u, Float& v);
+bool occluded_triangle_blocks(const TriangleBlock* blocks, int n, const WatertightRay& wr,
+                              Float t_min, Float t_max);
+
+//Indexed triangle mesh: the vertices (and normals) are transformed to world space once and shared
+//by every face that uses them, and a face is just three indices into those buffers plus the index
+//of its entry in the material table. BVHs built over a mesh store face numbers in their leaves
+//instead of one `triangle` object per face (see bvh_node).
+struct TriangleMesh {
+  size_t size() const {
+    return(vertexIndices.size() / 3);
+  }
+  bool has_normals(uint32_t face) const {
+    return(!n.empty() && (normalIndices.empty() || normalIndices[3*face] != kNoMeshIndex));
+  }
+  bool has_uv(uint32_t face) const {
+    return(!uv.empty() && (uvIndices.empty() || uvIndices[3*face] != kNoMeshIndex));
+  }
+  //Adds an entry to the material table and returns its index. If `use_uv` is true, the entry's
+  //textures are looked up with the face's texture coordinates instead of its barycentrics, so one
+  //texture can be shared by every face using the entry.
+  uint32_t add_material(std::shared_ptr<material> mat, std::shared_ptr<alpha_texture> alpha_mask,
+                        std::shared_ptr<bump_texture> bump_tex, bool use_uv = false);
+  //Drops the normal index buffer if it matches the vertex one (e.g. PLY and mesh3d normals)
+  void compact();
+  //Heap memory used by the mesh; mapped buffers aren't counted
+  size_t memory_size() const;
+
+  void set_block_lane(TriangleBlock& block, int lane, uint32_t face) const;
+
+  //Hit and shadow tests for face `face`, with the same watertight test as intersect_triangle_blocks()
+  bool hit(uint32_t face, const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng) const;
+  bool hit(uint32_t face, const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler) const;
+  bool intersect_p(uint32_t face, const ray& r, Float t_min, Float t_max) const;
+  //Fills in rec for a hit already found at t, with barycentrics u, v (see intersect_triangle_blocks())
+  void interaction(uint32_t face, const ray& r, Float t, Float u, Float v, hit_record& rec, random_gen& rng) const;
+  void interaction(uint32_t face, const ray& r, Float t, Float u, Float v, hit_record& rec, Sampler* sampler) const;
+  void bounds(uint32_t face, aabb& box) const;
+  Float area(uint32_t face) const;
+  Float pdf_value(uint32_t face, const point3f& o, const vec3f& v, random_gen& rng) const;
+  Float pdf_value(uint32_t face, const point3f& o, const vec3f& v, Sampler* sampler) const;
+  vec3f random(uint32_t face, const point3f& o, random_gen& rng) const;
+  vec3f random(uint32_t face, const point3f& o, Sampler* sampler) const;
+  //Light sampling over the whole mesh, with every face weighted equally (as in hitable_list)
+  Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng) const;
+  Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler) const;
+  vec3f random(const point3f& o, random_gen& rng) const;
+  vec3f random(const point3f& o, Sampler* sampler) const;
+
+  //The buffers can be views of a memory mapped mesh file (see meshfile.h)
+  MeshBuffer<point3f> p;                  //World space
+  MeshBuffer<normal3f> n;                 //World space, not normalized (as in triangle)
+  MeshBuffer<point2f> uv;
+  MeshBuffer<uint32_t> vertexIndices;     //3 per face
+  MeshBuffer<uint32_t> normalIndices;     //3 per face (kNoMeshIndex if the face has none), or empty
+                                          //if the normals are indexed like the vertices
+  MeshBuffer<uint32_t> uvIndices;         //Same layout as normalIndices
+  MeshBuffer<uint32_t> faceMaterials;     //Material table entry of each face, or empty if all use 0
+  std::vector<std::shared_ptr<material> > materials;
+  std::vector<std::shared_ptr<alpha_texture> > alpha_masks;
+  std::vector<std::shared_ptr<bump_texture> > bump_textures;
+  std::vector<bool> material_uv;
+};
+
 #endif
@@ -1,596 +1,276 @@
 #include "trimesh.h"
+#include "objloader.h"
 
-#define TINYOBJLOADER_IMPLEMENTATION
-#include "tinyobj/tiny_obj_loader.h"
 
+//Loads a texture of an OBJ material through the texture cache
+static std::shared_ptr<TextureImage> load_obj_texture(const std::string& path) {
+  std::shared_ptr<TextureImage> image = load_texture(path);
+  if(!image->data || image->nx == 0 || image->ny == 0 || image->nn == 0) {
+    throw std::runtime_error("Could not find " + path);
+  }
+  return(image);
+}
 
 trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, 
-        Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-        std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) : 
-  hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t > shapes;
-  std::vector<tinyobj::material_t > materials;
-  std::string warn, err;
-  mat_ptr = nullptr;
-  
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
-  bool has_sep = true;
-  if(strlen(basedir.c_str()) == 0) {
-    has_sep = false;
-  }
-  if(ret) {
-    int n = 0;
-    for (size_t s = 0; s < shapes.size(); s++) {
-      n += shapes[s].mesh.num_face_vertices.size();
-    }
+        Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, random_gen rng,
+        std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+        const MeshLOD& lod) : 
+  trimesh(inputfile, basedir, scale, 0, shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng,
+          ObjectToWorld, WorldToObject, reverseOrientation, lod) {}
+
+void add_mesh_materials(TriangleMesh& mesh, const std::vector<MeshMaterialInfo>& materials, Float sigma,
+                        std::vector<std::shared_ptr<TextureImage> >& textures,
+                        std::vector<std::shared_ptr<TextureImage> >& bump_textures) {
+  int nx, ny, nn;
+  for(size_t i = 0; i < materials.size(); i++) {
+    const MeshMaterialInfo& info = materials[i];
+    std::shared_ptr<material> tex = nullptr;
     std::shared_ptr<alpha_texture> alpha = nullptr;
     std::shared_ptr<bump_texture> bump = nullptr;
-    
-    obj_materials.reserve(materials.size()+1);
-    bump_materials.reserve(materials.size()+1);
-    bump_textures.reserve(materials.size()+1);
-    
-    std::vector<vec3f > diffuse_materials(materials.size()+1);
-    std::vector<vec3f > specular_materials(materials.size()+1);
-    std::vector<Float > ior_materials(materials.size()+1);
-    std::vector<bool > has_diffuse(materials.size()+1);
-    std::vector<bool > has_transparency(materials.size()+1);
-    std::vector<bool > has_single_diffuse(materials.size()+1);
-    std::vector<bool > has_alpha(materials.size()+1);
-    std::vector<bool > has_bump(materials.size()+1);
-    std::vector<Float > bump_intensity(materials.size()+1);
-    
-    std::vector<int > nx_mat(materials.size()+1);
-    std::vector<int > ny_mat(materials.size()+1);
-    std::vector<int > nn_mat(materials.size()+1);
-    
-    std::vector<int > nx_mat_bump(materials.size()+1);
-    std::vector<int > ny_mat_bump(materials.size()+1);
-    std::vector<int > nn_mat_bump(materials.size()+1);
-    int nx, ny, nn;
-    
-    for (size_t i = 0; i < materials.size(); i++) {
-      if(strlen(materials[i].diffuse_texname.c_str()) > 0) {
-        if(has_sep) {
-          obj_materials.push_back(stbi_loadf((basedir + separator() + materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
-        } else {
-          obj_materials.push_back(stbi_loadf((materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
-        }
-        if(nx == 0 || ny == 0 || nn == 0) {
-          if(has_sep) {
-            throw std::runtime_error("Could not find " + (basedir + separator() + materials[i].diffuse_texname));
-          } else {
-            throw std::runtime_error("Could not find " + materials[i].diffuse_texname);
-          }
-        }
-        has_diffuse[i] = true;
-        has_single_diffuse[i] = false;
-        nx_mat[i] = nx;
-        ny_mat[i] = ny;
-        nn_mat[i] = nn;
-        has_alpha[i] = false;
+    if(info.dissolve < 1) {
+      tex = std::make_shared<dielectric>(info.diffuse, info.ior, vec3f(0,0,0), 0);
+    } else {
+      std::shared_ptr<texture> albedo;
+      if(!info.diffuse_texture.empty()) {
+        std::shared_ptr<TextureImage> texture_image = load_obj_texture(info.diffuse_texture);
+        textures.push_back(texture_image);
+        Float* image = texture_image->data;
+        nx = texture_image->nx;
+        ny = texture_image->ny;
+        nn = texture_image->nn;
+        //Corners at (0,0), (1,0) and (0,1), so the texture is sampled at the texture coordinates
+        albedo = std::make_shared<triangle_image_texture>(image, nx, ny, nn, 0, 0, 1, 0, 0, 1);
+        bool has_alpha = false;
         if(nn == 4) {
           for(int j = 0; j < nx - 1; j++) {
             for(int k = 0; k < ny - 1; k++) {
-              if(obj_materials[i][4*j + 4*nx*k + 3] != 1.0) {
-                has_alpha[i] = true;
+              if(image[4*j + 4*nx*k + 3] != 1.0) {
+                has_alpha = true;
                 break;
               }
             }
-            if(has_alpha[i]) {
+            if(has_alpha) {
               break;
             }
           }
-        } 
-      } else if (sizeof(materials[i].diffuse) == 12) {
-        obj_materials.push_back(nullptr);
-        alpha_materials.push_back(nullptr);
-        
-        diffuse_materials[i] = vec3f(materials[i].diffuse[0],materials[i].diffuse[1],materials[i].diffuse[2]);
-        has_diffuse[i] = true;
-        has_alpha[i] = false;
-        has_single_diffuse[i] = true;
-      } else {
-        obj_materials.push_back(nullptr);
-        alpha_materials.push_back(nullptr);
-        
-        has_diffuse[i] = false;
-        has_alpha[i] = false;
-        has_single_diffuse[i] = false;
-      }
-      if(materials[i].dissolve < 1) {
-        obj_materials.push_back(nullptr);
-        alpha_materials.push_back(nullptr);
-        
-        specular_materials[i] = vec3f(materials[i].diffuse[0],materials[i].diffuse[1],materials[i].diffuse[2]);
-        ior_materials[i] = materials[i].ior;
-        has_alpha[i] = false;
-        has_transparency[i] = true; 
-      }
-      if(strlen(materials[i].bump_texname.c_str()) > 0) {
-        if(has_sep) {
-          bump_materials[i] = stbi_loadf((basedir + separator() + materials[i].bump_texname).c_str(), &nx, &ny, &nn, 0);
-        } else {
-          bump_materials[i] = stbi_loadf(materials[i].bump_texname.c_str(), &nx, &ny, &nn, 0);
         }
-        if(nx == 0 || ny == 0 || nn == 0) {
-          if(has_sep) {
-            throw std::runtime_error("Could not find " + basedir + separator() + materials[i].bump_texname);
-          } else {
-            throw std::runtime_error("Could not find " + materials[i].bump_texname);
-          }
+        if(has_alpha) {
+          alpha = std::make_shared<alpha_texture>(image, nx, ny, nn);
         }
-        nx_mat_bump[i] = nx;
-        ny_mat_bump[i] = ny;
-        nn_mat_bump[i] = nn;
-        bump_intensity[i] = materials[i].bump_texopt.bump_multiplier;
-        has_bump[i] = true;
       } else {
-        bump_materials.push_back(nullptr);
-        bump_intensity[i] = 1.0f;
-        has_bump[i] = false;
+        albedo = std::make_shared<constant_texture>(info.diffuse);
       }
-    }
-    bool has_normals = attrib.normals.size() > 0 ? true : false;
-    
-    vec3f tris[3];
-    vec3f normals[3];
-    Float tx[3];
-    Float ty[3];
-    for (size_t s = 0; s < shapes.size(); s++) {
-      // Loop over faces(polygon)
-      size_t index_offset = 0;
-      for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-        bool tempnormal = false;
-        
-        // Loop over vertices in the face.
-        for (size_t v = 0; v < 3; v++) {
-          // access to vertex
-          tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-          tris[v] = vec3f(attrib.vertices[3*idx.vertex_index+0],
-                         attrib.vertices[3*idx.vertex_index+1],
-                         attrib.vertices[3*idx.vertex_index+2])*scale;
-          
-          if(has_normals && idx.normal_index != -1) {
-            tempnormal = true;
-            normals[v] = vec3f(attrib.normals[3*idx.normal_index+0],
-                              attrib.normals[3*idx.normal_index+1],
-                              attrib.normals[3*idx.normal_index+2]);
-          }
-          if(idx.texcoord_index != -1) {
-            tx[v] = attrib.texcoords[2*idx.texcoord_index+0];
-            ty[v] = attrib.texcoords[2*idx.texcoord_index+1];
-          }
-        }
-        index_offset += 3;
-        if(std::isnan(tris[0].x()) || std::isnan(tris[0].y()) || std::isnan(tris[0].z()) ||
-           std::isnan(tris[1].x()) || std::isnan(tris[1].y()) || std::isnan(tris[1].z()) ||
-           std::isnan(tris[2].x()) || std::isnan(tris[2].y()) || std::isnan(tris[2].z())) {
-          // triangles.pop_back();
-          n--;
-          continue;
-        }
-        // if(std::isnan(normals[0].x()) || std::isnan(normals[0].y()) || std::isnan(normals[0].z()) ||
-        //    std::isnan(normals[1].x()) || std::isnan(normals[1].y()) || std::isnan(normals[1].z()) ||
-        //    std::isnan(normals[2].x()) || std::isnan(normals[2].y()) || std::isnan(normals[2].z())) {
-        //   // triangles.pop_back();
-        //   tempnormal = false;
-        // }
-        
-        // per-face material
-        int material_num = shapes[s].mesh.material_ids[f];
-        if(material_num > -1) {
-          if(has_alpha[material_num]) {
-            alpha = std::make_shared<alpha_texture>(obj_materials[material_num], 
-                                      nx_mat[material_num], ny_mat[material_num], nn_mat[material_num], 
-                                      vec3f(tx[0], tx[1], tx[2]), 
-                                      vec3f(ty[0], ty[1], ty[2]));
-            alpha_materials.push_back(alpha);
-          } else {
-            alpha = nullptr;
-          }
-          if(has_bump[material_num]) {
-            bump = std::make_shared<bump_texture>(bump_materials[material_num],
-                                    nx_mat_bump[material_num], ny_mat_bump[material_num], nn_mat_bump[material_num],
-                                    vec3f(tx[0], tx[1], tx[2]),
-                                    vec3f(ty[0], ty[1], ty[2]), bump_intensity[material_num]);
-            bump_textures.push_back(bump);
-          } else {
-            bump = nullptr;
-            bump_textures.push_back(nullptr);
-          }
-        } else {
-          alpha = nullptr;
-          bump = nullptr;
-        }
-        
-        std::shared_ptr<material> tex = nullptr;
-        
-        if(has_normals && tempnormal) {
-          if(material_num == -1) {
-            tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3f(1,1,1)));
-          } else {
-            if(has_transparency[material_num]) {
-              tex = std::make_shared<dielectric>(specular_materials[material_num], ior_materials[material_num], vec3f(0,0,0), 
-                                   0);;
-            } else if(has_diffuse[material_num]) {
-              if(has_single_diffuse[material_num]) {
-                tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(diffuse_materials[material_num]));
-              } else {
-                tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                                nx_mat[material_num], ny_mat[material_num],nn_mat[material_num],
-                                                                tx[0],ty[0], tx[1],ty[1],tx[2],ty[2]));
-              }
-            } else {
-              tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3f(1,1,1)));
-            }
-          }
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], 
-                                           normals[0], normals[1], normals[2], true, 
-                                           tex, alpha, bump, 
-                                           ObjectToWorld, WorldToObject, reverseOrientation));
-        } else {
-          if(material_num == -1) {
-            tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(diffuse_materials[material_num]));
-          } else {
-            if(has_transparency[material_num]) {
-              tex = std::make_shared<dielectric>(specular_materials[material_num], ior_materials[material_num], vec3f(0,0,0),
-                                   0);;
-            } else if(has_diffuse[material_num]) {
-              if(has_single_diffuse[material_num]) {
-                tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(diffuse_materials[material_num]));
-              } else {
-                tex = std::make_shared<lambertian>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                                nx_mat[material_num],ny_mat[material_num],nn_mat[material_num],
-                                                                tx[0],ty[0],
-                                                                tx[1],ty[1],
-                                                                tx[2],ty[2]));
-              }
-            } else {
-              tex = std::make_shared<lambertian>(std::make_shared<constant_texture>(vec3f(1,1,1)));
-            }
-          }
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], true, tex, alpha, bump, 
-                                                   ObjectToWorld, WorldToObject, reverseOrientation));
-        }
+      if(sigma == 0) {
+        tex = std::make_shared<lambertian>(albedo);
+      } else {
+        tex = std::make_shared<orennayar>(albedo, sigma);
       }
     }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
-  } else {
-    std::string mes = "Error reading " + inputfile + ": ";
-    throw std::runtime_error(mes + warn + err);
+    if(!info.bump_texture.empty()) {
+      std::shared_ptr<TextureImage> bump_image = load_obj_texture(info.bump_texture);
+      bump_textures.push_back(bump_image);
+      Float* image = bump_image->data;
+      nx = bump_image->nx;
+      ny = bump_image->ny;
+      nn = bump_image->nn;
+      bump = std::make_shared<bump_texture>(image, nx, ny, nn, info.bump_intensity);
+    }
+    mesh.add_material(tex, alpha, bump, true);
+  }
+  if(mesh.materials.size() == 1) {
+    mesh.faceMaterials.clear();
   }
 }
 
 trimesh::trimesh(std::string inputfile, std::string basedir, Float scale, Float sigma,
-        Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-        std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
+        Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, random_gen rng,
+        std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+        const MeshLOD& lod) :
       hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
+  mat_ptr = nullptr;
+  std::vector<MeshMaterialInfo> materials;
+  mesh = load_obj_mesh(inputfile, basedir, *ObjectToWorld, scale, numbercores, &materials);
+  add_mesh_materials(*mesh, materials, sigma, obj_materials, bump_materials);
+  apply_mesh_lod(mesh, lod, lod_source);
+  tri_mesh_bvh = std::make_shared<bvh_node>(mesh, bvh_type, max_leaf_size, numbercores, rng);
+}
+
+std::shared_ptr<TriangleMesh> load_obj_mesh(const std::string& inputfile, const std::string& basedir,
+                                            const Transform& ObjectToWorld, Float scale, size_t numbercores,
+                                            std::vector<MeshMaterialInfo>* material_table) {
   tinyobj::attrib_t attrib;
   std::vector<tinyobj::shape_t > shapes;
   std::vector<tinyobj::material_t > materials;
   std::string warn, err;
-  mat_ptr = nullptr;
   
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
-  bool has_sep = true;
-  if(strlen(basedir.c_str()) == 0) {
-    has_sep = false;
+  bool ret = load_obj_parallel(&attrib, &shapes, &materials, &warn, &err, inputfile, basedir, numbercores);
+  if(!ret) {
+    std::string mes = "Error reading " + inputfile + ": ";
+    throw std::runtime_error(mes + warn + err);
   }
-  if(ret) {
-    int n = 0;
-    for (size_t s = 0; s < shapes.size(); s++) {
-      n += shapes[s].mesh.num_face_vertices.size();
+  std::shared_ptr<TriangleMesh> mesh = std::make_shared<TriangleMesh>();
+  bool has_normals = attrib.normals.size() > 0 ? true : false;
+  bool keep_uv = material_table != nullptr && attrib.texcoords.size() > 0;
+  
+  //Vertices and normals are shared by the faces, so they're only transformed once
+  mesh->p.reserve(attrib.vertices.size() / 3);
+  for(size_t i = 0; i + 2 < attrib.vertices.size(); i += 3) {
+    mesh->p.push_back(ObjectToWorld(point3f(vec3f(attrib.vertices[i],
+                                                  attrib.vertices[i+1],
+                                                  attrib.vertices[i+2])*scale)));
+  }
+  if(has_normals) {
+    mesh->n.reserve(attrib.normals.size() / 3);
+    for(size_t i = 0; i + 2 < attrib.normals.size(); i += 3) {
+      mesh->n.push_back(ObjectToWorld(normal3f(attrib.normals[i], attrib.normals[i+1], attrib.normals[i+2])));
     }
-    std::shared_ptr<alpha_texture> alpha = nullptr;
-    std::shared_ptr<bump_texture> bump = nullptr;
-    
-    obj_materials.reserve(materials.size()+1);
-    bump_materials.reserve(materials.size()+1);
-    
-    std::vector<vec3f > diffuse_materials(materials.size()+1);
-    std::vector<vec3f > specular_materials(materials.size()+1);
-    std::vector<Float > ior_materials(materials.size()+1);
-    std::vector<bool > has_diffuse(materials.size()+1);
-    std::vector<bool > has_transparency(materials.size()+1);
-    std::vector<bool > has_single_diffuse(materials.size()+1);
-    std::vector<bool > has_alpha(materials.size()+1);
-    std::vector<bool > has_bump(materials.size()+1);
-    std::vector<Float > bump_intensity(materials.size()+1);
-    
-    std::vector<int > nx_mat(materials.size()+1);
-    std::vector<int > ny_mat(materials.size()+1);
-    std::vector<int > nn_mat(materials.size()+1);
-    
-    std::vector<int > nx_mat_bump(materials.size()+1);
-    std::vector<int > ny_mat_bump(materials.size()+1);
-    std::vector<int > nn_mat_bump(materials.size()+1);
-    
-    int nx,ny,nn;
+  }
+  if(keep_uv) {
+    mesh->uv.reserve(attrib.texcoords.size() / 2);
+    for(size_t i = 0; i + 1 < attrib.texcoords.size(); i += 2) {
+      mesh->uv.push_back(point2f(attrib.texcoords[i], attrib.texcoords[i+1]));
+    }
+  }
+  size_t n = 0;
+  for (size_t s = 0; s < shapes.size(); s++) {
+    n += shapes[s].mesh.num_face_vertices.size();
+  }
+  mesh->vertexIndices.reserve(3 * n);
+  if(material_table) {
+    mesh->faceMaterials.reserve(n);
+  }
+  
+  //Faces without an OBJ material use an extra table entry after the OBJ's own
+  uint32_t default_material = materials.size();
+  bool uses_default = false;
+  vec3f tris[3];
+  vec3f normals[3];
+  uint32_t normal_index[3] = {kNoMeshIndex, kNoMeshIndex, kNoMeshIndex};
+  for (size_t s = 0; s < shapes.size(); s++) {
     
-    for (size_t i = 0; i < materials.size(); i++) {
-      if(strlen(materials[i].diffuse_texname.c_str()) > 0) {
-        if(has_sep) {
-          obj_materials.push_back(stbi_loadf((basedir + separator() + materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
-        } else {
-          obj_materials.push_back(stbi_loadf((materials[i].diffuse_texname).c_str(), &nx, &ny, &nn, 0));
-        }
-        if(nx == 0 || ny == 0 || nn == 0) {
-          if(has_sep) {
-            throw std::runtime_error("Could not find " + (basedir + separator() + materials[i].diffuse_texname));
-          } else {
-            throw std::runtime_error("Could not find " + materials[i].diffuse_texname);
-          }
-        }
-        has_diffuse[i] = true;
-        has_single_diffuse[i] = false;
-        nx_mat[i] = nx;
-        ny_mat[i] = ny;
-        nn_mat[i] = nn;
-        has_alpha[i] = false;
-        if(nn == 4) {
-          for(int j = 0; j < nx - 1; j++) {
-            for(int k = 0; k < ny - 1; k++) {
-              if(obj_materials[i][4*j + 4*nx*k + 3] != 1.0) {
-                has_alpha[i] = true;
-                break;
-              }
-            }
-            if(has_alpha[i]) {
-              break;
-            }
-          }
-        } 
-      } else if (sizeof(materials[i].diffuse) == 12) {
-        obj_materials.push_back(nullptr);
-        alpha_materials.push_back(nullptr);
+    size_t index_offset = 0;
+    for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
+      bool tempnormal = false;
+      uint32_t vertex_index[3];
+      uint32_t uv_index[3];
+      
+      for (size_t v = 0; v < 3; v++) {
+        tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
         
-        diffuse_materials[i] = vec3f(materials[i].diffuse[0],materials[i].diffuse[1],materials[i].diffuse[2]);
-        has_diffuse[i] = true;
-        has_single_diffuse[i] = true;
-      } else {
-        obj_materials.push_back(nullptr);
-        alpha_materials.push_back(nullptr);
+        vertex_index[v] = idx.vertex_index;
+        uv_index[v] = idx.texcoord_index == -1 ? kNoMeshIndex : idx.texcoord_index;
+        tris[v] = vec3f(attrib.vertices[3*idx.vertex_index+0],
+                       attrib.vertices[3*idx.vertex_index+1],
+                                      attrib.vertices[3*idx.vertex_index+2])*scale;
         
-        has_diffuse[i] = false;
-        has_single_diffuse[i] = false;
+        if(has_normals  && idx.normal_index != -1) {
+          tempnormal = true;
+          normal_index[v] = idx.normal_index;
+          normals[v] = vec3f(attrib.normals[3*idx.normal_index+0],
+                            attrib.normals[3*idx.normal_index+1],
+                                          attrib.normals[3*idx.normal_index+2]);
+        }
       }
-      if(materials[i].dissolve < 1) {
-        obj_materials.push_back(nullptr);
-        alpha_materials.push_back(nullptr);
-        
-        specular_materials[i] = vec3f(materials[i].diffuse[0],materials[i].diffuse[1],materials[i].diffuse[2]);
-        ior_materials[i] = materials[i].ior;
-        has_transparency[i] = true; 
+      
+      index_offset += 3;
+      if(std::isnan(tris[0].x()) || std::isnan(tris[0].y()) || std::isnan(tris[0].z()) ||
+         std::isnan(tris[1].x()) || std::isnan(tris[1].y()) || std::isnan(tris[1].z()) ||
+         std::isnan(tris[2].x()) || std::isnan(tris[2].y()) || std::isnan(tris[2].z())) {
+        continue;
       }
-      if(strlen(materials[i].bump_texname.c_str()) > 0) {
-        bump_materials[i] = stbi_loadf((basedir + separator() + materials[i].bump_texname).c_str(), &nx, &ny, &nn, 0);
-        if(has_sep) {
-          bump_materials[i] = stbi_loadf((basedir + separator() + materials[i].bump_texname).c_str(), &nx, &ny, &nn, 0);
-        } else {
-          bump_materials[i] = stbi_loadf(materials[i].bump_texname.c_str(), &nx, &ny, &nn, 0);
-        }
-        
-        if(nx == 0 || ny == 0 || nn == 0) {
-          if(has_sep) {
-            throw std::runtime_error("Could not find " + basedir + separator() + materials[i].bump_texname);
-          } else {
-            throw std::runtime_error("Could not find " + materials[i].bump_texname);
-          }
-        }
-        nx_mat_bump[i] = nx;
-        ny_mat_bump[i] = ny;
-        nn_mat_bump[i] = nn;
-        bump_intensity[i] = materials[i].bump_texopt.bump_multiplier;
-        has_bump[i] = true;
-      } else {
-        bump_materials.push_back(nullptr);
-        bump_intensity[i] = 1.0f;
-        has_bump[i] = false;
+      if((normals[0].x() == 0 && normals[0].y() == 0 && normals[0].z() == 0) ||
+         (normals[1].x() == 0 && normals[1].y() == 0 && normals[1].z() == 0) ||
+         (normals[2].x() == 0 && normals[2].y() == 0 && normals[2].z() == 0)) {
+        has_normals = false;
       }
-    }
-    bool has_normals = attrib.normals.size() > 0 ? true : false;
-    vec3f tris[3];
-    vec3f normals[3];
-    Float tx[3];
-    Float ty[3];
-    for (size_t s = 0; s < shapes.size(); s++) {
-      // Loop over faces(polygon)
-      size_t index_offset = 0;
-      for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-        bool tempnormal = false;
-        
-        // Loop over vertices in the face.
-        for (size_t v = 0; v < 3; v++) {
-          // access to vertex
-          tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-          tris[v] = vec3f(attrib.vertices[3*idx.vertex_index+0],
-                         attrib.vertices[3*idx.vertex_index+1],
-                                        attrib.vertices[3*idx.vertex_index+2])*scale;
-          if(has_normals && idx.normal_index != -1) {
-            tempnormal = true;
-            normals[v] = vec3f(attrib.normals[3*idx.normal_index+0],
-                              attrib.normals[3*idx.normal_index+1],
-                                            attrib.normals[3*idx.normal_index+2]);
-          }
-          if(idx.texcoord_index != -1) {
-            tx[v] = attrib.texcoords[2*idx.texcoord_index+0];
-            ty[v] = attrib.texcoords[2*idx.texcoord_index+1];
-          }
+      bool face_normals = has_normals && tempnormal && normal_index[0] != kNoMeshIndex && 
+        normal_index[1] != kNoMeshIndex && normal_index[2] != kNoMeshIndex;
+      bool face_uv = uv_index[0] != kNoMeshIndex && uv_index[1] != kNoMeshIndex && uv_index[2] != kNoMeshIndex;
+      for(int v = 0; v < 3; v++) {
+        mesh->vertexIndices.push_back(vertex_index[v]);
+        mesh->normalIndices.push_back(face_normals ? normal_index[v] : kNoMeshIndex);
+        if(keep_uv) {
+          mesh->uvIndices.push_back(face_uv ? uv_index[v] : kNoMeshIndex);
         }
-        
-        index_offset += 3;
-        if(std::isnan(tris[0].x()) || std::isnan(tris[0].y()) || std::isnan(tris[0].z()) ||
-           std::isnan(tris[1].x()) || std::isnan(tris[1].y()) || std::isnan(tris[1].z()) ||
-           std::isnan(tris[2].x()) || std::isnan(tris[2].y()) || std::isnan(tris[2].z())) {
-          // triangles.pop_back();
-          n--;
-          continue;
-        }
-        // per-face material
-        int material_num = shapes[s].mesh.material_ids[f];
-        if(material_num > -1) {
-          if(has_alpha[material_num]) {
-            alpha = std::make_shared<alpha_texture>(obj_materials[material_num], nx, ny, nn, 
-                                      vec3f(tx[0], tx[1], tx[2]), 
-                                      vec3f(ty[0], ty[1], ty[2]));
-            alpha_materials.push_back(alpha);
-          } else {
-            alpha = nullptr;
-            alpha_materials.push_back(nullptr);
-          }
-          if(has_bump[material_num]) {
-            bump = std::make_shared<bump_texture>(bump_materials[material_num],
-                                    nx_mat_bump[material_num], ny_mat_bump[material_num], nn_mat_bump[material_num],
-                                                                                                     vec3f(tx[0], tx[1], tx[2]),
-                                                                                                     vec3f(ty[0], ty[1], ty[2]), bump_intensity[material_num]);
-            bump_textures.push_back(bump);
-          } else {
-            bump = nullptr;
-            bump_textures.push_back(nullptr);
-          }
-        }
-        
-        std::shared_ptr<material> tex = nullptr;
-        
-        if(has_normals && tempnormal) {
-          if(material_num == -1) {
-            tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(vec3f(1,1,1)), sigma);
-          } else {
-            if(has_transparency[material_num]) {
-              tex = std::make_shared<dielectric>(specular_materials[material_num], ior_materials[material_num], vec3f(0,0,0), 
-                                   0);;
-            } else if(has_diffuse[material_num]) {
-              if(has_single_diffuse[material_num]) {
-                tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(diffuse_materials[material_num]), sigma);
-              } else {
-                tex = std::make_shared<orennayar>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                               nx_mat[material_num], ny_mat[material_num],nn_mat[material_num],
-                                                               tx[0],ty[0], tx[1],ty[1],tx[2],ty[2]), sigma);
-              }
-            } else {
-              tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(vec3f(1,1,1)), sigma);
-            }
-          }
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], 
-                                           normals[0], normals[1], normals[2], true, 
-                                           tex, alpha,  bump, 
-                                           ObjectToWorld, WorldToObject, reverseOrientation));
+      }
+      if(material_table) {
+        int material_id = shapes[s].mesh.material_ids[f];
+        if(material_id < 0 || material_id >= static_cast<int>(materials.size())) {
+          uses_default = true;
+          mesh->faceMaterials.push_back(default_material);
         } else {
-          if(material_num == -1) {
-            tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(diffuse_materials[material_num]), sigma);
-          } else {
-            if(has_transparency[material_num]) {
-              tex = std::make_shared<dielectric>(specular_materials[material_num], ior_materials[material_num], vec3f(0,0,0), 
-                                   0);;
-            } else if(has_diffuse[material_num]) {
-              if(has_single_diffuse[material_num]) {
-                tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(diffuse_materials[material_num]), sigma);
-              } else {
-                tex = std::make_shared<orennayar>(std::make_shared<triangle_image_texture>(obj_materials[material_num],
-                                                               nx_mat[material_num],ny_mat[material_num],nn_mat[material_num],
-                                                                                                               tx[0],ty[0],tx[1],ty[1],tx[2],ty[2]), sigma);
-              }
-            } else {
-              tex = std::make_shared<orennayar>(std::make_shared<constant_texture>(vec3f(1,1,1)), sigma);
-            }
-          }
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], true, tex, alpha, bump, 
-                                                   ObjectToWorld, WorldToObject, reverseOrientation));
+          mesh->faceMaterials.push_back(material_id);
         }
       }
     }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
-  } else {
-    std::string mes = "Error reading " + inputfile + ": ";
-    throw std::runtime_error(mes + warn + err);
   }
+  if(mesh->n.empty()) {
+    mesh->normalIndices.clear();
+  }
+  if(material_table) {
+    material_table->clear();
+    for(size_t i = 0; i < materials.size(); i++) {
+      MeshMaterialInfo info;
+      info.name = materials[i].name;
+      info.diffuse = vec3f(materials[i].diffuse[0], materials[i].diffuse[1], materials[i].diffuse[2]);
+      info.specular = vec3f(materials[i].specular[0], materials[i].specular[1], materials[i].specular[2]);
+      info.ior = materials[i].ior;
+      info.dissolve = materials[i].dissolve;
+      info.bump_intensity = materials[i].bump_texname.empty() ? 1.0f : materials[i].bump_texopt.bump_multiplier;
+      std::string prefix = basedir.empty() ? std::string() : basedir + separator();
+      if(!materials[i].diffuse_texname.empty()) {
+        info.diffuse_texture = prefix + materials[i].diffuse_texname;
+      }
+      if(!materials[i].bump_texname.empty()) {
+        info.bump_texture = prefix + materials[i].bump_texname;
+      }
+      if(!materials[i].alpha_texname.empty()) {
+        info.alpha_texture = prefix + materials[i].alpha_texname;
+      }
+      material_table->push_back(info);
+    }
+    if(uses_default) {
+      material_table->push_back(MeshMaterialInfo());
+    }
+  }
+  mesh->compact();
+  return(mesh);
 }
 
 trimesh::trimesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-        Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-        std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) :
+        Float scale, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
+        std::string bvh_cache, random_gen rng,
+        std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+        const MeshLOD& lod) :
     hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
-  tinyobj::attrib_t attrib;
-  std::vector<tinyobj::shape_t > shapes;
-  std::vector<tinyobj::material_t > materials;
-  std::string warn, err;
   mat_ptr = mat;
-  
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
-  bool has_sep = true;
-  if(strlen(basedir.c_str()) == 0) {
-    has_sep = false;
+  //A cache hit skips parsing the file, simplifying the mesh and building the BVH. With level of
+  //detail on, the file is parsed first to pick the level, which the cache is keyed by (so moving
+  //the camera only misses the cache when it changes the level).
+  int lod_level = 0;
+  if(lod.enabled()) {
+    mesh = load_obj_mesh(inputfile, basedir, *ObjectToWorld, scale, numbercores, nullptr);
+    lod_level = mesh_lod_level(*mesh, lod, lod_source);
   }
-  std::shared_ptr<alpha_texture> alpha = nullptr;
-  std::shared_ptr<bump_texture> bump = nullptr;
-  if(ret) {
-    int n = 0;
-    for (size_t s = 0; s < shapes.size(); s++) {
-      n += shapes[s].mesh.num_face_vertices.size();
-    }
-    bool has_normals = attrib.normals.size() > 0 ? true : false;
-    vec3f tris[3];
-    vec3f normals[3];
-    for (size_t s = 0; s < shapes.size(); s++) {
-      
-      size_t index_offset = 0;
-      for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-        bool tempnormal = false;
-        
-        for (size_t v = 0; v < 3; v++) {
-          tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-          
-          tris[v] = vec3f(attrib.vertices[3*idx.vertex_index+0],
-                         attrib.vertices[3*idx.vertex_index+1],
-                                        attrib.vertices[3*idx.vertex_index+2])*scale;
-          
-          if(has_normals  && idx.normal_index != -1) {
-            tempnormal = true;
-            
-            normals[v] = vec3f(attrib.normals[3*idx.normal_index+0],
-                              attrib.normals[3*idx.normal_index+1],
-                                            attrib.normals[3*idx.normal_index+2]);
-          }
-        }
-        
-        index_offset += 3;
-        if(std::isnan(tris[0].x()) || std::isnan(tris[0].y()) || std::isnan(tris[0].z()) ||
-           std::isnan(tris[1].x()) || std::isnan(tris[1].y()) || std::isnan(tris[1].z()) ||
-           std::isnan(tris[2].x()) || std::isnan(tris[2].y()) || std::isnan(tris[2].z())) {
-          // triangles.pop_back();
-          n--;
-          continue;
-        }
-        if((normals[0].x() == 0 && normals[0].y() == 0 && normals[0].z() == 0) ||
-           (normals[1].x() == 0 && normals[1].y() == 0 && normals[1].z() == 0) ||
-           (normals[2].x() == 0 && normals[2].y() == 0 && normals[2].z() == 0)) {
-          has_normals = false;
-        }
-        
-        if(has_normals && tempnormal) {
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2],
-                                           normals[0],normals[1],normals[2], 
-                                           false,
-                                           mat_ptr, alpha,  bump, 
-                                           ObjectToWorld, WorldToObject, reverseOrientation));
-        } else {
-          triangles.add(std::make_shared<triangle>(tris[0],tris[1],tris[2], false, 
-                                                   mat_ptr, alpha, bump, 
-                                                   ObjectToWorld, WorldToObject, reverseOrientation));
-        }
-      }
-    }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
-  } else {
-    std::string mes = "Error reading " + inputfile + ": ";
-    throw std::runtime_error(mes + warn + err);
+  uint64_t cache_key = bvh_cache.empty() ? 0 : 
+    bvh_cache_key(inputfile, "obj", *ObjectToWorld, scale, bvh_type, max_leaf_size, lod_level);
+  if(cache_key != 0 && load_bvh_cache(bvh_cache_path(bvh_cache, cache_key), cache_key, mat_ptr, 
+                                      mesh, tri_mesh_bvh)) {
+    return;
+  }
+  if(!mesh) {
+    mesh = load_obj_mesh(inputfile, basedir, *ObjectToWorld, scale, numbercores, nullptr);
+  }
+  mesh->add_material(mat_ptr, nullptr, nullptr);
+  simplify_mesh_level(mesh, lod_level);
+  tri_mesh_bvh = std::make_shared<bvh_node>(mesh, bvh_type, max_leaf_size, numbercores, rng);
+  if(cache_key != 0) {
+    save_bvh_cache(bvh_cache_path(bvh_cache, cache_key), cache_key, *mesh, *tri_mesh_bvh);
   }
 }
 
 trimesh::trimesh(std::string inputfile, std::string basedir, float vertex_color_sigma,
-        Float scale, bool is_vertex_color, Float shutteropen, Float shutterclose, int bvh_type, 
+        Float scale, bool is_vertex_color, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
         random_gen rng,
         std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation) : hitable(ObjectToWorld, WorldToObject, reverseOrientation) {
   tinyobj::attrib_t attrib;
@@ -603,7 +283,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, float vertex_color_
   std::shared_ptr<alpha_texture> alpha = nullptr;
   std::shared_ptr<bump_texture> bump = nullptr;
   
-  bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, inputfile.c_str(), basedir.c_str());
+  bool ret = load_obj_parallel(&attrib, &shapes, &materials, &warn, &err, inputfile, basedir, numbercores, true);
   bool has_sep = true;
   if(strlen(basedir.c_str()) == 0) {
     has_sep = false;
@@ -672,7 +352,7 @@ trimesh::trimesh(std::string inputfile, std::string basedir, float vertex_color_
         }
       }
     }
-    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, rng);
+    tri_mesh_bvh = std::make_shared<bvh_node>(triangles, shutteropen, shutterclose, bvh_type, max_leaf_size, numbercores, rng);
   } else {
     std::string mes = "Error reading " + inputfile + ": ";
     throw std::runtime_error(mes + warn + err);
@@ -687,25 +367,53 @@ bool trimesh::hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampl
   return(tri_mesh_bvh->hit(r, t_min, t_max, rec, sampler));
 }
 
+bool trimesh::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng) {
+  return(tri_mesh_bvh->intersect(r, t_min, t_max, hit, rng));
+}
+
+bool trimesh::intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler) {
+  return(tri_mesh_bvh->intersect(r, t_min, t_max, hit, sampler));
+}
+
+bool trimesh::occluded(const ray& r, Float t_min, Float t_max, random_gen& rng) {
+  return(tri_mesh_bvh->occluded(r, t_min, t_max, rng));
+}
+
+bool trimesh::occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler) {
+  return(tri_mesh_bvh->occluded(r, t_min, t_max, sampler));
+}
+
 bool trimesh::bounding_box(Float t0, Float t1, aabb& box) const {
   return(tri_mesh_bvh->bounding_box(t0,t1,box));
 }
 
 
 Float trimesh::pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time) {
+  if(mesh) {
+    return(mesh->pdf_value(o, v, rng));
+  }
   return(triangles.pdf_value(o,v, rng, time));
 }
 
 Float trimesh::pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time) {
+  if(mesh) {
+    return(mesh->pdf_value(o, v, sampler));
+  }
   return(triangles.pdf_value(o,v, sampler, time));
   
 }
 
 vec3f trimesh::random(const point3f& o, random_gen& rng, Float time) {
+  if(mesh) {
+    return(mesh->random(o, rng));
+  }
   return(triangles.random(o, rng, time));
 }
 
 vec3f trimesh::random(const point3f& o, Sampler* sampler, Float time) {
+  if(mesh) {
+    return(mesh->random(o, sampler));
+  }
   return(triangles.random(o, sampler, time));
   
 }
@@ -3,6 +3,10 @@
 
 #include "triangle.h"
 #include "bvh_node.h"
+#include "bvhcache.h"
+#include "meshfile.h"
+#include "meshlod.h"
+#include "texturecache.h"
 #include "rng.h"
 #ifndef STBIMAGEH
 #define STBIMAGEH
@@ -18,32 +22,48 @@ inline char separator() {
   #endif
 }
 
+//Reads an OBJ file into an indexed mesh, with the vertices and normals transformed by ObjectToWorld
+//(after scaling the vertices), parsing the file on `numbercores` threads. The mesh's material table
+//is left empty. If `materials` isn't null, the OBJ's material table is returned in it, along with
+//each face's entry in faceMaterials and the texture coordinates in uv and uvIndices.
+std::shared_ptr<TriangleMesh> load_obj_mesh(const std::string& inputfile, const std::string& basedir,
+                                            const Transform& ObjectToWorld, Float scale, size_t numbercores,
+                                            std::vector<MeshMaterialInfo>* materials);
+
+//Adds one material (with its alpha and bump textures) per entry of a mesh file's material table
+//to the mesh, shared by all of that entry's faces. The textures are looked up with the faces'
+//texture coordinates, and their images are kept in `textures` and `bump_textures`.
+void add_mesh_materials(TriangleMesh& mesh, const std::vector<MeshMaterialInfo>& materials, Float sigma,
+                        std::vector<std::shared_ptr<TextureImage> >& textures,
+                        std::vector<std::shared_ptr<TextureImage> >& bump_textures);
+
 class trimesh : public hitable {
 public:
   trimesh() {}
-  ~trimesh() {
-    for(auto mat : obj_materials) {
-      if(mat) stbi_image_free(mat);
-    }
-    for(auto bump : bump_materials) {
-      if(bump) stbi_image_free(bump);
-    }
-  }
+  ~trimesh() {}
   trimesh(std::string inputfile, std::string basedir, Float scale, 
-          Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
+          Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, random_gen rng,
+          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+          const MeshLOD& lod = MeshLOD());
   trimesh(std::string inputfile, std::string basedir, Float scale, Float sigma,
-          Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
+          Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, random_gen rng,
+          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+          const MeshLOD& lod = MeshLOD());
   trimesh(std::string inputfile, std::string basedir, std::shared_ptr<material> mat, 
-          Float scale, Float shutteropen, Float shutterclose, int bvh_type, random_gen rng,
-          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
+          Float scale, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
+          std::string bvh_cache, random_gen rng,
+          std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation,
+          const MeshLOD& lod = MeshLOD());
   trimesh(std::string inputfile, std::string basedir, float vertex_color_sigma,
-          Float scale, bool is_vertex_color, Float shutteropen, Float shutterclose, int bvh_type, 
+          Float scale, bool is_vertex_color, Float shutteropen, Float shutterclose, int bvh_type, int max_leaf_size, size_t numbercores, 
           random_gen rng,
           std::shared_ptr<Transform> ObjectToWorld, std::shared_ptr<Transform> WorldToObject, bool reverseOrientation);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, random_gen& rng);
   virtual bool hit(const ray& r, Float t_min, Float t_max, hit_record& rec, Sampler* sampler);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, random_gen& rng);
+  virtual bool intersect(const ray& r, Float t_min, Float t_max, SurfaceHit& hit, Sampler* sampler);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, random_gen& rng);
+  virtual bool occluded(const ray& r, Float t_min, Float t_max, Sampler* sampler);
   
   Float pdf_value(const point3f& o, const vec3f& v, random_gen& rng, Float time = 0);
   Float pdf_value(const point3f& o, const vec3f& v, Sampler* sampler, Float time = 0);
@@ -56,10 +76,14 @@ public:
   }
   std::shared_ptr<bvh_node> tri_mesh_bvh;
   std::shared_ptr<material> mat_ptr;
-  std::vector<Float* > obj_materials;
-  std::vector<Float* > bump_materials;
-  std::vector<std::shared_ptr<bump_texture> > bump_textures;
-  std::vector<std::shared_ptr<alpha_texture> > alpha_materials;
+  //Images of the OBJ materials' textures, shared by all of their faces (and with other objects
+  //through the texture cache)
+  std::vector<std::shared_ptr<TextureImage> > obj_materials;
+  std::vector<std::shared_ptr<TextureImage> > bump_materials;
+  //Meshes are stored indexed in `mesh`, except vertex colored ones, which are separate triangles
+  std::shared_ptr<TriangleMesh> mesh;
+  //Size of the mesh before `lod` simplified it (empty if level of detail is off)
+  LodSource lod_source;
   hitable_list triangles;
 };
 